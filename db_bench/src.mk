@@ -322,6 +322,16 @@ MOCK_LIB_SOURCES =                                              \
 BENCH_LIB_SOURCES =                                             \
   tools/db_bench_tool.cc                                        \
   tools/iLSM.cc                                                 \
+  tools/iLSM_async.cc                                           \
+  tools/iLSM_uring.cc                                           \
+  tools/iLSM_buffer.cc                                          \
+  tools/iLSM_compress.cc                                        \
+  tools/iLSM_histogram.cc                                       \
+  tools/iLSM_transport.cc                                       \
+  tools/iLSM_mock.cc                                            \
+  tools/iLSM_filter.cc                                          \
+  tools/iLSM_qos.cc                                             \
+  tools/iLSM_sharded.cc                                         \
 
 STRESS_LIB_SOURCES =                                            \
   db_stress_tool/batched_ops_stress.cc                         \
@@ -500,6 +510,7 @@ TEST_MAIN_SOURCES =                                                     \
   table/block_fetcher_test.cc                                           \
   test_util/testutil_test.cc                                            \
   tools/block_cache_analyzer/block_cache_trace_analyzer_test.cc         \
+  tools/iLSM_test.cc                                                    \
   tools/io_tracer_parser_test.cc                                        \
   tools/ldb_cmd_test.cc                                                 \
   tools/reduce_levels_test.cc                                           \
@@ -8,11 +8,12 @@ TEMP5=`echo $TEMP4 | cut -d ' ' -f2`
 
 echo "Run DB_BENCH (iLSM)"
 
-if [ $# -ne 3 ]
+if [ $# -lt 3 ] || [ $# -gt 4 ]
 then
-    echo -e "Usage:\n sudo ./test.sh <fillseq/fillrandom/readseq/readrandom> <value_size> <#_of_pairs> [optional] \n"
+    echo -e "Usage:\n sudo ./test.sh <fillseq/fillrandom/readseq/readrandom> <value_size> <#_of_pairs> [<key_size> (1-255, default 4)] \n"
     exit 0
 fi
+KEY_SIZE=${4:-4}
 
-sudo ./db_bench --benchmarks="$1" -use_direct_io_for_flush_and_compaction=true --use_direct_reads=true --num=$3 --key_size=4 --value_size=$2 --db="/mnt/DB" --compression_ratio=1 --level0_file_num_compaction_trigger=2 --ilsm_device_path="$TEMP5" #--stats_interval=1
+sudo ./db_bench --benchmarks="$1" -use_direct_io_for_flush_and_compaction=true --use_direct_reads=true --num=$3 --key_size=$KEY_SIZE --value_size=$2 --db="/mnt/DB" --compression_ratio=1 --level0_file_num_compaction_trigger=2 --ilsm_device_path="$TEMP5" #--stats_interval=1
 
@@ -65,6 +65,7 @@
 #include "rocksdb/write_batch.h"
 #include "test_util/testutil.h"
 #include "test_util/transaction_test_util.h"
+#include "util/aligned_buffer.h"
 #include "util/cast_util.h"
 #include "util/compression.h"
 #include "util/crc32c.h"
@@ -90,6 +91,7 @@
 
 // iLSM
 #include "tools/iLSM.h"
+#include "tools/iLSM_sharded.h"
 
 using GFLAGS_NAMESPACE::ParseCommandLineFlags;
 using GFLAGS_NAMESPACE::RegisterFlagValidator;
@@ -1365,7 +1367,82 @@ DEFINE_int64(multiread_stride, 0,
 DEFINE_bool(multiread_batched, false, "Use the new MultiGet API");
 
 // iLSM DB
-DEFINE_string(ilsm_device_path, "", "iLSM device path");
+DEFINE_string(ilsm_device_path, "",
+              "iLSM device path; several comma-separated devices shard the "
+              "keys by consistent hashing");
+DEFINE_bool(ilsm_async_io, false,
+            "Submit iLSM commands through io_uring NVMe passthrough "
+            "(needs the /dev/ngXnY generic char device)");
+DEFINE_uint32(ilsm_queue_depth, 64, "io_uring queue depth for iLSM commands");
+DEFINE_bool(ilsm_poll_completions, false,
+            "Busy-poll iLSM completions on NVMe poll queues (io_uring "
+            "IOPOLL, implies ilsm_async_io) instead of taking interrupts");
+DEFINE_bool(ilsm_emulate, false,
+            "Run iLSM against the in-process KV-SSD emulator instead of "
+            "ilsm_device_path (one emulator per device listed there)");
+DEFINE_uint64(ilsm_emu_cmd_latency_ns, 2000,
+              "Emulated device-side latency per NVMe command (ns)");
+DEFINE_uint64(ilsm_emu_pcie_mbps, 3200,
+              "Emulated interconnect bandwidth (MB/s), 0 for free transfers");
+DEFINE_uint32(ilsm_emu_channels, 8,
+              "Commands the emulated device works on at once");
+DEFINE_string(ilsm_transfer_mode, "adapt",
+              "How iLSM puts move values: kvssd (PRP only), piggy (BandSlim "
+              "piggybacking only) or adapt");
+DEFINE_uint32(ilsm_piggyback_threshold, 127,
+              "adapt: values up to this size (bytes) are piggybacked");
+DEFINE_uint32(ilsm_combi_threshold, 4096,
+              "adapt: piggyback the sub-page tail of a PRP value if it is at "
+              "most this long (bytes), 0 to disable");
+DEFINE_bool(ilsm_calibrate, false,
+            "Measure piggyback vs. PRP latency at open and pick the adapt "
+            "thresholds (overrides the two above)");
+DEFINE_bool(ilsm_zero_copy_get, true,
+            "mixgraph: iLSM Gets DMA values straight into a page-aligned "
+            "per-thread buffer instead of returning a std::string");
+DEFINE_uint32(ilsm_multiget_batch, 1,
+              "mixgraph: issue Get queries in iLSM MultiGet batches of this "
+              "many keys (1 = one Get per query)");
+DEFINE_bool(ilsm_write_combining, false,
+            "Pack small iLSM puts of all threads into shared 4KB pages, "
+            "one batched put command per page");
+DEFINE_uint32(ilsm_combine_deadline_us, 50,
+              "ilsm_write_combining: write a page that is not full after "
+              "this many microseconds");
+DEFINE_uint64(ilsm_cache_size, 0,
+              "Bytes of a host LRU cache in front of iLSM Get/MultiGet "
+              "(0 = every read goes to the device)");
+DEFINE_uint32(ilsm_cache_max_value, 4096,
+              "ilsm_cache_size: values longer than this are not cached");
+DEFINE_uint64(ilsm_filter_keys, 0,
+              "Size a host existence filter of the iLSM keys for this many "
+              "keys; lookups of keys it rules out skip the device (0 = off)");
+DEFINE_string(ilsm_filter_path, "",
+              "ilsm_filter_keys: file the filter is saved to on close and "
+              "loaded from on open (empty = rebuild from the device keys)");
+DEFINE_string(ilsm_compression, "none",
+              "Codec iLSM compresses put values with, one value at a time "
+              "(none, lz4, zstd, zlib, ...); a value is stored compressed "
+              "only if that takes fewer commands or avoids a PRP transfer");
+DEFINE_uint32(ilsm_compression_dict_bytes, 0,
+              "ilsm_compression: train a dictionary of up to this many bytes "
+              "(zstd) on values of the benchmark's value generator");
+DEFINE_uint32(ilsm_qos_depth, 0,
+              "Max iLSM commands of all threads on the device at once, "
+              "shared out by weighted fair queuing between reads, small "
+              "writes, large writes and scans (0 = no scheduler)");
+DEFINE_string(ilsm_qos_weights, "8,4,1,2",
+              "ilsm_qos_depth: weights of reads, small writes, large writes "
+              "and scans");
+DEFINE_string(ilsm_qos_rate_limits, "0,0,0,0",
+              "ilsm_qos_depth: bytes/s each of those classes may move over "
+              "the interconnect (0 = unlimited)");
+DEFINE_uint32(ilsm_qos_large_write, 4096,
+              "ilsm_qos_depth: puts of longer values are large writes");
+DEFINE_bool(ilsm_atomic_batch, false,
+            "Apply the iLSM puts of each write batch (entries_per_batch, up "
+            "to 64) atomically with one iLSM Write() instead of one Put() "
+            "each");
 
 enum RepFactory {
   kSkipList,
@@ -2468,7 +2545,7 @@ class Benchmark {
   std::shared_ptr<const FilterPolicy> filter_policy_;
   const SliceTransform* prefix_extractor_;
   DBWithColumnFamilies db_;
-  iLSM::DB ilsm_db_;
+  iLSM::ShardedDB ilsm_db_;
   std::vector<DBWithColumnFamilies> multi_dbs_;
   int64_t num_;
   int key_size_;
@@ -4468,7 +4545,85 @@ class Benchmark {
     } else {
       s = DB::Open(options, db_name, &db->db);
       // Open iLSM DB here.
-      int err = ilsm_db_.Open(FLAGS_ilsm_device_path);
+      iLSM::Options ilsm_options;
+      ilsm_options.async_io = FLAGS_ilsm_async_io;
+      ilsm_options.queue_depth = FLAGS_ilsm_queue_depth;
+      ilsm_options.poll_completions = FLAGS_ilsm_poll_completions;
+      if (!strcasecmp(FLAGS_ilsm_transfer_mode.c_str(), "kvssd")) {
+        ilsm_options.transfer_mode = iLSM::TransferMode::KVSSD;
+      } else if (!strcasecmp(FLAGS_ilsm_transfer_mode.c_str(), "piggy")) {
+        ilsm_options.transfer_mode = iLSM::TransferMode::PIGGY;
+      } else if (!strcasecmp(FLAGS_ilsm_transfer_mode.c_str(), "adapt")) {
+        ilsm_options.transfer_mode = iLSM::TransferMode::ADAPT;
+      } else {
+        fprintf(stderr, "Unknown ilsm_transfer_mode: %s\n",
+                FLAGS_ilsm_transfer_mode.c_str());
+        exit(1);
+      }
+      ilsm_options.piggyback_threshold = FLAGS_ilsm_piggyback_threshold;
+      ilsm_options.combi_threshold = FLAGS_ilsm_combi_threshold;
+      ilsm_options.calibrate = FLAGS_ilsm_calibrate;
+      ilsm_options.write_combining = FLAGS_ilsm_write_combining;
+      ilsm_options.combine_deadline_us = FLAGS_ilsm_combine_deadline_us;
+      ilsm_options.cache_capacity = static_cast<size_t>(FLAGS_ilsm_cache_size);
+      ilsm_options.cache_max_value = FLAGS_ilsm_cache_max_value;
+      ilsm_options.filter_keys = static_cast<size_t>(FLAGS_ilsm_filter_keys);
+      ilsm_options.filter_path = FLAGS_ilsm_filter_path;
+      ilsm_options.compression =
+          StringToCompressionType(FLAGS_ilsm_compression.c_str());
+      if (FLAGS_ilsm_compression_dict_bytes) {
+        // The generator starts from a fixed seed: every run trains the same
+        // dictionary, so values of an earlier run stay readable
+        RandomGenerator gen;
+        std::vector<std::string> samples;
+        for (int i = 0; i < 100; i++) {
+          samples.push_back(
+              gen.Generate(static_cast<unsigned int>(value_size)).ToString());
+        }
+        ilsm_options.compression_dict = iLSM::ValueCompressor::TrainDict(
+            samples, FLAGS_ilsm_compression_dict_bytes);
+      }
+      if (FLAGS_ilsm_multiget_batch > 1) {
+        ilsm_options.multiget_batch = FLAGS_ilsm_multiget_batch;
+      }
+      ilsm_options.qos_depth = FLAGS_ilsm_qos_depth;
+      ilsm_options.qos_large_write = FLAGS_ilsm_qos_large_write;
+      std::vector<std::string> qos_weights =
+          ROCKSDB_NAMESPACE::StringSplit(FLAGS_ilsm_qos_weights, ',');
+      std::vector<std::string> qos_rates =
+          ROCKSDB_NAMESPACE::StringSplit(FLAGS_ilsm_qos_rate_limits, ',');
+      for (size_t c = 0; c < static_cast<size_t>(iLSM::QosClass::LAST); c++) {
+        if (c < qos_weights.size()) {
+          ilsm_options.qos_weight[c] =
+              static_cast<unsigned int>(std::stoul(qos_weights[c]));
+        }
+        if (c < qos_rates.size()) {
+          ilsm_options.qos_rate_limit[c] = std::stoll(qos_rates[c]);
+        }
+      }
+      int err;
+      if (FLAGS_ilsm_emulate) {
+        iLSM::EmulatorOptions emu_options;
+        emu_options.cmd_latency_ns = FLAGS_ilsm_emu_cmd_latency_ns;
+        emu_options.pcie_mbps = FLAGS_ilsm_emu_pcie_mbps;
+        emu_options.channels = FLAGS_ilsm_emu_channels;
+        std::vector<std::string> devs;
+        std::vector<iLSM::Options> per_device;
+        size_t num_devs = 1 + std::count(FLAGS_ilsm_device_path.begin(),
+                                         FLAGS_ilsm_device_path.end(), ',');
+        for (size_t i = 0; i < num_devs; i++) {
+          devs.push_back("");
+          per_device.push_back(ilsm_options);
+          per_device.back().emulator =
+              std::make_shared<iLSM::Emulator>(emu_options);
+          if (num_devs > 1 && !ilsm_options.filter_path.empty()) {
+            per_device.back().filter_path += "." + ToString(i);
+          }
+        }
+        err = ilsm_db_.Open(devs, per_device);
+      } else {
+        err = ilsm_db_.Open(FLAGS_ilsm_device_path, ilsm_options);
+      }
       if (err < 0) {
           fprintf(stderr, "[iLSM] open error: %d\n", err);
       }
@@ -4598,6 +4753,7 @@ class Benchmark {
     RandomGenerator gen;
     WriteBatch batch(/*reserved_bytes=*/0, /*max_bytes=*/0,
                      user_timestamp_size_);
+    iLSM::WriteBatch ilsm_batch;
     Status s;
     //////////////////////////////////// BandSlim
     // int64_t bytes = 0;
@@ -4645,6 +4801,7 @@ class Benchmark {
       size_t id = thread->rand.Next() % num_key_gens;
       DBWithColumnFamilies* db_with_cfh = SelectDBWithCfh(id);
       batch.Clear();
+      ilsm_batch.Clear();
       int64_t batch_bytes = 0;
       //////////////////////// BandSlim
       int64_t bytes = 0;
@@ -4691,7 +4848,11 @@ class Benchmark {
           // [iLSM] key and value to put.
           ////////////////////////////////////////////////////////////// BandSlim
           // ilsm_db_.Put(key.ToString(), val.ToString(), thread->stats.GetDone());
-          ilsm_db_.Put(key.ToString(), val.ToString());  // PUT
+          if (FLAGS_ilsm_atomic_batch) {
+            ilsm_batch.Put(key.ToString(), val.ToString());
+          } else {
+            ilsm_db_.Put(key.ToString(), val.ToString());  // PUT
+          }
           // std::string value;                             // GET
           // ilsm_db_.Get(key.ToString(), value);           // GET
           // val.ToString() = value;                        // GET
@@ -4780,6 +4941,13 @@ class Benchmark {
         // Not stacked BlobDB
         s = db_with_cfh->db->Write(write_options_, &batch);
       }
+      if (ilsm_batch.Count() > 0) {
+        int ilsm_err = ilsm_db_.Write(ilsm_batch);
+        if (ilsm_err != 0) {
+          fprintf(stderr, "iLSM write batch of %zu: %d\n", ilsm_batch.Count(),
+                  ilsm_err);
+        }
+      }
       /////////////////////////////////////////// BandSlim
       // thread->stats.SetPreviousBytes(thread->stats.GetBytes());
       thread->stats.AddBytes(bytes);
@@ -5826,6 +5994,39 @@ class Benchmark {
     // [iLSM] variables
     std::string ilsm_temp_value;
     int ilsm_err = 0;
+    // [iLSM] Page-aligned landing buffer of zero-copy Gets
+    AlignedBuffer ilsm_get_buf;
+    uint32_t ilsm_get_buf_len = 0;
+    if (FLAGS_ilsm_zero_copy_get) {
+      const uint64_t kMaxGetBuf = 524288;
+      uint64_t len = std::min<uint64_t>(
+          std::max<uint64_t>(value_max, 1), kMaxGetBuf);
+      ilsm_get_buf_len = static_cast<uint32_t>((len + 4095) / 4096 * 4096);
+      ilsm_get_buf.Alignment(4096);
+      ilsm_get_buf.AllocateNewBuffer(ilsm_get_buf_len);
+    }
+    // [iLSM] Get queries buffered for one MultiGet (ilsm_multiget_batch > 1)
+    std::vector<std::string> ilsm_batch_keys;
+    std::vector<std::string> ilsm_batch_values;
+    std::vector<int> ilsm_batch_statuses;
+    auto ilsm_flush_gets = [&]() {
+      if (ilsm_batch_keys.empty()) {
+        return;
+      }
+      std::vector<Slice> keys(ilsm_batch_keys.begin(), ilsm_batch_keys.end());
+      ilsm_db_.MultiGet(keys, &ilsm_batch_values, &ilsm_batch_statuses);
+      for (size_t i = 0; i < keys.size(); i++) {
+        if (ilsm_batch_statuses[i] == 0) {
+          found++;
+          bytes += key_size_ + ilsm_batch_values[i].length();
+        } else if (ilsm_batch_statuses[i] != -2) {
+          fprintf(stderr, "[iLSM] MultiGet, ioctl fail, at MixGraph\n");
+          abort();
+        }
+      }
+      thread->stats.FinishedOps(nullptr, nullptr, keys.size(), kRead);
+      ilsm_batch_keys.clear();
+    };
 
     // the limit of qps initiation
     if (FLAGS_sine_a != 0 || FLAGS_sine_d != 0) {
@@ -5907,8 +6108,31 @@ class Benchmark {
         // the Get query
         gets++;
         read++;
+        if (FLAGS_ilsm_multiget_batch > 1) {
+          // [iLSM] MultiGet
+          ilsm_batch_keys.push_back(key.ToString());
+          if (ilsm_batch_keys.size() >= FLAGS_ilsm_multiget_batch) {
+            ilsm_flush_gets();
+          }
+          if (thread->shared->read_rate_limiter.get() != nullptr &&
+              read % 256 == 255) {
+            thread->shared->read_rate_limiter->Request(
+                256, Env::IO_HIGH, nullptr /* stats */,
+                RateLimiter::OpType::kRead);
+          }
+          continue;
+        }
         // [iLSM] Get
-        ilsm_err = ilsm_db_.Get(key.ToString(), ilsm_temp_value);
+        if (FLAGS_ilsm_zero_copy_get) {
+          ilsm_err = ilsm_db_.Get(key.ToString(), ilsm_get_buf.BufferStart(),
+                                  ilsm_get_buf_len);
+          if (ilsm_err > static_cast<int>(ilsm_get_buf_len)) {
+            // Bigger than the buffer: fall back to the copying Get
+            ilsm_err = ilsm_db_.Get(key.ToString(), ilsm_temp_value);
+          }
+        } else {
+          ilsm_err = ilsm_db_.Get(key.ToString(), ilsm_temp_value);
+        }
         // [iLSM] comment out below.
         /*
         if (FLAGS_num_column_families > 1) { // [iLSM] never happen.
@@ -5924,12 +6148,14 @@ class Benchmark {
         // [iLSM]
 
         // [iLSM] Get check
-        if (ilsm_err == -1) {
+        if (ilsm_err == -2) {
+            // not found
+        } else if (ilsm_err < 0) {
             fprintf(stderr, "[iLSM] Get, ioctl fail, at MixGraph\n");
             abort();
-        } else if (ilsm_err != -2) {
+        } else {
             found++;
-            bytes += 4 + ilsm_temp_value.length();
+            bytes += key_size_ + ilsm_err;
         }
         // [iLSM] comment out below.
         /*
@@ -6018,7 +6244,7 @@ class Benchmark {
                       FLAGS_iter_sigma) %
               scan_len_max;
           for (int64_t j = 0; j < scan_length && ilsm_err >= 0; j++) {
-              bytes += 4 + ilsm_temp_value.length();
+              bytes += key_size_ + ilsm_temp_value.length();
               ilsm_err = ilsm_db_.Next(ilsm_iter_id, ilsm_temp_value);
               if (ilsm_err == -1) {
                   fprintf(stderr,"[iLSM] iter next, ioctl fail, at MixGraph\n");
@@ -6065,6 +6291,7 @@ class Benchmark {
         // [iLSM]
       }
     }
+    ilsm_flush_gets();
     char msg[256];
     snprintf(msg, sizeof(msg),
              "( Gets:%" PRIu64 " Puts:%" PRIu64 " Seek:%" PRIu64 " of %" PRIu64
@@ -6225,7 +6452,7 @@ class Benchmark {
       if (ilsm_err == -1) {
           fprintf(stderr, "[iLSM] Iterator Seek, ioctl fail, at SeekRandom\n");
       } else if (ilsm_err != -2) {
-          bytes += 4 + ilsm_temp_value.length(); 
+          bytes += key_size_ + ilsm_temp_value.length(); 
           found++;
       }
 
@@ -6254,7 +6481,7 @@ class Benchmark {
               break;
               //fprintf(stderr, "[iLSM] Iterator Next, No Key, at SeekRandom\n");
           } else {
-              bytes += 4 + ilsm_temp_value.length(); 
+              bytes += key_size_ + ilsm_temp_value.length(); 
           }
       }
       // [iLSM] comment out below
@@ -1,18 +1,26 @@
 #include "iLSM.h"
+#include "util/hash.h"
+#include "../../firmware/nvme_kv_payload.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <linux/nvme_ioctl.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <cstring>
+#include <cstdio>
 #include <cstdint>
 #include <stdlib.h>
 #include <limits.h>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <unordered_map>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <algorithm>
 
 #ifdef DEBUG_iLSM
 #include <iostream>
@@ -25,11 +33,106 @@ using namespace std;
 const unsigned int PAGE_SIZE = 4096;       // Memory page size
 const unsigned int MAX_BUFLEN = 524288;    // 512KB (MDTS)
 const unsigned int NSID = 60365824;        // Check via dmesg
+const unsigned int MAX_BATCH_PAGE = 16384; // BATCH_PUT pages land in one vLog slice
+const uint32_t SQE_BYTES = 64, CQE_BYTES = 16;
+
+// Keys: the first KEY_INLINE bytes ride in CDW2 CDW3 CDW14 CDW15; the rest of a
+// longer key, zero-padded to whole dwords, leads the piggybacked bytes of a put
+// (first Transfer command) or the data buffer of a read
+const unsigned int KEY_INLINE = 16;
+const unsigned int MAX_KEY_LEN = 255;
+// CDW10 of key-addressed commands: Key Size (31:24), Value Size (23:0)
+const unsigned int KEY_SIZE_SHIFT = 24;
+const uint32_t VALUE_SIZE_MASK = 0xFFFFFF;
+
+// CPU time of all threads of the process (submitters, reapers, flusher)
+static uint64_t process_cpu_ns()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// DBs open in the process by instance, so a thread exiting finds the ones
+// its contexts still belong to (never destroyed: threads may exit late)
+struct LiveDBs {
+    std::mutex mtx;
+    std::unordered_map<uint64_t, iLSM::DB*> dbs;
+};
+
+static LiveDBs &live_dbs()
+{
+    static LiveDBs *live = new LiveDBs();
+    return *live;
+}
+
+static uint64_t open_instance(iLSM::DB *db)
+{
+    static std::atomic<uint64_t> instances(0);
+    uint64_t instance = ++instances;
+    LiveDBs &live = live_dbs();
+    lock_guard<mutex> l(live.mtx);
+    live.dbs[instance] = db;
+    return instance;
+}
 
 int iLSM::DB::Open(const std::string &dev)
+{
+    return Open(dev, Options());
+}
+
+int iLSM::DB::Open(const std::string &dev, const Options &options)
 {
     int err;
-    err = open(dev.c_str(), O_RDONLY);
+    Close();
+    options_ = options;
+    open_cpu_ns_ = process_cpu_ns();
+    open_time_ = chrono::steady_clock::now();
+    if (options_.poll_completions)
+        options_.async_io = true;
+    if (options_.cache_capacity) {
+        cache_ = ROCKSDB_NAMESPACE::NewLRUCache(options_.cache_capacity, options_.cache_shard_bits);
+        cache_stripes_.reset(new CacheStripe[kCacheStripes]);
+    }
+    if (options_.compression != ROCKSDB_NAMESPACE::kNoCompression) {
+        if (ValueCompressor::Supported(options_.compression)) {
+            zip_.reset(new ValueCompressor(options_.compression, options_.compression_dict));
+        } else {
+            fprintf(stderr, "[iLSM] %s is not built in, values are stored uncompressed\n",
+                    ROCKSDB_NAMESPACE::CompressionTypeToString(options_.compression).c_str());
+            options_.compression = ROCKSDB_NAMESPACE::kNoCompression;
+        }
+    }
+
+    if (options_.qos_depth)
+        qos_.reset(new QosScheduler(options_.qos_depth, options_.qos_weight, options_.qos_rate_limit));
+
+    std::string path = dev;
+    if (options_.async_io && path.compare(0, 9, "/dev/nvme") == 0) {
+        // URING_CMD is only served by the generic char device (/dev/ngXnY)
+        std::string ng = "/dev/ng" + path.substr(9);
+        if (access(ng.c_str(), F_OK) == 0)
+            path = ng;
+    }
+
+    path_ = path;
+    if (options_.emulator) {
+        // No device: every context talks to the in-process emulator
+        options_.async_io = false;
+        options_.poll_completions = false;
+        if (!options_.emulator->Attach())
+            return -EBUSY;
+        instance_ = open_instance(this);
+        open_filter();
+        start_combiner();
+        start_async();
+        if (options_.calibrate)
+            return Calibrate();
+        return 0;
+    }
+
+    err = open(path.c_str(), O_RDONLY);
     if (err < 0)
         return -1; // fail to open
     fd_ = err;
@@ -39,157 +142,1145 @@ int iLSM::DB::Open(const std::string &dev)
         return -1;
     if (!S_ISCHR(nvme_stat.st_mode) && !S_ISBLK(nvme_stat.st_mode))
         return -1;
-    
+    // Stream slots are device-wide: one opener at a time
+    if (flock(fd_, LOCK_EX | LOCK_NB) < 0) {
+        close(fd_);
+        fd_ = -1;
+        return -EBUSY;
+    }
+
+    if (options_.async_io) {
+        // Rings are set up per thread context; probe once here
+        Uring probe;
+        err = probe.Init(fd_, options_.queue_depth, options_.poll_completions);
+        if (err < 0 && options_.poll_completions) {
+            fprintf(stderr, "[iLSM] polled io_uring setup failed (%s), using interrupts\n", strerror(-err));
+            options_.poll_completions = false;
+            probe.Close();
+            err = probe.Init(fd_, options_.queue_depth);
+        }
+        if (err < 0) {
+            // Fall back to the synchronous ioctl path
+            fprintf(stderr, "[iLSM] io_uring setup failed (%s), using ioctl\n", strerror(-err));
+            options_.async_io = false;
+        }
+    }
+
+    instance_ = open_instance(this);
+    open_filter();
+    start_combiner();
+    start_async();
+    if (options_.calibrate)
+        return Calibrate();
     return 0;
 }
 
+void iLSM::DB::Close()
+{
+    // Queued async ops, then staged puts go out first (the workers and the
+    // flusher need their contexts)
+    stop_async();
+    stop_combiner();
+    close_filter();
+    {
+        LiveDBs &live = live_dbs();
+        lock_guard<mutex> ll(live.mtx);
+        live.dbs.erase(instance_);
+    }
+    lock_guard<mutex> l(ctx_mtx);
+    contexts_.clear();
+    retired_ = ReportData();
+    cache_.reset();
+    zip_.reset();
+    qos_.reset();
+    if (instance_ && options_.emulator)
+        options_.emulator->Detach();
+    instance_ = 0;
+    if (fd_ >= 0)
+        close(fd_);
+    fd_ = -1;
+}
+
+struct iLSM::DB::ThreadContexts {
+    std::unordered_map<uint64_t, Context*> ctxs;
+
+    // Forget the contexts of DBs closed since (Close() freed them)
+    void prune() {
+        LiveDBs &live = live_dbs();
+        lock_guard<mutex> l(live.mtx);
+        for (auto it = ctxs.begin(); it != ctxs.end(); ) {
+            if (live.dbs.count(it->first))
+                ++it;
+            else
+                it = ctxs.erase(it);
+        }
+    }
+
+    // Thread exit: the DBs still open let go of the fd, ring and buffers
+    ~ThreadContexts() {
+        LiveDBs &live = live_dbs();
+        lock_guard<mutex> l(live.mtx);
+        for (auto &e : ctxs) {
+            auto it = live.dbs.find(e.first);
+            if (it != live.dbs.end())
+                it->second->retire_context(e.second);
+        }
+    }
+};
+
+// Look up (or register) the calling thread's submission context
+iLSM::DB::Context *iLSM::DB::context()
+{
+    // One-entry cache covers the common one-DB-per-thread case
+    thread_local uint64_t last_instance = 0;
+    thread_local Context *last_ctx = nullptr;
+    if (last_ctx && last_instance == instance_)
+        return last_ctx;
+
+    thread_local ThreadContexts mine;
+    auto it = mine.ctxs.find(instance_);
+    if (it == mine.ctxs.end()) {
+        mine.prune();
+        lock_guard<mutex> l(ctx_mtx);
+        std::unique_ptr<Context> ctx(new Context());
+        ctx->id = contexts_.size() + retired_.retired_contexts;
+        ctx->transport = new_transport(ctx->id);
+        it = mine.ctxs.emplace(instance_, ctx.get()).first;
+        contexts_.push_back(std::move(ctx));
+    }
+    last_instance = instance_;
+    last_ctx = it->second;
+    return last_ctx;
+}
+
+// The thread of ctx exited: its stats stay in the report, its fd, ring and
+// buffers go
+void iLSM::DB::retire_context(Context *ctx)
+{
+    lock_guard<mutex> l(ctx_mtx);
+    for (auto it = contexts_.begin(); it != contexts_.end(); ++it) {
+        if (it->get() != ctx)
+            continue;
+        retired_.op_stat.resize(static_cast<int>(iLSMOp::LAST));
+        retired_.passthru_stat.resize(NVME_CMD_KV_WRITE_BATCH - NVME_CMD_KV_PUT + 1);
+        retired_.qos_wait.resize(static_cast<int>(QosClass::LAST));
+        fold_context(*ctx, &retired_);
+        for (int i = 0; i < static_cast<int>(TrafficPath::LAST); i++)
+            ctx->traffic[i].AddTo(&retired_.traffic.path[i]);
+        retired_.retired_contexts++;
+        contexts_.erase(it);
+        return;
+    }
+}
+
+std::unique_ptr<iLSM::Transport> iLSM::DB::new_transport(unsigned int id)
+{
+    if (options_.emulator)
+        return std::unique_ptr<Transport>(new EmulatorTransport(options_.emulator.get()));
+
+    int fd = open(path_.c_str(), O_RDONLY);
+    if (fd < 0)     // Share the DB fd rather than fail the op
+        return std::unique_ptr<Transport>(new IoctlTransport(fd_, false));
+    if (options_.async_io) {
+        std::unique_ptr<UringTransport> uring(new UringTransport());
+        if (uring->Init(fd, options_.queue_depth, options_.poll_completions) == 0)
+            return std::unique_ptr<Transport>(uring.release());
+        fprintf(stderr, "[iLSM] io_uring setup failed for context %u, using ioctl\n", id);
+    }
+    return std::unique_ptr<Transport>(new IoctlTransport(fd, true));
+}
+
 int iLSM::DB::Put(const std::string &key, const std::string &value)
+{
+    return put_op(key, value, nullptr);
+}
+
+int iLSM::DB::Put(const std::string &key, const std::string &value, PutCallback done)
+{
+    return put_op(key, value, &done);
+}
+
+// Without done, returns once the pair is on the device
+int iLSM::DB::put_op(const std::string &key, const std::string &value, PutCallback *done)
 {
     auto st = chrono::high_resolution_clock::now();
-    int ret = _Put(key, value);
+    Context *ctx = context();
+    unsigned long long commands = ctx->commands;
+    int ret;
+    ctx->qos = value.size() > options_.qos_large_write ? QosClass::LARGE_WRITE : QosClass::SMALL_WRITE;
+    // In the filter before it can be on the device
+    if (filter_)
+        filter_->Add(key);
+    if (combines(key, value)) {
+        if (done) {
+            ret = stage(key, value, std::move(*done));
+        } else {
+            // Group commit: wait for the page holding this put
+            std::promise<int> durable;
+            std::future<int> written = durable.get_future();
+            ret = stage(key, value, [&durable](int status) { durable.set_value(status); });
+            if (ret == 0)
+                ret = written.get();
+        }
+    } else {
+        // A staged put of the same key must not land after this one
+        combine_barrier(&key);
+        ret = _Put(key, value);
+        Slice v(value);
+        cache_update(key, ret == 0 ? &v : nullptr);
+        if (ret == 0)
+            ctx->traffic[static_cast<int>(ctx->path)].payload_bytes += key.size() + value.size();
+        if (ret == 0 && done)
+            (*done)(0);
+    }
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
     finishOp(iLSMOp::Put, d);
+    ctx->op_stat.cmds_per_put.Add(ctx->commands - commands);
+    ctx->path = TrafficPath::READ;
+    ctx->qos = QosClass::READ;
     return ret;
 }
 
+void iLSM::DB::Flush()
+{
+    combine_barrier(nullptr);
+}
+
+int iLSM::DB::Delete(const std::string &key)
+{
+    auto st = chrono::high_resolution_clock::now();
+    Context *ctx = context();
+    ctx->path = TrafficPath::DELETE;
+    ctx->qos = QosClass::SMALL_WRITE;
+    combine_barrier(&key);
+    int ret = _Delete(key, nullptr);
+    cache_update(key, nullptr);
+    if (ret == 0)
+        ctx->traffic[static_cast<int>(TrafficPath::DELETE)].payload_bytes += key.size();
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = ed-st;
+    finishOp(iLSMOp::Delete, d);
+    ctx->path = TrafficPath::READ;
+    ctx->qos = QosClass::READ;
+    return ret;
+}
+
+int iLSM::DB::DeleteRange(const std::string &begin, const std::string &end)
+{
+    auto st = chrono::high_resolution_clock::now();
+    Context *ctx = context();
+    ctx->path = TrafficPath::DELETE;
+    ctx->qos = QosClass::SMALL_WRITE;
+    // Any staged page may hold a key of the range
+    combine_barrier(nullptr);
+    int ret = _Delete(begin, &end);
+    cache_clear();
+    if (ret == 0)
+        ctx->traffic[static_cast<int>(TrafficPath::DELETE)].payload_bytes += begin.size() + end.size();
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = ed-st;
+    finishOp(iLSMOp::DeleteRange, d);
+    ctx->path = TrafficPath::READ;
+    ctx->qos = QosClass::READ;
+    return ret;
+}
+
+int iLSM::DB::Write(const WriteBatch &batch)
+{
+    auto st = chrono::high_resolution_clock::now();
+    Context *ctx = context();
+    // In the filter before they can be on the device
+    if (filter_) {
+        for (const WriteBatch::Op &op : batch.ops_) {
+            if (!op.del)
+                filter_->Add(op.key);
+        }
+    }
+    // Staged puts of its keys must not land after it
+    if (!batch.ops_.empty())
+        combine_barrier(nullptr);
+    int ret = _Write(batch);
+    for (const WriteBatch::Op &op : batch.ops_) {
+        Slice v(op.value);
+        cache_update(op.key, ret == 0 && !op.del ? &v : nullptr);
+    }
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = ed-st;
+    ctx->path = TrafficPath::WRITE_BATCH;
+    finishOp(iLSMOp::Write, d);
+    ctx->path = TrafficPath::READ;
+    ctx->qos = QosClass::READ;
+    return ret;
+}
+
+// Header, the members by their usual paths tagged with the batch, then the
+// trailer: commit if every member made it to the device, else abort
+int iLSM::DB::_Write(const WriteBatch &batch)
+{
+    uint32_t n = batch.ops_.size();
+    if (!n)
+        return 0;
+    if (n > MAX_BATCH_MEMBERS)
+        return -EINVAL;
+    uint64_t bytes = 0;
+    for (const WriteBatch::Op &op : batch.ops_) {
+        if (op.key.empty() || op.key.size() > MAX_KEY_LEN)
+            return -EINVAL;
+        if (!op.del && (op.value.empty() || op.value.size() > VALUE_SIZE_MASK))
+            return -EINVAL;
+        bytes += op.key.size() + op.value.size();
+    }
+
+    Context *ctx = context();
+    uint32_t id = open_batch();
+    int err;
+    uint32_t result;
+    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
+    cdw10 = n;              // # of members
+    cdw12 = bytes;          // Key + value bytes
+    cdw13 = id;
+    ctx->path = TrafficPath::WRITE_BATCH;
+    ctx->qos = QosClass::SMALL_WRITE;
+    err = nvme_passthru(NVME_CMD_KV_WRITE_BATCH, 0, 0, NSID, cdw2, cdw3,
+            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
+            0, NULL, result);
+    if (err) {
+#ifdef DEBUG_iLSM
+        perror("ilsm write batch");
+#endif
+        close_batch(id);
+        return -1;
+    }
+
+    int ret = 0;
+    ctx->batch_tag = BATCH_MEMBER | (id << BATCH_ID_SHIFT);
+    for (const WriteBatch::Op &op : batch.ops_) {
+        if (op.del) {
+            ctx->path = TrafficPath::DELETE;
+            ctx->qos = QosClass::SMALL_WRITE;
+            ret = _Delete(op.key, nullptr);
+        } else {
+            ctx->qos = op.value.size() > options_.qos_large_write ? QosClass::LARGE_WRITE : QosClass::SMALL_WRITE;
+            ret = _Put(op.key, op.value);
+        }
+        if (ret != 0)
+            break;
+        TrafficCounters &t = ctx->traffic[static_cast<int>(ctx->path)];
+        t.ops++;
+        t.payload_bytes += op.key.size() + op.value.size();
+    }
+    ctx->batch_tag = 0;
+
+    ctx->path = TrafficPath::WRITE_BATCH;
+    ctx->qos = QosClass::SMALL_WRITE;
+    cdw11 = ret == 0 ? BATCH_COMMIT : BATCH_ABORT;
+    err = nvme_passthru(NVME_CMD_KV_WRITE_BATCH, 0, 0, NSID, cdw2, cdw3,
+            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
+            0, NULL, result);
+    close_batch(id);
+    if (ret != 0)
+        return ret;
+    if (err || result != n)
+        return -1;
+    return 0;
+}
+
+// Id of a free device batch slot (waits for one); its low bits are the slot
+uint32_t iLSM::DB::open_batch()
+{
+    unique_lock<mutex> l(batch_mtx_);
+    batch_cv_.wait(l, [this] { return batch_free_ != 0; });
+    uint32_t slot = __builtin_ctz(batch_free_);
+    batch_free_ &= ~(1u << slot);
+    return (batch_gen_++ * MAX_OPEN_BATCHES + slot) & BATCH_ID_MASK;
+}
+
+void iLSM::DB::close_batch(uint32_t id)
+{
+    {
+        lock_guard<mutex> l(batch_mtx_);
+        batch_free_ |= 1u << (id % MAX_OPEN_BATCHES);
+    }
+    batch_cv_.notify_one();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////// BandSlim ////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////////////////////
-// Transfer Modes (KVSSD-PRP, PIGGY-FG, ADAPT-OPT)
-// * Threshold of ADAPT is a configurable parameter
-#define KVSSD 1
-#define PIGGY 16384
-#define ADAPT 127
-// * Select the Transfer Mode using below macro
-// #define TRANSFER_MODE KVSSD
-// #define TRANSFER_MODE PIGGY
-#define TRANSFER_MODE ADAPT
+// Async ops: a pool of async_threads workers runs them as the blocking calls,
+// each worker on its own submission context (fd and ring), so one caller
+// keeps up to async_threads ops, and their commands, in flight
+void iLSM::DB::start_async()
+{
+    if (!options_.async_threads)
+        return;
+    async_.reset(new AsyncPool());
+    for (unsigned int i = 0; i < options_.async_threads; i++)
+        async_->threads.push_back(std::thread(&DB::async_worker, this));
+}
+
+void iLSM::DB::stop_async()
+{
+    if (!async_)
+        return;
+    {
+        lock_guard<mutex> l(async_->mtx);
+        async_->stop = true;
+    }
+    async_->cv.notify_all();
+    for (std::thread &t : async_->threads)
+        t.join();
+    async_.reset();
+}
+
+void iLSM::DB::async_worker()
+{
+    AsyncPool &pool = *async_;
+    while (1) {
+        std::function<void()> op;
+        {
+            unique_lock<mutex> l(pool.mtx);
+            pool.cv.wait(l, [&pool] { return pool.stop || !pool.tasks.empty(); });
+            if (pool.tasks.empty())
+                return;
+            op = std::move(pool.tasks.front());
+            pool.tasks.pop_front();
+        }
+        op();
+    }
+}
+
+// Queues op for a worker, or runs it now without async_threads
+void iLSM::DB::async_run(std::function<void()> op)
+{
+    if (!async_) {
+        op();
+        return;
+    }
+    {
+        lock_guard<mutex> l(async_->mtx);
+        async_->tasks.push_back(std::move(op));
+        async_->ops++;
+        if (async_->tasks.size() > async_->peak_queued)
+            async_->peak_queued = async_->tasks.size();
+    }
+    async_->cv.notify_one();
+}
+
+// Runs fn here, or on the thread polling cq
+static void complete(iLSM::CompletionQueue *cq, std::function<void()> fn)
+{
+    if (cq)
+        cq->Post(std::move(fn));
+    else
+        fn();
+}
+
+std::future<int> iLSM::DB::PutAsync(const std::string &key, const std::string &value)
+{
+    std::shared_ptr<std::promise<int>> p = std::make_shared<std::promise<int>>();
+    std::future<int> f = p->get_future();
+    PutAsync(key, value, [p](int status) { p->set_value(status); });
+    return f;
+}
+
+// A combined put completes when its page is written, on the thread writing it
+void iLSM::DB::PutAsync(const std::string &key, const std::string &value, PutCallback done,
+        CompletionQueue *cq)
+{
+    async_run([this, key, value, done, cq] {
+        PutCallback finish = [done, cq](int status) {
+            if (done)
+                complete(cq, [done, status] { done(status); });
+        };
+        int ret = Put(key, value, finish);
+        if (ret != 0)
+            finish(ret);
+    });
+}
+
+std::future<iLSM::GetResult> iLSM::DB::GetAsync(const std::string &key)
+{
+    std::shared_ptr<std::promise<GetResult>> p = std::make_shared<std::promise<GetResult>>();
+    std::future<GetResult> f = p->get_future();
+    GetAsync(key, [p](GetResult &r) { p->set_value(std::move(r)); });
+    return f;
+}
+
+void iLSM::DB::GetAsync(const std::string &key, GetCallback done, CompletionQueue *cq)
+{
+    async_run([this, key, done, cq] {
+        std::shared_ptr<GetResult> r = std::make_shared<GetResult>();
+        r->status = Get(key, r->value);
+        if (done)
+            complete(cq, [done, r] { done(*r); });
+    });
+}
+
+std::future<iLSM::MultiGetResult> iLSM::DB::MultiGetAsync(const std::vector<Slice> &keys)
+{
+    std::shared_ptr<std::promise<MultiGetResult>> p = std::make_shared<std::promise<MultiGetResult>>();
+    std::future<MultiGetResult> f = p->get_future();
+    MultiGetAsync(keys, [p](MultiGetResult &r) { p->set_value(std::move(r)); });
+    return f;
+}
+
+void iLSM::DB::MultiGetAsync(const std::vector<Slice> &keys, MultiGetCallback done, CompletionQueue *cq)
+{
+    std::vector<std::string> owned;
+    owned.reserve(keys.size());
+    for (const Slice &k : keys)
+        owned.push_back(std::string(k.data(), k.size()));
+    async_run([this, owned, done, cq] {
+        std::vector<Slice> slices(owned.begin(), owned.end());
+        std::shared_ptr<MultiGetResult> r = std::make_shared<MultiGetResult>();
+        r->status = MultiGet(slices, &r->values, &r->statuses);
+        if (done)
+            complete(cq, [done, r] { done(*r); });
+    });
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
-// * Enable the combination transfer method for PRP-based transfer
-#if TRANSFER_MODE == ADAPT
-        #define ADAPT_COMBI 
+// Write combining: small puts of all threads are packed into one shared page
+// of records and written by a single BATCH_PUT. The put that finds the page
+// full writes it; a flusher thread writes a page whose deadline passed. Pages
+// are written one at a time in the order they were taken, so the device sees
+// the puts of one key in order.
+void iLSM::DB::start_combiner()
+{
+    if (!options_.write_combining)
+        return;
+    combine_page_ = (options_.combine_page_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    if (combine_page_ < PAGE_SIZE)
+        combine_page_ = PAGE_SIZE;
+    if (combine_page_ > MAX_BATCH_PAGE)
+        combine_page_ = MAX_BATCH_PAGE;
+    combiner_.reset(new Combiner());
+    combiner_->open.page.reserve(combine_page_);
+    combiner_->flusher = std::thread(&DB::flusher, this);
+}
+
+void iLSM::DB::stop_combiner()
+{
+    if (!combiner_)
+        return;
+    {
+        lock_guard<mutex> l(combiner_->mtx);
+        combiner_->stop = true;
+    }
+    combiner_->wakeup.notify_one();
+    combiner_->flusher.join();
+    combiner_.reset();
+}
+
+bool iLSM::DB::combines(const std::string &key, const std::string &value) const
+{
+    return combiner_ && !value.empty() && value.size() <= options_.combine_threshold &&
+        !key.empty() && key.size() <= MAX_KEY_LEN &&
+        IterRecord::Size(key.size(), value.size()) <= combine_page_;
+}
+
+// Appends the pair to the open page; the put that finds it full writes it
+int iLSM::DB::stage(const std::string &key, const std::string &value, PutCallback done)
+{
+    Combiner &c = *combiner_;
+    uint32_t size = IterRecord::Size(key.size(), value.size());
+    IterRecord rec;
+    rec.key_size = key.size();
+    rec.rsvd = 0;
+    rec.value_size = value.size();
+    context()->path = TrafficPath::BATCH;
+
+    Batch full;
+    {
+        lock_guard<mutex> l(c.mtx);
+        if (c.open.page.size() + size > combine_page_)
+            take_batch(full);
+        if (!c.open.records) {
+            c.deadline = chrono::steady_clock::now() + chrono::microseconds(options_.combine_deadline_us);
+            c.wakeup.notify_one();
+        }
+        size_t pos = c.open.page.size();
+        c.open.page.resize(pos + size, 0);
+        memcpy(&c.open.page[pos], &rec, sizeof(rec));
+        memcpy(&c.open.page[pos + sizeof(rec)], key.data(), key.size());
+        memcpy(&c.open.page[pos + sizeof(rec) + key.size()], value.data(), value.size());
+        c.open.records++;
+        c.open.payload_bytes += key.size() + value.size();
+        c.open.done.push_back(std::move(done));
+    }
+    if (full.records)
+        write_batch(full);
+    return 0;
+}
+
+// Hands the open page to the caller for writing (c.mtx held)
+void iLSM::DB::take_batch(Batch &b)
+{
+    Combiner &c = *combiner_;
+    b = std::move(c.open);
+    b.seq = c.taken++;
+    c.open = Batch();
+    c.open.page.reserve(combine_page_);
+}
+
+// Writes a taken page once the ones taken before it are done, then runs
+// the callbacks of its puts
+void iLSM::DB::write_batch(Batch &b)
+{
+    Combiner &c = *combiner_;
+    {
+        unique_lock<mutex> l(c.mtx);
+        c.turn.wait(l, [&] { return c.written == b.seq; });
+    }
+
+    Context *ctx = context();
+    TrafficPath path = ctx->path;
+    QosClass qos = ctx->qos;
+    ctx->path = TrafficPath::BATCH;
+    ctx->qos = QosClass::SMALL_WRITE;
+    int err = batch_put(b);
+    if (err == 0)
+        ctx->traffic[static_cast<int>(TrafficPath::BATCH)].payload_bytes += b.payload_bytes;
+    ctx->path = path;
+    ctx->qos = qos;
+    if (cache_) {
+        for (size_t pos = 0; pos < b.page.size(); ) {
+            IterRecord rec;
+            memcpy(&rec, b.page.data() + pos, sizeof(rec));
+            Slice key(b.page.data() + pos + sizeof(rec), rec.key_size);
+            Slice value(key.data() + rec.key_size, rec.value_size);
+            cache_update(key, err == 0 ? &value : nullptr);
+            pos += IterRecord::Size(rec.key_size, rec.value_size);
+        }
+    }
+
+    {
+        lock_guard<mutex> l(c.mtx);
+        c.written++;
+        c.records += b.records;
+    }
+    c.turn.notify_all();
+    for (auto &done : b.done)
+        done(err);
+}
+
+// One BATCH_PUT of a page of records
+int iLSM::DB::batch_put(const Batch &b)
+{
+    Context *ctx = context();
+    unsigned int data_len = (b.page.size() - 1) / PAGE_SIZE * PAGE_SIZE + PAGE_SIZE;
+    DmaBuffer buf(ctx->pool, data_len);
+    if (!buf.data())
+        return -ENOMEM;
+    memcpy(buf.data(), b.page.data(), b.page.size());
+
+    int err;
+    uint32_t result;
+    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
+    cdw10 = b.records;      // # of records
+    cdw11 = b.page.size();  // Record bytes
+    cdw12 = 0 | (0xFFFF & ((data_len - 1) / PAGE_SIZE));
+    err = nvme_passthru(NVME_CMD_KV_BATCH_PUT, 0, 0, NSID, cdw2, cdw3,
+            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
+            data_len, buf.data(), result);
+    if (err < 0) {
+        // ioctl fail
+#ifdef DEBUG_iLSM
+        perror("ilsm batch put");
 #endif
+        return -1;
+    }
+    if (err || result != b.records)
+        return -1;
+    return 0;
+}
+
+// True if a record of the page has this key
+static bool batch_holds(const std::string &page, const std::string &key)
+{
+    size_t pos = 0;
+    while (pos + sizeof(iLSM::IterRecord) <= page.size()) {
+        iLSM::IterRecord rec;
+        memcpy(&rec, page.data() + pos, sizeof(rec));
+        if (rec.key_size == key.size() && !memcmp(page.data() + pos + sizeof(rec), key.data(), key.size()))
+            return true;
+        pos += iLSM::IterRecord::Size(rec.key_size, rec.value_size);
+    }
+    return false;
+}
+
+// Writes the open page if it holds key (any page if key is null), then
+// waits until every page taken so far is written
+void iLSM::DB::combine_barrier(const std::string *key)
+{
+    if (!combiner_)
+        return;
+    Combiner &c = *combiner_;
+    Batch b;
+    uint64_t taken;
+    {
+        lock_guard<mutex> l(c.mtx);
+        if (c.open.records && (!key || batch_holds(c.open.page, *key)))
+            take_batch(b);
+        taken = c.taken;
+        if (c.written == taken)
+            return;
+    }
+    if (b.records)
+        write_batch(b);
+    unique_lock<mutex> l(c.mtx);
+    c.turn.wait(l, [&] { return c.written >= taken; });
+}
+
+// Writes the open page once its deadline passes, and what is left on stop
+void iLSM::DB::flusher()
+{
+    Combiner &c = *combiner_;
+    unique_lock<mutex> l(c.mtx);
+    while (1) {
+        if (c.open.records && (c.stop || chrono::steady_clock::now() >= c.deadline)) {
+            Batch b;
+            take_batch(b);
+            if (!c.stop)
+                c.deadline_pages++;
+            l.unlock();
+            write_batch(b);
+            l.lock();
+            continue;
+        }
+        if (c.stop)
+            break;
+        if (c.open.records)
+            c.wakeup.wait_until(l, c.deadline);
+        else
+            c.wakeup.wait(l);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////// BandSlim ////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+// Transfer Modes (KVSSD-PRP, PIGGY-FG, ADAPT-OPT) and the thresholds of ADAPT are
+// runtime parameters (iLSM::Options), see transfer_path()
+// * Largest value a BandSlim WRITE + TRANSFERs can carry: its vLog record
+//   (header and value) has to fit one 16KB slice
+const unsigned int MAX_PIGGYBACK = 16384 - KV_VLOG_HEADER_BYTES;
+// * CDW11 flag of PUT: only the whole pages before the tail come by PRP, the
+//   sub-page tail follows by BANDSLIM_TRANSFERs (combination transfer)
+const uint32_t KV_PUT_COMBI = 1u << 31;
+// * CDW11 of PUT: one segment of a value past MDTS (streaming put). Segment n
+//   (15:0) carries bytes [n x MAX_BUFLEN, n x MAX_BUFLEN + MAX_BUFLEN) of the
+//   PRP part, NLB its own pages; CDW10 has the whole value size, so the
+//   device places every segment at its offset, and the pair completes once
+//   all segments and its Transfer stream arrived
+const uint32_t KV_PUT_SEGMENT = 1u << 30;
+// * CDW11 flag of DELETE: a tombstone of [key, end key); the end key size is in
+//   CDW10 (23:16), the end key itself follows the rest of the key in the
+//   Transfer stream, zero-padded to whole dwords
+const uint32_t KV_DELETE_RANGE = 1u << 31;
+const uint32_t END_KEY_SHIFT = 16;
+// * Key of the probe puts issued by Calibrate()
+const uint32_t CALIBRATION_KEY = 0xFFFFFFFF;
+// * Payload of a BandSlim Write and of a Transfer, in the dwords the shared
+//   layout (firmware/nvme_kv_payload.h) lists. CDW13 of a PUT/WRITE opens a
+//   stream with the host's stream id, CDW2 of every Transfer tags it: stream
+//   id (31:16) | sequence # (15:0); fragment n holds bytes [n x 52, n x 52 +
+//   52) of the stream (rest of a long key, then the value bytes the PUT/WRITE
+//   did not carry)
+const uint32_t WRITE_PAYLOAD = KV_WRITE_PAYLOAD;
+const uint32_t TRANSFER_PAYLOAD = KV_TRANSFER_PAYLOAD;
 //////////////////////////////////////////////////////////////////////////////////////////
-// * Macro function for piggybacking value (be sure to wrap up this macro with {,})
-#define PIGGYBACK_VALUE(cdw, ptr, left, step) \
-        memcpy(&cdw, ptr, (left < step ? left : step)); \
-        ptr = (char*)ptr + step; \
-        left -= step;
 // * Macro function for checking value size
-#define IS_LEFT(left) left > 0 && left <= 16384
+#define IS_LEFT(left) (left > 0 && left <= MAX_PIGGYBACK + MAX_KEY_LEN)
 //////////////////////////////////////////////////////////////////////////////////////////
+// Picks PRP vs piggybacking for a value, and whether a PRP value sends its
+// sub-page tail by piggybacking (combination transfer)
+void iLSM::DB::transfer_path(uint32_t value_size, bool &prp, bool &combi)
+{
+    combi = false;
+    switch (options_.transfer_mode) {
+        case TransferMode::KVSSD:
+            prp = true;
+            break;
+        case TransferMode::PIGGY:
+            prp = value_size > MAX_PIGGYBACK;
+            break;
+        default:
+            prp = value_size > options_.piggyback_threshold || value_size > MAX_PIGGYBACK;
+            if (prp && value_size > PAGE_SIZE) {
+                uint32_t tail = value_size - ((value_size - 1) / PAGE_SIZE) * PAGE_SIZE;
+                combi = tail <= options_.combi_threshold;
+            }
+    }
+}
+
 int iLSM::DB::_Put(const std::string &key, const std::string &value)
+{
+    bool prp, combi;
+    transfer_path(value.size(), prp, combi);
+    // A value that fits one WRITE cannot take fewer commands
+    if (zip_ && (prp || value.size() > WRITE_PAYLOAD)) {
+        Context *ctx = context();
+        std::string zipped;
+        ctx->zip_tried++;
+        if (zip_->Compress(value, &zipped)) {
+            bool zprp, zcombi;
+            transfer_path(zipped.size(), zprp, zcombi);
+            uint32_t commands = put_commands(key.size(), value.size(), prp, combi);
+            uint32_t zcommands = put_commands(key.size(), zipped.size(), zprp, zcombi);
+            if (zcommands < commands || (prp && !zprp)) {
+                int ret = put_value(key, zipped, zprp, zcombi, true);
+                if (ret == 0) {
+                    ctx->zip_stored++;
+                    ctx->zip_raw_commands += commands;
+                    ctx->zip_commands += zcommands;
+                    ctx->zip_raw_bytes += value.size();
+                    ctx->zip_bytes += zipped.size();
+                }
+                return ret;
+            }
+        }
+    }
+    return put_value(key, value, prp, combi);
+}
+
+// Commands put_value() issues for a value on a path: the PUT/WRITE, and
+// the Transfers of the rest of a long key and of what it did not carry
+// (a PRP part past MDTS takes a PUT per segment)
+uint32_t iLSM::DB::put_commands(size_t key_size, uint32_t value_size, bool prp, bool combi)
+{
+    uint32_t stream = key_size > KEY_INLINE ? (key_size - KEY_INLINE + 3) / 4 * 4 : 0;
+    uint32_t puts = 1;
+    if (!prp) {
+        stream += value_size > WRITE_PAYLOAD ? value_size - WRITE_PAYLOAD : 0;
+    } else {
+        uint32_t pages = (value_size - 1) / PAGE_SIZE;
+        if (combi && value_size > PAGE_SIZE)
+            stream += value_size - pages * PAGE_SIZE;
+        else
+            pages++;
+        puts = (pages * PAGE_SIZE - 1) / MAX_BUFLEN + 1;
+    }
+    return puts + (stream + TRANSFER_PAYLOAD - 1) / TRANSFER_PAYLOAD;
+}
+
+// Value the device stored compressed (VALUE_COMPRESSED), as it was put
+int iLSM::DB::unzip(const Slice &data, std::string &value)
+{
+    if (!zip_)
+        return -1;      // Opened without the codec it was put with
+    return zip_->Uncompress(data.data(), data.size(), &value);
+}
+
+// Lays the key out in CDW2 CDW3 CDW14 CDW15 (first KEY_INLINE bytes);
+// returns the key size, or -EINVAL if it cannot be encoded
+int iLSM::DB::encode_key(const std::string &key, uint32_t &cdw2, uint32_t &cdw3,
+        uint32_t &cdw14, uint32_t &cdw15)
+{
+    if (key.empty() || key.size() > MAX_KEY_LEN)
+        return -EINVAL;
+    uint32_t kdw[KEY_INLINE / 4] = {0, 0, 0, 0};
+    memcpy(kdw, key.data(), key.size() < KEY_INLINE ? key.size() : KEY_INLINE);
+    cdw2 = kdw[0]; cdw3 = kdw[1]; cdw14 = kdw[2]; cdw15 = kdw[3];
+    return key.size();
+}
+
+// Key bytes past KEY_INLINE, zero-padded to whole dwords
+std::string iLSM::DB::key_spill(const std::string &key)
+{
+    if (key.size() <= KEY_INLINE)
+        return std::string();
+    std::string spill = key.substr(KEY_INLINE);
+    spill.resize((spill.size() + 3) / 4 * 4, 0);
+    return spill;
+}
+
+// Sends the rest of a long key (if any), then data, by BandSlim Transfer
+// commands, TRANSFER_PAYLOAD bytes each. Every fragment carries its place in
+// the stream, so they go back to back, transfer_queue_depth at a time, and
+// only the last completion is waited for
+int iLSM::DB::piggyback_transfer(uint16_t stream, std::string &spill, const void *data, uint32_t left)
+{
+    if (!spill.empty()) {
+        spill.append((const char*)data, left);
+        data = spill.data();
+        left = spill.size();
+    }
+    if (!IS_LEFT(left))
+        return 0;
+
+    bool raw = context()->transport->RawDwords();
+    std::vector<struct nvme_passthru_cmd> cmds;
+    cmds.reserve((left - 1) / TRANSFER_PAYLOAD + 1);
+    for (uint32_t seq = 0, ofs = 0; ofs < left; seq++, ofs += TRANSFER_PAYLOAD) {
+        uint32_t dw[16] = {0};
+        dw[2] = ((uint32_t)stream << 16) | seq;
+        kv_payload_pack(dw, kv_transfer_dwords, KV_TRANSFER_SLOTS, (const char*)data + ofs,
+                left - ofs < TRANSFER_PAYLOAD ? left - ofs : TRANSFER_PAYLOAD);
+        cmds.push_back(bandslim_cmd(NVME_CMD_KV_BANDSLIM_TRANSFER, dw, raw));
+    }
+    return submit_batch(NVME_CMD_KV_BANDSLIM_TRANSFER, cmds);
+}
+
+// Streaming put of the len PRP bytes at data (whole pages): one PUT per
+// MAX_BUFLEN segment, with the key, sizes and flags of dw. The segments go
+// back to back, so the device pulls one while it flushes the vLog slices of
+// the one before
+int iLSM::DB::put_segments(const uint32_t *dw, const char *data, uint32_t len)
+{
+    std::vector<struct nvme_passthru_cmd> cmds;
+    cmds.reserve((len - 1) / MAX_BUFLEN + 1);
+    for (uint32_t seg = 0, ofs = 0; ofs < len; seg++, ofs += MAX_BUFLEN) {
+        uint32_t seg_len = len - ofs < MAX_BUFLEN ? len - ofs : MAX_BUFLEN;
+        struct nvme_passthru_cmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_KV_PUT;
+        cmd.nsid = NSID;
+        cmd.cdw2 = dw[2];
+        cmd.cdw3 = dw[3];
+        cmd.addr = (uint64_t)(uintptr_t)(data + ofs);
+        cmd.data_len = seg_len;
+        cmd.cdw10 = dw[10];
+        cmd.cdw11 = dw[11] | KV_PUT_SEGMENT | seg;
+        cmd.cdw12 = 0xFFFF & (seg_len / PAGE_SIZE - 1);
+        cmd.cdw13 = dw[13];
+        cmd.cdw14 = dw[14];
+        cmd.cdw15 = dw[15];
+        cmds.push_back(cmd);
+    }
+    return submit_batch(NVME_CMD_KV_PUT, cmds);
+}
+
+int iLSM::DB::put_value(const std::string &key, const std::string &value, bool use_prp, bool combi,
+        bool compressed)
 {
     int err = 0;
     uint32_t result;
-    uint32_t cdw2, cdw3, cdw8, cdw9, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15; uint64_t cdw4_5, cdw6_7; 
-    cdw2 = cdw3 = cdw8 = cdw9 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0; cdw4_5 = cdw6_7 = 0;
+    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
 
-    // CDW2 CDW3 CDW14 CDW15 -> Key (we only use CDW2)
-    // CDW11's 1Byte -> Key Size (we rather specify in CDW3) 
-    memcpy(&cdw2, key.c_str(), 4); cdw3 = 4; 
-    
-    // CDW10 -> Value Size
+    // CDW2 CDW3 CDW14 CDW15 -> Key (up to 16B inline, the rest leads the
+    // piggybacked bytes of the first Transfer command)
+    int key_size = encode_key(key, cdw2, cdw3, cdw14, cdw15);
+    if (key_size < 0)
+        return key_size;
+    std::string spill = key_spill(key);
+    // CDW13 -> Stream of the Transfers that may follow, whether the value
+    // is compressed, and the Write() batch it belongs to
+    Context *ctx = context();
+
+    // CDW10 -> Key Size (31:24), Value Size (23:0)
     uint32_t value_size = value.size();
-    cdw10 = value_size;
+    if (value_size == 0 || value_size > VALUE_SIZE_MASK)
+        return -EINVAL;
+    cdw10 = (key_size << KEY_SIZE_SHIFT) | value_size;
+    // A stream only if more commands follow (stream 0: the device completes
+    // the pair with this one)
+    uint16_t stream = put_commands(key.size(), value_size, use_prp, combi) > 1 ? open_stream() : 0;
+    cdw13 = stream | (compressed ? VALUE_COMPRESSED : 0) | ctx->batch_tag;
     
-    // PRP Entry Base Address
-    void *data = NULL;//, *data_start;
+    // PRP Entry Base Address (piggybacked bytes are read straight from the value)
+    const void *data = value.c_str();
     unsigned int data_len = value_size;
     unsigned int nlb = (data_len - 1) / PAGE_SIZE;
     data_len = (nlb + 1) * PAGE_SIZE;
-    if (posix_memalign(&data, PAGE_SIZE, data_len))
-        return -ENOMEM;
-    // data_start = data;
-    memcpy(data, value.c_str(), value.size()); 
+    if (data_len > ctx->expected_value)
+        ctx->expected_value = data_len < MAX_BUFLEN ? data_len : MAX_BUFLEN;
 
-    // Select the Transfer Mode
-    if (value_size > TRANSFER_MODE) { // (1) Page-Unit DMA via PRP
+    // Selected Transfer Mode
+    ctx->path = !use_prp ? TrafficPath::PIGGY : combi && nlb ? TrafficPath::COMBI : TrafficPath::PRP;
+    if (use_prp) { // (1) Page-Unit DMA via PRP
+        DmaBuffer prp(ctx->pool, data_len);
+        if (!prp.data()) {
+            if (stream)
+                close_stream(stream);
+            return -ENOMEM;
+        }
+        memcpy(prp.data(), value.c_str(), value.size());
+        data = prp.data();
         cdw12 = 0 | (0xFFFF & ((value.size() - 1) / PAGE_SIZE));
 
-#ifdef ADAPT_COMBI
-        // (1-1) Combination transfer of Adaptive Value Transfer
-        unsigned int prp_len = nlb * PAGE_SIZE;
+        if (data_len > MAX_BUFLEN) {
+            // (1-0) Streaming put: the PRP part in MDTS segments, then the
+            // tail (combination transfer) by piggybacking
+            unsigned int prp_len = combi ? nlb * PAGE_SIZE : data_len;
+            uint32_t dw[16] = {0};
+            dw[2] = cdw2; dw[3] = cdw3; dw[10] = cdw10;
+            dw[11] = combi ? KV_PUT_COMBI : 0;
+            dw[13] = cdw13; dw[14] = cdw14; dw[15] = cdw15;
+            err = put_segments(dw, (const char*)prp.data(), prp_len);
+            data = (const char*)value.c_str() + prp_len;
+            value_size = prp_len < value_size ? value_size - prp_len : 0;
+        }
+        else if (combi && nlb != 0) {
+            // (1-1) Combination transfer of Adaptive Value Transfer
+            unsigned int prp_len = nlb * PAGE_SIZE;
 
-        // (1-1-1) PRP-based transfer part
-        err = nvme_passthru(NVME_CMD_KV_PUT, 0, 0, NSID, cdw2, cdw3,
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len, data, result);
-        cdw2 = cdw3 = cdw8 = cdw9 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0; cdw4_5 = cdw6_7 = 0;
-        
-        // (1-1-2) Piggyback-based transfer part
-        data = (char*)data + prp_len; 
-        value_size -= prp_len;
-        while (prp_len != 0 && IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw2, data, value_size, 4) 
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw3, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw4_5, data, value_size, 8) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw6_7, data, value_size, 8) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw8, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw9, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw10, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw11, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw12, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw13, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw14, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw15, data, value_size, 4) }
-
-            // BandSlim Transfer Command
-            err = nvme_passthru_bandslim(NVME_CMD_KV_BANDSLIM_TRANSFER, 0, 0, NSID, 
-                cdw2, cdw3, cdw4_5, cdw6_7, cdw8, cdw9, cdw10, 
-                cdw11, cdw12, cdw13, cdw14, cdw15, result);
-
-            cdw2 = cdw3 = cdw8 = cdw9 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0; cdw4_5 = cdw6_7 = 0;
+            // (1-1-1) PRP-based transfer part
+            cdw11 = KV_PUT_COMBI;
+            err = nvme_passthru(NVME_CMD_KV_PUT, 0, 0, NSID, cdw2, cdw3,
+                cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len, prp.data(), result);
+
+            // (1-1-2) Piggyback-based transfer part
+            data = (char*)data + prp_len;
+            value_size -= prp_len;
         }
-#else
-        // (1-2) Naive NVMe PRP-based transfer
-        err = nvme_passthru(NVME_CMD_KV_PUT, 0, 0, NSID, cdw2, cdw3,
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len, data, result);
-#endif	
+        else {
+            // (1-2) Naive NVMe PRP-based transfer
+            err = nvme_passthru(NVME_CMD_KV_PUT, 0, 0, NSID, cdw2, cdw3,
+                cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len, prp.data(), result);
+            value_size = 0;
+        }
+
+        if (err == 0)
+            err = piggyback_transfer(stream, spill, data, value_size);
     }
     else { // (2) Piggyback-based transfer
-	// * We assume there's no value bigger than 16KB (for simple PoC)
-        if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw4_5, data, value_size, 8) }
-        if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw6_7, data, value_size, 8) }
-        if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw8, data, value_size, 4) }
-        if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw9, data, value_size, 4) }
-        if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw11, data, value_size, 4) }
-        if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw12, data, value_size, 4) }
-        if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw13, data, value_size, 4) }
-        
+	// * transfer_path() sends values past MAX_PIGGYBACK by PRP
+        // The whole command at once: the first WRITE_PAYLOAD bytes go to the
+        // payload dwords of the shared layout
+        uint32_t dw[16] = {0};
+        dw[2] = cdw2; dw[3] = cdw3; dw[10] = cdw10;
+        dw[13] = cdw13; dw[14] = cdw14; dw[15] = cdw15;
+        uint32_t piggyback = value_size < WRITE_PAYLOAD ? value_size : WRITE_PAYLOAD;
+        kv_payload_pack(dw, kv_write_dwords, KV_WRITE_SLOTS, data, piggyback);
+
         // BandSlim Write Command
-        err = nvme_passthru_bandslim(NVME_CMD_KV_BANDSLIM_WRITE, 0, 0, NSID, 
-            cdw2, cdw3, cdw4_5, cdw6_7, cdw8, cdw9, cdw10, 
-            cdw11, cdw12, cdw13, cdw14, cdw15, result);
-
-        cdw2 = cdw3 = cdw8 = cdw9 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0; cdw4_5 = cdw6_7 = 0;
-	
-        // * Key (CDW2 CDW3 CDW14 CDW15) and Value Size (CDW10) are also used here
-        // * Known Limitation: synchronous NVMe command submission is forced...
-        while (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw2, data, value_size, 4) 
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw3, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw4_5, data, value_size, 8) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw6_7, data, value_size, 8) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw8, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw9, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw10, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw11, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw12, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw13, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw14, data, value_size, 4) }
-            if (IS_LEFT(value_size)) { PIGGYBACK_VALUE(cdw15, data, value_size, 4) }
-
-            // BandSlim Transfer Command
-            err = nvme_passthru_bandslim(NVME_CMD_KV_BANDSLIM_TRANSFER, 0, 0, NSID, 
-                cdw2, cdw3, cdw4_5, cdw6_7, cdw8, cdw9, cdw10, 
-                cdw11, cdw12, cdw13, cdw14, cdw15, result);
-            
-            cdw2 = cdw3 = cdw8 = cdw9 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0; cdw4_5 = cdw6_7 = 0;
-	}
-    }
-    //free(data_start);
-    
-    if (err < 0 || result != 0)
+        err = nvme_passthru_bandslim(NVME_CMD_KV_BANDSLIM_WRITE, dw, result);
+
+        // The rest of the value (after the rest of a long key) follows by Transfer commands
+        data = (const char*)data + piggyback;
+        value_size -= piggyback;
+        if (err == 0)
+            err = piggyback_transfer(stream, spill, data, value_size);
+    }
+    if (stream)
+        close_stream(stream);
+
+    // PUT/WRITE complete with the value length in DW0, so judge by status
+    if (err != 0)
+        return -1;
+    return 0;
+}
+
+// DELETE without a data pointer: the key as in a put (CDW13 opens the stream
+// of the rest of a long key), and for a range the end key after it
+int iLSM::DB::_Delete(const std::string &key, const std::string *end)
+{
+    int err;
+    uint32_t result;
+    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
+
+    int key_size = encode_key(key, cdw2, cdw3, cdw14, cdw15);
+    if (key_size < 0)
+        return key_size;
+    cdw10 = key_size << KEY_SIZE_SHIFT;
+    std::string tail;
+    if (end) {
+        if (end->empty() || end->size() > MAX_KEY_LEN || *end < key)
+            return -EINVAL;
+        if (*end == key)
+            return 0;   // Empty range
+        cdw10 |= end->size() << END_KEY_SHIFT;
+        cdw11 = KV_DELETE_RANGE;
+        tail = *end;
+        tail.resize((tail.size() + 3) / 4 * 4, 0);
+    }
+    std::string spill = key_spill(key);
+    uint16_t stream = spill.empty() && tail.empty() ? 0 : open_stream();
+    cdw13 = stream | context()->batch_tag;
+
+    err = nvme_passthru(NVME_CMD_KV_DELETE, 0, 0, NSID, cdw2, cdw3,
+            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
+            0, NULL, result);
+    if (err < 0) {
+        // ioctl fail
+#ifdef DEBUG_iLSM
+        perror("ilsm delete");
+#endif
+        if (stream)
+            close_stream(stream);
+        return -1;
+    }
+    if (err == 0)
+        err = piggyback_transfer(stream, spill, tail.data(), tail.size());
+    if (stream)
+        close_stream(stream);
+    if (err)
+        return -1;
+    return 0;
+}
+
+// Median latency (ns) of putting a len-byte value over the given path, 0 on error
+uint64_t iLSM::DB::probe_put(uint32_t len, bool prp, bool combi)
+{
+    std::string key((const char*)&CALIBRATION_KEY, sizeof(CALIBRATION_KEY));
+    std::string value(len, 'c');
+    std::vector<uint64_t> lat;
+    if (filter_)
+        filter_->Add(key);
+    unsigned int rounds = options_.calibration_rounds ? options_.calibration_rounds : 1;
+
+    for (unsigned int i = 0; i < rounds; i++) {
+        auto st = chrono::high_resolution_clock::now();
+        int err = put_value(key, value, prp, combi);
+        auto ed = chrono::high_resolution_clock::now();
+        if (err != 0)
+            return 0;
+        lat.push_back(chrono::duration_cast<chrono::nanoseconds>(ed - st).count());
+    }
+    std::nth_element(lat.begin(), lat.begin() + lat.size() / 2, lat.end());
+    return lat[lat.size() / 2];
+}
+
+int iLSM::DB::Calibrate()
+{
+    Context *ctx = context();
+    // Probes are not workload: keep them out of the passthru histograms
+    struct ProbeScope {
+        bool &probing;
+        explicit ProbeScope(bool &p) : probing(p) { probing = true; }
+        ~ProbeScope() { probing = false; }
+    } scope(ctx->probing);
+
+    // (1) threshold1 x alpha: WRITE + n TRANSFERs vs. one PRP page, probed at
+    //     each size where piggybacking needs one more command
+    uint64_t prp_ns = probe_put(PAGE_SIZE, true, false);
+    if (!prp_ns)
+        return -1;
+    uint32_t piggyback_threshold = 0;
+    for (uint32_t len = WRITE_PAYLOAD; len <= PAGE_SIZE; len += TRANSFER_PAYLOAD) {
+        uint64_t ns = probe_put(len, false, false);
+        if (!ns)
+            return -1;
+        if (ns > prp_ns)
+            break;
+        piggyback_threshold = len;
+    }
+
+    // (2) threshold2 x beta: n pages + piggybacked tail vs. n+1 pages by PRP
+    uint64_t full_ns = probe_put(2 * PAGE_SIZE, true, false);
+    if (!full_ns)
         return -1;
+    uint32_t combi_threshold = 0;
+    for (uint32_t tail = TRANSFER_PAYLOAD; tail < PAGE_SIZE; tail += TRANSFER_PAYLOAD) {
+        uint64_t ns = probe_put(PAGE_SIZE + tail, true, true);
+        if (!ns)
+            return -1;
+        if (ns > full_ns)
+            break;
+        combi_threshold = tail;
+    }
+
+    options_.piggyback_threshold = piggyback_threshold;
+    options_.combi_threshold = combi_threshold;
+#ifdef DEBUG_iLSM
+    fprintf(stderr, "[iLSM] calibrated: PRP page %" PRIu64 " ns, piggyback <= %u B, combi tail <= %u B\n",
+            prp_ns, piggyback_threshold, combi_threshold);
+#endif
     return 0;
 }
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -200,7 +1291,9 @@ int iLSM::DB::_Put(const std::string &key, const std::string &value)
 int iLSM::DB::Seek(const unsigned int iter_id, const std::string &key, std::string &value)
 {
     auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
     int ret = _Seek(iter_id, key, value);
+    context()->qos = QosClass::READ;
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
     // s[cnt++] = d;
@@ -212,12 +1305,14 @@ int iLSM::DB::Seek(const unsigned int iter_id, const std::string &key, std::stri
 int iLSM::DB::Seek(const unsigned int iter_id, const std::string &key, std::string &value)
 {
     auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
     int ret;
+    // Get probing walks the 4-byte key space only
     memcpy((void*) &iter[iter_id].key, (void*) key.c_str(), 4); 
     unsigned int i = iter[iter_id].key;
     while (1) {
         std::string k((char *)&i, 4); 
-        numGetofSeek++;
+        context()->numGetofSeek++;
         ret = _Get(k, value);
         if (ret != -2) // No Such Key
             break;
@@ -227,6 +1322,7 @@ int iLSM::DB::Seek(const unsigned int iter_id, const std::string &key, std::stri
 
     iter[iter_id].key = i;
 
+    context()->qos = QosClass::READ;
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
     finishOp(iLSMOp::Seek, d);
@@ -235,196 +1331,814 @@ int iLSM::DB::Seek(const unsigned int iter_id, const std::string &key, std::stri
 
 #endif
 
+#ifndef GET_FOR_SEEK_AND_NEXT_ILSM
 int iLSM::DB::_Seek(const unsigned int iter_id, const std::string &key, std::string &value)
 {
-    void *data = NULL;
-    unsigned int data_len = MAX_BUFLEN;
-    unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
+    if (iter_id >= MAX_ITER_NUM)
+        return -1;
+    int err = iter_fill(iter_id, &key);
+    if (err < 0)
+        return err;
+    return iter_read(iter_id, value);
+}
+#endif
+
+#ifndef GET_FOR_SEEK_AND_NEXT_ILSM
+int iLSM::DB::Next(const unsigned int iter_id, std::string &value)
+{
+    auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
+    int ret = _Next(iter_id, value);
+    context()->qos = QosClass::READ;
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = ed-st;
+    finishOp(iLSMOp::Next, d);
+    return ret;
+}
+#else
+int iLSM::DB::Next(const unsigned int iter_id, std::string &value)
+{
+    auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
+    int ret;
+    unsigned int i = iter[iter_id].key;
+    i++;
+    while (1) {
+        std::string k((char *)&i, 4); 
+        context()->numGetofNext++;
+        ret = _Get(k, value);
+        if (ret != -2) // No Such Key
+            break;
+        else
+            i++;
+    }
+    iter[iter_id].key = i;
+
+    context()->qos = QosClass::READ;
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = ed-st;
+    finishOp(iLSMOp::Next, d);
+    return ret;
+}
+#endif
+
+#ifndef GET_FOR_SEEK_AND_NEXT_ILSM
+int iLSM::DB::_Next(const unsigned int iter_id, std::string &value)
+{
+    if (iter_id >= MAX_ITER_NUM)
+        return -1;
+    if (!iter[iter_id].left) {
+        int err = iter_fill(iter_id, nullptr);
+        if (err < 0)
+            return err;
+    }
+    return iter_read(iter_id, value);
+}
+
+// Issues ITER_SEEK (key given) or ITER_NEXT and keeps the page of records
+// it returns; grows the page if the next record alone does not fit
+int iLSM::DB::iter_fill(const unsigned int iter_id, const std::string *key)
+{
+    struct _iterator &it = iter[iter_id];
+    unsigned int want = it.page_len;
+    if (!want) {
+        want = options_.iter_page_size < MAX_BUFLEN ? options_.iter_page_size : MAX_BUFLEN;
+        want = want ? (want - 1) / PAGE_SIZE * PAGE_SIZE + PAGE_SIZE : PAGE_SIZE;
+    }
+    it.left = 0;
+
+    while (1) {
+        if (it.page_len < want) {
+            void *page = NULL;
+            if (posix_memalign(&page, PAGE_SIZE, want))
+                return -ENOMEM;
+            free(it.page);
+            it.page = (char*)page;
+            it.page_len = want;
+        }
+
+        int err;
+        uint32_t result;
+        uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+        cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
+        if (key) {
+            // Key as in Get
+            int key_size = encode_key(*key, cdw2, cdw3, cdw14, cdw15);
+            if (key_size < 0)
+                return key_size;
+            cdw10 = key_size << KEY_SIZE_SHIFT;
+            if (key->size() > KEY_INLINE) {
+                std::string spill = key_spill(*key);
+                memcpy(it.page, spill.data(), spill.size());
+            }
+        }
+        cdw12 = 0 | (0xFFFF & ((it.page_len - 1) / PAGE_SIZE));
+        cdw13 = iter_id;
+        err = nvme_passthru(key ? NVME_CMD_KV_ITER_SEEK : NVME_CMD_KV_ITER_NEXT, 0, 0, NSID, cdw2, cdw3,
+                cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
+                it.page_len, it.page, result);
+
+        if (err < 0) {
+            // ioctl fail
+#ifdef DEBUG_iLSM
+            perror(key ? "ilsm seek" : "ilsm next");
+#endif
+            return -1;
+        }
+
+        if (err == 0x7C1) {
+            // no more keys
+            return -2;
+        }
+        if (err)
+            return -1;
+
+        if (result == 0) {
+            // The device did not move; retry with room for the record
+            const IterRecord *rec = (const IterRecord*)it.page;
+            want = IterRecord::Size(rec->key_size, rec->value_size);
+            want = (want - 1) / PAGE_SIZE * PAGE_SIZE + PAGE_SIZE;
+            if (want <= it.page_len || want > MAX_BUFLEN)
+                return -1;
+            continue;
+        }
+
+        it.pos = 0;
+        it.left = result;
+        context()->iter_pages++;
+        return 0;
+    }
+}
+
+// Serves the next record of the buffered page
+int iLSM::DB::iter_read(const unsigned int iter_id, std::string &value)
+{
+    struct _iterator &it = iter[iter_id];
+    if (!it.left || it.pos + sizeof(IterRecord) > it.page_len)
+        return -1;
+    const IterRecord *rec = (const IterRecord*)(it.page + it.pos);
+    uint32_t size = IterRecord::Size(rec->key_size, rec->value_size);
+    if (it.pos + size > it.page_len)
+        return -1;
+
+    const char *p = (const char*)(rec + 1);
+    uint32_t len = rec->value_size & ~VALUE_COMPRESSED;
+    it.key.assign(p, rec->key_size);
+    it.pos += size;
+    it.left--;
+    if (rec->value_size & VALUE_COMPRESSED) {
+        if (unzip(Slice(p + rec->key_size, len), value) < 0)
+            return -1;
+    } else {
+        value.assign(p + rec->key_size, len);
+    }
+    Context *ctx = context();
+    ctx->iter_records++;
+    ctx->traffic[static_cast<int>(TrafficPath::READ)].payload_bytes += rec->key_size + value.size();
+    return value.size();
+}
+
+int iLSM::DB::IterKey(const unsigned int iter_id, std::string &key)
+{
+    if (iter_id >= MAX_ITER_NUM)
+        return -1;
+    key = iter[iter_id].key;
+    return key.size();
+}
+#else
+int iLSM::DB::IterKey(const unsigned int iter_id, std::string &key)
+{
+    if (iter_id >= MAX_ITER_NUM)
+        return -1;
+    key.assign((const char*)&iter[iter_id].key, sizeof(iter[iter_id].key));
+    return key.size();
+}
+#endif
+
+int iLSM::DB::Get(const std::string &key, std::string &value)
+{
+    auto st = chrono::high_resolution_clock::now();
+    int ret = _Get(key, value);
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = ed-st;
+    finishOp(iLSMOp::Get, d);
+    return ret;
+}
+
+int iLSM::DB::Get(const std::string &key, void *buf, uint32_t buf_len)
+{
+    auto st = chrono::high_resolution_clock::now();
+    int ret;
+    if (!buf || !buf_len || buf_len % PAGE_SIZE || buf_len > MAX_BUFLEN ||
+            (uintptr_t)buf % PAGE_SIZE) {
+        ret = -EINVAL;
+    } else {
+        uint32_t result;
+        uint64_t epoch = 0;
+        if (filtered(key)) {
+            ret = -2;
+        } else if (cache_get(key, buf, buf_len, result)) {
+            ret = 0;
+        } else {
+            epoch = cache_epoch(key);
+            ret = get_into(key, buf, buf_len, result);
+            if (ret == 0 && (result & VALUE_COMPRESSED)) {
+                // Stored compressed: buf gets the value as it was put
+                std::string value;
+                int len;
+                result &= ~VALUE_COMPRESSED;
+                if (result <= buf_len)
+                    len = unzip(Slice((const char*)buf, result), value) < 0 ? -1 : (int)value.size();
+                else
+                    len = get_value(key, value);
+                if (len < 0) {
+                    ret = len;
+                } else {
+                    memcpy(buf, value.data(), value.size() < buf_len ? value.size() : buf_len);
+                    result = len;
+                }
+            }
+            if (ret == 0 && result <= buf_len)
+                cache_fill(key, Slice((const char*)buf, result), epoch);
+        }
+        if (ret == 0) {
+            ret = result;
+            context()->traffic[static_cast<int>(TrafficPath::READ)].payload_bytes +=
+                key.size() + (result < buf_len ? result : buf_len);
+        }
     }
-    memset(data, 0, data_len);
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = ed-st;
+    finishOp(iLSMOp::Get, d);
+    return ret;
+}
+
+// One GET, value DMAed straight into data; result is the full value length as
+// stored, with VALUE_COMPRESSED if it is compressed
+int iLSM::DB::get_into(const std::string &key, void *data, uint32_t data_len, uint32_t &result)
+{
     int err;
-    uint32_t result;
     uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+    unsigned int nlb = (data_len-1) / PAGE_SIZE;
+
     cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    memcpy(&cdw10, key.c_str(), 4);
+    // CDW2 CDW3 CDW14 CDW15 -> Key, CDW10 -> Key Size (31:24); the rest
+    // of a long key is read by the device from the head of the buffer.
+    // CDW11 -> Value offset the buffer starts at (0; see get_chunks())
+    int key_size = encode_key(key, cdw2, cdw3, cdw14, cdw15);
+    if (key_size < 0)
+        return key_size;
+    cdw10 = key_size << KEY_SIZE_SHIFT;
+    if (key.size() > KEY_INLINE) {
+        std::string spill = key_spill(key);
+        memcpy(data, spill.data(), spill.size());
+    }
+
     cdw12 = 0 | (0xFFFF & nlb);
-    cdw13 = iter_id;
-    err = nvme_passthru(NVME_CMD_KV_ITER_SEEK, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
+    err = nvme_passthru(NVME_CMD_KV_GET, 0, 0, NSID, cdw2, cdw3,
+            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
             data_len, data, result);
 
     if (err < 0) {
         // ioctl fail
-#ifdef DEBUG_iLSM
-        perror("ilsm seek");
+#ifdef DEBUG
+        perror("ilsm get");
 #endif
-        free(data);
         return -1;
     }
 
     if (err == 0x7C1) {
         // no such key
-        free(data);
         return -2;
     }
+    if (err)
+        return -1;
+    return 0;
+}
+
+int iLSM::DB::_Get(const std::string &key, std::string &value)
+{
+    Context *ctx = context();
+    if (filtered(key))
+        return -2;
+    if (cache_get(key, value)) {
+        ctx->traffic[static_cast<int>(TrafficPath::READ)].payload_bytes += key.size() + value.size();
+        return value.size();
+    }
+    uint64_t epoch = cache_epoch(key);
+    int ret = get_value(key, value);
+    if (ret < 0)
+        return ret;
+    ctx->traffic[static_cast<int>(TrafficPath::READ)].payload_bytes += key.size() + value.size();
+    if ((uint32_t)ret == value.size())
+        cache_fill(key, value, epoch);
+    return ret;
+}
+
+// Value of key from the device (decompressed if it was stored so); returns
+// its length. A value past one GET buffer is read in chunks, see get_chunks()
+int iLSM::DB::get_value(const std::string &key, std::string &value)
+{
+    // Map only the pages the value is expected to need; the device reports
+    // the real value length, so retry once with a big enough buffer
+    Context *ctx = context();
+    unsigned int data_len = ctx->expected_value;
+    uint32_t result;
+
+    while (1) {
+        DmaBuffer buf(ctx->pool, data_len);
+        void *data = buf.data();
+        if (!data) {
+            return -ENOMEM;
+        }
+
+        int err = get_into(key, data, data_len, result);
+        if (err < 0)
+            return err;
+        bool compressed = (result & VALUE_COMPRESSED) != 0;
+        uint32_t len = result & ~VALUE_COMPRESSED;
+
+        if (len > data_len && data_len < MAX_BUFLEN) {
+            data_len = ((len - 1) / PAGE_SIZE + 1) * PAGE_SIZE;
+            if (data_len > MAX_BUFLEN)
+                data_len = MAX_BUFLEN;
+            ctx->expected_value = data_len;
+            continue;
+        }
+        std::string whole;
+        const char *stored = (const char*)data;
+        if (len > data_len) {
+            // Past MDTS: the rest by chunked GETs
+            whole.assign(stored, data_len);
+            err = get_chunks(key, data_len, result, whole);
+            if (err == -EAGAIN)
+                continue;   // Overwritten meanwhile: read it again
+            if (err < 0)
+                return err;
+            stored = whole.data();
+        }
+        if (!compressed) {
+            if (whole.empty())
+                value.assign(stored, len);
+            else
+                value.swap(whole);
+            return len;
+        }
+        if (unzip(Slice(stored, len), value) < 0)
+            return -1;
+        return value.size();
+    }
+}
+
+// Rest of a value from value offset ofs on (CDW11 of GET), appended to value:
+// GETs of up to MAX_BUFLEN each, queued back to back into one buffer. Every
+// chunk has to report the value the first GET did (stored, as in get_into()),
+// else it was overwritten meanwhile and -EAGAIN is returned
+int iLSM::DB::get_chunks(const std::string &key, uint32_t ofs, uint32_t stored, std::string &value)
+{
+    uint32_t cdw2, cdw3, cdw14, cdw15;
+    int key_size = encode_key(key, cdw2, cdw3, cdw14, cdw15);
+    if (key_size < 0)
+        return key_size;
+    std::string spill = key_spill(key);
+    uint32_t rest = (stored & ~VALUE_COMPRESSED) - ofs;
+    uint32_t buf_len = ((rest - 1) / PAGE_SIZE + 1) * PAGE_SIZE;
+    DmaBuffer buf(context()->pool, buf_len);
+    char *data = (char*)buf.data();
+    if (!data)
+        return -ENOMEM;
 
-    if (result > 0) { // value length
-        value = std::string(static_cast<const char*>(data), (int)4);
-    }  else {
-        value = std::string();
+    std::vector<struct nvme_passthru_cmd> cmds;
+    cmds.reserve((buf_len - 1) / MAX_BUFLEN + 1);
+    for (uint32_t pos = 0; pos < buf_len; pos += MAX_BUFLEN) {
+        uint32_t len = buf_len - pos < MAX_BUFLEN ? buf_len - pos : MAX_BUFLEN;
+        // The rest of a long key heads every chunk, as in get_into()
+        memcpy(data + pos, spill.data(), spill.size());
+        struct nvme_passthru_cmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_KV_GET;
+        cmd.nsid = NSID;
+        cmd.cdw2 = cdw2;
+        cmd.cdw3 = cdw3;
+        cmd.addr = (uint64_t)(uintptr_t)(data + pos);
+        cmd.data_len = len;
+        cmd.cdw10 = key_size << KEY_SIZE_SHIFT;
+        cmd.cdw11 = ofs + pos;
+        cmd.cdw12 = 0xFFFF & (len / PAGE_SIZE - 1);
+        cmd.cdw14 = cdw14;
+        cmd.cdw15 = cdw15;
+        cmds.push_back(cmd);
     }
-    free(data);
-    return result;
+    int err = submit_batch(NVME_CMD_KV_GET, cmds);
+    if (err == 0x7C1)
+        return -EAGAIN;     // Deleted meanwhile
+    if (err)
+        return -1;
+    for (const struct nvme_passthru_cmd &cmd : cmds) {
+        if (cmd.result != stored)
+            return -EAGAIN;
+    }
+    value.append(data, rest);
+    return 0;
 }
 
-#ifndef GET_FOR_SEEK_AND_NEXT_ILSM
-int iLSM::DB::Next(const unsigned int iter_id, std::string &value)
+int iLSM::DB::MultiGet(const std::vector<Slice> &keys, std::vector<std::string> *values,
+        std::vector<int> *statuses)
 {
     auto st = chrono::high_resolution_clock::now();
-    int ret = _Next(iter_id, value);
+    values->assign(keys.size(), std::string());
+    statuses->assign(keys.size(), -1);
+    size_t batch = options_.multiget_batch ? options_.multiget_batch : 1;
+    int ret = 0;
+    if (!cache_ && !filter_) {
+        for (size_t i = 0; i < keys.size(); i += batch) {
+            size_t n = keys.size() - i < batch ? keys.size() - i : batch;
+            if (_MultiGet(keys, i, n, values, statuses) < 0)
+                ret = -1;
+        }
+    } else {
+        // Only the keys the filter and the cache miss go to the device
+        Context *ctx = context();
+        std::vector<Slice> miss;
+        std::vector<size_t> idx;
+        std::vector<uint64_t> epochs;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (filtered(keys[i])) {
+                (*statuses)[i] = -2;
+                continue;
+            }
+            if (cache_get(keys[i], (*values)[i])) {
+                (*statuses)[i] = 0;
+                ctx->traffic[static_cast<int>(TrafficPath::READ)].payload_bytes +=
+                    keys[i].size() + (*values)[i].size();
+                continue;
+            }
+            miss.push_back(keys[i]);
+            idx.push_back(i);
+            epochs.push_back(cache_epoch(keys[i]));
+        }
+        std::vector<std::string> miss_values(miss.size());
+        std::vector<int> miss_statuses(miss.size(), -1);
+        for (size_t i = 0; i < miss.size(); i += batch) {
+            size_t n = miss.size() - i < batch ? miss.size() - i : batch;
+            if (_MultiGet(miss, i, n, &miss_values, &miss_statuses) < 0)
+                ret = -1;
+        }
+        for (size_t j = 0; j < miss.size(); j++) {
+            if (miss_statuses[j] == 0)
+                cache_fill(miss[j], miss_values[j], epochs[j]);
+            (*values)[idx[j]].swap(miss_values[j]);
+            (*statuses)[idx[j]] = miss_statuses[j];
+        }
+    }
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
-    finishOp(iLSMOp::Next, d);
+    finishOp(iLSMOp::MultiGet, d);
     return ret;
 }
-#else
-int iLSM::DB::Next(const unsigned int iter_id, std::string &value)
+
+// One MULTI_GET for keys[first, first + n)
+int iLSM::DB::_MultiGet(const std::vector<Slice> &keys, size_t first, size_t n,
+        std::vector<std::string> *values, std::vector<int> *statuses)
+{
+    // Keys the device can address; the rest fail without a command
+    std::vector<size_t> idx;
+    uint32_t req_len = 0;
+    for (size_t i = first; i < first + n; i++) {
+        if (keys[i].size() == 0 || keys[i].size() > MAX_KEY_LEN) {
+            (*statuses)[i] = -EINVAL;
+            continue;
+        }
+        idx.push_back(i);
+        req_len += (sizeof(uint16_t) + keys[i].size() + 3) / 4 * 4;
+    }
+    if (idx.empty())
+        return 0;
+
+    Context *ctx = context();
+    unsigned int data_len = req_len > ctx->expected_multiget ? req_len : ctx->expected_multiget;
+    data_len = ((data_len - 1) / PAGE_SIZE + 1) * PAGE_SIZE;
+    while (1) {
+        DmaBuffer buf(ctx->pool, data_len);
+        char *data = (char*)buf.data();
+        if (!data)
+            return -ENOMEM;
+
+        // Request: u16 key size + key, dword-padded, per key
+        char *p = data;
+        for (size_t i : idx) {
+            uint16_t key_size = keys[i].size();
+            memcpy(p, &key_size, sizeof(key_size));
+            memcpy(p + sizeof(key_size), keys[i].data(), key_size);
+            uint32_t len = (sizeof(key_size) + key_size + 3) / 4 * 4;
+            memset(p + sizeof(key_size) + key_size, 0, len - sizeof(key_size) - key_size);
+            p += len;
+        }
+
+        int err;
+        uint32_t result;
+        uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+        cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
+        cdw10 = idx.size();     // # of keys
+        cdw11 = req_len;        // Request bytes
+        cdw12 = 0 | (0xFFFF & ((data_len - 1) / PAGE_SIZE));
+        err = nvme_passthru(NVME_CMD_KV_MULTI_GET, 0, 0, NSID, cdw2, cdw3,
+                cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
+                data_len, data, result);
+        if (err < 0) {
+            // ioctl fail
+#ifdef DEBUG_iLSM
+            perror("ilsm multiget");
+#endif
+            return -1;
+        }
+        if (err)
+            return -1;
+
+        if (result > data_len) {
+            if (result > MAX_BUFLEN) {
+                // Values too big for one buffer: split the batch, down to
+                // a chunked Get of a value past MDTS
+                if (n == 1) {
+                    std::string key(keys[first].data(), keys[first].size());
+                    int len = get_value(key, (*values)[first]);
+                    (*statuses)[first] = len < 0 ? len : 0;
+                    if (len < 0)
+                        return len == -2 ? 0 : -1;
+                    ctx->traffic[static_cast<int>(TrafficPath::READ)].payload_bytes +=
+                        key.size() + (*values)[first].size();
+                    return 0;
+                }
+                int ret1 = _MultiGet(keys, first, n / 2, values, statuses);
+                int ret2 = _MultiGet(keys, first + n / 2, n - n / 2, values, statuses);
+                return ret1 < 0 || ret2 < 0 ? -1 : 0;
+            }
+            data_len = ((result - 1) / PAGE_SIZE + 1) * PAGE_SIZE;
+            ctx->expected_multiget = data_len;
+            continue;
+        }
+
+        // Response: offset table, then the values
+        const MultiGetEntry *table = (const MultiGetEntry*)data;
+        if (idx.size() * sizeof(MultiGetEntry) > result)
+            return -1;
+        for (size_t j = 0; j < idx.size(); j++) {
+            size_t i = idx[j];
+            uint32_t size = table[j].value_size & ~VALUE_COMPRESSED;
+            if (table[j].offset == MULTIGET_MISSING) {
+                (*statuses)[i] = -2;
+            } else if (table[j].offset > result || size > result - table[j].offset) {
+                (*statuses)[i] = -1;
+            } else if ((table[j].value_size & VALUE_COMPRESSED) &&
+                    unzip(Slice(data + table[j].offset, size), (*values)[i]) < 0) {
+                (*statuses)[i] = -1;
+            } else {
+                if (!(table[j].value_size & VALUE_COMPRESSED))
+                    (*values)[i].assign(data + table[j].offset, size);
+                (*statuses)[i] = 0;
+                ctx->traffic[static_cast<int>(TrafficPath::READ)].payload_bytes +=
+                    keys[i].size() + (*values)[i].size();
+            }
+        }
+        return 0;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Read cache: values up to cache_max_value from Get/MultiGet, kept in a sharded
+// LRU cache keyed by the device key; writes update or drop the cached copy once
+// they reached the device
+struct CachedValue {
+    uint64_t gen;               // cache_gen_ at insertion
+    std::string value;
+};
+
+static void delete_cached_value(const ROCKSDB_NAMESPACE::Slice &, void *value)
 {
-    auto st = chrono::high_resolution_clock::now();
-    int ret;
-    unsigned int i = iter[iter_id].key;
-    i++;
-    while (1) {
-        std::string k((char *)&i, 4); 
-        numGetofNext++;
-        ret = _Get(k, value);
-        if (ret != -2) // No Such Key
-            break;
-        else
-            i++;
-    }
-    iter[iter_id].key = i;
+    delete static_cast<CachedValue*>(value);
+}
 
-    auto ed = chrono::high_resolution_clock::now();
-    chrono::nanoseconds d = ed-st;
-    finishOp(iLSMOp::Next, d);
-    return ret;
+iLSM::DB::CacheStripe &iLSM::DB::cache_stripe(const Slice &key)
+{
+    return cache_stripes_[ROCKSDB_NAMESPACE::GetSliceHash(key) % kCacheStripes];
 }
-#endif
 
-int iLSM::DB::_Next(const unsigned int iter_id, std::string &value)
+// Handle of a current entry (an entry older than a DeleteRange is dropped)
+ROCKSDB_NAMESPACE::Cache::Handle *iLSM::DB::cache_lookup(const Slice &key)
 {
-    void *data = NULL;
-    unsigned int data_len = MAX_BUFLEN;
-    unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    std::string key="1234";
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
+    Context *ctx = context();
+    ROCKSDB_NAMESPACE::Cache::Handle *h = cache_->Lookup(key);
+    if (h && static_cast<CachedValue*>(cache_->Value(h))->gen != cache_gen_.load(std::memory_order_acquire)) {
+        cache_->Release(h, true);
+        h = nullptr;
     }
-    memset(data, 0, data_len);
-    int err;
-    uint32_t result;
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    cdw10 = 0; // key
-    cdw12 = 0 | (0xFFFF & nlb);
-    cdw13 = iter_id;
-    err = nvme_passthru(NVME_CMD_KV_ITER_NEXT, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-            data_len, data, result);
+    if (h)
+        ctx->cache_hits++;
+    else
+        ctx->cache_misses++;
+    return h;
+}
 
-    if (err < 0) {
-        // ioctl fail
-#ifdef DEBUG_iLSM
-        perror("ilsm next");
-#endif
-        free(data);
-        return -1;
-    }
+bool iLSM::DB::cache_get(const Slice &key, std::string &value)
+{
+    if (!cache_)
+        return false;
+    ROCKSDB_NAMESPACE::Cache::Handle *h = cache_lookup(key);
+    if (!h)
+        return false;
+    value = static_cast<CachedValue*>(cache_->Value(h))->value;
+    cache_->Release(h);
+    return true;
+}
 
-    if (err == 0x7C1) {
-        // no such key
-        free(data);
-        return -2;
-    }
+// Copies at most buf_len bytes, len gets the full value length
+bool iLSM::DB::cache_get(const Slice &key, void *buf, uint32_t buf_len, uint32_t &len)
+{
+    if (!cache_)
+        return false;
+    ROCKSDB_NAMESPACE::Cache::Handle *h = cache_lookup(key);
+    if (!h)
+        return false;
+    const std::string &value = static_cast<CachedValue*>(cache_->Value(h))->value;
+    len = value.size();
+    memcpy(buf, value.data(), len < buf_len ? len : buf_len);
+    cache_->Release(h);
+    return true;
+}
 
-    if (result > 0) { // value length
-        value = std::string(static_cast<const char*>(data), (int)4);
-    }  else {
-        value = std::string();
-    }
+// Taken before a device read whose result may be cached
+uint64_t iLSM::DB::cache_epoch(const Slice &key)
+{
+    if (!cache_)
+        return 0;
+    CacheStripe &stripe = cache_stripe(key);
+    lock_guard<mutex> l(stripe.mtx);
+    return stripe.epoch;
+}
 
-    free(data);
-    return result;
+// Caches what the device returned, unless a write of the key got in between
+void iLSM::DB::cache_fill(const Slice &key, const Slice &value, uint64_t epoch)
+{
+    if (!cache_ || value.size() > options_.cache_max_value)
+        return;
+    CacheStripe &stripe = cache_stripe(key);
+    lock_guard<mutex> l(stripe.mtx);
+    if (stripe.epoch == epoch)
+        cache_insert(key, value);
 }
 
-int iLSM::DB::Get(const std::string &key, std::string &value)
+// (stripe of key locked)
+void iLSM::DB::cache_insert(const Slice &key, const Slice &value)
 {
-    auto st = chrono::high_resolution_clock::now();
-    int ret = _Get(key, value);
-    auto ed = chrono::high_resolution_clock::now();
-    chrono::nanoseconds d = ed-st;
-    finishOp(iLSMOp::Get, d);
-    return ret;
+    CachedValue *cv = new CachedValue{cache_gen_.load(std::memory_order_acquire), std::string(value.data(), value.size())};
+    cache_->Insert(key, cv, key.size() + value.size(), delete_cached_value);
 }
 
-int iLSM::DB::_Get(const std::string &key, std::string &value)
+// A write of key reached the device (value null for a delete or a failed
+// write): a cached copy takes the new value or goes
+void iLSM::DB::cache_update(const Slice &key, const Slice *value)
 {
-    void *data = NULL; // void *temp = NULL;
-    unsigned int data_len = MAX_BUFLEN; unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    // unsigned int lba, index, lba, tuple_offset, tuple_value_len, tuple_value_offset;
-    
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
+    if (!cache_)
+        return;
+    CacheStripe &stripe = cache_stripe(key);
+    lock_guard<mutex> l(stripe.mtx);
+    stripe.epoch++;
+    if (value && value->size() <= options_.cache_max_value) {
+        ROCKSDB_NAMESPACE::Cache::Handle *h = cache_->Lookup(key);
+        if (h) {
+            cache_->Release(h);
+            cache_insert(key, *value);
+            return;
+        }
     }
-    memset(data, 0, data_len);
-   
-    int err;
-    uint32_t result;  
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    memcpy(&cdw10, key.c_str(), 4);
+    cache_->Erase(key);
+}
 
-    cdw12 = 0 | (0xFFFF & nlb);
-    err = nvme_passthru(NVME_CMD_KV_GET, 0, 0, NSID, cdw2, cdw3,
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15,
-            data_len, data, result);
+// Drops every entry (a DeleteRange cannot be applied key by key)
+void iLSM::DB::cache_clear()
+{
+    if (!cache_)
+        return;
+    for (int i = 0; i < kCacheStripes; i++)
+        cache_stripes_[i].mtx.lock();
+    for (int i = 0; i < kCacheStripes; i++)
+        cache_stripes_[i].epoch++;
+    cache_gen_.fetch_add(1, std::memory_order_acq_rel);
+    cache_->EraseUnRefEntries();
+    for (int i = kCacheStripes - 1; i >= 0; i--)
+        cache_stripes_[i].mtx.unlock();
+}
+//////////////////////////////////////////////////////////////////////////////////////////
 
-    if (err < 0) {
-        // ioctl fail
-#ifdef DEBUG
-        perror("ilsm get");
-#endif
-        free(data);
-        return -1;
+//////////////////////////////////////////////////////////////////////////////////////////
+// Existence filter: every key put through the DB is added before its write is
+// issued, so a key the filter rules out is not on the device (a false positive
+// only costs the usual command)
+void iLSM::DB::open_filter()
+{
+    filter_source_.clear();
+    if (!options_.filter_keys)
+        return;
+    filter_.reset(new ExistenceFilter(options_.filter_keys, options_.filter_bits_per_key));
+    if (!options_.filter_path.empty() && filter_->Load(options_.filter_path) == 0) {
+        // Saved again by Close(); after a crash the next Open() rebuilds
+        remove(options_.filter_path.c_str());
+        filter_source_ = "loaded";
+        return;
     }
+    int keys = rebuild_filter();
+    if (keys < 0) {
+        fprintf(stderr, "[iLSM] cannot list the device keys, existence filter off\n");
+        filter_.reset();
+        return;
+    }
+    filter_source_ = "rebuilt from " + to_string(keys) + " keys";
+}
 
-    if (err == 0x7C1) {
-        // no such key
-        free(data);
-        return -2;
+// Adds every key on the device, walking them with one iterator; returns the
+// # of keys or <0 on failure
+int iLSM::DB::rebuild_filter()
+{
+#ifdef GET_FOR_SEEK_AND_NEXT_ILSM
+    return -1;  // No device iterator to list the keys
+#else
+    Context *ctx = context();
+    uint64_t iter_pages = ctx->iter_pages;
+    ctx->probing = true;        // Not workload: keep it out of the stats
+    unsigned int iter_id;
+    int err = _CreateIter(iter_id);
+    if (err == 0 && iter_id >= MAX_ITER_NUM) {
+        _DestroyIter(iter_id);
+        err = -1;
     }
-    else {
-        value = std::string();
+    int keys = 0;
+    if (err == 0) {
+        struct _iterator &it = iter[iter_id];
+        std::string first(1, '\0');    // Smallest key
+        err = iter_fill(iter_id, &first);
+        while (err == 0) {
+            for (; it.left; it.left--) {
+                if (it.pos + sizeof(IterRecord) > it.page_len) {
+                    err = -1;
+                    break;
+                }
+                const IterRecord *rec = (const IterRecord*)(it.page + it.pos);
+                uint32_t size = IterRecord::Size(rec->key_size, rec->value_size);
+                if (it.pos + size > it.page_len) {
+                    err = -1;
+                    break;
+                }
+                filter_->Add(Slice((const char*)(rec + 1), rec->key_size));
+                keys++;
+                it.pos += size;
+            }
+            if (err == 0)
+                err = iter_fill(iter_id, nullptr);
+        }
+        it.left = 0;
+        it.key.clear();
+        _DestroyIter(iter_id);
     }
+    ctx->probing = false;
+    ctx->iter_pages = iter_pages;
+    return err == -2 ? keys : -1;   // -2: past the last key
+#endif
+}
 
-    free(data);
-    return result;
+void iLSM::DB::close_filter()
+{
+    if (filter_ && !options_.filter_path.empty() && filter_->Save(options_.filter_path) < 0)
+        fprintf(stderr, "[iLSM] cannot save the existence filter to %s\n", options_.filter_path.c_str());
+    filter_.reset();
+}
+
+// True if key is surely not on the device
+bool iLSM::DB::filtered(const Slice &key)
+{
+    if (!filter_ || filter_->MayContain(key))
+        return false;
+    context()->filter_negatives++;
+    return true;
 }
+//////////////////////////////////////////////////////////////////////////////////////////
 
 #ifndef GET_FOR_SEEK_AND_NEXT_ILSM
 int iLSM::DB::CreateIter(unsigned int &iter_id)
 {
     auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
     int ret = _CreateIter(iter_id);
+
+    if (ret >= 0 && iter_id >= MAX_ITER_NUM) {
+        _DestroyIter(iter_id);  // No host state slot for it
+        ret = -1;
+    }
+    else if (ret >= 0) {
+        iter[iter_id].left = 0;
+        iter[iter_id].key.clear();
+    }
+
+    context()->qos = QosClass::READ;
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
     finishOp(iLSMOp::CreateIter, d);
@@ -434,11 +2148,13 @@ int iLSM::DB::CreateIter(unsigned int &iter_id)
 int iLSM::DB::CreateIter(unsigned int &iter_id)
 {
     auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
     int ret = _CreateIter(iter_id);
 
     if (ret >= 0)
         iter[iter_id].key = 0;
     
+    context()->qos = QosClass::READ;
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
     finishOp(iLSMOp::CreateIter, d);
@@ -480,7 +2196,15 @@ int iLSM::DB::_CreateIter(unsigned int &iter_id)
 int iLSM::DB::DestroyIter(const unsigned int iter_id)
 {
     auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
     int ret = _DestroyIter(iter_id);
+
+    if (ret >= 0 && iter_id < MAX_ITER_NUM) {
+        iter[iter_id].left = 0;
+        iter[iter_id].key.clear();
+    }
+
+    context()->qos = QosClass::READ;
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
     finishOp(iLSMOp::DestroyIter, d);
@@ -490,11 +2214,13 @@ int iLSM::DB::DestroyIter(const unsigned int iter_id)
 int iLSM::DB::DestroyIter(const unsigned int iter_id)
 {
     auto st = chrono::high_resolution_clock::now();
+    context()->qos = QosClass::SCAN;
     int ret = _DestroyIter(iter_id);
 
     if (ret >= 0)
        iter[iter_id].key = 0; 
 
+    context()->qos = QosClass::READ;
     auto ed = chrono::high_resolution_clock::now();
     chrono::nanoseconds d = ed-st;
     finishOp(iLSMOp::DestroyIter, d);
@@ -532,6 +2258,19 @@ int iLSM::DB::_DestroyIter(const unsigned int iter_id)
     return result;
 }
 
+// Hand a command to the device through the calling thread's own transport,
+// once the QoS scheduler (if any) gives it a slot
+inline int iLSM::DB::submit(struct nvme_passthru_cmd &cmd, uint32_t dma_bytes)
+{
+    Context *ctx = context();
+    if (!qos_)
+        return ctx->transport->Passthru(cmd);
+    ctx->qos_wait[static_cast<int>(ctx->qos)].Add(qos_->Admit(ctx->qos, 1, SQE_BYTES + dma_bytes));
+    int err = ctx->transport->Passthru(cmd);
+    qos_->Release(1);
+    return err;
+}
+
 int iLSM::DB::nvme_passthru(uint8_t opcode,
         uint8_t flags, uint16_t rsvd,
         uint32_t nsid, uint32_t cdw2, uint32_t cdw3, uint32_t cdw10, uint32_t cdw11,
@@ -560,6 +2299,7 @@ int iLSM::DB::nvme_passthru(uint8_t opcode,
         .result		= 0,
     };
     int err;
+    uint32_t dma_bytes = 0;
 #ifdef DEBUG_iLSM
     {/*
         fprintf(stderr, "-- iLSM::DB::nvme_passthru --\n");
@@ -582,14 +2322,19 @@ int iLSM::DB::nvme_passthru(uint8_t opcode,
         fprintf(stderr, "timeout_ms   : %08x\n", cmd.timeout_ms); */
     }
 #endif
-    {
-#ifdef THREAD_SAFE_ILSM
-        lock_guard<mutex> l(ioctl_mtx);
-#endif
-        err = ioctl(fd_, NVME_IOCTL_IO_CMD, &cmd);
+    if (opcode != NVME_CMD_KV_LAST) {
+        // A combination PUT maps the tail page but the device pulls the
+        // whole pages before it only; MULTI_GET moves its keys both ways
+        dma_bytes = data_len;
+        if (opcode == NVME_CMD_KV_PUT && (cdw11 & KV_PUT_COMBI))
+            dma_bytes -= PAGE_SIZE;
+        else if (opcode == NVME_CMD_KV_MULTI_GET)
+            dma_bytes += (cdw11 + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+        account(dma_bytes);
     }
+    err = submit(cmd, dma_bytes);
 
-    if ((!err && opcode < NVME_CMD_KV_LAST) || (opcode == NVME_CMD_KV_GET)) {
+    if ((!err && opcode != NVME_CMD_KV_LAST) || (opcode == NVME_CMD_KV_GET)) {
         result = cmd.result; 
         auto ed = chrono::high_resolution_clock::now();
         chrono::nanoseconds d = ed-st;
@@ -604,43 +2349,13 @@ int iLSM::DB::nvme_passthru(uint8_t opcode,
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////// BandSlim ////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
-int iLSM::DB::nvme_passthru_bandslim(
-        uint8_t opcode, uint8_t flags, uint16_t rsvd, uint32_t nsid, 
-        uint32_t cdw2, uint32_t cdw3, uint64_t cdw4_5, uint64_t cdw6_7, 
-	uint32_t cdw8, uint32_t cdw9, uint32_t cdw10, uint32_t cdw11,
-        uint32_t cdw12, uint32_t cdw13, uint32_t cdw14, uint32_t cdw15,
-        uint32_t &result)
+int iLSM::DB::nvme_passthru_bandslim(uint8_t opcode, const uint32_t *dw, uint32_t &result)
 {
-    // Make a comment on the right below line if you've modified the NVMe driver 
-    cdw4_5 = cdw6_7 = 0;
     auto st = chrono::high_resolution_clock::now();
-    struct nvme_passthru_cmd cmd = {
-        .opcode		= opcode,
-        .flags		= flags,
-        .rsvd1		= rsvd,
-        .nsid		= nsid,
-        .cdw2		= cdw2,
-        .cdw3		= cdw3,
-        .metadata	= cdw4_5,
-        .addr		= cdw6_7,
-        .metadata_len	= cdw8,
-        .data_len	= cdw9,
-        .cdw10		= cdw10,
-        .cdw11		= cdw11,
-        .cdw12		= cdw12,
-        .cdw13		= cdw13,
-        .cdw14		= cdw14,
-        .cdw15		= cdw15,
-        .timeout_ms	= 0,
-        .result		= 0,
-    };
+    struct nvme_passthru_cmd cmd = bandslim_cmd(opcode, dw, context()->transport->RawDwords());
     int err;
-    {
-#ifdef THREAD_SAFE_ILSM
-        lock_guard<mutex> l(ioctl_mtx);
-#endif
-        err = ioctl(fd_, NVME_IOCTL_IO_CMD, &cmd);
-    }
+    account(0);     // Payload rides in the command itself
+    err = submit(cmd, 0);
     if ((!err && opcode < NVME_CMD_KV_LAST) || (opcode == NVME_CMD_KV_GET) ||
         (opcode == NVME_CMD_KV_BANDSLIM_WRITE) || (opcode == NVME_CMD_KV_BANDSLIM_TRANSFER)) {
         result = cmd.result; 
@@ -653,41 +2368,356 @@ int iLSM::DB::nvme_passthru_bandslim(
 
     return err;
 }
+
+// BandSlim command from its 16 dwords (DW0/DW1 are filled in here)
+struct nvme_passthru_cmd iLSM::DB::bandslim_cmd(uint8_t opcode, const uint32_t *dw, bool raw)
+{
+    struct nvme_passthru_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = opcode;
+    cmd.nsid = NSID;
+    cmd.cdw2 = dw[2];
+    cmd.cdw3 = dw[3];
+    if (raw) {  // The stock driver reads CDW4-CDW7 as pointers, see Transport::RawDwords()
+        cmd.metadata = dw[4] | ((uint64_t)dw[5] << 32);
+        cmd.addr = dw[6] | ((uint64_t)dw[7] << 32);
+    }
+    cmd.metadata_len = dw[8];
+    cmd.data_len = dw[9];
+    cmd.cdw10 = dw[10];
+    cmd.cdw11 = dw[11];
+    cmd.cdw12 = dw[12];
+    cmd.cdw13 = dw[13];
+    cmd.cdw14 = dw[14];
+    cmd.cdw15 = dw[15];
+    return cmd;
+}
+
+// Submits cmds back to back (up to transfer_queue_depth in flight); each is
+// recorded with an even share of the batch latency. PUT/GET segments move
+// the pages they map, BandSlim commands their own payload only
+int iLSM::DB::submit_batch(uint8_t opcode, std::vector<struct nvme_passthru_cmd> &cmds)
+{
+    if (cmds.empty())
+        return 0;
+    Context *ctx = context();
+    bool prp = opcode == NVME_CMD_KV_PUT || opcode == NVME_CMD_KV_GET;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < cmds.size(); i++) {
+        uint32_t dma_bytes = prp ? cmds[i].data_len : 0;
+        account(dma_bytes);
+        bytes += SQE_BYTES + dma_bytes;
+    }
+    auto st = chrono::high_resolution_clock::now();
+    unsigned int depth = options_.transfer_queue_depth ? options_.transfer_queue_depth : 1;
+    // The batch holds as many device slots as it keeps commands in flight
+    unsigned int slots = cmds.size() < depth ? cmds.size() : depth;
+    if (qos_)
+        ctx->qos_wait[static_cast<int>(ctx->qos)].Add(qos_->Admit(ctx->qos, slots, bytes));
+    int err = ctx->transport->PassthruBatch(cmds.data(), cmds.size(), depth);
+    if (qos_)
+        qos_->Release(slots);
+    auto ed = chrono::high_resolution_clock::now();
+    chrono::nanoseconds d = (ed - st) / cmds.size();
+    for (size_t i = 0; i < cmds.size(); i++)
+        finishPassthru(static_cast<enum NvmeOpcode>(opcode), d);
+    return err;
+}
+
+// Id of a free device stream slot, so no two puts in flight share a slot on
+// the device; its low bits are the slot (0 unused). Claimed by CAS, waits
+// only while all slots are taken
+uint16_t iLSM::DB::open_stream()
+{
+    uint64_t free = stream_free_.load();
+    while (1) {
+        if (!free) {
+            unique_lock<mutex> l(stream_mtx_);
+            stream_waiters_++;
+            stream_cv_.wait(l, [this] { return stream_free_.load() != 0; });
+            stream_waiters_--;
+            free = stream_free_.load();
+            continue;
+        }
+        if (stream_free_.compare_exchange_weak(free, free & (free - 1)))
+            break;
+    }
+    uint32_t slot = __builtin_ctzll(free);
+    // The generation of a slot is its holder's alone
+    uint16_t stream;
+    do {
+        stream = (++stream_gen_[slot] * MAX_OPEN_STREAMS + slot) & 0xFFFF;
+    } while (!stream);
+    return stream;
+}
+
+// After the last Transfer of the stream completed (or the put failed)
+void iLSM::DB::close_stream(uint16_t stream)
+{
+    stream_free_.fetch_or(1ull << (stream % MAX_OPEN_STREAMS));
+    if (stream_waiters_.load()) {
+        lock_guard<mutex> l(stream_mtx_);
+        stream_cv_.notify_all();
+    }
+}
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////// BandSlim ////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 
 void iLSM::DB::finishOp(const enum iLSMOp op, chrono::nanoseconds &d)
 {
-#ifdef THREAD_SAFE_ILSM
-    lock_guard<mutex> l(op_stat_mtx);
-#endif
-    int idx = static_cast<int>(op);
-    op_stat.t[idx] += d;
-    op_stat.c[idx] ++;
+    Context *ctx = context();
+    ctx->op_stat.h[static_cast<int>(op)].Add(d.count());
+    ctx->traffic[static_cast<int>(ctx->path)].ops++;
+}
+
+// One command on the wire for the op in progress (Calibrate() probes and
+// the Report() space query are not workload)
+void iLSM::DB::account(uint32_t dma_bytes)
+{
+    Context *ctx = context();
+    if (ctx->probing)
+        return;
+    TrafficCounters &t = ctx->traffic[static_cast<int>(ctx->path)];
+    t.commands++;
+    t.cmd_bytes += SQE_BYTES;
+    t.cpl_bytes += CQE_BYTES;
+    t.dma_bytes += dma_bytes;
+}
+
+void iLSM::Traffic::Add(const Traffic &t)
+{
+    ops += t.ops;
+    commands += t.commands;
+    cmd_bytes += t.cmd_bytes;
+    dma_bytes += t.dma_bytes;
+    cpl_bytes += t.cpl_bytes;
+    payload_bytes += t.payload_bytes;
+}
+
+void iLSM::DB::TrafficCounters::AddTo(Traffic *t) const
+{
+    t->ops += ops;
+    t->commands += commands;
+    t->cmd_bytes += cmd_bytes;
+    t->dma_bytes += dma_bytes;
+    t->cpl_bytes += cpl_bytes;
+    t->payload_bytes += payload_bytes;
+}
+
+iLSM::Traffic iLSM::TrafficStats::Total() const
+{
+    Traffic total;
+    for (const Traffic &t : path)
+        total.Add(t);
+    return total;
+}
+
+iLSM::TrafficStats iLSM::DB::GetTrafficStats()
+{
+    lock_guard<mutex> cl(ctx_mtx);
+    TrafficStats stats = retired_.traffic;
+    for (auto &ctx : contexts_) {
+        for (int i = 0; i < static_cast<int>(TrafficPath::LAST); i++)
+            ctx->traffic[i].AddTo(&stats.path[i]);
+    }
+    return stats;
 }
 
 void iLSM::DB::finishPassthru(const enum NvmeOpcode opcode, chrono::nanoseconds &d)
 {
-#ifdef THREAD_SAFE_ILSM
-    lock_guard<mutex> l(passthru_stat_mtx);
+    Context *ctx = context();
+    if (ctx->probing)
+        return;
+    ctx->passthru_stat.h[opcode - NvmeOpcode::NVME_CMD_KV_PUT].Add(d.count());
+    ctx->commands++;
+}
+
+// Adds the stats of one context (but its traffic) to d
+void iLSM::DB::fold_context(const Context &ctx, ReportData *d)
+{
+    for (size_t i = 0; i < d->op_stat.size(); i++)
+        d->op_stat[i].Merge(ctx.op_stat.h[i]);
+    for (size_t i = 0; i < d->passthru_stat.size(); i++)
+        d->passthru_stat[i].Merge(ctx.passthru_stat.h[i]);
+    d->cmds_per_put.Merge(ctx.op_stat.cmds_per_put);
+    for (size_t i = 0; i < d->qos_wait.size(); i++)
+        d->qos_wait[i].Merge(ctx.qos_wait[i]);
+    d->peak_inflight += ctx.transport->PeakInflight();
+    d->pool_allocs += ctx.pool.Allocs();
+    d->pool_reuses += ctx.pool.Reuses();
+    d->cache_hits += ctx.cache_hits;
+    d->cache_misses += ctx.cache_misses;
+    d->filter_negatives += ctx.filter_negatives;
+    d->zip_tried += ctx.zip_tried;
+    d->zip_stored += ctx.zip_stored;
+    d->zip_raw_commands += ctx.zip_raw_commands;
+    d->zip_commands += ctx.zip_commands;
+    d->zip_raw_bytes += ctx.zip_raw_bytes;
+    d->zip_bytes += ctx.zip_bytes;
+#ifdef GET_FOR_SEEK_AND_NEXT_ILSM
+    d->iter_probes_seek += ctx.numGetofSeek;
+    d->iter_probes_next += ctx.numGetofNext;
+#else
+    d->iter_pages += ctx.iter_pages;
+    d->iter_records += ctx.iter_records;
 #endif
-    int idx = opcode - NvmeOpcode::NVME_CMD_KV_PUT;
-    passthru_stat.t[idx] += d;
-    passthru_stat.c[idx] ++;
 }
 
-string iLSM::DB::Report()
+// "Elapse Time ... = Average ... us, P50 ... us" line of one histogram (ns)
+static string latency_line(const iLSM::HistogramSnapshot &h)
+{
+    double total = (double) h.Sum() / 1000;
+    string msg = "Elapse Time " + to_string(total) + " us / " + to_string(h.Count()) +
+        " = Average " + to_string(h.Average() / 1000) + " us";
+    msg += ", P50 " + to_string(h.Percentile(50) / 1000) +
+        ", P90 " + to_string(h.Percentile(90) / 1000) +
+        ", P99 " + to_string(h.Percentile(99) / 1000) +
+        ", P99.9 " + to_string(h.Percentile(99.9) / 1000) +
+        ", Max " + to_string((double) h.Max() / 1000) + " us \n";
+    return msg;
+}
+
+// Merge the per-thread shards (call once the workload is quiesced), and ask
+// the device for its space report
+void iLSM::DB::GetReport(ReportData *d)
 {
 #ifdef THREAD_SAFE_ILSM
     lock_guard<mutex> l(report_mtx);
 #endif
+    {
+        lock_guard<mutex> cl(ctx_mtx);
+        *d = retired_;      // Contexts of the threads that exited
+        d->devices = 1;
+        d->options = options_;
+        d->op_stat.resize(static_cast<int>(iLSMOp::LAST));
+        d->passthru_stat.resize(NVME_CMD_KV_WRITE_BATCH - NVME_CMD_KV_PUT + 1);
+        d->qos_wait.resize(static_cast<int>(QosClass::LAST));
+        d->num_contexts = contexts_.size() + d->retired_contexts;
+        for (auto &ctx : contexts_)
+            fold_context(*ctx, d);
+    }
+    d->traffic = GetTrafficStats();
+    if (combiner_) {
+        lock_guard<mutex> wl(combiner_->mtx);
+        d->combine_pages = combiner_->written;
+        d->combine_records = combiner_->records;
+        d->deadline_pages = combiner_->deadline_pages;
+    }
+    if (async_) {
+        lock_guard<mutex> al(async_->mtx);
+        d->async_threads = async_->threads.size();
+        d->async_ops = async_->ops;
+        d->async_peak_queued = async_->peak_queued;
+    }
+    if (options_.emulator)
+        d->emulator = options_.emulator->GetStats();
+    if (cache_) {
+        d->cache_capacity = cache_->GetCapacity();
+        d->cache_usage = cache_->GetUsage();
+    }
+    if (filter_) {
+        d->filter_bits = filter_->Bits();
+        d->filter_source = filter_source_;
+    }
+    d->cpu_ns = process_cpu_ns() - open_cpu_ns_;
+    d->wall_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - open_time_).count();
+
+    {
+        void *data = NULL;
+        unsigned int data_len = 0;
+        int err;
+        uint32_t result;
+        uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+        cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
+        err = nvme_passthru(NVME_CMD_KV_LAST, 0, 0, NSID, cdw2, cdw3, 
+            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
+                data_len, data, result);
+        if (err < 0) {
+            // ioctl fail
+            perror("ilsm report failed");
+        }
+        // fprintf(stderr, "Total used sectors (space amplification): %u\n", result);
+    }
+}
+
+void iLSM::ReportData::Add(const ReportData &d)
+{
+    if (!devices) {
+        *this = d;
+        return;
+    }
+    devices += d.devices;
+    op_stat.resize(std::max(op_stat.size(), d.op_stat.size()));
+    for (size_t i = 0; i < d.op_stat.size(); i++)
+        op_stat[i].Merge(d.op_stat[i]);
+    passthru_stat.resize(std::max(passthru_stat.size(), d.passthru_stat.size()));
+    for (size_t i = 0; i < d.passthru_stat.size(); i++)
+        passthru_stat[i].Merge(d.passthru_stat[i]);
+    cmds_per_put.Merge(d.cmds_per_put);
+    qos_wait.resize(std::max(qos_wait.size(), d.qos_wait.size()));
+    for (size_t i = 0; i < d.qos_wait.size(); i++)
+        qos_wait[i].Merge(d.qos_wait[i]);
+    for (int i = 0; i < static_cast<int>(TrafficPath::LAST); i++)
+        traffic.path[i].Add(d.traffic.path[i]);
+    num_contexts += d.num_contexts;
+    retired_contexts += d.retired_contexts;
+    peak_inflight += d.peak_inflight;
+    pool_allocs += d.pool_allocs;
+    pool_reuses += d.pool_reuses;
+    cache_hits += d.cache_hits;
+    cache_misses += d.cache_misses;
+    cache_capacity += d.cache_capacity;
+    cache_usage += d.cache_usage;
+    filter_negatives += d.filter_negatives;
+    filter_bits += d.filter_bits;
+    if (filter_source != d.filter_source)
+        filter_source = "per device";
+    zip_tried += d.zip_tried;
+    zip_stored += d.zip_stored;
+    zip_raw_commands += d.zip_raw_commands;
+    zip_commands += d.zip_commands;
+    zip_raw_bytes += d.zip_raw_bytes;
+    zip_bytes += d.zip_bytes;
+    combine_pages += d.combine_pages;
+    combine_records += d.combine_records;
+    deadline_pages += d.deadline_pages;
+    async_threads += d.async_threads;
+    async_ops += d.async_ops;
+    async_peak_queued += d.async_peak_queued;
+    emulator.commands += d.emulator.commands;
+    emulator.cmd_bytes += d.emulator.cmd_bytes;
+    emulator.cpl_bytes += d.emulator.cpl_bytes;
+    emulator.dma_bytes += d.emulator.dma_bytes;
+    emulator.vlog_bytes += d.emulator.vlog_bytes;
+    emulator.vlog_slices += d.emulator.vlog_slices;
+    emulator.tombstones += d.emulator.tombstones;
+    emulator.dead_bytes += d.emulator.dead_bytes;
+    emulator.batches += d.emulator.batches;
+    iter_probes_seek += d.iter_probes_seek;
+    iter_probes_next += d.iter_probes_next;
+    iter_pages += d.iter_pages;
+    iter_records += d.iter_records;
+    // The DBs share the process: its CPU time is counted once
+    cpu_ns = std::max(cpu_ns, d.cpu_ns);
+    wall_ns = std::max(wall_ns, d.wall_ns);
+}
+
+string iLSM::DB::Report()
+{
+    ReportData d;
+    GetReport(&d);
+    return FormatReport(d);
+}
+
+string iLSM::DB::FormatReport(const ReportData &d)
+{
+    const Options &options = d.options;
     string msg;
-    for (int i = 0; i < static_cast<int>(iLSMOp::LAST); i++) {
+    for (int i = 0; i < static_cast<int>(d.op_stat.size()); i++) {
         
-        if (!op_stat.t[i].count())
+        if (!d.op_stat[i].Count())
             continue;
-
         switch(static_cast<enum iLSMOp>(i)) {
             case iLSMOp::Put:
                 msg += "[Put] ";
@@ -707,17 +2737,44 @@ string iLSM::DB::Report()
             case iLSMOp::DestroyIter:
                 msg += "[DestroyIter] ";
                 break;
+            case iLSMOp::MultiGet:
+                msg += "[MultiGet] ";
+                break;
+            case iLSMOp::Delete:
+                msg += "[Delete] ";
+                break;
+            case iLSMOp::DeleteRange:
+                msg += "[DeleteRange] ";
+                break;
+            case iLSMOp::Write:
+                msg += "[Write] ";
+                break;
             default:
                 msg += "[????] ";
         }
-        double total, avg;
-        total = (double) op_stat.t[i].count() / 1000;
-        avg = total / op_stat.c[i];
-        msg += "Elapse Time " + to_string (total) + " us / " + to_string(op_stat.c[i]) + " = Average " + to_string(avg) + " us \n";
+        msg += latency_line(d.op_stat[i]);
     }
-    for (int i = 0; i < (static_cast<int>(NvmeOpcode::NVME_CMD_KV_LAST) - 0xA0); i++) {
+    const HistogramSnapshot &cmds_per_put = d.cmds_per_put;
+    if (cmds_per_put.Count())
+        msg += "[Put] Commands per Put: Average " + to_string(cmds_per_put.Average()) +
+            ", P50 " + to_string(cmds_per_put.Percentile(50)) +
+            ", P99 " + to_string(cmds_per_put.Percentile(99)) +
+            ", P99.9 " + to_string(cmds_per_put.Percentile(99.9)) +
+            ", Max " + to_string(cmds_per_put.Max()) + " \n";
+    uint64_t ops = 0;
+    for (auto &h : d.op_stat)
+        ops += h.Count();
+    if (ops) {
+        // Whole process since Open(): what polling costs shows up here
+        double cpu_ns = (double)d.cpu_ns;
+        double wall_ns = (double)d.wall_ns;
+        msg += "[CPU] " + to_string(cpu_ns / ops / 1000) + " us per Op, " +
+            to_string(wall_ns ? cpu_ns / wall_ns : 0) + " Cores Busy, Completions " +
+            (options.poll_completions ? "Polled" : "by Interrupt") + " \n";
+    }
+    for (int i = 0; i < static_cast<int>(d.passthru_stat.size()); i++) {
 
-        if (!passthru_stat.t[i].count())
+        if (!d.passthru_stat[i].Count())
             continue;
 
         switch(static_cast<enum NvmeOpcode>(i + 0xA0)) {
@@ -754,32 +2811,92 @@ string iLSM::DB::Report()
             case NVME_CMD_KV_ITER_DESTROY_ITER:
                 msg += "[NVME_CMD_KV_ITER_DESTROY_ITER] ";
                 break;
+            case NVME_CMD_KV_MULTI_GET:
+                msg += "[NVME_CMD_KV_MULTI_GET] ";
+                break;
+            case NVME_CMD_KV_BATCH_PUT:
+                msg += "[NVME_CMD_KV_BATCH_PUT] ";
+                break;
+            case NVME_CMD_KV_WRITE_BATCH:
+                msg += "[NVME_CMD_KV_WRITE_BATCH] ";
+                break;
             default:
                 msg += "[???] ";
         }
 
-        double total, avg;
-        total = (double) passthru_stat.t[i].count() / 1000;
-        avg = total / passthru_stat.c[i];
-        msg += "Elapse Time " + to_string (total) + " us / " + to_string(passthru_stat.c[i]) + " = Average " + to_string(avg) + " us \n";
+        msg += latency_line(d.passthru_stat[i]);
 
     }
- 
     {
-        void *data = NULL;
-        unsigned int data_len = 0;
-        int err;
-        uint32_t result;
-        uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-        cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-        err = nvme_passthru(NVME_CMD_KV_LAST, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-                data_len, data, result);
-        if (err < 0) {
-            // ioctl fail
-            perror("ilsm report failed");
+        static const char *modes[] = {"KVSSD", "PIGGY", "ADAPT"};
+        msg += string("[Transfer] Mode ") + modes[static_cast<int>(options.transfer_mode)];
+        if (options.transfer_mode == TransferMode::ADAPT)
+            msg += ", Piggyback <= " + to_string(options.piggyback_threshold) + " B, Combi Tail <= " +
+                to_string(options.combi_threshold) + " B" + (options.calibrate ? " (calibrated)" : "");
+        msg += " \n";
+    }
+    {
+        static const char *paths[] = {"PRP", "PIGGY", "COMBI", "BATCH", "DELETE", "READ", "WRITE_BATCH"};
+        for (int i = 0; i < static_cast<int>(TrafficPath::LAST); i++) {
+            const Traffic &t = d.traffic.path[i];
+            if (!t.commands)
+                continue;
+            msg += string("[Traffic ") + paths[i] + "] Ops " + to_string(t.ops) +
+                ", Commands " + to_string(t.commands) + ", SQE Bytes " + to_string(t.cmd_bytes) +
+                ", DMA Bytes " + to_string(t.dma_bytes) + ", CQE Bytes " + to_string(t.cpl_bytes) +
+                ", Payload Bytes " + to_string(t.payload_bytes) +
+                ", Amplification " + to_string(t.Amplification()) + " \n";
         }
-        // fprintf(stderr, "Total used sectors (space amplification): %u\n", result);
     }
+    if (d.zip_tried)
+        msg += "[Compression] " + ROCKSDB_NAMESPACE::CompressionTypeToString(options.compression) +
+            ", Values Stored Compressed " + to_string(d.zip_stored) + " of " + to_string(d.zip_tried) +
+            " Tried, Commands " + to_string(d.zip_raw_commands) + " -> " + to_string(d.zip_commands) +
+            ", Value Bytes " + to_string(d.zip_raw_bytes) + " -> " + to_string(d.zip_bytes) + " \n";
+    if (d.combine_pages)
+        msg += "[Write Combining] Pages " + to_string(d.combine_pages) + ", Records " +
+            to_string(d.combine_records) + " (" + to_string((double)d.combine_records / d.combine_pages) +
+            " per Page), Deadline Flushes " + to_string(d.deadline_pages) + " \n";
+    if (options.qos_depth) {
+        // Time the commands of each class waited for a device slot
+        static const char *classes[] = {"Read", "Small Write", "Large Write", "Scan"};
+        for (size_t i = 0; i < d.qos_wait.size(); i++) {
+            if (!d.qos_wait[i].Count())
+                continue;
+            msg += string("[QoS ") + classes[i] + "] Depth " + to_string(options.qos_depth) +
+                ", Weight " + to_string(options.qos_weight[i]) + ", Rate " +
+                (options.qos_rate_limit[i] ? to_string(options.qos_rate_limit[i]) + " B/s" : string("Unlimited")) +
+                ", Queue " + latency_line(d.qos_wait[i]);
+        }
+    }
+    if (d.async_threads)
+        msg += "[Async] " + to_string(d.async_threads) + " Workers, Ops " + to_string(d.async_ops) +
+            ", Peak Queued " + to_string(d.async_peak_queued) + " \n";
+    if (options.async_io)
+        msg += "[io_uring] " + to_string(d.num_contexts) + " Rings x Queue Depth " + to_string(options.queue_depth) + ", Peak In-flight " + to_string(d.peak_inflight) + " \n";
+    if (options.emulator) {
+        const Emulator::Stats &es = d.emulator;
+        msg += "[Emulator] Commands " + to_string(es.commands) + ", Command Bytes " + to_string(es.cmd_bytes) +
+            ", DMA Bytes " + to_string(es.dma_bytes) + ", vLog Bytes " + to_string(es.vlog_bytes) +
+            " in " + to_string(es.vlog_slices) + " Slices, Tombstones " + to_string(es.tombstones) +
+            ", Dead vLog Bytes " + to_string(es.dead_bytes) + ", Batches Committed " +
+            to_string(es.batches) + " \n";
+    }
+    if (d.cache_capacity && (d.cache_hits || d.cache_misses))
+        msg += "[Read Cache] Capacity " + to_string(d.cache_capacity) + ", Usage " + to_string(d.cache_usage) +
+            ", Hits " + to_string(d.cache_hits) + ", Misses " + to_string(d.cache_misses) +
+            ", Hit Ratio " + to_string((double)d.cache_hits / (d.cache_hits + d.cache_misses)) + " \n";
+    if (d.filter_bits)
+        msg += "[Existence Filter] Bits " + to_string(d.filter_bits) + " (" + d.filter_source +
+            "), Lookups Answered on the Host " + to_string(d.filter_negatives) + " \n";
+    if (d.pool_allocs)
+        msg += "[DMA Buffer Pool] Allocations " + to_string(d.pool_allocs) + ", Recycled " + to_string(d.pool_reuses) + " \n";
+#ifdef GET_FOR_SEEK_AND_NEXT_ILSM
+    if (d.iter_probes_seek || d.iter_probes_next)
+        msg += "[Seek/Next] Get Probes " + to_string(d.iter_probes_seek) + " / " + to_string(d.iter_probes_next) + " \n";
+#else
+    if (d.iter_pages)
+        msg += "[Seek/Next] Pages " + to_string(d.iter_pages) + ", Records " + to_string(d.iter_records) + " \n";
+#endif
     return msg;
 }
@@ -2,32 +2,303 @@
 
 #include <string>
 #include <mutex>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
 #include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+
+#include "rocksdb/cache.h"
+#include "rocksdb/slice.h"
+
+#include "iLSM_transport.h"
+#include "iLSM_async.h"
+#include "iLSM_buffer.h"
+#include "iLSM_compress.h"
+#include "iLSM_filter.h"
+#include "iLSM_histogram.h"
+#include "iLSM_mock.h"
+#include "iLSM_qos.h"
 
 #define MAX_ITER_NUM 100
 
 #define THREAD_SAFE_ILSM
-#define GET_FOR_SEEK_AND_NEXT_ILSM // BandSlim
+// Iterate by probing Get() over the 4-byte key space, for devices without
+// ITER_SEEK/NEXT (one round trip per missing key)
+// #define GET_FOR_SEEK_AND_NEXT_ILSM // BandSlim
 
 namespace iLSM {
+    typedef ROCKSDB_NAMESPACE::Slice Slice;
+
+    // How Put() moves a value to the device
+    enum class TransferMode : int {
+        KVSSD   = 0,    // Page-unit DMA via PRP only
+        PIGGY   = 1,    // Piggyback in BandSlim WRITE/TRANSFER dwords (values up to 16KB - 4B)
+        ADAPT   = 2,    // Piggyback small values, PRP (+ piggybacked tail) otherwise
+    };
+
+    struct Options {
+        // Submit commands asynchronously through io_uring (IORING_OP_URING_CMD)
+        // on the NVMe generic char device instead of one blocking ioctl at a
+        // time; falls back to the ioctl path if the ring cannot be set up
+        bool async_io = false;
+        // Max # of commands outstanding on the ring
+        unsigned int queue_depth = 64;
+        // Busy-poll completions instead of taking the interrupt: the rings are
+        // set up with IORING_SETUP_IOPOLL (implies async_io), so commands use
+        // the NVMe poll queues (nvme.poll_queues=N) and the waiting thread
+        // spins in the kernel until they complete. Trades a core per thread
+        // for latency; see the CPU per op in Report(). Falls back to
+        // interrupts if a polled ring cannot be set up
+        bool poll_completions = false;
+        // If set, commands go to this in-process KV-SSD emulator instead of
+        // a device (the device path is ignored). One open DB per emulator
+        std::shared_ptr<Emulator> emulator;
+
+        TransferMode transfer_mode = TransferMode::ADAPT;
+        // ADAPT: values up to this size are piggybacked (threshold1 x alpha)
+        uint32_t piggyback_threshold = 127;
+        // ADAPT: a PRP value longer than a page piggybacks its sub-page tail
+        // if the tail is at most this long (threshold2 x beta), 0 = never
+        uint32_t combi_threshold = 4096;
+        // Pick both ADAPT thresholds at Open() by timing probe puts
+        bool calibrate = false;
+        // Puts per probed size and path (the median is taken)
+        unsigned int calibration_rounds = 16;
+        // Max # of BandSlim Transfers of one value in flight at once (needs
+        // a transport that queues, e.g. async_io; 1 = one round trip each)
+        unsigned int transfer_queue_depth = 32;
+        // Buffer of packed records one ITER_SEEK/NEXT fills (bytes)
+        unsigned int iter_page_size = 16384;
+        // Max # of keys MultiGet() ships per MULTI_GET command
+        unsigned int multiget_batch = 32;
+        // Stage small puts of all threads in one shared page of packed
+        // records and write it with one BATCH_PUT (a single DMA) once it is
+        // full or its first put has waited combine_deadline_us
+        bool write_combining = false;
+        // Values up to this size are combined
+        uint32_t combine_threshold = 127;
+        // Staging page (bytes, rounded to 4KB, up to 16KB)
+        unsigned int combine_page_size = 4096;
+        unsigned int combine_deadline_us = 50;
+        // Host read cache in front of Get/MultiGet: bytes of cached keys and
+        // values (0 = off), over 2^cache_shard_bits LRU shards
+        size_t cache_capacity = 0;
+        int cache_shard_bits = 4;
+        // Larger values are always read from the device
+        uint32_t cache_max_value = 4096;
+        // Host existence filter (a Bloom filter of every key put through the
+        // DB): a Get/MultiGet of a key it rules out, and each key Get probing
+        // skips, is answered -2 with no command. Sized for filter_keys keys
+        // (0 = off) at filter_bits_per_key
+        size_t filter_keys = 0;
+        uint32_t filter_bits_per_key = 10;
+        // Close() saves the filter here and Open() loads it, removing the file
+        // until the next Close() so a crash cannot leave a stale one. Without
+        // a usable file Open() rebuilds the filter by walking the device keys
+        // with an iterator; if that fails the filter is off
+        std::string filter_path;
+        // Compress put values one by one with this codec (kNoCompression =
+        // off, see ValueCompressor::Supported()). A value is stored
+        // compressed only if that takes fewer commands, or moves it from PRP
+        // to piggybacking; the device keeps the flag with it and reads
+        // decompress. Write-combined puts are stored as given
+        ROCKSDB_NAMESPACE::CompressionType compression = ROCKSDB_NAMESPACE::kNoCompression;
+        // Dictionary of the codec (e.g. from ValueCompressor::TrainDict());
+        // values put with one are read back with the same one only
+        std::string compression_dict;
+        // Threads running PutAsync()/GetAsync()/MultiGetAsync(), each with
+        // one op (and its commands) in flight on its own submission context.
+        // 0 = the async calls run the op on the caller and complete before
+        // they return
+        unsigned int async_threads = 0;
+        // Device-queue QoS: at most qos_depth commands of all threads are on
+        // the device at once (0 = off), handed out by weighted fair queuing
+        // over the QosClass of the op that issued them, so a bulk load does
+        // not crowd Get out of the queue. Per class (indexed by QosClass): a
+        // weight, and a rate limit in wire bytes/s (0 = unlimited)
+        unsigned int qos_depth = 0;
+        unsigned int qos_weight[static_cast<int>(QosClass::LAST)] = {8, 4, 1, 2};
+        int64_t qos_rate_limit[static_cast<int>(QosClass::LAST)] = {0, 0, 0, 0};
+        // Puts of longer values are LARGE_WRITE
+        uint32_t qos_large_write = 4096;
+    };
+
+    // Status of a put once it is on the device: 0, or <0 as Put() returns
+    typedef std::function<void(int status)> PutCallback;
+    typedef std::function<void(GetResult &result)> GetCallback;
+    typedef std::function<void(MultiGetResult &result)> MultiGetCallback;
+
+    // Interconnect traffic of the ops that took one path
+    enum class TrafficPath : int {
+        PRP     = 0,    // Put, value by PRP only
+        PIGGY   = 1,    // Put, value in BandSlim WRITE + TRANSFERs
+        COMBI   = 2,    // Put, whole pages by PRP + piggybacked tail
+        BATCH   = 3,    // Put, combined into a page with others
+        DELETE  = 4,    // Delete and DeleteRange (keys in the commands)
+        READ    = 5,    // Get, MultiGet and iterators
+        WRITE_BATCH = 6,// Write(): batch header and trailer (members count by their path)
+        LAST    = 7,
+    };
+
+    struct Traffic {
+        uint64_t ops = 0;           // Logical ops (API calls)
+        uint64_t commands = 0;
+        uint64_t cmd_bytes = 0;     // 64B per SQE
+        uint64_t dma_bytes = 0;     // PRP transfers (page-rounded)
+        uint64_t cpl_bytes = 0;     // 16B per CQE
+        uint64_t payload_bytes = 0; // Key + value bytes the ops moved
+        uint64_t WireBytes() const { return cmd_bytes + dma_bytes + cpl_bytes; }
+        // Bytes on the interconnect per useful byte
+        double Amplification() const {
+            return payload_bytes ? (double)WireBytes() / payload_bytes : 0;
+        }
+        void Add(const Traffic &t);
+    };
+
+    struct TrafficStats {
+        Traffic path[static_cast<int>(TrafficPath::LAST)];
+        const Traffic &operator[](TrafficPath p) const { return path[static_cast<int>(p)]; }
+        Traffic Total() const;
+    };
+
+    // What Report() prints: the per-thread stats of a DB merged, and its
+    // options. Add() sums the data of several DBs (the shards of a ShardedDB)
+    struct ReportData {
+        unsigned int devices = 0;
+        Options options;            // Of the first DB
+        std::vector<HistogramSnapshot> op_stat;         // Latency (ns) per op
+        std::vector<HistogramSnapshot> passthru_stat;   // And per opcode
+        HistogramSnapshot cmds_per_put;
+        TrafficStats traffic;
+        size_t num_contexts = 0;
+        size_t retired_contexts = 0;    // Of those, of threads that exited
+        unsigned int peak_inflight = 0;
+        unsigned long long pool_allocs = 0, pool_reuses = 0;
+        unsigned long long cache_hits = 0, cache_misses = 0;
+        size_t cache_capacity = 0, cache_usage = 0;
+        unsigned long long filter_negatives = 0;
+        uint64_t filter_bits = 0;
+        std::string filter_source;
+        unsigned long long zip_tried = 0, zip_stored = 0;   // Values compressed, and stored so
+        unsigned long long zip_raw_commands = 0;            // Commands those would have taken
+        unsigned long long zip_commands = 0;                // And took
+        uint64_t zip_raw_bytes = 0, zip_bytes = 0;
+        uint64_t combine_pages = 0, combine_records = 0, deadline_pages = 0;
+        unsigned int async_threads = 0;
+        uint64_t async_ops = 0, async_peak_queued = 0;
+        std::vector<HistogramSnapshot> qos_wait;        // Queue time (ns) per QosClass
+        Emulator::Stats emulator;
+        unsigned long long iter_probes_seek = 0, iter_probes_next = 0;  // Get probing
+        unsigned long long iter_pages = 0, iter_records = 0;            // Device iterators
+        uint64_t cpu_ns = 0;        // Process CPU time since Open()
+        uint64_t wall_ns = 0;
+        void Add(const ReportData &d);
+    };
+
+    // Puts and deletes that Write() applies atomically: a Get sees all of
+    // them or none. Applied in order, so the last op of a key wins
+    class WriteBatch {
+        public:
+            void Put(const std::string &key, const std::string &value) { ops_.push_back(Op{key, value, false}); }
+            void Delete(const std::string &key) { ops_.push_back(Op{key, std::string(), true}); }
+            void Clear() { ops_.clear(); }
+            size_t Count() const { return ops_.size(); }
+
+        private:
+            friend class DB;
+            friend class ShardedDB;
+            struct Op {
+                std::string key;
+                std::string value;
+                bool del;
+            };
+            std::vector<Op> ops_;
+    };
+
     class DB{
         public:
-            DB() : fd_(-1) {
-                op_stat.t.resize(6);
-                op_stat.c.resize(6);
-                passthru_stat.t.resize(8);   // BandSlim
-                passthru_stat.c.resize(8, 0);// BandSlim
-            }
+            DB() : fd_(-1) {}
+            ~DB() { Close(); }
+            // One DB per device: the stream ids of piggybacked puts pick
+            // device-wide slots, so Open() locks the device (flock, or the
+            // emulator) and fails with -EBUSY while another DB or process
+            // holds it, until that one's Close()
             int Open(const std::string &dev);
+            int Open(const std::string &dev, const Options &options);
+            void Close();
+            // Keys of 1-255 bytes (up to 16 travel inline in the command).
+            // Returns once the pair is on the device; with write_combining a
+            // small put waits for its page (group commit)
             int Put(const std::string &key, const std::string &value);
+            // Same, but a combined put returns 0 as soon as it is staged and
+            // done runs once its page is written, on the thread writing it.
+            // Other puts run done before returning. done is not called if
+            // Put() fails; a Get() may miss a put whose done has not run
+            int Put(const std::string &key, const std::string &value, PutCallback done);
+            // Applies the batch atomically: a header command opens it on the
+            // device, every op goes as a Put()/Delete() would (never write
+            // combined) and the trailer commits them all at once. Up to
+            // MAX_BATCH_MEMBERS ops (-EINVAL beyond); on failure none is
+            // applied. An empty batch is a no-op
+            int Write(const WriteBatch &batch);
+            // Writes the staged page now and waits for every page in flight
+            void Flush();
+            // Tombstones carried in the command dwords (and Transfers for
+            // long keys), no data pointer; deleting a missing key is not an
+            // error. DeleteRange drops [begin, end), -EINVAL if end < begin,
+            // and empties the read cache
+            int Delete(const std::string &key);
+            int DeleteRange(const std::string &begin, const std::string &end);
             int Get(const std::string &key, std::string &value);
+            // Zero-copy Get: the device DMAs the value straight into buf, which
+            // must be page-aligned and a multiple of 4KB long (up to 512KB).
+            // Returns the full value length; if it exceeds buf_len only the
+            // first buf_len bytes were written, retry with a bigger buffer
+            int Get(const std::string &key, void *buf, uint32_t buf_len);
+            // Looks up all keys, multiget_batch per command. statuses[i] is 0
+            // (values[i] set), -2 (no such key) or <0 on failure; returns -1
+            // if any command failed
+            int MultiGet(const std::vector<Slice> &keys, std::vector<std::string> *values,
+                    std::vector<int> *statuses);
+            // The same ops without blocking the caller: they are queued to
+            // the async_threads workers, which run them as above. done runs
+            // on the worker once the op completed, or with cq on the thread
+            // polling cq; the futures are set on the worker. Keys and values
+            // are copied. Close() runs the ops still queued first (so it must
+            // not be called from a callback run on a worker)
+            std::future<int> PutAsync(const std::string &key, const std::string &value);
+            void PutAsync(const std::string &key, const std::string &value, PutCallback done,
+                    CompletionQueue *cq = nullptr);
+            std::future<GetResult> GetAsync(const std::string &key);
+            void GetAsync(const std::string &key, GetCallback done, CompletionQueue *cq = nullptr);
+            std::future<MultiGetResult> MultiGetAsync(const std::vector<Slice> &keys);
+            void MultiGetAsync(const std::vector<Slice> &keys, MultiGetCallback done,
+                    CompletionQueue *cq = nullptr);
             int CreateIter(unsigned int &iter_id);
             int Seek(const unsigned int iter_id, const std::string &key, std::string &value);
             int Next(const unsigned int iter_id, std::string &value);
             int DestroyIter(const unsigned int iter_id);
+            // Key of the record the last Seek()/Next() returned
+            int IterKey(const unsigned int iter_id, std::string &key);
+            // Times piggyback vs. PRP puts at several sizes and sets the ADAPT
+            // thresholds to the measured crossovers. Overwrites one reserved
+            // key (0xFFFFFFFF); call while no other thread uses the DB.
+            int Calibrate();
+            const Options &GetOptions() const { return options_; }
+            // Sum of the per-thread traffic counters (exact once quiesced)
+            TrafficStats GetTrafficStats();
 
             std::string Report();
+            // Report() in two steps, to merge the data of several DBs first
+            void GetReport(ReportData *d);
+            static std::string FormatReport(const ReportData &d);
         private:
             enum NvmeOpcode {
                 NVME_CMD_KV_PUT                 = 0xA0,
@@ -43,6 +314,9 @@ namespace iLSM {
                 NVME_CMD_KV_LAST                = 0xA8,  
                 NVME_CMD_KV_BANDSLIM_WRITE        = 0xA7,   
                 NVME_CMD_KV_BANDSLIM_TRANSFER     = 0xA9,   
+                NVME_CMD_KV_MULTI_GET           = 0xAA,
+                NVME_CMD_KV_BATCH_PUT           = 0xAB,
+                NVME_CMD_KV_WRITE_BATCH         = 0xAC,
                 ////////////////////////////////////////////////////////////////
                 /////////////////////////// BandSlim ///////////////////////////
                 ////////////////////////////////////////////////////////////////
@@ -55,34 +329,217 @@ namespace iLSM {
                 Seek            = 3,
                 Next            = 4,
                 DestroyIter     = 5,
-                LAST            = 6,
+                MultiGet        = 6,
+                Delete          = 7,
+                DeleteRange     = 8,
+                Write           = 9,
+                LAST            = 10,
             };
 
+            // Latency (ns) per op, owned by one context's thread
             struct OP_STAT {
-                std::vector<std::chrono::nanoseconds> t;
-                std::vector<int> c;
-            } op_stat;
+                std::unique_ptr<Histogram[]> h;
+                Histogram cmds_per_put;     // NVMe commands one Put() took
+                OP_STAT() : h(new Histogram[static_cast<int>(iLSMOp::LAST)]) {}
+            };
 
             struct PASSTHRU_STAT {
-                std::vector<std::chrono::nanoseconds> t;
-                std::vector<int> c;
-            } passthru_stat;
+                std::unique_ptr<Histogram[]> h;
+                // Indexed by (opcode - NVME_CMD_KV_PUT), up to WRITE_BATCH
+                PASSTHRU_STAT() : h(new Histogram[NVME_CMD_KV_WRITE_BATCH - NVME_CMD_KV_PUT + 1]) {}
+            };
+
+            // Traffic of one path in a Context
+            struct TrafficCounters {
+                Counter ops, commands, cmd_bytes, dma_bytes, cpl_bytes, payload_bytes;
+                void AddTo(Traffic *t) const;
+            };
+
+            // Per-thread submission context. Every thread touching the DB
+            // gets its own fd (and ring), and its own stats shard, so the
+            // hot path takes no shared lock; commands of one thread (e.g.
+            // a BANDSLIM_WRITE and its TRANSFERs) are issued in order.
+            struct Context {
+                unsigned int id;
+                std::unique_ptr<Transport> transport;   // Own fd/ring, or the emulator
+                OP_STAT op_stat;            // Written by the owner thread only,
+                PASSTHRU_STAT passthru_stat;// merged by Report()
+                Counter commands;           // NVMe commands issued
+                bool probing = false;       // Calibrate() running, not recorded
+                TrafficCounters traffic[static_cast<int>(TrafficPath::LAST)];
+                TrafficPath path = TrafficPath::READ;   // Of the op in progress
+                QosClass qos = QosClass::READ;          // Same
+                uint32_t batch_tag = 0;     // CDW13 bits of the Write() batch in progress
+                Histogram qos_wait[static_cast<int>(QosClass::LAST)];  // Queue time per class
+                BufferPool pool;            // Staging/DMA buffers of this thread
+                unsigned int expected_value = 4096; // Get buffer size (bytes, page-rounded)
+                unsigned int expected_multiget = 16384; // Same for MultiGet
+                // Counters below and traffic: owner thread writes, Report()
+                // and GetTrafficStats() read
+                Counter cache_hits;
+                Counter cache_misses;
+                Counter filter_negatives;   // Lookups answered by the filter
+                Counter zip_tried, zip_stored;      // See ReportData
+                Counter zip_raw_commands, zip_commands;
+                Counter zip_raw_bytes, zip_bytes;
+#ifdef GET_FOR_SEEK_AND_NEXT_ILSM
+                Counter numGetofSeek;
+                Counter numGetofNext;
+#else
+                Counter iter_pages;         // ITER_SEEK/NEXT round trips
+                Counter iter_records;       // Records served from pages
+#endif
+            };
+
+            // The contexts of one thread, by DB instance. Its destructor
+            // retires them when the thread exits
+            struct ThreadContexts;
+
+            // Write combining: a page of records (IterRecord layout) and the
+            // callbacks of its puts
+            struct Batch {
+                std::string page;
+                uint32_t records = 0;
+                uint64_t payload_bytes = 0;
+                std::vector<PutCallback> done;
+                uint64_t seq = 0;           // Pages reach the device in this order
+            };
+
+            struct Combiner {
+                std::mutex mtx;
+                std::condition_variable wakeup;     // Flusher: page opened or stop
+                std::condition_variable turn;       // Writers: written advanced
+                Batch open;                 // Being filled
+                std::chrono::steady_clock::time_point deadline;  // Of the open page
+                uint64_t taken = 0;         // Pages handed to writers
+                uint64_t written = 0;       // Of those, completed
+                uint64_t deadline_pages = 0;// Written by the flusher on deadline
+                uint64_t records = 0;       // Of the written pages
+                bool stop = false;
+                std::thread flusher;
+            };
+
+            // Async ops queued for the workers
+            struct AsyncPool {
+                std::mutex mtx;
+                std::condition_variable cv;
+                std::deque<std::function<void()>> tasks;
+                bool stop = false;
+                std::vector<std::thread> threads;
+                uint64_t ops = 0;
+                uint64_t peak_queued = 0;
+            };
 
             int fd_;
             int cnt=0;
+            Options options_;
+            std::string path_;
+            uint64_t instance_ = 0;     // Changes on every Open(), tags thread-local lookups
+            std::vector<std::unique_ptr<Context>> contexts_;
+            std::mutex ctx_mtx;         // Context registration only (not on the hot path)
+            ReportData retired_;        // Stats of the contexts of exited threads
+            std::unique_ptr<Combiner> combiner_;    // write_combining only
+            std::unique_ptr<AsyncPool> async_;      // async_threads only
+            std::unique_ptr<QosScheduler> qos_;     // qos_depth only
+            uint32_t combine_page_ = 0;
+            // Device write batch slots (MAX_OPEN_BATCHES), one per Write() in flight
+            std::mutex batch_mtx_;
+            std::condition_variable batch_cv_;
+            uint32_t batch_free_ = (1u << MAX_OPEN_BATCHES) - 1;    // Bit per slot
+            uint32_t batch_gen_ = 0;
+            // Device stream slots (MAX_OPEN_STREAMS), one per put/delete in
+            // flight that has Transfers to follow; the lock and condvar are
+            // for waiting while none is free only
+            std::atomic<uint64_t> stream_free_{~0ull};  // Bit per slot
+            std::atomic<unsigned int> stream_waiters_{0};
+            uint16_t stream_gen_[MAX_OPEN_STREAMS] = {};  // Of the slot's holder
+            std::mutex stream_mtx_;
+            std::condition_variable stream_cv_;
+
+            // Read cache. A fill from the device only lands if no write of
+            // the key (nor a DeleteRange) completed since the read was issued:
+            // writers bump the epoch of the key's stripe, readers compare it.
+            // Entries of an older generation (before a DeleteRange) are misses.
+            struct CacheStripe {
+                std::mutex mtx;
+                uint64_t epoch = 0;
+            };
+            static const int kCacheStripes = 64;
+            std::shared_ptr<ROCKSDB_NAMESPACE::Cache> cache_;
+            std::unique_ptr<CacheStripe[]> cache_stripes_;
+            std::atomic<uint64_t> cache_gen_{0};
+            std::unique_ptr<ExistenceFilter> filter_;
+            std::string filter_source_;     // How Open() got the filter
+            std::unique_ptr<ValueCompressor> zip_;  // compression only
+            // Process CPU time and wall clock at Open(), for the CPU per op
+            uint64_t open_cpu_ns_ = 0;
+            std::chrono::steady_clock::time_point open_time_;
 #ifdef THREAD_SAFE_ILSM
-            std::mutex ioctl_mtx;
-            std::mutex op_stat_mtx;
-            std::mutex passthru_stat_mtx;
             std::mutex report_mtx;
 #endif
 
+            Context *context();
+            std::unique_ptr<Transport> new_transport(unsigned int id);
+            void retire_context(Context *ctx);
+            static void fold_context(const Context &ctx, ReportData *d);
+            int put_op(const std::string &key, const std::string &value, PutCallback *done);
+            int _Write(const WriteBatch &batch);
+            uint32_t open_batch();
+            void close_batch(uint32_t id);
             inline int _Put(const std::string &key, const std::string &value);
+            void start_async();
+            void stop_async();
+            void async_worker();
+            void async_run(std::function<void()> op);
+            void start_combiner();
+            void stop_combiner();
+            bool combines(const std::string &key, const std::string &value) const;
+            int stage(const std::string &key, const std::string &value, PutCallback done);
+            void take_batch(Batch &b);
+            void write_batch(Batch &b);
+            int batch_put(const Batch &b);
+            void combine_barrier(const std::string *key);
+            void flusher();
+            void transfer_path(uint32_t value_size, bool &prp, bool &combi);
+            int put_value(const std::string &key, const std::string &value, bool use_prp, bool combi,
+                    bool compressed = false);
+            static uint32_t put_commands(size_t key_size, uint32_t value_size, bool prp, bool combi);
+            int unzip(const Slice &data, std::string &value);
+            int piggyback_transfer(uint16_t stream, std::string &spill, const void *data, uint32_t left);
+            int put_segments(const uint32_t *dw, const char *data, uint32_t len);
+            struct nvme_passthru_cmd bandslim_cmd(uint8_t opcode, const uint32_t *dw, bool raw);
+            int submit_batch(uint8_t opcode, std::vector<struct nvme_passthru_cmd> &cmds);
+            uint16_t open_stream();
+            void close_stream(uint16_t stream);
+            int encode_key(const std::string &key, uint32_t &cdw2, uint32_t &cdw3,
+                    uint32_t &cdw14, uint32_t &cdw15);
+            std::string key_spill(const std::string &key);
+            uint64_t probe_put(uint32_t len, bool prp, bool combi);
+            int _Delete(const std::string &key, const std::string *end);
+            CacheStripe &cache_stripe(const Slice &key);
+            ROCKSDB_NAMESPACE::Cache::Handle *cache_lookup(const Slice &key);
+            bool cache_get(const Slice &key, std::string &value);
+            bool cache_get(const Slice &key, void *buf, uint32_t buf_len, uint32_t &len);
+            uint64_t cache_epoch(const Slice &key);
+            void cache_fill(const Slice &key, const Slice &value, uint64_t epoch);
+            void cache_insert(const Slice &key, const Slice &value);
+            void cache_update(const Slice &key, const Slice *value);
+            void cache_clear();
+            void open_filter();
+            int rebuild_filter();
+            void close_filter();
+            bool filtered(const Slice &key);
             inline int _Get(const std::string &key, std::string &value);
+            int get_into(const std::string &key, void *data, uint32_t data_len, uint32_t &result);
+            int get_value(const std::string &key, std::string &value);
+            int get_chunks(const std::string &key, uint32_t ofs, uint32_t stored, std::string &value);
+            int _MultiGet(const std::vector<Slice> &keys, size_t first, size_t n,
+                    std::vector<std::string> *values, std::vector<int> *statuses);
             inline int _CreateIter(unsigned int &iter_id);
             inline int _Seek(const unsigned int iter_id, const std::string &key, std::string &value);
             inline int _Next(const unsigned int iter_id, std::string &value);
             inline int _DestroyIter(const unsigned int iter_id);
+            inline int submit(struct nvme_passthru_cmd &cmd, uint32_t dma_bytes);
             int nvme_passthru(uint8_t opcode,
                     uint8_t flags, uint16_t rsvd, uint32_t nsid,
                     uint32_t cdw2, uint32_t cdw3, uint32_t cdw10, uint32_t cdw11,
@@ -91,18 +548,15 @@ namespace iLSM {
             ////////////////////////////////////////////////////////////////
             /////////////////////////// BandSlim ///////////////////////////
             ////////////////////////////////////////////////////////////////
-            int nvme_passthru_bandslim(
-                    uint8_t opcode, uint8_t flags, uint16_t rsvd, uint32_t nsid, 
-                    uint32_t cdw2, uint32_t cdw3, uint64_t cdw4_5, uint64_t cdw6_7, 
-	            uint32_t cdw8, uint32_t cdw9, uint32_t cdw10, uint32_t cdw11,
-                    uint32_t cdw12, uint32_t cdw13, uint32_t cdw14, uint32_t cdw15,
-                    uint32_t &result);
+            // dw: the 16 dwords of the command (see bandslim_cmd())
+            int nvme_passthru_bandslim(uint8_t opcode, const uint32_t *dw, uint32_t &result);
             ////////////////////////////////////////////////////////////////
             /////////////////////////// BandSlim ///////////////////////////
             ////////////////////////////////////////////////////////////////
 
             void finishOp(const enum iLSMOp op, std::chrono::nanoseconds &d);
             void finishPassthru(const enum NvmeOpcode opcode, std::chrono::nanoseconds &d);
+            void account(uint32_t dma_bytes);
 
 #ifdef GET_FOR_SEEK_AND_NEXT_ILSM
             // For Iterator Using Get()
@@ -111,8 +565,21 @@ namespace iLSM {
             };
             
             struct _iterator iter[MAX_ITER_NUM];
-            unsigned long long numGetofSeek=0;
-            unsigned long long numGetofNext=0;
+#else
+            // Host side of a device iterator: the page of records the last
+            // ITER_SEEK/NEXT returned, served to Next() from memory
+            struct _iterator {
+                char *page = nullptr;
+                uint32_t page_len = 0;
+                uint32_t pos = 0;           // Offset of the next record to serve
+                uint32_t left = 0;          // # of records not served yet
+                std::string key;            // Key of the current record
+                ~_iterator() { free(page); }
+            };
+
+            struct _iterator iter[MAX_ITER_NUM];
+            int iter_fill(const unsigned int iter_id, const std::string *key);
+            int iter_read(const unsigned int iter_id, std::string &value);
 #endif
     };
 }
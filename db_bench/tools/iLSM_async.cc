@@ -0,0 +1,31 @@
+#include "iLSM_async.h"
+
+void iLSM::CompletionQueue::Post(std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> l(mtx_);
+        done_.push_back(std::move(fn));
+    }
+    cv_.notify_one();
+}
+
+size_t iLSM::CompletionQueue::Poll(std::chrono::microseconds timeout)
+{
+    std::deque<std::function<void()>> ready;
+    {
+        std::unique_lock<std::mutex> l(mtx_);
+        if (done_.empty() && timeout.count() > 0)
+            cv_.wait_for(l, timeout, [this] { return !done_.empty(); });
+        ready.swap(done_);
+    }
+    // Outside the lock: a completion may post (or start) more ops
+    for (auto &fn : ready)
+        fn();
+    return ready.size();
+}
+
+size_t iLSM::CompletionQueue::Pending()
+{
+    std::lock_guard<std::mutex> l(mtx_);
+    return done_.size();
+}
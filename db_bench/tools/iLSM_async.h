@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "rocksdb/slice.h"
+
+#if __cplusplus >= 202002L
+#include <coroutine>
+#endif
+
+namespace iLSM {
+    // Outcome of GetAsync(): status as Get() returns it (the value length,
+    // -2 if there is no such key, <0 on failure)
+    struct GetResult {
+        int status = -1;
+        std::string value;
+    };
+
+    // Outcome of MultiGetAsync(), as MultiGet() returns it
+    struct MultiGetResult {
+        int status = -1;
+        std::vector<std::string> values;
+        std::vector<int> statuses;
+    };
+
+    // Completions handed to one thread: the async ops post their callbacks
+    // here and an event loop runs them with Poll(), so callbacks (and the
+    // coroutines they resume) never run on a DB worker. Thread-safe.
+    class CompletionQueue {
+        public:
+            CompletionQueue() {}
+            CompletionQueue(const CompletionQueue &) = delete;
+            CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+            void Post(std::function<void()> fn);
+            // Runs the completions posted so far, first waiting up to timeout
+            // for one if there is none; returns how many ran
+            size_t Poll(std::chrono::microseconds timeout = std::chrono::microseconds(0));
+            size_t Pending();
+
+        private:
+            std::mutex mtx_;
+            std::condition_variable cv_;
+            std::deque<std::function<void()>> done_;
+    };
+
+#if __cplusplus >= 202002L
+    // co_await-able async op: start gets the function to call with the
+    // result. Whichever of the completion and the suspension comes second
+    // resumes the coroutine, so an op that completes at once (no async
+    // threads) does not suspend at all
+    template <class Result>
+    class Awaitable {
+        public:
+            typedef std::function<void(std::function<void(Result &)>)> Start;
+
+            explicit Awaitable(Start start) : start_(std::move(start)) {}
+
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> h) {
+                handle_ = h;
+                start_([this](Result &r) {
+                    result_ = std::move(r);
+                    if (done_.exchange(true))
+                        handle_.resume();
+                });
+                return !done_.exchange(true);
+            }
+            Result await_resume() { return std::move(result_); }
+
+        private:
+            Start start_;
+            Result result_{};
+            std::atomic<bool> done_{false};
+            std::coroutine_handle<> handle_;
+    };
+
+    // co_await AsyncPut(db, key, value, &cq) etc. on a DB or ShardedDB. With
+    // cq the coroutine resumes on the thread polling cq, else on the worker
+    // that ran the op
+    template <class DBType>
+    Awaitable<int> AsyncPut(DBType &db, std::string key, std::string value, CompletionQueue *cq = nullptr)
+    {
+        return Awaitable<int>([&db, key = std::move(key), value = std::move(value), cq](
+                    std::function<void(int &)> done) {
+            db.PutAsync(key, value, [done](int status) { done(status); }, cq);
+        });
+    }
+
+    template <class DBType>
+    Awaitable<GetResult> AsyncGet(DBType &db, std::string key, CompletionQueue *cq = nullptr)
+    {
+        return Awaitable<GetResult>([&db, key = std::move(key), cq](std::function<void(GetResult &)> done) {
+            db.GetAsync(key, done, cq);
+        });
+    }
+
+    template <class DBType>
+    Awaitable<MultiGetResult> AsyncMultiGet(DBType &db, const std::vector<ROCKSDB_NAMESPACE::Slice> &keys,
+            CompletionQueue *cq = nullptr)
+    {
+        // Slices of the caller: MultiGetAsync() copies them when it is called
+        return Awaitable<MultiGetResult>([&db, &keys, cq](std::function<void(MultiGetResult &)> done) {
+            db.MultiGetAsync(keys, done, cq);
+        });
+    }
+#endif
+}
@@ -0,0 +1,58 @@
+#include "iLSM_buffer.h"
+#include <stdlib.h>
+
+iLSM::BufferPool::~BufferPool()
+{
+    for (int i = 0; i < kNumClasses; i++) {
+        for (void *buf : free_[i])
+            free(buf);
+        free_[i].clear();
+    }
+}
+
+// Smallest class holding len bytes, -1 if larger than the biggest class
+int iLSM::BufferPool::size_class(size_t len)
+{
+    size_t sz = kPageSize;
+    for (int i = 0; i < kNumClasses; i++, sz <<= 1) {
+        if (len <= sz)
+            return i;
+    }
+    return -1;
+}
+
+void *iLSM::BufferPool::Allocate(size_t len, size_t *cap)
+{
+    void *buf = NULL;
+    int cls = size_class(len);
+    allocs_++;
+
+    if (cls < 0) {
+        // Oversized: exact page-rounded allocation, never cached
+        *cap = ((len + kPageSize - 1) / kPageSize) * kPageSize;
+        if (posix_memalign(&buf, kPageSize, *cap))
+            return NULL;
+        return buf;
+    }
+
+    *cap = kPageSize << cls;
+    if (!free_[cls].empty()) {
+        buf = free_[cls].back();
+        free_[cls].pop_back();
+        reuses_++;
+        return buf;
+    }
+    if (posix_memalign(&buf, kPageSize, *cap))
+        return NULL;
+    return buf;
+}
+
+void iLSM::BufferPool::Release(void *buf, size_t cap)
+{
+    int cls = size_class(cap);
+    if (cls < 0 || (kPageSize << cls) != cap || free_[cls].size() >= kMaxFreePerClass) {
+        free(buf);
+        return;
+    }
+    free_[cls].push_back(buf);
+}
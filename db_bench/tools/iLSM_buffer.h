@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace iLSM {
+    // Page-aligned DMA buffers in power-of-two size classes (4KB .. 512KB),
+    // recycled across commands instead of a posix_memalign/free per call.
+    // Not thread-safe: every submission context owns its own pool.
+    class BufferPool {
+        public:
+            static const size_t kPageSize = 4096;
+            static const size_t kMaxSize = 524288;       // MDTS
+            static const int kNumClasses = 8;            // 4KB << 0..7
+            static const size_t kMaxFreePerClass = 16;
+
+            BufferPool() : allocs_(0), reuses_(0) {}
+            ~BufferPool();
+            BufferPool(const BufferPool &) = delete;
+            BufferPool &operator=(const BufferPool &) = delete;
+
+            // Returns a buffer of at least len bytes and its capacity in *cap
+            void *Allocate(size_t len, size_t *cap);
+            void Release(void *buf, size_t cap);
+
+            unsigned long long Allocs() const { return allocs_; }
+            unsigned long long Reuses() const { return reuses_; }
+
+        private:
+            static int size_class(size_t len);
+
+            std::vector<void*> free_[kNumClasses];
+            unsigned long long allocs_;
+            unsigned long long reuses_;
+    };
+
+    // Scoped buffer taken from a pool, handed back on destruction
+    class DmaBuffer {
+        public:
+            DmaBuffer(BufferPool &pool, size_t len) : pool_(pool), cap_(0) {
+                data_ = pool_.Allocate(len, &cap_);
+            }
+            ~DmaBuffer() {
+                if (data_)
+                    pool_.Release(data_, cap_);
+            }
+            DmaBuffer(const DmaBuffer &) = delete;
+            DmaBuffer &operator=(const DmaBuffer &) = delete;
+
+            void *data() const { return data_; }
+            size_t size() const { return cap_; }
+
+        private:
+            BufferPool &pool_;
+            void *data_;
+            size_t cap_;
+    };
+}
@@ -0,0 +1,64 @@
+#include "iLSM_compress.h"
+
+using namespace ROCKSDB_NAMESPACE;
+
+iLSM::ValueCompressor::ValueCompressor(CompressionType type, const std::string &dict)
+    : type_(type),
+      cdict_(dict, type, CompressionOptions::kDefaultCompressionLevel),
+      udict_(dict, type == kZSTD || type == kZSTDNotFinalCompression)
+{
+    opts_.max_dict_bytes = dict.size();
+}
+
+bool iLSM::ValueCompressor::Supported(CompressionType type)
+{
+    return type != kNoCompression && type != kDisableCompressionOption &&
+        CompressionTypeSupported(type);
+}
+
+bool iLSM::ValueCompressor::Compress(const Slice &value, std::string *out)
+{
+    std::unique_ptr<CompressionContext> ctx;
+    {
+        std::lock_guard<std::mutex> l(mtx_);
+        if (!idle_.empty()) {
+            ctx = std::move(idle_.back());
+            idle_.pop_back();
+        }
+    }
+    if (!ctx)
+        ctx.reset(new CompressionContext(type_));
+
+    out->clear();
+    CompressionInfo info(opts_, *ctx, cdict_, type_, 0);
+    bool ok = CompressData(value, info, kFormatVersion, out) && out->size() < value.size();
+
+    std::lock_guard<std::mutex> l(mtx_);
+    idle_.push_back(std::move(ctx));
+    return ok;
+}
+
+int iLSM::ValueCompressor::Uncompress(const char *data, size_t n, std::string *out) const
+{
+    UncompressionContext ctx(type_);
+    UncompressionInfo info(ctx, udict_, type_);
+    size_t size = 0;
+    CacheAllocationPtr raw = UncompressData(info, data, n, &size, kFormatVersion);
+    if (!raw)
+        return -1;
+    out->assign(raw.get(), size);
+    return 0;
+}
+
+std::string iLSM::ValueCompressor::TrainDict(const std::vector<std::string> &samples, size_t max_bytes)
+{
+    if (!ZSTD_TrainDictionarySupported() || samples.empty() || !max_bytes)
+        return std::string();
+    std::string all;
+    std::vector<size_t> lens;
+    for (const std::string &s : samples) {
+        all += s;
+        lens.push_back(s.size());
+    }
+    return ZSTD_TrainDictionary(all, lens, max_bytes);
+}
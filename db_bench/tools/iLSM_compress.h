@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "rocksdb/compression_type.h"
+#include "rocksdb/slice.h"
+#include "util/compression.h"
+
+namespace iLSM {
+    // Per-value compression of put values by the codecs of util/compression.h
+    // (LZ4, ZSTD, ... as built in), optionally with a dictionary. A value is
+    // compressed on its own, in compress format 2 (the uncompressed size
+    // leads), so any compressor of the same type and dictionary reads it back.
+    // Compress() and Uncompress() may run on several threads at once.
+    class ValueCompressor {
+        public:
+            ValueCompressor(ROCKSDB_NAMESPACE::CompressionType type, const std::string &dict);
+            ValueCompressor(const ValueCompressor &) = delete;
+            ValueCompressor &operator=(const ValueCompressor &) = delete;
+
+            // Whether this build can compress with type
+            static bool Supported(ROCKSDB_NAMESPACE::CompressionType type);
+            ROCKSDB_NAMESPACE::CompressionType Type() const { return type_; }
+
+            // Compressed value in out; false if the codec failed or the
+            // value did not shrink
+            bool Compress(const ROCKSDB_NAMESPACE::Slice &value, std::string *out);
+            // 0, or -1 if data is not a value compressed this way
+            int Uncompress(const char *data, size_t n, std::string *out) const;
+
+            // Dictionary of up to max_bytes trained on samples (ZSTD only;
+            // empty if this build cannot train one)
+            static std::string TrainDict(const std::vector<std::string> &samples, size_t max_bytes);
+
+        private:
+            static const uint32_t kFormatVersion = 2;
+
+            ROCKSDB_NAMESPACE::CompressionType type_;
+            ROCKSDB_NAMESPACE::CompressionOptions opts_;
+            ROCKSDB_NAMESPACE::CompressionDict cdict_;
+            ROCKSDB_NAMESPACE::UncompressionDict udict_;
+            // Idle codec contexts (a ZSTD context serves one call at a time)
+            std::mutex mtx_;
+            std::vector<std::unique_ptr<ROCKSDB_NAMESPACE::CompressionContext>> idle_;
+    };
+}
@@ -0,0 +1,95 @@
+#include "iLSM_filter.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <cstring>
+#include <limits>
+
+const uint64_t FILTER_MAGIC = 0x313046454d534c69ULL;   // "iLSMEF01" (LE)
+const size_t FILTER_ALIGN = 64;                         // Cache line, >= a bloom block
+
+iLSM::ExistenceFilter::Memory::~Memory()
+{
+    free(data);
+}
+
+char *iLSM::ExistenceFilter::Memory::Allocate(size_t bytes)
+{
+    return AllocateAligned(bytes);
+}
+
+char *iLSM::ExistenceFilter::Memory::AllocateAligned(size_t bytes, size_t huge_page_size,
+        ROCKSDB_NAMESPACE::Logger *logger)
+{
+    (void)huge_page_size;
+    (void)logger;
+    // DynamicBloom allocates once; an aligned block makes it use the block
+    // from its first byte
+    void *p = NULL;
+    if (data || posix_memalign(&p, FILTER_ALIGN, (bytes + FILTER_ALIGN - 1) / FILTER_ALIGN * FILTER_ALIGN))
+        abort();
+    data = (char*)p;
+    size = bytes;
+    return data;
+}
+
+iLSM::ExistenceFilter::ExistenceFilter(size_t keys, uint32_t bits_per_key)
+{
+    uint64_t bits = (uint64_t)keys * (bits_per_key ? bits_per_key : 1);
+    uint64_t max_bits = std::numeric_limits<uint32_t>::max() / 512 * 512;
+    if (bits < 512)
+        bits = 512;
+    total_bits_ = bits > max_bits ? max_bits : bits;
+    bloom_.reset(new ROCKSDB_NAMESPACE::DynamicBloom(&mem_, total_bits_, kNumProbes));
+}
+
+void iLSM::ExistenceFilter::Clear()
+{
+    memset(mem_.data, 0, mem_.size);
+}
+
+static uint32_t hash_probe()
+{
+    return ROCKSDB_NAMESPACE::BloomHash(ROCKSDB_NAMESPACE::Slice("iLSM existence filter"));
+}
+
+int iLSM::ExistenceFilter::Load(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return errno == ENOENT ? -2 : -1;
+    Header h;
+    int ret = -1;
+    if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == FILTER_MAGIC &&
+            h.total_bits == total_bits_ && h.num_probes == kNumProbes &&
+            h.bytes == mem_.size && h.hash_probe == hash_probe() &&
+            fread(mem_.data, 1, mem_.size, f) == mem_.size)
+        ret = 0;
+    fclose(f);
+    if (ret)
+        Clear();
+    return ret;
+}
+
+int iLSM::ExistenceFilter::Save(const std::string &path) const
+{
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return -1;
+    Header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = FILTER_MAGIC;
+    h.total_bits = total_bits_;
+    h.num_probes = kNumProbes;
+    h.bytes = mem_.size;
+    h.hash_probe = hash_probe();
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(mem_.data, 1, mem_.size, f) == mem_.size;
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "memory/allocator.h"
+#include "rocksdb/slice.h"
+#include "util/dynamic_bloom.h"
+
+namespace iLSM {
+    // Host copy of "which keys may be on the device": a DynamicBloom over
+    // every key put through the DB. A key it rules out was never written,
+    // so a lookup of it needs no command. Keys are never removed (a deleted
+    // key stays a false positive). Add() and MayContain() are lock-free.
+    class ExistenceFilter {
+        public:
+            static const uint32_t kNumProbes = 6;
+
+            // Room for keys keys at bits_per_key each (capped at 2^32 bits)
+            ExistenceFilter(size_t keys, uint32_t bits_per_key);
+            ExistenceFilter(const ExistenceFilter &) = delete;
+            ExistenceFilter &operator=(const ExistenceFilter &) = delete;
+
+            void Add(const ROCKSDB_NAMESPACE::Slice &key) { bloom_->AddConcurrently(key); }
+            bool MayContain(const ROCKSDB_NAMESPACE::Slice &key) const { return bloom_->MayContain(key); }
+            // Drops every key
+            void Clear();
+
+            uint32_t Bits() const { return total_bits_; }
+            size_t MemoryUsage() const { return mem_.size; }
+
+            // The file holds a header (geometry and a probe of the hash
+            // function) and the filter bits. Load() returns 0, -2 if there is
+            // no file, or -1 if it was written by a filter of another geometry
+            // or hash, or is cut short. Save() replaces the file atomically.
+            int Load(const std::string &path);
+            int Save(const std::string &path) const;
+
+        private:
+            // Hands DynamicBloom the one aligned block it asks for, so the
+            // bits can be read and written as a whole
+            struct Memory : public ROCKSDB_NAMESPACE::Allocator {
+                char *data = nullptr;
+                size_t size = 0;
+                ~Memory() override;
+                char *Allocate(size_t bytes) override;
+                char *AllocateAligned(size_t bytes, size_t huge_page_size = 0,
+                        ROCKSDB_NAMESPACE::Logger *logger = nullptr) override;
+                size_t BlockSize() const override { return 0; }
+            };
+
+            struct Header {
+                uint64_t magic;
+                uint32_t total_bits;
+                uint32_t num_probes;
+                uint64_t bytes;             // Of filter bits that follow
+                uint32_t hash_probe;        // BloomHash() of a fixed key
+                uint32_t rsvd;
+            };
+
+            uint32_t total_bits_;
+            Memory mem_;
+            std::unique_ptr<ROCKSDB_NAMESPACE::DynamicBloom> bloom_;
+    };
+}
@@ -0,0 +1,66 @@
+#include "iLSM_histogram.h"
+
+iLSM::Histogram::Histogram() : sum_(0), max_(0)
+{
+    for (int i = 0; i < kNumBuckets; i++)
+        buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+uint64_t iLSM::Histogram::BucketLower(int idx)
+{
+    if (idx < kSub)
+        return idx;
+    int shift = idx / kSub - 1;
+    return (uint64_t)(kSub + idx % kSub) << shift;
+}
+
+uint64_t iLSM::Histogram::BucketWidth(int idx)
+{
+    if (idx < kSub)
+        return 1;
+    return 1ull << (idx / kSub - 1);
+}
+
+void iLSM::HistogramSnapshot::Merge(const Histogram &h)
+{
+    // Count from the buckets themselves, so it matches them while the
+    // owner keeps adding
+    for (int i = 0; i < Histogram::kNumBuckets; i++) {
+        uint64_t n = h.buckets_[i].load(std::memory_order_relaxed);
+        buckets_[i] += n;
+        count_ += n;
+    }
+    sum_ += h.sum_.load(std::memory_order_relaxed);
+    uint64_t max = h.max_.load(std::memory_order_relaxed);
+    if (max > max_)
+        max_ = max;
+}
+
+void iLSM::HistogramSnapshot::Merge(const HistogramSnapshot &s)
+{
+    for (int i = 0; i < Histogram::kNumBuckets; i++)
+        buckets_[i] += s.buckets_[i];
+    count_ += s.count_;
+    sum_ += s.sum_;
+    if (s.max_ > max_)
+        max_ = s.max_;
+}
+
+double iLSM::HistogramSnapshot::Percentile(double p) const
+{
+    if (!count_)
+        return 0;
+    double target = count_ * p / 100;
+    uint64_t cum = 0;
+    for (int i = 0; i < Histogram::kNumBuckets; i++) {
+        if (!buckets_[i])
+            continue;
+        if (cum + buckets_[i] >= target) {
+            double r = Histogram::BucketLower(i) +
+                Histogram::BucketWidth(i) * (target - cum) / buckets_[i];
+            return r < max_ ? r : max_;
+        }
+        cum += buckets_[i];
+    }
+    return max_;
+}
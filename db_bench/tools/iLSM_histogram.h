@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace iLSM {
+    // Add for a counter with a single writer: a relaxed load and store, no
+    // locked read-modify-write. Readers on other threads load it relaxed
+    inline void Bump(std::atomic<uint64_t> &a, uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // A Bump()ed counter: written by the owning thread, read by Report()
+    class Counter {
+        public:
+            Counter() : v_(0) {}
+            Counter(const Counter &) = delete;
+            Counter &operator=(const Counter &) = delete;
+
+            // Owner thread only
+            Counter &operator+=(uint64_t n) { Bump(v_, n); return *this; }
+            void operator++(int) { Bump(v_, 1); }
+            Counter &operator=(uint64_t n) { v_.store(n, std::memory_order_relaxed); return *this; }
+
+            operator uint64_t() const { return v_.load(std::memory_order_relaxed); }
+
+        private:
+            std::atomic<uint64_t> v_;
+    };
+
+    // Log-linear histogram (HdrHistogram-like): values below 16 get a
+    // bucket each, above that every power of two is split into 16 linear
+    // sub-buckets, so a percentile is off by at most 1/16 of its value.
+    // One writer (the owning thread) and lock-free readers: the counters
+    // are relaxed atomics, summed into a HistogramSnapshot by Report().
+    class Histogram {
+        public:
+            static const int kSubBits = 4;
+            static const int kSub = 1 << kSubBits;
+            static const int kNumBuckets = (64 - kSubBits + 1) * kSub;
+
+            Histogram();
+            Histogram(const Histogram &) = delete;
+            Histogram &operator=(const Histogram &) = delete;
+
+            // Owner thread only
+            void Add(uint64_t value) {
+                Bump(buckets_[Bucket(value)], 1);
+                Bump(sum_, value);
+                if (value > max_.load(std::memory_order_relaxed))
+                    max_.store(value, std::memory_order_relaxed);
+            }
+
+            static int Bucket(uint64_t value) {
+                if (value < (uint64_t)kSub)
+                    return (int)value;
+                int shift = 63 - __builtin_clzll(value) - kSubBits;
+                return (shift + 1) * kSub + (int)((value >> shift) & (kSub - 1));
+            }
+            // [lower, lower + width) covered by bucket idx
+            static uint64_t BucketLower(int idx);
+            static uint64_t BucketWidth(int idx);
+
+        private:
+            friend class HistogramSnapshot;
+
+            std::atomic<uint64_t> buckets_[kNumBuckets];
+            std::atomic<uint64_t> sum_;
+            std::atomic<uint64_t> max_;
+    };
+
+    // Plain sum of per-thread histograms, taken at report time
+    class HistogramSnapshot {
+        public:
+            HistogramSnapshot() : buckets_(Histogram::kNumBuckets, 0), count_(0), sum_(0), max_(0) {}
+
+            void Merge(const Histogram &h);
+            void Merge(const HistogramSnapshot &s);
+            uint64_t Count() const { return count_; }
+            uint64_t Sum() const { return sum_; }
+            uint64_t Max() const { return max_; }
+            double Average() const { return count_ ? (double)sum_ / count_ : 0; }
+            // p in [0, 100], interpolated within the bucket
+            double Percentile(double p) const;
+
+        private:
+            std::vector<uint64_t> buckets_;
+            uint64_t count_;
+            uint64_t sum_;
+            uint64_t max_;
+    };
+}
@@ -1,326 +1,775 @@
-#include "iLSM.h"
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/ioctl.h>
-#include <linux/nvme_ioctl.h>
-#include <fcntl.h>
+#include "iLSM_mock.h"
+#include "../../firmware/nvme_kv_payload.h"
 #include <cstring>
-#include <cstdint>
-#include <stdlib.h>
-
-#include <iostream>
-#include <cstdio>
-#include <inttypes.h>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
+// Opcodes as named in firmware/nvme_io_cmd.c
+enum {
+    IO_NVM_KV_PUT                   = 0xA0,
+    IO_NVM_KV_GET                   = 0xA1,
+    IO_NVM_KV_DELETE                = 0xA2,
+    IO_NVM_KV_ITER_CREATE_ITER      = 0xA3,
+    IO_NVM_KV_ITER_SEEK             = 0xA4,
+    IO_NVM_KV_ITER_NEXT             = 0xA5,
+    IO_NVM_KV_ITER_DESTROY_ITER     = 0xA6,
+    IO_NVM_KV_BANDSLIM_WRITE        = 0xA7,
+    IO_NVM_KV_LAST                  = 0xA8,
+    IO_NVM_KV_BANDSLIM_TRANSFER     = 0xA9,
+    IO_NVM_KV_MULTI_GET             = 0xAA,
+    IO_NVM_KV_BATCH_PUT             = 0xAB,
+    IO_NVM_KV_WRITE_BATCH           = 0xAC,
+};
+
+// NVMe status codes
+const int NVME_SC_INVALID_OPCODE = 0x1;
+const int NVME_SC_INVALID_FIELD = 0x2;
+const int KV_NO_SUCH_KEY = 0x7C1;
+
+// CDW11 flag of PUT: the sub-page tail follows by BANDSLIM_TRANSFERs
+const uint32_t KV_PUT_COMBI = 1u << 31;
+// CDW11 of PUT: segment n (15:0) of a value past MDTS, bytes [n x
+// SEGMENT_BYTES, n x SEGMENT_BYTES + SEGMENT_BYTES) of its PRP part
+const uint32_t KV_PUT_SEGMENT = 1u << 30;
+const uint32_t SEGMENT_INDEX_MASK = 0xFFFF;
+const uint32_t SEGMENT_BYTES = 524288;  // MDTS
+// CDW11 flag of DELETE: tombstone of [key, end key), end key size in CDW10
+// (23:16), the end key in the Transfer stream after the rest of the key
+const uint32_t KV_DELETE_RANGE = 1u << 31;
+const uint32_t END_KEY_SHIFT = 16;
+
+// Key layout: up to KEY_INLINE bytes in CDW2 CDW3 CDW14 CDW15, key size in
+// CDW10 (31:24) next to the value size (23:0)
+const uint32_t KEY_INLINE = 16;
+const uint32_t KEY_SIZE_SHIFT = 24;
+const uint32_t VALUE_SIZE_MASK = 0xFFFFFF;
 
-const unsigned int PAGE_SIZE = 4096;
-const unsigned int MAX_BUFLEN = 4*1024; // 1MB
-const unsigned int NSID = 1;
+const uint32_t BYTES_PER_NVME_BLOCK = 4096;
+const uint32_t BYTES_PER_DATA_REGION_OF_SLICE = 16384;
+const uint32_t BYTES_PER_SECTOR = 512;
+const uint32_t SQE_BYTES = 64;
+const uint32_t CQE_BYTES = 16;
+const unsigned int MAX_ITERATORS = 100;
+
+// Payload-bearing dwords: the layout firmware/nvme_kv_payload.h shares with
+// the host (Transfer: CDW2 is the tag)
+const uint32_t WRITE_PAYLOAD = KV_WRITE_PAYLOAD;
+const uint32_t TRANSFER_PAYLOAD = KV_TRANSFER_PAYLOAD;
+// Stream id of a PUT/WRITE (CDW13) and tag of a Transfer (CDW2)
+#define STREAM_ID(tag)  ((tag) >> 16)
+#define STREAM_SEQ(tag) ((tag) & 0xFFFF)
+
+// Sleeps through most of a long wait, like a thread blocked in the
+// passthru ioctl, and spins the rest for accuracy
+static void wait_until(chrono::steady_clock::time_point until)
+{
+    const auto spin = chrono::microseconds(100);
+    if (until - chrono::steady_clock::now() > 2 * spin)
+        this_thread::sleep_until(until - spin);
+    while (chrono::steady_clock::now() < until);
+}
 
-int iLSM::DB::Open(const std::string &dev)
+iLSM::Emulator::Emulator(const EmulatorOptions &options)
+    : options_(options), busy_until_(options.channels ? options.channels : 1)
 {
+    stats_.vlog_slices = 1;
+}
+
+int iLSM::Emulator::Execute(struct nvme_passthru_cmd &cmd)
+{
+    return execute(cmd, options_.cmd_latency_ns);
+}
+
+// All commands are queued at once: the first pays the full per-command cost,
+// the ones behind it overlap with it (pipelined_cmd_latency_ns)
+int iLSM::Emulator::ExecuteBatch(struct nvme_passthru_cmd *cmds, unsigned int n)
+{
+    uint64_t queued_ns = options_.pipelined_cmd_latency_ns ?
+        options_.pipelined_cmd_latency_ns : options_.cmd_latency_ns;
+    int ret = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        // Worst case arrival order: last fragment first
+        unsigned int j = options_.reverse_batches ? n - 1 - i : i;
+        int err = execute(cmds[j], i ? queued_ns : options_.cmd_latency_ns);
+        if (err && !ret)
+            ret = err;
+    }
+    return ret;
+}
+
+int iLSM::Emulator::execute(struct nvme_passthru_cmd &cmd, uint64_t latency_ns)
+{
+    // Rebuild the 16 command dwords the device would fetch
+    uint32_t dw[16];
+    memset(dw, 0, sizeof(dw));
+    dw[0] = cmd.opcode | (cmd.flags << 8);
+    dw[1] = cmd.nsid;
+    dw[2] = cmd.cdw2;
+    dw[3] = cmd.cdw3;
+    dw[4] = (uint32_t)cmd.metadata;
+    dw[5] = (uint32_t)(cmd.metadata >> 32);
+    dw[6] = (uint32_t)cmd.addr;
+    dw[7] = (uint32_t)(cmd.addr >> 32);
+    dw[8] = cmd.metadata_len;
+    dw[9] = cmd.data_len;
+    dw[10] = cmd.cdw10;
+    dw[11] = cmd.cdw11;
+    dw[12] = cmd.cdw12;
+    dw[13] = cmd.cdw13;
+    dw[14] = cmd.cdw14;
+    dw[15] = cmd.cdw15;
+
+    unique_lock<mutex> l(mtx_);
+    auto st = chrono::steady_clock::now();
+    cmd.result = 0;
+    dma_ = 0;
+
     int err;
-    err = open(dev.c_str(), O_RDONLY);
-    if (err < 0)
-        return -1; // fail to open
-    fd_ = err;
-    struct stat nvme_stat;
-    err = fstat(fd_, &nvme_stat);
-    if (err < 0)
-        return -1;
-    if (!S_ISCHR(nvme_stat.st_mode) && !S_ISBLK(nvme_stat.st_mode))
-        return -1;
+    switch (cmd.opcode) {
+        case IO_NVM_KV_PUT:
+            err = put(dw, cmd);
+            break;
+        case IO_NVM_KV_BANDSLIM_WRITE:
+            err = bandslim_write(dw, cmd);
+            break;
+        case IO_NVM_KV_BANDSLIM_TRANSFER:
+            err = bandslim_transfer(dw, cmd);
+            break;
+        case IO_NVM_KV_DELETE:
+            err = kv_delete(dw, cmd);
+            break;
+        case IO_NVM_KV_GET:
+            err = get(dw, cmd);
+            break;
+        case IO_NVM_KV_MULTI_GET:
+            err = multi_get(cmd);
+            break;
+        case IO_NVM_KV_BATCH_PUT:
+            err = batch_put(cmd);
+            break;
+        case IO_NVM_KV_WRITE_BATCH:
+            err = write_batch(cmd);
+            break;
+        case IO_NVM_KV_ITER_CREATE_ITER:
+            err = iter_create(cmd);
+            break;
+        case IO_NVM_KV_ITER_SEEK:
+            err = iter_seek(dw, cmd);
+            break;
+        case IO_NVM_KV_ITER_NEXT:
+            err = iter_next(dw, cmd);
+            break;
+        case IO_NVM_KV_ITER_DESTROY_ITER:
+            err = iter_destroy(dw, cmd);
+            break;
+        case IO_NVM_KV_LAST:
+            // # of used sectors (space amplification)
+            cmd.result = ((stats_.vlog_slices - 1) * BYTES_PER_DATA_REGION_OF_SLICE +
+                    vlog_offset_ + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+            err = 0;
+            break;
+        default:
+            err = NVME_SC_INVALID_OPCODE;
+    }
+
+    // Latency model: fixed per-command cost + bytes on the interconnect
+    stats_.commands++;
+    stats_.cmd_bytes += SQE_BYTES;
+    stats_.cpl_bytes += CQE_BYTES;
+    stats_.dma_bytes += dma_;
+    uint64_t ns = latency_ns;
+    if (options_.pcie_mbps)
+        ns += (SQE_BYTES + CQE_BYTES + dma_) * 1000 / options_.pcie_mbps;
+    // On the channel free first, from arrival or once it is free
+    auto channel = busy_until_.begin();
+    for (auto it = busy_until_.begin(); it != busy_until_.end(); ++it) {
+        if (*it < *channel)
+            channel = it;
+    }
+    auto done = (*channel > st ? *channel : st) + chrono::nanoseconds(ns);
+    *channel = done;
+    l.unlock();
+    wait_until(done);
+    return err;
+}
+
+// PRP-based DMA (handle_nvme_io_kv_put)
+// Inline part of the key; *spill gets the word-padded size of the rest
+static bool decode_key(const uint32_t *dw, string *key, uint32_t *spill)
+{
+    uint32_t key_size = dw[10] >> KEY_SIZE_SHIFT;
+    if (!key_size)
+        return false;
+    uint32_t kdw[4] = {dw[2], dw[3], dw[14], dw[15]};
+    key->assign((const char*)kdw, key_size < KEY_INLINE ? key_size : KEY_INLINE);
+    *spill = key_size > KEY_INLINE ? (key_size - KEY_INLINE + 3) / 4 * 4 : 0;
+    return true;
+}
+
+// Reads key the way get/seek address it: the rest of a long key heads the buffer
+static bool read_key(const uint32_t *dw, const struct nvme_passthru_cmd &cmd, string *key)
+{
+    uint32_t spill;
+    if (!decode_key(dw, key, &spill))
+        return false;
+    if (spill) {
+        if (!cmd.addr || cmd.data_len < spill)
+            return false;
+        key->append((const char*)(uintptr_t)cmd.addr, (dw[10] >> KEY_SIZE_SHIFT) - KEY_INLINE);
+    }
+    return true;
+}
+
+int iLSM::Emulator::put(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
+{
+    uint32_t len = dw[10] & VALUE_SIZE_MASK;
+    uint32_t total_dma_size;
+    if (!len)
+        return NVME_SC_INVALID_FIELD;
+
+    if (dw[11] & KV_PUT_COMBI) {
+        // Whole pages by DMA, the sub-page tail follows by piggybacking
+        total_dma_size = ((len - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+        if (total_dma_size < BYTES_PER_NVME_BLOCK)
+            total_dma_size = BYTES_PER_NVME_BLOCK;
+    } else {
+        total_dma_size = ((len - 1) / BYTES_PER_NVME_BLOCK + 1) * BYTES_PER_NVME_BLOCK;
+    }
+    uint32_t prp_bytes = len < total_dma_size ? len : total_dma_size;
+    if (dw[11] & KV_PUT_SEGMENT)
+        return put_segment(dw, cmd, len, prp_bytes);
+    if (!cmd.addr || cmd.data_len < total_dma_size)
+        return NVME_SC_INVALID_FIELD;
+
+    Stream st;
+    if (!open_stream(dw, &st))
+        return NVME_SC_INVALID_FIELD;
+    st.value.assign((const char*)(uintptr_t)cmd.addr, prp_bytes);
+    dma_ += total_dma_size;
+
+    vlog_dma(total_dma_size / BYTES_PER_NVME_BLOCK, prp_bytes);
+    if (len > prp_bytes)
+        vlog_reserve(len - prp_bytes);
+    add_stream(dw[13], st, len);
+
+    cmd.result = len;
     return 0;
 }
 
-int iLSM::DB::Put(const std::string &key, const std::string &value)
+// Streaming put: segment n lands at n x SEGMENT_BYTES of the PRP part
+// (prp_bytes of the len-byte value), whatever order the segments come in. The
+// first one opens the pair, which completes once all segments and its
+// Transfer stream are in
+int iLSM::Emulator::put_segment(const uint32_t *dw, struct nvme_passthru_cmd &cmd, uint32_t len,
+        uint32_t prp_bytes)
 {
-    void *data = NULL;
-    unsigned int data_len = value.size();
-    unsigned int nlb = ((data_len-1)/PAGE_SIZE); 
-    data_len = (nlb+1) * PAGE_SIZE;
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
+    uint32_t seg = dw[11] & SEGMENT_INDEX_MASK;
+    uint32_t ofs = seg * SEGMENT_BYTES;
+    if (ofs >= prp_bytes)
+        return NVME_SC_INVALID_FIELD;
+    uint32_t n = prp_bytes - ofs < SEGMENT_BYTES ? prp_bytes - ofs : SEGMENT_BYTES;
+    uint32_t pages = (n + BYTES_PER_NVME_BLOCK - 1) / BYTES_PER_NVME_BLOCK;
+    if (!cmd.addr || cmd.data_len < pages * BYTES_PER_NVME_BLOCK)
+        return NVME_SC_INVALID_FIELD;
+
+    uint32_t id = dw[13] & 0xFFFF;
+    uint32_t segments = (prp_bytes - 1) / SEGMENT_BYTES + 1;
+    auto it = streams_.find(id % MAX_OPEN_STREAMS);
+    // A stream left open by a failed put (or of another id in the slot) is
+    // replaced
+    if (it == streams_.end() || it->second.id != id || it->second.segments.size() != segments ||
+            it->second.value.size() != prp_bytes || it->second.segments[seg]) {
+        Stream st;
+        if (!open_stream(dw, &st))
+            return NVME_SC_INVALID_FIELD;
+        st.value.assign(prp_bytes, 0);
+        st.segments.assign(segments, false);
+        st.segments_left = segments;
+        uint32_t stream_len = st.spill + (len - prp_bytes);
+        st.data.assign(stream_len, 0);
+        st.seen.assign((stream_len + TRANSFER_PAYLOAD - 1) / TRANSFER_PAYLOAD, false);
+        st.id = id;
+        streams_[id % MAX_OPEN_STREAMS] = std::move(st);
+        it = streams_.find(id % MAX_OPEN_STREAMS);
     }
-    memcpy(data, value.c_str(), value.size());
-    int err;
-    uint32_t result;
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    memcpy(&cdw10, key.c_str(), 4);
-    cdw12 = 0 | (0xFFFF & nlb);
-    cdw13 = value.size();
-    err = nvme_passthru(NVME_CMD_KV_PUT, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-            data_len, data, result);
-    free(data);
-    if (err < 0) {
-        return -1;
-    } else if (result != 0) {
-        return -1;
+    Stream &st = it->second;
+
+    memcpy(&st.value[ofs], (const char*)(uintptr_t)cmd.addr, n);
+    dma_ += pages * BYTES_PER_NVME_BLOCK;
+    vlog_dma(pages, n);
+    st.segments[seg] = true;
+    if (--st.segments_left == 0) {
+        if (len > prp_bytes)
+            vlog_reserve(len - prp_bytes);
+        if (st.received == st.seen.size()) {
+            finish_stream(st);
+            streams_.erase(it);
+        }
     }
+    cmd.result = len;
     return 0;
 }
 
-int iLSM::DB::Seek(const unsigned int iter_id, const std::string &key, std::string &value)
+// Write command (handle_nvme_io_bandslim_write)
+int iLSM::Emulator::bandslim_write(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
 {
-    void *data = NULL;
-    unsigned int data_len = MAX_BUFLEN;
-    unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
+    uint32_t len = dw[10] & VALUE_SIZE_MASK;
+    Stream st;
+    if (!len || !open_stream(dw, &st))
+        return NVME_SC_INVALID_FIELD;
+    // Packed as a vLog record: header and value, no padding
+    if (!vlog_reserve(KV_VLOG_HEADER_BYTES + len))
+        return NVME_SC_INVALID_FIELD;
+
+    // Value bytes only; the rest of a long key leads the Transfer stream
+    st.value.resize(len < WRITE_PAYLOAD ? len : WRITE_PAYLOAD);
+    kv_payload_gather(&st.value[0], dw, kv_write_dwords, 0, st.value.size());
+    add_stream(dw[13], st, len);
+    cmd.result = len;
+    return 0;
+}
+
+// Transfer command (handle_nvme_io_bandslim_transfer): the fragment lands at
+// its sequence # x TRANSFER_PAYLOAD in the stream whatever order it came in
+int iLSM::Emulator::bandslim_transfer(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
+{
+    auto it = streams_.find(STREAM_ID(dw[2]) % MAX_OPEN_STREAMS);
+    if (it == streams_.end() || it->second.id != STREAM_ID(dw[2]))
+        return NVME_SC_INVALID_FIELD;   // No value waiting for its payload
+    Stream &st = it->second;
+    uint32_t seq = STREAM_SEQ(dw[2]);
+    uint32_t ofs = seq * TRANSFER_PAYLOAD;
+    if (ofs >= st.data.size() || st.seen[seq])
+        return NVME_SC_INVALID_FIELD;
+    uint32_t n = st.data.size() - ofs < TRANSFER_PAYLOAD ? st.data.size() - ofs : TRANSFER_PAYLOAD;
+    kv_payload_gather(&st.data[ofs], dw, kv_transfer_dwords, 0, n);
+    st.seen[seq] = true;
+    if (++st.received == st.seen.size() && !st.segments_left) {
+        finish_stream(st);
+        streams_.erase(it);
     }
-    memset(data, 0, data_len);
-    int err;
-    uint32_t result;
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    memcpy(&cdw10, key.c_str(), 4);
-    cdw12 = 0 | (0xFFFF & nlb);
-    cdw13 = iter_id;
-    err = nvme_passthru(NVME_CMD_KV_ITER_SEEK, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-            data_len, data, result);
-
-    if (err < 0) {
-        // ioctl fail
-        perror("ilsm seek");
-        free(data);
-        return -1;
+    cmd.result = 0;
+    return 0;
+}
+
+// Batched put (handle_nvme_io_kv_batch_put): the pages land on a 4KB boundary
+// of the vLog and every value slides down to the packing offset as a record
+int iLSM::Emulator::batch_put(struct nvme_passthru_cmd &cmd)
+{
+    uint32_t n = cmd.cdw10;
+    uint32_t len = cmd.cdw11;
+    if (!n || !len || !cmd.addr)
+        return NVME_SC_INVALID_FIELD;
+    uint32_t total_dma_size = ((len - 1) / BYTES_PER_NVME_BLOCK + 1) * BYTES_PER_NVME_BLOCK;
+    if (cmd.data_len < total_dma_size || total_dma_size > BYTES_PER_DATA_REGION_OF_SLICE)
+        return NVME_SC_INVALID_FIELD;
+    const char *page = (const char*)(uintptr_t)cmd.addr;
+    dma_ += total_dma_size;
+
+    // Check the whole page first: all records are stored or none
+    uint32_t pos = 0, values = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        IterRecord rec;
+        if (len - pos < sizeof(rec))
+            return NVME_SC_INVALID_FIELD;
+        memcpy(&rec, page + pos, sizeof(rec));
+        uint32_t size = IterRecord::Size(rec.key_size, rec.value_size);
+        if (!rec.key_size || !rec.value_size || size > len - pos)
+            return NVME_SC_INVALID_FIELD;
+        values += rec.value_size;
+        pos += size;
     }
 
-    if (err == 0x7C1) {
-        // no such key
-        free(data);
-        return -2;
+    uint32_t ofs = ((vlog_offset_ + BYTES_PER_NVME_BLOCK - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+    if (ofs + total_dma_size > BYTES_PER_DATA_REGION_OF_SLICE) {
+        stats_.vlog_slices++;
+        vlog_offset_ = 0;
     }
+    vlog_offset_ += n * KV_VLOG_HEADER_BYTES + values;
+    stats_.vlog_bytes += values;
 
-    if (result > 0) { // value length
-        value = std::string(static_cast<const char*>(data), (int)4);
-    }  else {
-        value = std::string();
+    pos = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        IterRecord rec;
+        memcpy(&rec, page + pos, sizeof(rec));
+        const char *key = page + pos + sizeof(rec);
+        string k(key, rec.key_size);
+        kv_[k].assign(key + rec.key_size, rec.value_size);
+        compressed_.erase(k);
+        pos += IterRecord::Size(rec.key_size, rec.value_size);
     }
-    free(data);
-    return result;
+    cmd.result = n;
+    return 0;
 }
 
-int iLSM::DB::Next(const unsigned int iter_id, std::string &value)
+// Write batch header and trailer (handle_nvme_io_kv_write_batch)
+int iLSM::Emulator::write_batch(struct nvme_passthru_cmd &cmd)
 {
-    void *data = NULL;
-    unsigned int data_len = MAX_BUFLEN;
-    unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    std::string key="1234";
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
-    }
-    memset(data, 0, data_len);
-    int err;
-    uint32_t result;
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    cdw10 = 0; // key
-    cdw12 = 0 | (0xFFFF & nlb);
-    cdw13 = iter_id;
-    err = nvme_passthru(NVME_CMD_KV_ITER_NEXT, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-            data_len, data, result);
-
-    if (err < 0) {
-        // ioctl fail
-        perror("ilsm next");
-        free(data);
-        return -1;
+    uint32_t id = cmd.cdw13 & BATCH_ID_MASK;
+    if (!(cmd.cdw11 & (BATCH_COMMIT | BATCH_ABORT))) {
+        // Header: opens the batch if its slot is free
+        if (!cmd.cdw10 || cmd.cdw10 > MAX_BATCH_MEMBERS)
+            return NVME_SC_INVALID_FIELD;
+        for (auto &b : batches_) {
+            if (b.first % MAX_OPEN_BATCHES == id % MAX_OPEN_BATCHES)
+                return NVME_SC_INVALID_FIELD;
+        }
+        batches_[id].members = cmd.cdw10;
+        cmd.result = 0;
+        return 0;
     }
 
-    if (err == 0x7C1) {
-        // no such key
-        free(data);
-        return -2;
+    auto it = batches_.find(id);
+    if (it == batches_.end())
+        return NVME_SC_INVALID_FIELD;
+    OpenBatch b = std::move(it->second);
+    batches_.erase(it);
+    if ((cmd.cdw11 & BATCH_COMMIT) && cmd.cdw10 == b.members && b.staged.size() == b.members) {
+        for (Stream &st : b.staged)
+            apply(st);
+        stats_.batches++;
+        cmd.result = b.members;
+        return 0;
+    }
+    // Aborted, or a member missing: none is applied, the values the
+    // members placed are dead
+    for (Stream &st : b.staged) {
+        if (!st.tombstone)
+            stats_.dead_bytes += st.value.size();
     }
+    cmd.result = 0;
+    return (cmd.cdw11 & BATCH_COMMIT) ? NVME_SC_INVALID_FIELD : 0;
+}
 
-    if (result > 0) { // value length
-        value = std::string(static_cast<const char*>(data), (int)4);
-    }  else {
-        value = std::string();
+// Delete command (handle_nvme_io_kv_delete): keys only, no data moved
+int iLSM::Emulator::kv_delete(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
+{
+    Stream st;
+    if (!open_stream(dw, &st))
+        return NVME_SC_INVALID_FIELD;
+    st.tombstone = true;
+    uint32_t tail = 0;
+    if (dw[11] & KV_DELETE_RANGE) {
+        st.end_size = (dw[10] >> END_KEY_SHIFT) & 0xFF;
+        if (!st.end_size)
+            return NVME_SC_INVALID_FIELD;
+        tail = (st.end_size + 3) / 4 * 4;
     }
+    add_stream(dw[13], st, tail);
+    cmd.result = 0;
+    return 0;
+}
 
-    free(data);
-    return result;
+// Inline key of a PUT/WRITE/DELETE
+bool iLSM::Emulator::open_stream(const uint32_t *dw, Stream *st)
+{
+    uint32_t spill;
+    if (!decode_key(dw, &st->key, &spill))
+        return false;
+    st->key_size = dw[10] >> KEY_SIZE_SHIFT;
+    st->spill = spill;
+    st->compressed = (dw[13] & VALUE_COMPRESSED) != 0;
+    // A member of a batch that is not open is refused
+    st->batch = dw[13] & (BATCH_MEMBER | (BATCH_ID_MASK << BATCH_ID_SHIFT));
+    if ((st->batch & BATCH_MEMBER) && !batches_.count((st->batch >> BATCH_ID_SHIFT) & BATCH_ID_MASK))
+        return false;
+    return true;
 }
 
+// Finishes the pair now if it has no Transfer stream, else waits for one of
+// (padded key rest + value bytes the PUT/WRITE did not carry)
+void iLSM::Emulator::add_stream(uint32_t stream, Stream &st, uint32_t len)
+{
+    uint32_t stream_len = st.spill + (len - st.value.size());
+    if (!stream_len) {
+        finish_stream(st);
+        return;
+    }
+    st.data.assign(stream_len, 0);
+    st.seen.assign((stream_len + TRANSFER_PAYLOAD - 1) / TRANSFER_PAYLOAD, false);
+    st.received = 0;
+    // A stream left open by a failed put, or by another id in the slot, is
+    // replaced
+    st.id = stream & 0xFFFF;
+    streams_[st.id % MAX_OPEN_STREAMS] = std::move(st);
+}
 
-int iLSM::DB::Get(const std::string &key, std::string &value)
+// The pair (or tombstone) is complete: applied now, or staged in its batch
+// until the trailer
+void iLSM::Emulator::finish_stream(Stream &st)
 {
-    void *data = NULL;
-    unsigned int data_len = MAX_BUFLEN;
-    unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
+    if (st.spill)
+        st.key.append(st.data.data(), st.key_size - KEY_INLINE);
+    if (!st.tombstone) {
+        st.value.append(st.data.data() + st.spill, st.data.size() - st.spill);
+        stats_.vlog_bytes += st.value.size();
     }
-    memset(data, 0, data_len);
-    int err;
-    uint32_t result;
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    memcpy(&cdw10, key.c_str(), 4);
-    cdw12 = 0 | (0xFFFF & nlb);
-    err = nvme_passthru(NVME_CMD_KV_GET, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-            data_len, data, result);
-
-    if (err < 0) {
-        // ioctl fail
-        perror("ilsm get");
-        free(data);
-        return -1;
+    if (st.batch & BATCH_MEMBER) {
+        auto it = batches_.find((st.batch >> BATCH_ID_SHIFT) & BATCH_ID_MASK);
+        if (it != batches_.end())
+            it->second.staged.push_back(std::move(st));
+        else if (!st.tombstone)     // Its batch was dropped meanwhile
+            stats_.dead_bytes += st.value.size();
+        return;
     }
+    apply(st);
+}
 
-    if (err == 0x7C1) {
-        // no such key
-        free(data);
-        return -2;
+void iLSM::Emulator::apply(Stream &st)
+{
+    if (st.tombstone) {
+        if (!st.end_size) {
+            drop(st.key, nullptr);
+        } else {
+            string end(st.data.data() + st.spill, st.end_size);
+            drop(st.key, &end);
+        }
+        return;
     }
+    kv_[st.key].swap(st.value);
+    if (st.compressed)
+        compressed_.insert(st.key);
+    else
+        compressed_.erase(st.key);
+}
 
-    if (result > 0) { // value length
-        value = std::string(static_cast<const char*>(data), (int)result);
-    }  else {
-        value = std::string();
+// Tombstone of key, or of [key, end): the values left in the vLog are dead
+void iLSM::Emulator::drop(const string &key, const string *end)
+{
+    stats_.tombstones++;
+    auto first = kv_.lower_bound(key);
+    auto last = first;
+    if (end && *end > key)
+        last = kv_.lower_bound(*end);
+    else if (first != kv_.end() && first->first == key)
+        ++last;
+    for (auto it = first; it != last; ++it) {
+        stats_.dead_bytes += it->second.size();
+        compressed_.erase(it->first);
     }
-
-    free(data);
-    return result;
+    kv_.erase(first, last);
 }
 
-int iLSM::DB::CreateIter(unsigned int &iter_id)
+// Piggybacked bytes are packed at the current vLog offset; false if they
+// can never fit one slice
+bool iLSM::Emulator::vlog_reserve(uint32_t len)
 {
-    void *data = NULL;
-    unsigned int data_len = MAX_BUFLEN;
-    unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
-    }
-    memset(data, 0, data_len);
-    int err;
-    uint32_t result;
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    cdw12 = 0 | (0xFFFF & nlb);
-    err = nvme_passthru(NVME_CMD_KV_ITER_CREATE_ITER, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-            data_len, data, result);
-    free(data);
-    if (err < 0) {
-        // ioctl fail
-        perror("ilsm create iter");
-        return -1;
+    if (len > BYTES_PER_DATA_REGION_OF_SLICE)
+        return false;
+    if (BYTES_PER_DATA_REGION_OF_SLICE - vlog_offset_ < len) {
+        stats_.vlog_slices++;
+        vlog_offset_ = 0;
     }
+    vlog_offset_ += len;
+    return true;
+}
 
-    if (err == 0x7C1) {
-        // no such key
-        return -2;
+// DMA'd pages land on 4KB boundaries; a partial last page is backfilled
+void iLSM::Emulator::vlog_dma(uint32_t pages, uint32_t bytes)
+{
+    uint32_t ofs = ((vlog_offset_ + BYTES_PER_NVME_BLOCK - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+    for (uint32_t i = 0; i < pages; i++) {
+        if (ofs >= BYTES_PER_DATA_REGION_OF_SLICE) {
+            stats_.vlog_slices++;
+            ofs = 0;
+        }
+        ofs += (i + 1 < pages) ? BYTES_PER_NVME_BLOCK : bytes - i * BYTES_PER_NVME_BLOCK;
     }
+    vlog_offset_ = ofs;
+}
 
-    iter_id = result;
+int iLSM::Emulator::get(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
+{
+    string key;
+    if (!read_key(dw, cmd, &key))
+        return NVME_SC_INVALID_FIELD;
+    auto it = kv_.find(key);
+    if (it == kv_.end())
+        return KV_NO_SUCH_KEY;
+
+    // CDW11: value offset the buffer starts at (chunked get)
+    uint32_t len = it->second.size();
+    uint32_t ofs = dw[11] < len ? dw[11] : len;
+    uint32_t copy = len - ofs < cmd.data_len ? len - ofs : cmd.data_len;
+    if (copy && !cmd.addr)
+        return NVME_SC_INVALID_FIELD;
+    memcpy((void*)(uintptr_t)cmd.addr, it->second.data() + ofs, copy);
+    dma_ += ((copy + BYTES_PER_NVME_BLOCK - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+    cmd.result = len | (compressed_.count(key) ? VALUE_COMPRESSED : 0);
     return 0;
 }
 
-int iLSM::DB::DestroyIter(const unsigned int iter_id)
+int iLSM::Emulator::multi_get(struct nvme_passthru_cmd &cmd)
 {
-    void *data = NULL;
-    unsigned int data_len = MAX_BUFLEN;
-    unsigned int nlb = (MAX_BUFLEN-1) / PAGE_SIZE;
-    if (posix_memalign(&data, PAGE_SIZE, data_len)) {
-        return -ENOMEM;
+    uint32_t n = cmd.cdw10;
+    uint32_t req_len = cmd.cdw11;
+    if (!n || req_len > cmd.data_len || !cmd.addr)
+        return NVME_SC_INVALID_FIELD;
+    char *data = (char*)(uintptr_t)cmd.addr;
+    dma_ += ((req_len + BYTES_PER_NVME_BLOCK - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+
+    // Request: u16 key size + key, dword-padded, per key
+    vector<map<string, string>::iterator> found;
+    uint32_t pos = 0;
+    uint32_t total = n * sizeof(MultiGetEntry);
+    for (uint32_t i = 0; i < n; i++) {
+        uint16_t key_size;
+        if (pos + sizeof(key_size) > req_len)
+            return NVME_SC_INVALID_FIELD;
+        memcpy(&key_size, data + pos, sizeof(key_size));
+        if (!key_size || pos + sizeof(key_size) + key_size > req_len)
+            return NVME_SC_INVALID_FIELD;
+        auto it = kv_.find(string(data + pos + sizeof(key_size), key_size));
+        found.push_back(it);
+        if (it != kv_.end())
+            total += (it->second.size() + 3) / 4 * 4;
+        pos += (sizeof(key_size) + key_size + 3) / 4 * 4;
     }
-    memset(data, 0, data_len);
-    int err;
-    uint32_t result;
-    uint32_t cdw2, cdw3, cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
-    cdw2 = cdw3 = cdw10 = cdw11 = cdw12 = cdw13 = cdw14 = cdw15 = 0;
-    //    memcpy(&cdw10, key.c_str()+4, 4);
-    //    memcpy(&cdw11, key.c_str(), 4);
-    cdw12 = 0 | (0xFFFF & nlb);
-    cdw13 = iter_id;
-    err = nvme_passthru(NVME_CMD_KV_ITER_DESTROY_ITER, 0, 0, NSID, cdw2, cdw3, 
-            cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, 
-            data_len, data, result);
-    free(data);
-    if (err < 0) {
-        // ioctl fail
-        perror("ilsm destroy iter");
-        return -1;
+
+    // Host buffer too small: report the size only, the host retries
+    cmd.result = total;
+    if (total > cmd.data_len)
+        return 0;
+
+    // Response: offset table, then the values (the request is consumed)
+    vector<MultiGetEntry> table(n);
+    uint32_t offset = n * sizeof(MultiGetEntry);
+    for (uint32_t i = 0; i < n; i++) {
+        if (found[i] == kv_.end()) {
+            table[i].offset = MULTIGET_MISSING;
+            table[i].value_size = 0;
+            continue;
+        }
+        const string &value = found[i]->second;
+        table[i].offset = offset;
+        table[i].value_size = value.size() | (compressed_.count(found[i]->first) ? VALUE_COMPRESSED : 0);
+        memcpy(data + offset, value.data(), value.size());
+        offset += (value.size() + 3) / 4 * 4;
     }
+    memcpy(data, table.data(), n * sizeof(MultiGetEntry));
+    dma_ += ((total + BYTES_PER_NVME_BLOCK - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+    return 0;
+}
 
-    if (err == 0x7C1) {
-        // no such key
-        return -2;
+int iLSM::Emulator::iter_create(struct nvme_passthru_cmd &cmd)
+{
+    for (unsigned int id = 0; id < MAX_ITERATORS; id++) {
+        if (iters_.find(id) == iters_.end()) {
+            iters_[id] = Iter();
+            cmd.result = id;
+            return 0;
+        }
     }
+    return NVME_SC_INVALID_FIELD;
+}
 
-    return result;
-}
-
-int iLSM::DB::nvme_passthru(uint8_t opcode,
-        uint8_t flags, uint16_t rsvd,
-        uint32_t nsid, uint32_t cdw2, uint32_t cdw3, uint32_t cdw10, uint32_t cdw11,
-        uint32_t cdw12, uint32_t cdw13, uint32_t cdw14, uint32_t cdw15,
-        uint32_t data_len, void *data, uint32_t &result)
-{
-    struct nvme_passthru_cmd cmd = {
-        .opcode		= opcode,
-        .flags		= flags,
-        .rsvd1		= rsvd,
-        .nsid		= nsid,
-        .cdw2		= cdw2,
-        .cdw3		= cdw3,
-        .metadata	= (uint64_t)(uintptr_t) NULL,
-        .addr		= (uint64_t)(uintptr_t) data,
-        .metadata_len	= 0,
-        .data_len	= data_len,
-        .cdw10		= cdw10,
-        .cdw11		= cdw11,
-        .cdw12		= cdw12,
-        .cdw13		= cdw13,
-        .cdw14		= cdw14,
-        .cdw15		= cdw15,
-        .timeout_ms	= 0,
-        .result		= 0,
-    };
-    int err;
-    /*{
-        fprintf(stderr, "-- iLSM::DB::nvme_passthru --\n");
-        fprintf(stderr, "opcode       : %02x\n", cmd.opcode);
-        fprintf(stderr, "flags        : %02x\n", cmd.flags);
-        fprintf(stderr, "rsvd1        : %04x\n", cmd.rsvd1);
-        fprintf(stderr, "nsid         : %08x\n", cmd.nsid);
-        fprintf(stderr, "cdw2         : %08x\n", cmd.cdw2);
-        fprintf(stderr, "cdw3         : %08x\n", cmd.cdw3);
-        fprintf(stderr, "data_len     : %08x\n", cmd.data_len);
-        fprintf(stderr, "metadata_len : %08x\n", cmd.metadata_len);
-        fprintf(stderr, "addr         : %llx\n", cmd.addr);
-        fprintf(stderr, "metadata     : %llx\n", cmd.metadata);
-        fprintf(stderr, "cdw10        : %08x\n", cmd.cdw10);
-        fprintf(stderr, "cdw11        : %08x\n", cmd.cdw11);
-        fprintf(stderr, "cdw12        : %08x\n", cmd.cdw12);
-        fprintf(stderr, "cdw13        : %08x\n", cmd.cdw13);
-        fprintf(stderr, "cdw14        : %08x\n", cmd.cdw14);
-        fprintf(stderr, "cdw15        : %08x\n", cmd.cdw15);
-        fprintf(stderr, "timeout_ms   : %08x\n", cmd.timeout_ms);
-    }*/
-    // err = ioctl(fd_, NVME_IOCTL_IO_CMD, &cmd);
-    err = 0; // MOCK!!!!
-    if (!err && result)
-        result = cmd.result;
-    return err;
+int iLSM::Emulator::iter_seek(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
+{
+    auto iter = iters_.find(dw[13]);
+    if (iter == iters_.end())
+        return NVME_SC_INVALID_FIELD;
+    string key;
+    if (!read_key(dw, cmd, &key))
+        return NVME_SC_INVALID_FIELD;
+    return iter_read(kv_.lower_bound(key), iter->second, cmd);
+}
+
+int iLSM::Emulator::iter_next(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
+{
+    auto iter = iters_.find(dw[13]);
+    if (iter == iters_.end() || !iter->second.positioned)
+        return NVME_SC_INVALID_FIELD;
+    return iter_read(kv_.upper_bound(iter->second.key), iter->second, cmd);
+}
+
+// Packs records from it on into the buffer; positions the iterator on the last one
+int iLSM::Emulator::iter_read(map<string, string>::iterator it, Iter &iter,
+        struct nvme_passthru_cmd &cmd)
+{
+    if (it == kv_.end())
+        return KV_NO_SUCH_KEY;
+    if (!cmd.addr || cmd.data_len < sizeof(IterRecord))
+        return NVME_SC_INVALID_FIELD;
+
+    char *page = (char*)(uintptr_t)cmd.addr;
+    uint32_t pos = 0, n = 0;
+    for (; it != kv_.end(); ++it) {
+        IterRecord rec;
+        rec.key_size = it->first.size();
+        rec.rsvd = 0;
+        rec.value_size = it->second.size();
+        uint32_t size = IterRecord::Size(rec.key_size, rec.value_size);
+        if (cmd.data_len - pos < size) {
+            if (!n) {
+                // Tell the host how big the record is
+                memcpy(page, &rec, sizeof(rec));
+                pos = sizeof(rec);
+            }
+            break;
+        }
+        if (compressed_.count(it->first))
+            rec.value_size |= VALUE_COMPRESSED;
+        memcpy(page + pos, &rec, sizeof(rec));
+        memcpy(page + pos + sizeof(rec), it->first.data(), rec.key_size);
+        memcpy(page + pos + sizeof(rec) + rec.key_size, it->second.data(), it->second.size());
+        memset(page + pos + sizeof(rec) + rec.key_size + it->second.size(), 0,
+                size - sizeof(rec) - rec.key_size - it->second.size());
+        pos += size;
+        n++;
+        iter.key = it->first;
+        iter.positioned = true;
+    }
+    dma_ += ((pos + BYTES_PER_NVME_BLOCK - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+    cmd.result = n;
+    return 0;
+}
+
+int iLSM::Emulator::iter_destroy(const uint32_t *dw, struct nvme_passthru_cmd &cmd)
+{
+    if (!iters_.erase(dw[13]))
+        return NVME_SC_INVALID_FIELD;
+    cmd.result = 0;
+    return 0;
 }
 
+bool iLSM::Emulator::Lookup(const std::string &key, std::string *value, bool *compressed)
+{
+    lock_guard<mutex> l(mtx_);
+    auto it = kv_.find(key);
+    if (it == kv_.end())
+        return false;
+    *value = it->second;
+    if (compressed)
+        *compressed = compressed_.count(key) != 0;
+    return true;
+}
+
+size_t iLSM::Emulator::NumKeys()
+{
+    lock_guard<mutex> l(mtx_);
+    return kv_.size();
+}
+
+iLSM::Emulator::Stats iLSM::Emulator::GetStats()
+{
+    lock_guard<mutex> l(mtx_);
+    return stats_;
+}
+
+bool iLSM::Emulator::Attach()
+{
+    lock_guard<mutex> l(mtx_);
+    if (attached_)
+        return false;
+    attached_ = true;
+    return true;
+}
+
+void iLSM::Emulator::Detach()
+{
+    lock_guard<mutex> l(mtx_);
+    attached_ = false;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <map>
+#include <set>
+#include <mutex>
+#include <vector>
+
+#include "iLSM_transport.h"
+
+namespace iLSM {
+    struct EmulatorOptions {
+        // Fixed device-side cost of a command (fetch, decode, completion)
+        uint64_t cmd_latency_ns = 2000;
+        // Interconnect bandwidth charged for SQE/CQE and DMA bytes (0 = free)
+        uint64_t pcie_mbps = 3200;
+        // Cost of a command queued behind another of the same batch, which
+        // overlaps with it (0 = cmd_latency_ns, no overlap)
+        uint64_t pipelined_cmd_latency_ns = 0;
+        // Execute batches last command first (out-of-order arrival)
+        bool reverse_batches = false;
+        // Commands the device works on at once (flash channels): a command
+        // takes the channel free first and waits if none is, so commands of
+        // different contexts overlap up to this many (1 = one at a time)
+        unsigned int channels = 8;
+    };
+
+    // In-process software KV-SSD. Decodes the iLSM/BandSlim opcodes
+    // (0xA0-0xAC) the way firmware/nvme_io_cmd.c does, packs values into
+    // 16KB vLog slices for space accounting and charges modeled latency per
+    // command. One emulator plays one device: it is shared by all submission
+    // contexts and applies commands one at a time like the firmware, then
+    // models their device time outside the lock on one of
+    // EmulatorOptions::channels; piggyback streams of different puts are
+    // told apart by their stream id, in MAX_OPEN_STREAMS slots like the
+    // firmware's.
+    class Emulator {
+        public:
+            struct Stats {
+                uint64_t commands = 0;
+                uint64_t cmd_bytes = 0;     // 64B per SQE
+                uint64_t cpl_bytes = 0;     // 16B per CQE
+                uint64_t dma_bytes = 0;     // PRP page transfers
+                uint64_t vlog_bytes = 0;    // Value bytes placed in the vLog
+                uint64_t vlog_slices = 0;   // vLog slices opened
+                uint64_t tombstones = 0;    // Delete/DeleteRange recorded
+                uint64_t dead_bytes = 0;    // vLog bytes of deleted pairs (for GC)
+                uint64_t batches = 0;       // Write batches committed
+            };
+
+            explicit Emulator(const EmulatorOptions &options = EmulatorOptions());
+
+            // Executes one command, same contract as Transport::Passthru
+            int Execute(struct nvme_passthru_cmd &cmd);
+            // Commands submitted back to back, same contract as
+            // Transport::PassthruBatch
+            int ExecuteBatch(struct nvme_passthru_cmd *cmds, unsigned int n);
+
+            // Value as stored; *compressed tells if the host compressed it
+            bool Lookup(const std::string &key, std::string *value, bool *compressed = nullptr);
+            size_t NumKeys();
+            Stats GetStats();
+            // One DB at a time, like a device (its stream slots are
+            // device-wide): false if another DB holds it
+            bool Attach();
+            void Detach();
+
+        private:
+            // Pair under reassembly, one per device stream slot
+            struct Stream {
+                uint32_t id = 0;            // Stream id (CDW13 15:0) holding the slot
+                std::string key;
+                uint32_t key_size = 0;
+                uint32_t spill = 0;         // Padded key bytes leading the stream
+                std::string value;          // Bytes the PUT/WRITE carried
+                std::string data;           // Transfer stream, placed by sequence #
+                std::vector<bool> seen;     // Per fragment
+                uint32_t received = 0;
+                bool tombstone = false;     // Of a DELETE: no value
+                uint32_t end_size = 0;      // DeleteRange: end key after the key
+                bool compressed = false;    // VALUE_COMPRESSED in CDW13
+                std::vector<bool> segments; // Streaming put: per PUT segment
+                uint32_t segments_left = 0;
+                uint32_t batch = 0;         // Member of a write batch: its CDW13 bits
+            };
+
+            // Write batch between its header and trailer: the members
+            // completed so far, applied by the commit
+            struct OpenBatch {
+                uint32_t members = 0;
+                std::vector<Stream> staged;
+            };
+
+            struct Iter {
+                std::string key;
+                bool positioned = false;
+            };
+
+            int put(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int put_segment(const uint32_t *dw, struct nvme_passthru_cmd &cmd, uint32_t len,
+                    uint32_t prp_bytes);
+            int bandslim_write(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int bandslim_transfer(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int kv_delete(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int get(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int multi_get(struct nvme_passthru_cmd &cmd);
+            int batch_put(struct nvme_passthru_cmd &cmd);
+            int write_batch(struct nvme_passthru_cmd &cmd);
+            int iter_create(struct nvme_passthru_cmd &cmd);
+            int iter_seek(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int iter_next(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int iter_destroy(const uint32_t *dw, struct nvme_passthru_cmd &cmd);
+            int iter_read(std::map<std::string, std::string>::iterator it, Iter &iter,
+                    struct nvme_passthru_cmd &cmd);
+
+            int execute(struct nvme_passthru_cmd &cmd, uint64_t latency_ns);
+            bool open_stream(const uint32_t *dw, Stream *st);
+            void add_stream(uint32_t stream, Stream &st, uint32_t len);
+            void finish_stream(Stream &st);
+            void apply(Stream &st);
+            void drop(const std::string &key, const std::string *end);
+            bool vlog_reserve(uint32_t len);
+            void vlog_dma(uint32_t pages, uint32_t bytes);
+
+            EmulatorOptions options_;
+            std::mutex mtx_;
+
+            std::map<std::string, std::string> kv_;
+            std::set<std::string> compressed_;  // Keys of values put with VALUE_COMPRESSED
+            std::map<unsigned int, Iter> iters_;
+
+            std::map<uint32_t, Stream> streams_;
+            std::map<uint32_t, OpenBatch> batches_;     // By batch id
+
+            // vLog packing state
+            uint32_t vlog_offset_ = 0;
+
+            bool attached_ = false;
+            uint64_t dma_ = 0;      // DMA bytes of the command being executed
+            Stats stats_;
+            // When each channel is done with the commands it took
+            std::vector<std::chrono::steady_clock::time_point> busy_until_;
+    };
+
+    class EmulatorTransport : public Transport {
+        public:
+            explicit EmulatorTransport(Emulator *emu) : emu_(emu) {}
+            int Passthru(struct nvme_passthru_cmd &cmd) override { return emu_->Execute(cmd); }
+            int PassthruBatch(struct nvme_passthru_cmd *cmds, unsigned int n, unsigned int) override {
+                return emu_->ExecuteBatch(cmds, n);
+            }
+            bool RawDwords() const override { return true; }
+        private:
+            Emulator *emu_;
+    };
+}
@@ -0,0 +1,80 @@
+#include "iLSM_qos.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace ROCKSDB_NAMESPACE;
+
+iLSM::QosScheduler::QosScheduler(unsigned int depth, const unsigned int *weights, const int64_t *rates)
+    : depth_(depth ? depth : 1), free_(depth_)
+{
+    for (int c = 0; c < static_cast<int>(QosClass::LAST); c++) {
+        weight_[c] = weights[c] ? weights[c] : 1;
+        if (rates[c] > 0)
+            limiter_[c].reset(NewGenericRateLimiter(rates[c], 100 * 1000, 10, RateLimiter::Mode::kAllIo));
+    }
+}
+
+uint64_t iLSM::QosScheduler::Admit(QosClass c, unsigned int slots, uint64_t bytes)
+{
+    auto st = std::chrono::steady_clock::now();
+    int i = static_cast<int>(c);
+    throttle(c, bytes);
+
+    std::unique_lock<std::mutex> l(mtx_);
+    Waiter w;
+    w.slots = std::min(std::max(slots, 1u), depth_);
+    w.start = std::max(vtime_, finish_[i]);
+    w.granted = false;
+    finish_[i] = w.start + bytes * kTagScale / weight_[i];
+    waiting_.emplace(std::make_pair(finish_[i], seq_++), &w);
+    dispatch();
+    cv_.wait(l, [&w] { return w.granted; });
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - st).count();
+}
+
+void iLSM::QosScheduler::Release(unsigned int slots)
+{
+    std::lock_guard<std::mutex> l(mtx_);
+    free_ += std::min(std::max(slots, 1u), depth_);
+    dispatch();
+}
+
+size_t iLSM::QosScheduler::Waiting()
+{
+    std::lock_guard<std::mutex> l(mtx_);
+    return waiting_.size();
+}
+
+// Hands free slots out in tag order; the head waits for room rather than
+// being overtaken, so a wide batch is not starved by single commands
+void iLSM::QosScheduler::dispatch()
+{
+    bool woke = false;
+    while (!waiting_.empty()) {
+        Waiter *w = waiting_.begin()->second;
+        if (w->slots > free_)
+            break;
+        free_ -= w->slots;
+        vtime_ = std::max(vtime_, w->start);
+        w->granted = true;
+        waiting_.erase(waiting_.begin());
+        woke = true;
+    }
+    if (woke)
+        cv_.notify_all();
+}
+
+// Takes bytes from the class's limiter, one burst at a time
+void iLSM::QosScheduler::throttle(QosClass c, uint64_t bytes)
+{
+    RateLimiter *limiter = limiter_[static_cast<int>(c)].get();
+    if (!limiter)
+        return;
+    int64_t burst = std::max<int64_t>(limiter->GetSingleBurstBytes(), 1);
+    for (int64_t left = bytes; left > 0; ) {
+        int64_t n = std::min(left, burst);
+        limiter->Request(n, Env::IO_HIGH, nullptr, RateLimiter::OpType::kWrite);
+        left -= n;
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "rocksdb/rate_limiter.h"
+
+namespace iLSM {
+    // Who a command is for, as far as the device queue is concerned
+    enum class QosClass : int {
+        READ        = 0,    // Get and MultiGet
+        SMALL_WRITE = 1,    // Puts up to qos_large_write, Delete(Range), combined pages
+        LARGE_WRITE = 2,    // Larger puts (PRP pages, segments of streamed values)
+        SCAN        = 3,    // Iterators
+        LAST        = 4,
+    };
+
+    // Device-queue scheduler shared by all submission contexts of a DB: at
+    // most depth commands are on the device at once, and when a slot frees
+    // the waiting command with the smallest virtual finish tag gets it
+    // (weighted fair queuing, start-time virtual clock). A command costs its
+    // bytes on the wire over the weight of its class, so a class of weight w
+    // gets w shares of the queue while it is backlogged and a class coming
+    // back from idle starts at the current virtual time (no saved credit).
+    // A class may also be held to a rate (bytes/s) by a RocksDB rate
+    // limiter before it queues, so a throttled class holds no slot.
+    class QosScheduler {
+        public:
+            // weights: one per class, 0 counts as 1; rates: bytes/s per
+            // class, 0 = unlimited
+            QosScheduler(unsigned int depth, const unsigned int *weights, const int64_t *rates);
+            QosScheduler(const QosScheduler &) = delete;
+            QosScheduler &operator=(const QosScheduler &) = delete;
+
+            // Blocks until slots (at most Depth()) are granted to bytes of
+            // class c; returns the ns it waited, throttling included
+            uint64_t Admit(QosClass c, unsigned int slots, uint64_t bytes);
+            void Release(unsigned int slots);
+
+            unsigned int Depth() const { return depth_; }
+            // # of commands (or batches) waiting for slots
+            size_t Waiting();
+
+        private:
+            static const uint64_t kTagScale = 1024;    // Virtual time per byte at weight 1
+
+            struct Waiter {
+                unsigned int slots;
+                uint64_t start;         // Virtual start tag
+                bool granted;
+            };
+
+            void throttle(QosClass c, uint64_t bytes);
+            void dispatch();
+
+            const unsigned int depth_;
+            uint64_t weight_[static_cast<int>(QosClass::LAST)];
+            std::unique_ptr<ROCKSDB_NAMESPACE::RateLimiter> limiter_[static_cast<int>(QosClass::LAST)];
+
+            std::mutex mtx_;
+            std::condition_variable cv_;
+            unsigned int free_;
+            uint64_t vtime_ = 0;
+            uint64_t finish_[static_cast<int>(QosClass::LAST)] = {};   // Last tag per class
+            uint64_t seq_ = 0;          // Breaks tag ties in arrival order
+            std::map<std::pair<uint64_t, uint64_t>, Waiter*> waiting_;  // By (finish tag, seq)
+    };
+}
@@ -0,0 +1,503 @@
+#include "iLSM_sharded.h"
+#include "util/hash.h"
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+const uint32_t RING_SEED = 0x5eed5a4d;     // Apart from the hashes the DBs use
+
+int iLSM::ShardedDB::Open(const std::string &devs)
+{
+    return Open(devs, Options());
+}
+
+int iLSM::ShardedDB::Open(const std::string &devs, const Options &options)
+{
+    std::vector<std::string> paths;
+    size_t pos = 0;
+    while (1) {
+        size_t comma = devs.find(',', pos);
+        paths.push_back(devs.substr(pos, comma == string::npos ? string::npos : comma - pos));
+        if (comma == string::npos)
+            break;
+        pos = comma + 1;
+    }
+    if (paths.size() > 1 && options.emulator)
+        return -EINVAL;
+    std::vector<Options> per_device(paths.size(), options);
+    if (paths.size() > 1 && !options.filter_path.empty()) {
+        for (size_t i = 0; i < paths.size(); i++)
+            per_device[i].filter_path += "." + to_string(i);
+    }
+    return Open(paths, per_device);
+}
+
+int iLSM::ShardedDB::Open(const std::vector<std::string> &devs, const std::vector<Options> &options)
+{
+    Close();
+    if (devs.empty() || devs.size() != options.size())
+        return -EINVAL;
+    for (size_t i = 0; i < devs.size(); i++) {
+        std::unique_ptr<DB> db(new DB());
+        int err = db->Open(devs[i], options[i]);
+        if (err < 0) {
+            Close();
+            return err;
+        }
+        shards_.push_back(std::move(db));
+
+        // Ring points follow the device, not its position in the list
+        std::string name = devs[i].empty() || options[i].emulator ? "#" + to_string(i) : devs[i];
+        for (int v = 0; v < kVirtualNodes; v++) {
+            std::string point = name + "/" + to_string(v);
+            ring_.emplace_back(ROCKSDB_NAMESPACE::Hash(point.data(), point.size(), RING_SEED), i);
+        }
+    }
+    std::sort(ring_.begin(), ring_.end());
+
+    for (size_t i = 0; i < shards_.size(); i++)
+        pools_.emplace_back(new Pool());
+    return 0;
+}
+
+void iLSM::ShardedDB::Close()
+{
+    for (auto &p : pools_) {
+        {
+            lock_guard<mutex> l(p->mtx);
+            p->stop = true;
+        }
+        p->cv.notify_all();
+        for (auto &t : p->threads)
+            t.join();
+    }
+    pools_.clear();
+    for (auto &it : iters_)
+        it = Iter();
+    shards_.clear();
+    ring_.clear();
+}
+
+size_t iLSM::ShardedDB::ShardOf(const Slice &key) const
+{
+    if (ring_.size() <= kVirtualNodes)
+        return 0;
+    uint32_t h = ROCKSDB_NAMESPACE::Hash(key.data(), key.size(), RING_SEED);
+    auto it = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(h, (uint32_t)0));
+    if (it == ring_.end())
+        it = ring_.begin();     // Wrap around
+    return it->second;
+}
+
+void iLSM::ShardedDB::work(Pool *p)
+{
+    while (1) {
+        std::function<void()> task;
+        {
+            unique_lock<mutex> l(p->mtx);
+            p->idle++;
+            p->cv.wait(l, [p] { return p->stop || !p->tasks.empty(); });
+            p->idle--;
+            if (p->tasks.empty())
+                return;
+            task = std::move(p->tasks.front());
+            p->tasks.pop_front();
+        }
+        task();
+    }
+}
+
+// The calling thread takes the first shard, the pools of the others the rest
+void iLSM::ShardedDB::fan_out(const std::vector<size_t> &shards, const std::function<void(size_t)> &fn)
+{
+    if (shards.size() == 1) {
+        fn(shards[0]);
+        return;
+    }
+    struct {
+        std::mutex mtx;
+        std::condition_variable cv;
+        size_t left;
+    } pending;
+    pending.left = shards.size();
+    auto run = [&pending, &fn](size_t shard) {
+        fn(shard);
+        lock_guard<mutex> l(pending.mtx);
+        if (--pending.left == 0)
+            pending.cv.notify_one();
+    };
+    for (size_t i = 1; i < shards.size(); i++) {
+        size_t shard = shards[i];
+        Pool *p = pools_[shard].get();
+        {
+            lock_guard<mutex> l(p->mtx);
+            p->tasks.push_back([&run, shard] { run(shard); });
+            // Every queued task needs a thread of its own
+            if (p->tasks.size() > p->idle)
+                p->threads.emplace_back(&ShardedDB::work, this, p);
+        }
+        p->cv.notify_one();
+    }
+    run(shards[0]);
+    unique_lock<mutex> l(pending.mtx);
+    pending.cv.wait(l, [&pending] { return pending.left == 0; });
+}
+
+void iLSM::ShardedDB::fan_out_all(const std::function<void(size_t)> &fn)
+{
+    std::vector<size_t> shards(shards_.size());
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i] = i;
+    fan_out(shards, fn);
+}
+
+int iLSM::ShardedDB::Put(const std::string &key, const std::string &value)
+{
+    return shards_[ShardOf(key)]->Put(key, value);
+}
+
+int iLSM::ShardedDB::Put(const std::string &key, const std::string &value, PutCallback done)
+{
+    return shards_[ShardOf(key)]->Put(key, value, std::move(done));
+}
+
+void iLSM::ShardedDB::Flush()
+{
+    fan_out_all([this](size_t shard) { shards_[shard]->Flush(); });
+}
+
+int iLSM::ShardedDB::Delete(const std::string &key)
+{
+    return shards_[ShardOf(key)]->Delete(key);
+}
+
+// Any device may hold keys of the range
+int iLSM::ShardedDB::DeleteRange(const std::string &begin, const std::string &end)
+{
+    std::vector<int> rets(shards_.size());
+    fan_out_all([&](size_t shard) { rets[shard] = shards_[shard]->DeleteRange(begin, end); });
+    for (int ret : rets) {
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int iLSM::ShardedDB::Write(const WriteBatch &batch)
+{
+    std::vector<WriteBatch> parts(shards_.size());
+    std::vector<size_t> shards;
+    for (const WriteBatch::Op &op : batch.ops_) {
+        size_t shard = ShardOf(op.key);
+        if (!parts[shard].Count())
+            shards.push_back(shard);
+        parts[shard].ops_.push_back(op);
+    }
+    if (shards.empty())
+        return 0;
+    std::vector<int> rets(shards_.size());
+    fan_out(shards, [&](size_t shard) { rets[shard] = shards_[shard]->Write(parts[shard]); });
+    for (size_t shard : shards) {
+        if (rets[shard] < 0)
+            return rets[shard];
+    }
+    return 0;
+}
+
+int iLSM::ShardedDB::Get(const std::string &key, std::string &value)
+{
+    return shards_[ShardOf(key)]->Get(key, value);
+}
+
+int iLSM::ShardedDB::Get(const std::string &key, void *buf, uint32_t buf_len)
+{
+    return shards_[ShardOf(key)]->Get(key, buf, buf_len);
+}
+
+// Each device looks up its own keys, all devices at once
+int iLSM::ShardedDB::MultiGet(const std::vector<Slice> &keys, std::vector<std::string> *values,
+        std::vector<int> *statuses)
+{
+    values->assign(keys.size(), std::string());
+    statuses->assign(keys.size(), -1);
+    std::vector<std::vector<size_t>> idx(shards_.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        idx[ShardOf(keys[i])].push_back(i);
+    std::vector<size_t> shards;
+    for (size_t shard = 0; shard < idx.size(); shard++) {
+        if (!idx[shard].empty())
+            shards.push_back(shard);
+    }
+    if (shards.empty())
+        return 0;
+
+    std::vector<int> rets(shards_.size(), 0);
+    fan_out(shards, [&](size_t shard) {
+        std::vector<Slice> sub;
+        for (size_t i : idx[shard])
+            sub.push_back(keys[i]);
+        std::vector<std::string> sub_values;
+        std::vector<int> sub_statuses;
+        rets[shard] = shards_[shard]->MultiGet(sub, &sub_values, &sub_statuses);
+        for (size_t j = 0; j < sub.size(); j++) {
+            (*values)[idx[shard][j]].swap(sub_values[j]);
+            (*statuses)[idx[shard][j]] = sub_statuses[j];
+        }
+    });
+    for (int ret : rets) {
+        if (ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+std::future<int> iLSM::ShardedDB::PutAsync(const std::string &key, const std::string &value)
+{
+    return shards_[ShardOf(key)]->PutAsync(key, value);
+}
+
+void iLSM::ShardedDB::PutAsync(const std::string &key, const std::string &value, PutCallback done,
+        CompletionQueue *cq)
+{
+    shards_[ShardOf(key)]->PutAsync(key, value, std::move(done), cq);
+}
+
+std::future<iLSM::GetResult> iLSM::ShardedDB::GetAsync(const std::string &key)
+{
+    return shards_[ShardOf(key)]->GetAsync(key);
+}
+
+void iLSM::ShardedDB::GetAsync(const std::string &key, GetCallback done, CompletionQueue *cq)
+{
+    shards_[ShardOf(key)]->GetAsync(key, std::move(done), cq);
+}
+
+std::future<iLSM::MultiGetResult> iLSM::ShardedDB::MultiGetAsync(const std::vector<Slice> &keys)
+{
+    std::shared_ptr<std::promise<MultiGetResult>> p = std::make_shared<std::promise<MultiGetResult>>();
+    std::future<MultiGetResult> f = p->get_future();
+    MultiGetAsync(keys, [p](MultiGetResult &r) { p->set_value(std::move(r)); });
+    return f;
+}
+
+// Each device looks up its own keys; the last one to answer completes
+void iLSM::ShardedDB::MultiGetAsync(const std::vector<Slice> &keys, MultiGetCallback done,
+        CompletionQueue *cq)
+{
+    struct Pending {
+        std::mutex mtx;
+        size_t left = 0;
+        MultiGetResult result;
+    };
+    std::shared_ptr<Pending> pending = std::make_shared<Pending>();
+    pending->result.status = 0;
+    pending->result.values.assign(keys.size(), std::string());
+    pending->result.statuses.assign(keys.size(), -1);
+    std::vector<std::vector<size_t>> idx(shards_.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        idx[ShardOf(keys[i])].push_back(i);
+    for (size_t shard = 0; shard < idx.size(); shard++) {
+        if (!idx[shard].empty())
+            pending->left++;
+    }
+    auto finish = [pending, done, cq] {
+        if (!done)
+            return;
+        if (cq)
+            cq->Post([pending, done] { done(pending->result); });
+        else
+            done(pending->result);
+    };
+    if (!pending->left) {
+        finish();
+        return;
+    }
+
+    for (size_t shard = 0; shard < idx.size(); shard++) {
+        if (idx[shard].empty())
+            continue;
+        std::vector<Slice> sub;
+        for (size_t i : idx[shard])
+            sub.push_back(keys[i]);
+        std::vector<size_t> sub_idx = idx[shard];
+        shards_[shard]->MultiGetAsync(sub, [pending, sub_idx, finish](MultiGetResult &r) {
+            {
+                lock_guard<mutex> l(pending->mtx);
+                if (r.status < 0)
+                    pending->result.status = -1;
+                for (size_t j = 0; j < sub_idx.size(); j++) {
+                    pending->result.values[sub_idx[j]].swap(r.values[j]);
+                    pending->result.statuses[sub_idx[j]] = r.statuses[j];
+                }
+                if (--pending->left)
+                    return;
+            }
+            finish();
+        });
+    }
+}
+
+int iLSM::ShardedDB::CreateIter(unsigned int &iter_id)
+{
+    unsigned int id;
+    {
+        lock_guard<mutex> l(iter_mtx_);
+        for (id = 0; id < MAX_ITER_NUM && iters_[id].used; id++)
+            ;
+        if (id == MAX_ITER_NUM)
+            return -1;
+        iters_[id].used = true;
+    }
+    Iter &it = iters_[id];
+    size_t n = shards_.size();
+    it.ids.assign(n, 0);
+    it.status.assign(n, -2);
+    it.keys.assign(n, std::string());
+    it.values.assign(n, std::string());
+    it.cur = -1;
+    std::vector<int> rets(n);
+    fan_out_all([&](size_t shard) { rets[shard] = shards_[shard]->CreateIter(it.ids[shard]); });
+    int ret = 0;
+    for (size_t shard = 0; shard < n; shard++) {
+        if (rets[shard] < 0)
+            ret = rets[shard];
+    }
+    if (ret < 0) {
+        for (size_t shard = 0; shard < n; shard++) {
+            if (rets[shard] >= 0)
+                shards_[shard]->DestroyIter(it.ids[shard]);
+        }
+        lock_guard<mutex> l(iter_mtx_);
+        it = Iter();
+        return ret;
+    }
+    iter_id = id;
+    return 0;
+}
+
+// Moves the device's iterator to key (Seek) or its next record
+void iLSM::ShardedDB::advance(Iter &it, size_t shard, const std::string *key)
+{
+    DB &db = *shards_[shard];
+    int ret = key ? db.Seek(it.ids[shard], *key, it.values[shard]) : db.Next(it.ids[shard], it.values[shard]);
+    if (ret >= 0 && db.IterKey(it.ids[shard], it.keys[shard]) < 0)
+        ret = -1;
+    it.status[shard] = ret;
+}
+
+static bool key_less(const std::string &a, const std::string &b)
+{
+#ifdef GET_FOR_SEEK_AND_NEXT_ILSM
+    // Get probing walks the 4-byte key space in integer order
+    uint32_t x = 0, y = 0;
+    memcpy(&x, a.data(), std::min(a.size(), sizeof(x)));
+    memcpy(&y, b.data(), std::min(b.size(), sizeof(y)));
+    return x < y;
+#else
+    return a < b;       // Device iterators go in bytewise key order
+#endif
+}
+
+// Returns the smallest current record of the devices
+int iLSM::ShardedDB::pick(Iter &it, std::string &value)
+{
+    it.cur = -1;
+    for (size_t shard = 0; shard < it.status.size(); shard++) {
+        int st = it.status[shard];
+        if (st < 0 && st != -2)
+            return st;
+        if (st >= 0 && (it.cur < 0 || key_less(it.keys[shard], it.keys[it.cur])))
+            it.cur = shard;
+    }
+    if (it.cur < 0)
+        return -2;
+    value.swap(it.values[it.cur]);
+    return it.status[it.cur];
+}
+
+int iLSM::ShardedDB::Seek(const unsigned int iter_id, const std::string &key, std::string &value)
+{
+    if (iter_id >= MAX_ITER_NUM || !iters_[iter_id].used)
+        return -1;
+    Iter &it = iters_[iter_id];
+    fan_out_all([&](size_t shard) { advance(it, shard, &key); });
+    return pick(it, value);
+}
+
+int iLSM::ShardedDB::Next(const unsigned int iter_id, std::string &value)
+{
+    if (iter_id >= MAX_ITER_NUM || !iters_[iter_id].used)
+        return -1;
+    Iter &it = iters_[iter_id];
+    if (it.cur < 0)
+        return -2;
+    // Only the device whose record went out moves
+    advance(it, it.cur, nullptr);
+    return pick(it, value);
+}
+
+int iLSM::ShardedDB::IterKey(const unsigned int iter_id, std::string &key)
+{
+    if (iter_id >= MAX_ITER_NUM || !iters_[iter_id].used || iters_[iter_id].cur < 0)
+        return -1;
+    key = iters_[iter_id].keys[iters_[iter_id].cur];
+    return key.size();
+}
+
+int iLSM::ShardedDB::DestroyIter(const unsigned int iter_id)
+{
+    if (iter_id >= MAX_ITER_NUM || !iters_[iter_id].used)
+        return -1;
+    Iter &it = iters_[iter_id];
+    std::vector<int> rets(shards_.size());
+    fan_out_all([&](size_t shard) { rets[shard] = shards_[shard]->DestroyIter(it.ids[shard]); });
+    lock_guard<mutex> l(iter_mtx_);
+    it = Iter();
+    for (int ret : rets) {
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int iLSM::ShardedDB::Calibrate()
+{
+    std::vector<int> rets(shards_.size());
+    fan_out_all([&](size_t shard) { rets[shard] = shards_[shard]->Calibrate(); });
+    for (int ret : rets) {
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+iLSM::TrafficStats iLSM::ShardedDB::GetTrafficStats()
+{
+    TrafficStats total;
+    for (auto &db : shards_) {
+        TrafficStats t = db->GetTrafficStats();
+        for (int i = 0; i < static_cast<int>(TrafficPath::LAST); i++)
+            total.path[i].Add(t.path[i]);
+    }
+    return total;
+}
+
+string iLSM::ShardedDB::Report()
+{
+    ReportData total;
+    string ops;
+    for (auto &db : shards_) {
+        ReportData d;
+        db->GetReport(&d);
+        uint64_t n = 0;
+        for (auto &h : d.op_stat)
+            n += h.Count();
+        ops += (ops.empty() ? "" : " / ") + to_string(n);
+        total.Add(d);
+    }
+    string msg;
+    if (shards_.size() > 1)
+        msg += "[Devices] " + to_string(shards_.size()) + ", Ops per Device " + ops + " \n";
+    return msg + DB::FormatReport(total);
+}
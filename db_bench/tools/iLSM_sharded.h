@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "iLSM.h"
+
+namespace iLSM {
+    // One iLSM::DB per KV-SSD (or namespace) behind the DB interface. Keys
+    // go to devices by consistent hashing, so adding a device moves only
+    // its share of the keys. Ops on one key touch one device; MultiGet,
+    // Write, DeleteRange, Flush and iterators fan out to the devices in
+    // parallel, and iterators merge the devices' key order.
+    class ShardedDB {
+        public:
+            ShardedDB() {}
+            ~ShardedDB() { Close(); }
+            ShardedDB(const ShardedDB &) = delete;
+            ShardedDB &operator=(const ShardedDB &) = delete;
+
+            // devs: device paths separated by ','. Every device gets options,
+            // with ".<n>" appended to filter_path if there are several; an
+            // emulator can back one device only
+            int Open(const std::string &devs);
+            int Open(const std::string &devs, const Options &options);
+            // Options of each device (e.g. one emulator each)
+            int Open(const std::vector<std::string> &devs, const std::vector<Options> &options);
+            void Close();
+
+            int Put(const std::string &key, const std::string &value);
+            int Put(const std::string &key, const std::string &value, PutCallback done);
+            void Flush();
+            int Delete(const std::string &key);
+            int DeleteRange(const std::string &begin, const std::string &end);
+            // The ops of each device go as one DB::Write(), in parallel:
+            // atomic per device only. Returns the first failure
+            int Write(const WriteBatch &batch);
+            int Get(const std::string &key, std::string &value);
+            int Get(const std::string &key, void *buf, uint32_t buf_len);
+            int MultiGet(const std::vector<Slice> &keys, std::vector<std::string> *values,
+                    std::vector<int> *statuses);
+            // Async ops of the device of the key (see DB::PutAsync()); a
+            // MultiGetAsync() completes once every device answered
+            std::future<int> PutAsync(const std::string &key, const std::string &value);
+            void PutAsync(const std::string &key, const std::string &value, PutCallback done,
+                    CompletionQueue *cq = nullptr);
+            std::future<GetResult> GetAsync(const std::string &key);
+            void GetAsync(const std::string &key, GetCallback done, CompletionQueue *cq = nullptr);
+            std::future<MultiGetResult> MultiGetAsync(const std::vector<Slice> &keys);
+            void MultiGetAsync(const std::vector<Slice> &keys, MultiGetCallback done,
+                    CompletionQueue *cq = nullptr);
+            // One iterator per device; Seek()/Next() return the smallest of
+            // their current records
+            int CreateIter(unsigned int &iter_id);
+            int Seek(const unsigned int iter_id, const std::string &key, std::string &value);
+            int Next(const unsigned int iter_id, std::string &value);
+            int DestroyIter(const unsigned int iter_id);
+            int IterKey(const unsigned int iter_id, std::string &key);
+            int Calibrate();
+            const Options &GetOptions() const { return shards_[0]->GetOptions(); }
+            TrafficStats GetTrafficStats();
+            // The devices' reports merged into one
+            std::string Report();
+
+            size_t NumShards() const { return shards_.size(); }
+            DB &Shard(size_t shard) { return *shards_[shard]; }
+            // Device of key
+            size_t ShardOf(const Slice &key) const;
+
+        private:
+            static const int kVirtualNodes = 128;   // Ring points per device
+
+            // Threads running the fan-out work of one device. The pool grows
+            // whenever a task finds no idle thread, so it ends up as large as
+            // the # of callers fanning out at once and none waits behind
+            // another; each device sees the same threads (and their
+            // submission contexts) again
+            struct Pool {
+                std::mutex mtx;
+                std::condition_variable cv;
+                std::deque<std::function<void()>> tasks;
+                size_t idle = 0;
+                bool stop = false;
+                std::vector<std::thread> threads;
+            };
+
+            // Merged iterator: a device iterator each and their current records
+            struct Iter {
+                bool used = false;
+                std::vector<unsigned int> ids;
+                std::vector<int> status;    // Of the current record: value size, -2 at the end, <0 on failure
+                std::vector<std::string> keys;
+                std::vector<std::string> values;
+                int cur = -1;               // Device of the record last returned
+            };
+
+            void work(Pool *p);
+            // fn(shard) for every shard given, in parallel; returns once all ran
+            void fan_out(const std::vector<size_t> &shards, const std::function<void(size_t)> &fn);
+            void fan_out_all(const std::function<void(size_t)> &fn);
+            void advance(Iter &it, size_t shard, const std::string *key);
+            int pick(Iter &it, std::string &value);
+
+            std::vector<std::unique_ptr<DB>> shards_;
+            std::vector<std::pair<uint32_t, uint32_t>> ring_;  // (point, shard), by point
+            std::vector<std::unique_ptr<Pool>> pools_;       // One per shard
+            std::mutex iter_mtx_;       // Iterator slot allocation only
+            Iter iters_[MAX_ITER_NUM];
+    };
+}
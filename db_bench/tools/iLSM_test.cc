@@ -0,0 +1,1552 @@
+#include "tools/iLSM.h"
+#include "tools/iLSM_sharded.h"
+#include "../../firmware/nvme_kv_payload.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "test_util/testharness.h"
+
+namespace iLSM {
+
+class iLSMTest : public testing::Test {
+ public:
+  iLSMTest() {
+    EmulatorOptions emu_options;
+    emu_options.cmd_latency_ns = 0;
+    emu_options.pcie_mbps = 0;
+    emu_ = std::make_shared<Emulator>(emu_options);
+    options_.emulator = emu_;
+  }
+
+  // 4-byte keys, laid out the way the Get-based iterator probes them
+  static std::string Key(uint32_t k) {
+    return std::string(reinterpret_cast<const char*>(&k), sizeof(k));
+  }
+
+  static std::string Value(size_t len, char seed) {
+    std::string v(len, 0);
+    for (size_t i = 0; i < len; i++) {
+      v[i] = static_cast<char>(seed + i * 7);
+    }
+    return v;
+  }
+
+  void PutAndCheck(DB& db, uint32_t k, size_t len) {
+    std::string value = Value(len, static_cast<char>(k));
+    ASSERT_EQ(0, db.Put(Key(k), value));
+
+    std::string stored;
+    ASSERT_TRUE(emu_->Lookup(Key(k), &stored));
+    ASSERT_EQ(value, stored) << "value size " << len;
+
+    std::string got;
+    ASSERT_EQ(static_cast<int>(len), db.Get(Key(k), got));
+    ASSERT_EQ(value, got);
+  }
+
+  std::shared_ptr<Emulator> emu_;
+  Options options_;
+};
+
+TEST_F(iLSMTest, PiggybackedValues) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // Single BANDSLIM_WRITE up to 32B, WRITE + TRANSFERs beyond
+  uint32_t k = 0;
+  for (size_t len : {1, 3, 4, 17, 32, 33, 84, 85, 100, 127}) {
+    PutAndCheck(db, k++, len);
+  }
+}
+
+TEST_F(iLSMTest, PayloadLayout) {
+  // What the host packs into a command the device gathers back, and only
+  // the payload dwords of the layout are touched
+  struct Layout {
+    const unsigned char* dwords;
+    unsigned int slots;
+  };
+  for (const Layout& l : {Layout{kv_write_dwords, KV_WRITE_SLOTS},
+                          Layout{kv_transfer_dwords, KV_TRANSFER_SLOTS}}) {
+    for (unsigned int len = 0; len <= l.slots * 4; len++) {
+      std::string value = Value(len, static_cast<char>(len));
+      uint32_t dw[16] = {0};
+      kv_payload_pack(dw, l.dwords, l.slots, value.data(), len);
+      std::string got(len, 0);
+      kv_payload_gather(&got[0], dw, l.dwords, 0, len);
+      ASSERT_EQ(value, got) << "payload size " << len;
+      for (int i = 0; i < 16; i++) {
+        if (std::find(l.dwords, l.dwords + l.slots, i) == l.dwords + l.slots) {
+          ASSERT_EQ(0u, dw[i]) << "CDW" << i;
+        }
+      }
+    }
+  }
+  ASSERT_EQ(32, KV_WRITE_PAYLOAD);
+  ASSERT_EQ(52, KV_TRANSFER_PAYLOAD);
+}
+
+TEST_F(iLSMTest, PackedVlogRecords) {
+  // Values of any size packed back to back the way the firmware does it,
+  // with aligned word stores only; Transfer fragments land last, in
+  // reverse, and merge with their neighbours
+  std::vector<uint32_t> words(16384 / 4, 0xA5A5A5A5);
+  unsigned char* vlog = reinterpret_cast<unsigned char*>(words.data());
+  std::string expected;
+  struct Fragment {
+    uint32_t ofs;
+    uint32_t dw[16];
+    uint32_t len;
+  };
+  std::vector<Fragment> fragments;
+  uint32_t k = 0;
+  for (uint32_t len : {1, 3, 5, 32, 33, 57, 101, 2, 7, 84, 250}) {
+    std::string value = Value(len, static_cast<char>(k++));
+    uint32_t header = KV_VLOG_HEADER(len, k % 2 ? VALUE_COMPRESSED : 0);
+    uint32_t piggyback = std::min<uint32_t>(len, KV_WRITE_PAYLOAD);
+    uint32_t dw[16] = {0};
+    kv_payload_pack(dw, kv_write_dwords, KV_WRITE_SLOTS, value.data(), piggyback);
+    KV_VLOG_CURSOR c;
+    kv_vlog_open(&c, vlog + expected.size());
+    kv_vlog_put(&c, header, KV_VLOG_HEADER_BYTES);
+    kv_payload_append(&c, dw, kv_write_dwords, 0, piggyback);
+    kv_vlog_close(&c);
+    for (uint32_t pos = piggyback; pos < len; pos += KV_TRANSFER_PAYLOAD) {
+      Fragment f;
+      f.ofs = expected.size() + KV_VLOG_HEADER_BYTES + pos;
+      f.len = std::min<uint32_t>(len - pos, KV_TRANSFER_PAYLOAD);
+      memset(f.dw, 0, sizeof(f.dw));
+      kv_payload_pack(f.dw, kv_transfer_dwords, KV_TRANSFER_SLOTS, value.data() + pos, f.len);
+      fragments.push_back(f);
+    }
+    expected.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    expected += value;
+  }
+  for (auto f = fragments.rbegin(); f != fragments.rend(); ++f) {
+    kv_payload_gather_packed(vlog + f->ofs, f->dw, kv_transfer_dwords, 0, f->len);
+  }
+  ASSERT_EQ(expected, std::string(reinterpret_cast<char*>(vlog), expected.size()));
+  ASSERT_EQ(0xA5, vlog[expected.size()]);
+
+  // BATCH_PUT: a page of dword-padded records lands on the next 4KB
+  // boundary and its values slide down behind the last record in place
+  uint32_t page = (expected.size() + 4095) / 4096 * 4096;
+  uint32_t pos = 0;
+  std::vector<std::string> values;
+  for (uint32_t len : {9, 1, 30, 6}) {
+    IterRecord rec = {static_cast<uint16_t>(3 + len % 5), 0, len};
+    values.push_back(Value(len, static_cast<char>(len)));
+    memcpy(vlog + page + pos, &rec, sizeof(rec));
+    memset(vlog + page + pos + sizeof(rec), 'k', rec.key_size);
+    memcpy(vlog + page + pos + sizeof(rec) + rec.key_size, values.back().data(), len);
+    pos += IterRecord::Size(rec.key_size, len);
+  }
+  KV_VLOG_CURSOR c;
+  kv_vlog_open(&c, vlog + expected.size());
+  pos = 0;
+  for (const std::string& v : values) {
+    IterRecord rec;
+    memcpy(&rec, vlog + page + pos, sizeof(rec));
+    kv_vlog_put(&c, rec.value_size, KV_VLOG_HEADER_BYTES);
+    kv_vlog_append(&c, vlog + page + pos + sizeof(rec) + rec.key_size, rec.value_size);
+    pos += IterRecord::Size(rec.key_size, rec.value_size);
+    uint32_t header = v.size();
+    expected.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    expected += v;
+  }
+  kv_vlog_close(&c);
+  ASSERT_EQ(expected, std::string(reinterpret_cast<char*>(vlog), expected.size()));
+  ASSERT_NE(0u, expected.size() % 4);
+}
+
+TEST_F(iLSMTest, PrpValues) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // PRP only up to a page, whole pages + piggybacked tail beyond
+  uint32_t k = 100;
+  for (size_t len : {128, 1000, 4096, 4097, 6000, 8192, 12345, 16384}) {
+    PutAndCheck(db, k++, len);
+  }
+}
+
+TEST_F(iLSMTest, TransferModes) {
+  // DMA bytes moved by putting one value in the given mode
+  auto put_dma = [&](TransferMode mode, uint32_t k, size_t len) {
+    options_.transfer_mode = mode;
+    DB db;
+    EXPECT_EQ(0, db.Open("", options_));
+    uint64_t before = emu_->GetStats().dma_bytes;
+    std::string value = Value(len, static_cast<char>(k));
+    EXPECT_EQ(0, db.Put(Key(k), value));
+    std::string stored;
+    EXPECT_TRUE(emu_->Lookup(Key(k), &stored));
+    EXPECT_EQ(value, stored);
+    return emu_->GetStats().dma_bytes - before;
+  };
+
+  ASSERT_EQ(4096u, put_dma(TransferMode::KVSSD, 200, 20));
+  ASSERT_EQ(8192u, put_dma(TransferMode::KVSSD, 201, 5000));
+  ASSERT_EQ(0u, put_dma(TransferMode::PIGGY, 202, 1000));
+  ASSERT_EQ(0u, put_dma(TransferMode::PIGGY, 203, 9000));
+  // A piggybacked record (4B header and value) has to fit a 16KB slice
+  ASSERT_EQ(0u, put_dma(TransferMode::PIGGY, 207, 16384 - KV_VLOG_HEADER_BYTES));
+  ASSERT_EQ(16384u, put_dma(TransferMode::PIGGY, 208, 16384 - KV_VLOG_HEADER_BYTES + 1));
+  struct nvme_passthru_cmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = 0xA7;  // BANDSLIM_WRITE
+  cmd.cdw2 = 209;
+  cmd.cdw10 = (4u << 24) | (16384 - KV_VLOG_HEADER_BYTES + 1);
+  cmd.cdw13 = 1;
+  ASSERT_NE(0, emu_->Execute(cmd));
+  ASSERT_EQ(0u, put_dma(TransferMode::ADAPT, 204, 100));
+  ASSERT_EQ(4096u, put_dma(TransferMode::ADAPT, 205, 4100));
+  // Without combination transfer the 4B tail takes a page of its own
+  options_.combi_threshold = 0;
+  ASSERT_EQ(8192u, put_dma(TransferMode::ADAPT, 206, 4100));
+}
+
+TEST_F(iLSMTest, Calibrate) {
+  // 20us per command, 20ns per byte: a PRP page costs as much as ~4.8
+  // piggybacking commands, an extra PRP page as much as ~3.8
+  EmulatorOptions emu_options;
+  emu_options.cmd_latency_ns = 20000;
+  emu_options.pcie_mbps = 50;
+  options_.emulator = std::make_shared<Emulator>(emu_options);
+  options_.calibrate = true;
+
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // WRITE + 3 TRANSFERs, and 3 TRANSFERs of tail
+  ASSERT_EQ(32u + 3 * 52u, db.GetOptions().piggyback_threshold);
+  ASSERT_EQ(3 * 52u, db.GetOptions().combi_threshold);
+  ASSERT_EQ(std::string::npos, db.Report().find("[NVME_CMD_KV_PUT]"));
+}
+
+TEST_F(iLSMTest, VariableLengthKeys) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // Inline keys, and long keys spilling into the piggybacked stream, over
+  // WRITE only, WRITE + TRANSFERs, PRP and PRP + piggybacked tail
+  for (size_t key_len : {1, 4, 8, 15, 16, 17, 19, 40, 255}) {
+    for (size_t len : {8, 36, 300, 4096, 4100}) {
+      std::string key = Value(key_len, static_cast<char>(len));
+      std::string value = Value(len, static_cast<char>(key_len));
+      ASSERT_EQ(0, db.Put(key, value)) << key_len << "/" << len;
+
+      std::string stored;
+      ASSERT_TRUE(emu_->Lookup(key, &stored)) << key_len << "/" << len;
+      ASSERT_EQ(value, stored);
+      std::string got;
+      ASSERT_EQ(static_cast<int>(len), db.Get(key, got));
+    }
+  }
+  // Keys sharing the inline 16B stay apart
+  std::string got;
+  ASSERT_EQ(-2, db.Get(Value(16, 8) + "y", got));
+
+  ASSERT_EQ(-EINVAL, db.Put(std::string(256, 'k'), Value(8, 0)));
+  ASSERT_EQ(-EINVAL, db.Put("", Value(8, 0)));
+}
+
+TEST_F(iLSMTest, ShortKeysTakeNoExtraCommand) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  uint64_t before = emu_->GetStats().commands;
+  ASSERT_EQ(0, db.Put(std::string(16, 'k'), Value(32, 0)));
+  ASSERT_EQ(before + 1, emu_->GetStats().commands);
+  // A 17B key needs one TRANSFER for its last byte
+  ASSERT_EQ(0, db.Put(std::string(17, 'k'), Value(32, 0)));
+  ASSERT_EQ(before + 3, emu_->GetStats().commands);
+}
+
+TEST_F(iLSMTest, OverwriteAndMissingKey) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  PutAndCheck(db, 7, 64);
+  PutAndCheck(db, 7, 5000);
+  PutAndCheck(db, 7, 8);
+  ASSERT_EQ(1u, emu_->NumKeys());
+
+  std::string got;
+  ASSERT_EQ(-2, db.Get(Key(8), got));
+}
+
+TEST_F(iLSMTest, ZeroCopyGet) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  std::string long_key = Value(40, 3);
+  ASSERT_EQ(0, db.Put(Key(1), Value(100, 1)));
+  ASSERT_EQ(0, db.Put(long_key, Value(6000, 2)));
+
+  void* buf = nullptr;
+  ASSERT_EQ(0, posix_memalign(&buf, 4096, 8192));
+  ASSERT_EQ(100, db.Get(Key(1), buf, 8192));
+  ASSERT_EQ(Value(100, 1), std::string(static_cast<char*>(buf), 100));
+  ASSERT_EQ(6000, db.Get(long_key, buf, 8192));
+  ASSERT_EQ(Value(6000, 2), std::string(static_cast<char*>(buf), 6000));
+  // Too small: the full length comes back, the first page holds its head
+  ASSERT_EQ(6000, db.Get(long_key, buf, 4096));
+  ASSERT_EQ(Value(4096, 2), std::string(static_cast<char*>(buf), 4096));
+  ASSERT_EQ(-2, db.Get(Key(2), buf, 4096));
+  ASSERT_EQ(-EINVAL, db.Get(Key(1), static_cast<char*>(buf) + 8, 4096));
+  ASSERT_EQ(-EINVAL, db.Get(Key(1), buf, 100));
+  free(buf);
+}
+
+TEST_F(iLSMTest, MultiGet) {
+  DB db;
+  options_.multiget_batch = 16;
+  ASSERT_EQ(0, db.Open("", options_));
+  // Even keys only, long keys among them, a few values over a page
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < 40; i++) {
+    keys.push_back(i % 5 == 0 ? Value(40, static_cast<char>(i)) : Key(i));
+    if (i % 2 == 0) {
+      size_t len = i % 8 == 0 ? 5000 : 10 + i;
+      ASSERT_EQ(0, db.Put(keys[i], Value(len, static_cast<char>(i))));
+    }
+  }
+  keys.push_back(std::string(256, 'k'));
+
+  std::vector<Slice> slices(keys.begin(), keys.end());
+  std::vector<std::string> values;
+  std::vector<int> statuses;
+  uint64_t before = emu_->GetStats().commands;
+  ASSERT_EQ(0, db.MultiGet(slices, &values, &statuses));
+  ASSERT_EQ(keys.size(), values.size());
+  ASSERT_EQ(keys.size(), statuses.size());
+  for (uint32_t i = 0; i < 40; i++) {
+    if (i % 2 == 0) {
+      size_t len = i % 8 == 0 ? 5000 : 10 + i;
+      ASSERT_EQ(0, statuses[i]) << i;
+      ASSERT_EQ(Value(len, static_cast<char>(i)), values[i]);
+    } else {
+      ASSERT_EQ(-2, statuses[i]) << i;
+    }
+  }
+  ASSERT_EQ(-EINVAL, statuses[40]);
+  // 3 batches, each retried at most once with a grown buffer
+  ASSERT_LE(emu_->GetStats().commands - before, 6u);
+  ASSERT_NE(std::string::npos, db.Report().find("[MultiGet]"));
+}
+
+TEST_F(iLSMTest, Iterator) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_EQ(0, db.Put(Key(1), Value(8, 1)));
+  ASSERT_EQ(0, db.Put(Key(2), Value(12, 2)));
+  ASSERT_EQ(0, db.Put(Key(5), Value(20, 5)));
+
+  unsigned int iter_id = 1000;
+  ASSERT_EQ(0, db.CreateIter(iter_id));
+  ASSERT_LT(iter_id, static_cast<unsigned int>(MAX_ITER_NUM));
+
+  std::string value, key;
+  ASSERT_EQ(8, db.Seek(iter_id, Key(0), value));
+  ASSERT_EQ(Value(8, 1), value);
+  ASSERT_EQ(12, db.Next(iter_id, value));
+  ASSERT_EQ(Value(12, 2), value);
+  ASSERT_EQ(20, db.Next(iter_id, value));
+  ASSERT_EQ(4, db.IterKey(iter_id, key));
+  ASSERT_EQ(Key(5), key);
+  ASSERT_EQ(-2, db.Next(iter_id, value));
+  ASSERT_EQ(-2, db.Seek(iter_id, Key(6), value));
+  ASSERT_EQ(0, db.DestroyIter(iter_id));
+}
+
+TEST_F(iLSMTest, ScanIsBatched) {
+  DB db;
+  options_.iter_page_size = 4096;
+  ASSERT_EQ(0, db.Open("", options_));
+  // Sparse keys (one Get probe per missing key would take ~10^6 probes),
+  // and one value bigger than a page
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < 200; i++) {
+    keys.push_back(std::string(1, 'a') + Value(8 + i % 9, static_cast<char>(i)));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  for (size_t i = 0; i < keys.size(); i++) {
+    size_t len = i == 50 ? 10000 : 8 + i % 40;
+    ASSERT_EQ(0, db.Put(keys[i], Value(len, static_cast<char>(i))));
+  }
+
+  unsigned int iter_id;
+  ASSERT_EQ(0, db.CreateIter(iter_id));
+  uint64_t before = emu_->GetStats().commands;
+  std::string value, key;
+  int ret = db.Seek(iter_id, "a", value);
+  for (size_t i = 0; i < keys.size(); i++) {
+    size_t len = i == 50 ? 10000 : 8 + i % 40;
+    ASSERT_EQ(static_cast<int>(len), ret) << i;
+    ASSERT_EQ(Value(len, static_cast<char>(i)), value);
+    db.IterKey(iter_id, key);
+    ASSERT_EQ(keys[i], key);
+    ret = db.Next(iter_id, value);
+  }
+  ASSERT_EQ(-2, ret);
+  // ~60B records, 4KB pages, + the grown page for the big value
+  ASSERT_LT(emu_->GetStats().commands - before, 12u);
+  ASSERT_EQ(0, db.DestroyIter(iter_id));
+  ASSERT_NE(std::string::npos, db.Report().find("[Seek/Next] Pages"));
+}
+
+TEST_F(iLSMTest, TrafficByPath) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_EQ(0, db.Put(Key(1), Value(100, 1)));    // WRITE + 2 TRANSFERs
+  ASSERT_EQ(0, db.Put(Key(2), Value(2000, 2)));   // PUT, 1 page
+  ASSERT_EQ(0, db.Put(Key(3), Value(5000, 3)));   // PUT, 1 page + 904B tail
+                                                  // in 18 TRANSFERs
+  std::string got;
+  ASSERT_EQ(5000, db.Get(Key(3), got));           // GET, 8KB buffer
+
+  TrafficStats t = db.GetTrafficStats();
+  ASSERT_EQ(1u, t[TrafficPath::PIGGY].ops);
+  ASSERT_EQ(3u, t[TrafficPath::PIGGY].commands);
+  ASSERT_EQ(0u, t[TrafficPath::PIGGY].dma_bytes);
+  ASSERT_EQ(104u, t[TrafficPath::PIGGY].payload_bytes);
+  ASSERT_EQ(1u, t[TrafficPath::PRP].commands);
+  ASSERT_EQ(4096u, t[TrafficPath::PRP].dma_bytes);
+  ASSERT_EQ(1u + 18u, t[TrafficPath::COMBI].commands);
+  ASSERT_EQ(4096u, t[TrafficPath::COMBI].dma_bytes);
+  ASSERT_EQ(19u * 64, t[TrafficPath::COMBI].cmd_bytes);
+  ASSERT_EQ(19u * 16, t[TrafficPath::COMBI].cpl_bytes);
+  ASSERT_EQ(1u, t[TrafficPath::READ].ops);
+  ASSERT_EQ(5004u, t[TrafficPath::READ].payload_bytes);
+  ASSERT_GE(t[TrafficPath::READ].dma_bytes, 8192u);
+
+  // Puts agree with what the device saw
+  Emulator::Stats es = emu_->GetStats();
+  Traffic total = t.Total();
+  ASSERT_EQ(es.commands, total.commands);
+  ASSERT_EQ(es.cmd_bytes, total.cmd_bytes);
+  ASSERT_DOUBLE_EQ((64 + 4096 + 16) / 2004.0,
+                   t[TrafficPath::PRP].Amplification());
+  ASSERT_NE(std::string::npos, db.Report().find("[Traffic COMBI] Ops 1"));
+}
+
+TEST(iLSMHistogramTest, Percentiles) {
+  Histogram h;
+  for (uint64_t v = 1; v <= 100000; v++) {
+    h.Add(v);
+  }
+  h.Add(5000000);
+  HistogramSnapshot snap;
+  snap.Merge(h);
+  ASSERT_EQ(100001u, snap.Count());
+  ASSERT_EQ(5000000u, snap.Max());
+  // Within one sub-bucket (1/16) of the exact rank
+  for (double p : {50.0, 90.0, 99.0, 99.9}) {
+    double exact = p * 1000.01;
+    ASSERT_NEAR(exact, snap.Percentile(p), exact / 16) << p;
+  }
+  ASSERT_EQ(5000000.0, snap.Percentile(100));
+  // Bucket bounds tile the value range
+  for (int i = 0; i + 1 < Histogram::kNumBuckets; i++) {
+    ASSERT_EQ(Histogram::BucketLower(i) + Histogram::BucketWidth(i),
+              Histogram::BucketLower(i + 1));
+    ASSERT_EQ(i, Histogram::Bucket(Histogram::BucketLower(i)));
+  }
+}
+
+TEST_F(iLSMTest, CommandsPerPut) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // 1 command for 32B, WRITE + 2 TRANSFERs for 100B
+  ASSERT_EQ(0, db.Put(Key(1), Value(32, 1)));
+  ASSERT_EQ(0, db.Put(Key(2), Value(100, 2)));
+  std::string report = db.Report();
+  ASSERT_NE(std::string::npos, report.find("[Put] Elapse Time"));
+  ASSERT_NE(std::string::npos, report.find("P99.9"));
+  ASSERT_NE(std::string::npos, report.find("Commands per Put: Average 2.0"));
+  ASSERT_NE(std::string::npos, report.find("Max 3 "));
+}
+
+TEST_F(iLSMTest, CpuPerOp) {
+  // The emulator completes inline: nothing to poll
+  options_.poll_completions = true;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_FALSE(db.GetOptions().poll_completions);
+  ASSERT_FALSE(db.GetOptions().async_io);
+  ASSERT_EQ(std::string::npos, db.Report().find("[CPU]"));
+  ASSERT_EQ(0, db.Put(Key(1), Value(8, 1)));
+  std::string report = db.Report();
+  ASSERT_NE(std::string::npos, report.find("[CPU] "));
+  ASSERT_NE(std::string::npos, report.find("us per Op"));
+  ASSERT_NE(std::string::npos, report.find("Completions by Interrupt"));
+}
+
+TEST_F(iLSMTest, TransfersOutOfOrder) {
+  // Fragments of a value arrive last first; each lands by its sequence #
+  EmulatorOptions emu_options;
+  emu_options.cmd_latency_ns = 0;
+  emu_options.pcie_mbps = 0;
+  emu_options.reverse_batches = true;
+  emu_ = std::make_shared<Emulator>(emu_options);
+  options_.emulator = emu_;
+  options_.transfer_mode = TransferMode::PIGGY;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  for (size_t len : {33, 100, 2048, 9000, 16384}) {
+    PutAndCheck(db, static_cast<uint32_t>(len), len);
+  }
+  std::string key = Value(200, 9);
+  ASSERT_EQ(0, db.Put(key, Value(3000, 9)));
+  std::string stored;
+  ASSERT_TRUE(emu_->Lookup(key, &stored));
+  ASSERT_EQ(Value(3000, 9), stored);
+}
+
+TEST_F(iLSMTest, ValuesPastMdts) {
+  // Segments and chunks of a batch arrive last first as well
+  EmulatorOptions emu_options;
+  emu_options.cmd_latency_ns = 0;
+  emu_options.pcie_mbps = 0;
+  emu_options.reverse_batches = true;
+  emu_ = std::make_shared<Emulator>(emu_options);
+  options_.emulator = emu_;
+  options_.combi_threshold = 256;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // One page past MDTS; a sub-page tail by combination transfer; several
+  // segments, with a key too long to fit in the command
+  PutAndCheck(db, 1, 524288 + 4096);
+  PutAndCheck(db, 2, 3 * 524288 + 100);
+  std::string key = Value(40, 7);
+  std::string value = Value(5 * 1024 * 1024 + 1234, 7);
+  uint64_t before = emu_->GetStats().commands;
+  ASSERT_EQ(0, db.Put(key, value));
+  // 11 PUT segments, then the key rest in one Transfer
+  ASSERT_EQ(12u, emu_->GetStats().commands - before);
+  std::string got;
+  before = emu_->GetStats().commands;
+  ASSERT_EQ(static_cast<int>(value.size()), db.Get(key, got));
+  ASSERT_TRUE(value == got);
+  // One GET of up to MDTS, then the other 10 chunks
+  ASSERT_EQ(11u, emu_->GetStats().commands - before);
+
+  std::vector<std::string> values;
+  std::vector<int> statuses;
+  std::vector<Slice> keys = {Key(2), key, Key(3)};
+  ASSERT_EQ(0, db.MultiGet(keys, &values, &statuses));
+  ASSERT_EQ(std::vector<int>({0, 0, -2}), statuses);
+  ASSERT_TRUE(Value(3 * 524288 + 100, 2) == values[0]);
+  ASSERT_TRUE(value == values[1]);
+
+  // Zero-copy Get fills the buffer and reports the whole length
+  void* buf = nullptr;
+  ASSERT_EQ(0, posix_memalign(&buf, 4096, 4096));
+  ASSERT_EQ(static_cast<int>(value.size()), db.Get(key, buf, 4096));
+  ASSERT_EQ(0, memcmp(buf, value.data(), 4096));
+  free(buf);
+
+  ASSERT_EQ(-EINVAL, db.Put(Key(4), std::string(16 * 1024 * 1024, 'v')));
+}
+
+TEST_F(iLSMTest, ConcurrentPiggybackStreams) {
+  // Multi-command values of several threads interleave at the device
+  options_.transfer_mode = TransferMode::PIGGY;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  const int kThreads = 4;
+  const int kKeysPerThread = 50;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kKeysPerThread; i++) {
+        uint32_t k = t * kKeysPerThread + i;
+        ASSERT_EQ(0, db.Put(Key(k), Value(500 + k, static_cast<char>(k))));
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  for (uint32_t k = 0; k < kThreads * kKeysPerThread; k++) {
+    std::string stored;
+    ASSERT_TRUE(emu_->Lookup(Key(k), &stored)) << k;
+    ASSERT_EQ(Value(500 + k, static_cast<char>(k)), stored) << k;
+  }
+}
+
+TEST_F(iLSMTest, StreamSlots) {
+  // The device reassembles MAX_OPEN_STREAMS pairs, in slot id % that: a new
+  // stream evicts the one open in its slot
+  options_.transfer_mode = TransferMode::PIGGY;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  std::string key = Value(20, 3);
+  ASSERT_EQ(0, db.Put(key, Value(10, 3)));
+  auto to_cmd = [](uint8_t opcode, const uint32_t* dw) {
+    struct nvme_passthru_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = opcode;
+    cmd.cdw2 = dw[2];
+    cmd.cdw3 = dw[3];
+    cmd.metadata = dw[4] | (static_cast<uint64_t>(dw[5]) << 32);
+    cmd.addr = dw[6] | (static_cast<uint64_t>(dw[7]) << 32);
+    cmd.metadata_len = dw[8];
+    cmd.data_len = dw[9];
+    cmd.cdw10 = dw[10];
+    cmd.cdw11 = dw[11];
+    cmd.cdw12 = dw[12];
+    cmd.cdw13 = dw[13];
+    cmd.cdw14 = dw[14];
+    cmd.cdw15 = dw[15];
+    return cmd;
+  };
+  // DELETEs of the 20-byte key: its last 4 bytes follow by Transfer
+  uint32_t dw[16] = {0};
+  memcpy(&dw[2], key.data(), 8);
+  memcpy(&dw[14], key.data() + 8, 8);
+  dw[10] = 20u << 24;
+  for (uint32_t stream : {1u, 1u + MAX_OPEN_STREAMS}) {
+    dw[13] = stream;
+    struct nvme_passthru_cmd cmd = to_cmd(0xA2, dw);
+    ASSERT_EQ(0, emu_->Execute(cmd));
+  }
+  uint32_t tdw[16] = {0};
+  kv_payload_pack(tdw, kv_transfer_dwords, KV_TRANSFER_SLOTS, key.data() + 16, 4);
+  tdw[2] = 1u << 16;
+  struct nvme_passthru_cmd cmd = to_cmd(0xA9, tdw);
+  ASSERT_NE(0, emu_->Execute(cmd));  // Evicted
+  std::string got;
+  ASSERT_TRUE(emu_->Lookup(key, &got));
+  tdw[2] = (1u + MAX_OPEN_STREAMS) << 16;
+  cmd = to_cmd(0xA9, tdw);
+  ASSERT_EQ(0, emu_->Execute(cmd));
+  ASSERT_FALSE(emu_->Lookup(key, &got));
+
+  // More threads than slots: no two puts in flight share one
+  const int kThreads = 96;
+  const int kKeysPerThread = 5;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kKeysPerThread; i++) {
+        uint32_t k = t * kKeysPerThread + i;
+        ASSERT_EQ(0, db.Put(Key(k), Value(300 + k, static_cast<char>(k))));
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  for (uint32_t k = 0; k < kThreads * kKeysPerThread; k++) {
+    std::string stored;
+    ASSERT_TRUE(emu_->Lookup(Key(k), &stored)) << k;
+    ASSERT_EQ(Value(300 + k, static_cast<char>(k)), stored) << k;
+  }
+
+  // The slots are the device's: a second DB on it could take a slot the
+  // first one has open, so it is turned away until the first one closes
+  DB other;
+  ASSERT_EQ(-EBUSY, other.Open("", options_));
+  db.Close();
+  ASSERT_EQ(0, other.Open("", options_));
+  ASSERT_EQ(-EBUSY, db.Open("", options_));
+  other.Close();
+  ASSERT_EQ(0, db.Open("", options_));
+
+  // Same for a device, across processes too (flock)
+  Options dev_options;
+  DB dev;
+  DB dev2;
+  ASSERT_EQ(0, dev.Open("/dev/null", dev_options));
+  ASSERT_EQ(-EBUSY, dev2.Open("/dev/null", dev_options));
+  dev.Close();
+  ASSERT_EQ(0, dev2.Open("/dev/null", dev_options));
+}
+
+TEST_F(iLSMTest, ConcurrentPuts) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  const int kThreads = 4;
+  const int kKeysPerThread = 200;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kKeysPerThread; i++) {
+        uint32_t k = t * kKeysPerThread + i;
+        ASSERT_EQ(0, db.Put(Key(k), Value(32, static_cast<char>(k))));
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  ASSERT_EQ(static_cast<size_t>(kThreads * kKeysPerThread), emu_->NumKeys());
+
+  std::string report = db.Report();
+  ASSERT_NE(std::string::npos, report.find("[Put]"));
+  ASSERT_NE(std::string::npos, report.find("[NVME_CMD_KV_BANDSLIM_WRITE]"));
+}
+
+TEST_F(iLSMTest, EmulatorChannels) {
+  // 2ms per command: 4 threads x 20 one-command puts take 160ms on one
+  // channel, about a quarter of that on four
+  const int kThreads = 4;
+  const int kKeysPerThread = 20;
+  for (unsigned int channels : {1u, 4u}) {
+    EmulatorOptions emu_options;
+    emu_options.cmd_latency_ns = 2000000;
+    emu_options.pcie_mbps = 0;
+    emu_options.channels = channels;
+    options_.emulator = std::make_shared<Emulator>(emu_options);
+    DB db;
+    ASSERT_EQ(0, db.Open("", options_));
+
+    auto st = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&, t]() {
+        for (int i = 0; i < kKeysPerThread; i++) {
+          uint32_t k = t * kKeysPerThread + i;
+          ASSERT_EQ(0, db.Put(Key(k), Value(32, static_cast<char>(k))));
+        }
+      });
+    }
+    for (auto& th : threads) {
+      th.join();
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - st).count();
+    if (channels == 1) {
+      ASSERT_GE(ms, 160);
+    } else {
+      ASSERT_LT(ms, 120);
+    }
+  }
+}
+
+TEST_F(iLSMTest, ThreadContextsRetire) {
+  // A thread's context goes when the thread exits; its stats stay
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  for (uint32_t k = 0; k < 20; k++) {
+    std::thread([&, k]() {
+      ASSERT_EQ(0, db.Put(Key(k), Value(100, static_cast<char>(k))));
+    }).join();
+  }
+  ASSERT_EQ(0, db.Put(Key(20), Value(100, 20)));
+  ReportData d;
+  db.GetReport(&d);
+  ASSERT_EQ(21u, d.num_contexts);
+  ASSERT_EQ(20u, d.retired_contexts);
+  ASSERT_NE(std::string::npos, db.Report().find("/ 21 = Average"));
+  ASSERT_EQ(21u, db.GetTrafficStats().Total().ops);
+
+  // Entries of a closed DB are dropped, not reused
+  db.Close();
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_EQ(0, db.Put(Key(21), Value(100, 21)));
+  db.GetReport(&d);
+  ASSERT_EQ(1u, d.num_contexts);
+  ASSERT_EQ(0u, d.retired_contexts);
+  std::string got;
+  ASSERT_EQ(100, db.Get(Key(3), got));
+  ASSERT_EQ(Value(100, 3), got);
+}
+
+TEST_F(iLSMTest, AsyncOps) {
+  options_.async_threads = 4;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  const int kKeys = 200;
+
+  // One thread keeps all the ops in flight
+  std::vector<std::future<int>> puts;
+  for (int k = 0; k < kKeys; k++) {
+    puts.push_back(db.PutAsync(Key(k), Value(64 + k, static_cast<char>(k))));
+  }
+  for (auto& f : puts) {
+    ASSERT_EQ(0, f.get());
+  }
+  ASSERT_EQ(static_cast<size_t>(kKeys), emu_->NumKeys());
+  std::vector<std::future<GetResult>> gets;
+  for (int k = 0; k < kKeys + 1; k++) {
+    gets.push_back(db.GetAsync(Key(k)));
+  }
+  for (int k = 0; k < kKeys; k++) {
+    GetResult r = gets[k].get();
+    ASSERT_EQ(64 + k, r.status);
+    ASSERT_EQ(Value(64 + k, static_cast<char>(k)), r.value);
+  }
+  ASSERT_EQ(-2, gets[kKeys].get().status);
+
+  // Callbacks through a completion queue run on the thread polling it
+  CompletionQueue cq;
+  std::thread::id self = std::this_thread::get_id();
+  int completed = 0;
+  std::vector<Slice> keys;
+  std::vector<std::string> key_bufs = {Key(1), Key(kKeys), Key(2)};
+  for (const std::string& k : key_bufs) {
+    keys.push_back(k);
+  }
+  db.MultiGetAsync(keys, [&](MultiGetResult& r) {
+    EXPECT_EQ(self, std::this_thread::get_id());
+    EXPECT_EQ(0, r.status);
+    EXPECT_EQ(std::vector<int>({0, -2, 0}), r.statuses);
+    EXPECT_EQ(Value(66, 2), r.values[2]);
+    completed++;
+  }, &cq);
+  db.PutAsync(Key(1), "v", [&](int status) {
+    EXPECT_EQ(self, std::this_thread::get_id());
+    EXPECT_EQ(0, status);
+    completed++;
+  }, &cq);
+  db.GetAsync(Key(3), [&](GetResult& r) {
+    EXPECT_EQ(self, std::this_thread::get_id());
+    EXPECT_EQ(67, r.status);
+    completed++;
+  }, &cq);
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (completed < 3 && std::chrono::steady_clock::now() < until) {
+    cq.Poll(std::chrono::microseconds(1000));
+  }
+  ASSERT_EQ(3, completed);
+  ASSERT_EQ(0u, cq.Pending());
+
+  ASSERT_NE(std::string::npos, db.Report().find("[Async] 4 Workers, Ops 404"));
+  db.Close();
+
+  // Without workers the ops run on the caller
+  options_.async_threads = 0;
+  ASSERT_EQ(0, db.Open("", options_));
+  std::future<int> put = db.PutAsync(Key(5), "x");
+  ASSERT_EQ(std::future_status::ready, put.wait_for(std::chrono::seconds(0)));
+  ASSERT_EQ(0, put.get());
+}
+
+#if __cplusplus >= 202002L
+// Fire-and-forget coroutine that counts down when it finishes
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static Detached ReadModifyWrite(DB& db, uint32_t k, CompletionQueue* cq, int* done) {
+  GetResult r = co_await AsyncGet(db, iLSMTest::Key(k), cq);
+  EXPECT_EQ(1, r.status);
+  int status = co_await AsyncPut(db, iLSMTest::Key(k), r.value + "+", cq);
+  EXPECT_EQ(0, status);
+  (*done)++;
+}
+
+TEST_F(iLSMTest, AsyncCoroutines) {
+  options_.async_threads = 4;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  const int kKeys = 100;
+  for (int k = 0; k < kKeys; k++) {
+    ASSERT_EQ(0, db.Put(Key(k), "v"));
+  }
+  // One event loop drives every coroutine
+  CompletionQueue cq;
+  int done = 0;
+  for (int k = 0; k < kKeys; k++) {
+    ReadModifyWrite(db, k, &cq, &done);
+  }
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (done < kKeys && std::chrono::steady_clock::now() < until) {
+    cq.Poll(std::chrono::microseconds(1000));
+  }
+  ASSERT_EQ(kKeys, done);
+  std::string value;
+  ASSERT_EQ(2, db.Get(Key(7), value));
+  ASSERT_EQ("v+", value);
+}
+#endif
+
+TEST_F(iLSMTest, DeleteAndDeleteRange) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  for (uint32_t k = 0; k < 20; k++) {
+    ASSERT_EQ(0, db.Put(Key(k), Value(100, static_cast<char>(k))));
+  }
+  std::string long_key = Value(40, 3);
+  ASSERT_EQ(0, db.Put(long_key, Value(50, 4)));
+  TrafficStats before = db.GetTrafficStats();
+
+  // One command for a short key, the rest of a long one by a Transfer
+  ASSERT_EQ(0, db.Delete(Key(3)));
+  ASSERT_EQ(0, db.Delete(Key(1000)));
+  ASSERT_EQ(0, db.Delete(long_key));
+  std::string got;
+  ASSERT_EQ(-2, db.Get(Key(3), got));
+  ASSERT_EQ(-2, db.Get(long_key, got));
+  ASSERT_EQ(100, db.Get(Key(4), got));
+
+  // [begin, end) over big-endian keys so the byte order is the numeric one
+  auto be = [](uint32_t k) {
+    std::string s(4, 0);
+    for (int i = 0; i < 4; i++) {
+      s[i] = static_cast<char>(k >> (24 - 8 * i));
+    }
+    return s;
+  };
+  for (uint32_t k = 0; k < 10; k++) {
+    ASSERT_EQ(0, db.Put(be(k), Value(8, 1)));
+  }
+  size_t keys = emu_->NumKeys();
+  ASSERT_EQ(0, db.DeleteRange(be(2), be(7)));
+  ASSERT_EQ(keys - 5, emu_->NumKeys());
+  ASSERT_EQ(-2, db.Get(be(2), got));
+  ASSERT_EQ(-2, db.Get(be(6), got));
+  ASSERT_EQ(8, db.Get(be(7), got));
+  ASSERT_EQ(8, db.Get(be(1), got));
+  ASSERT_EQ(0, db.DeleteRange(be(7), be(7)));
+  ASSERT_EQ(-EINVAL, db.DeleteRange(be(7), be(1)));
+  ASSERT_EQ(8, db.Get(be(7), got));
+
+  TrafficStats t = db.GetTrafficStats();
+  ASSERT_EQ(6u, t[TrafficPath::DELETE].ops);  // Calls, incl. the empty and bad range
+  // 3 DELETEs + 1 Transfer, then DELETE + 1 Transfer (end key)
+  ASSERT_EQ(before[TrafficPath::DELETE].commands + 6, t[TrafficPath::DELETE].commands);
+  ASSERT_EQ(0u, t[TrafficPath::DELETE].dma_bytes);
+  Emulator::Stats es = emu_->GetStats();
+  ASSERT_EQ(4u, es.tombstones);
+  ASSERT_EQ(100u + 50 + 5 * 8, es.dead_bytes);
+  ASSERT_NE(std::string::npos, db.Report().find("[DeleteRange]"));
+}
+
+TEST_F(iLSMTest, ReadCache) {
+  options_.cache_capacity = 1 << 20;
+  options_.cache_max_value = 1000;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  for (uint32_t k = 0; k < 10; k++) {
+    ASSERT_EQ(0, db.Put(Key(k), Value(100, static_cast<char>(k))));
+  }
+  ASSERT_EQ(0, db.Put(Key(10), Value(2000, 10)));   // Too big to cache
+  uint64_t commands = emu_->GetStats().commands;
+
+  // First reads miss, repeats are served from memory
+  std::string got;
+  for (int round = 0; round < 3; round++) {
+    for (uint32_t k = 0; k <= 10; k++) {
+      ASSERT_EQ(k < 10 ? 100 : 2000, db.Get(Key(k), got));
+    }
+  }
+  ASSERT_EQ(commands + 10 + 3, emu_->GetStats().commands);
+  char *buf = static_cast<char*>(aligned_alloc(4096, 4096));
+  ASSERT_EQ(100, db.Get(Key(4), buf, 4096));
+  ASSERT_EQ(0, memcmp(Value(100, 4).data(), buf, 100));
+  free(buf);
+  std::vector<Slice> keys = {Key(1), Key(2), Key(11)};
+  std::vector<std::string> values;
+  std::vector<int> statuses;
+  ASSERT_EQ(0, db.MultiGet(keys, &values, &statuses));
+  ASSERT_EQ(Value(100, 2), values[1]);
+  ASSERT_EQ(-2, statuses[2]);
+  ASSERT_EQ(commands + 14, emu_->GetStats().commands);   // Key(11) only
+
+  // Writes update or drop the cached copy
+  ASSERT_EQ(0, db.Put(Key(1), Value(50, 9)));
+  ASSERT_EQ(50, db.Get(Key(1), got));
+  ASSERT_EQ(Value(50, 9), got);
+  ASSERT_EQ(0, db.Put(Key(2), Value(3000, 9)));
+  ASSERT_EQ(3000, db.Get(Key(2), got));
+  ASSERT_EQ(0, db.Delete(Key(3)));
+  ASSERT_EQ(-2, db.Get(Key(3), got));
+  ASSERT_EQ(100, db.Get(Key(5), got));
+  ASSERT_EQ(0, db.DeleteRange(Key(5), Key(6)));
+  ASSERT_EQ(-2, db.Get(Key(5), got));
+  ASSERT_NE(std::string::npos, db.Report().find("[Read Cache] Capacity 1048576"));
+}
+
+TEST_F(iLSMTest, ExistenceFilter) {
+  // Keys already on the device when the filter is first set up
+  {
+    DB db;
+    ASSERT_EQ(0, db.Open("", options_));
+    for (uint32_t k = 0; k < 50; k++) {
+      ASSERT_EQ(0, db.Put(Key(k), Value(20, static_cast<char>(k))));
+    }
+  }
+  const std::string path = testing::TempDir() + "ilsm_existence_filter";
+  remove(path.c_str());
+  options_.filter_keys = 10000;
+  options_.filter_path = path;
+
+  // No file: rebuilt by walking the device keys
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_NE(std::string::npos, db.Report().find("(rebuilt from 50 keys)"));
+  std::string got;
+  uint64_t commands = emu_->GetStats().commands;
+  for (uint32_t k = 0; k < 50; k++) {
+    ASSERT_EQ(20, db.Get(Key(k), got));
+  }
+  ASSERT_EQ(commands + 50, emu_->GetStats().commands);
+  // Misses mostly stay on the host (false positives still ask the device)
+  commands = emu_->GetStats().commands;
+  for (uint32_t k = 1000; k < 2000; k++) {
+    ASSERT_EQ(-2, db.Get(Key(k), got));
+  }
+  ASSERT_LT(emu_->GetStats().commands - commands, 20u);
+  ASSERT_EQ(0, db.Put(Key(1500), Value(30, 1)));
+  ASSERT_EQ(30, db.Get(Key(1500), got));
+  ASSERT_EQ(0, db.Delete(Key(7)));
+  ASSERT_EQ(-2, db.Get(Key(7), got));
+  std::vector<Slice> keys;
+  std::vector<std::string> key_data;
+  for (uint32_t k = 3000; k < 3032; k++) {
+    key_data.push_back(Key(k));
+  }
+  key_data.push_back(Key(1500));
+  for (auto& k : key_data) {
+    keys.push_back(k);
+  }
+  std::vector<std::string> values;
+  std::vector<int> statuses;
+  ASSERT_EQ(0, db.MultiGet(keys, &values, &statuses));
+  ASSERT_EQ(0, statuses[32]);
+  ASSERT_EQ(Value(30, 1), values[32]);
+  for (size_t i = 0; i < 32; i++) {
+    ASSERT_EQ(-2, statuses[i]);
+  }
+  ASSERT_NE(std::string::npos, db.Report().find("[Existence Filter] Bits 100000"));
+  db.Close();
+
+  // Saved on Close(), loaded (and set aside until the next Close()) on Open()
+  ASSERT_EQ(0, access(path.c_str(), F_OK));
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_NE(std::string::npos, db.Report().find("(loaded)"));
+  ASSERT_NE(0, access(path.c_str(), F_OK));
+  ASSERT_EQ(30, db.Get(Key(1500), got));
+  ASSERT_EQ(20, db.Get(Key(49), got));
+  commands = emu_->GetStats().commands;
+  for (uint32_t k = 1000; k < 1100; k++) {
+    if (k != 1500) {
+      ASSERT_EQ(-2, db.Get(Key(k), got));
+    }
+  }
+  ASSERT_LT(emu_->GetStats().commands - commands, 10u);
+  db.Close();
+
+  // A file of another geometry is not trusted
+  options_.filter_keys = 20000;
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_NE(std::string::npos, db.Report().find("(rebuilt from 50 keys)"));
+  db.Close();
+  remove(path.c_str());
+}
+
+TEST_F(iLSMTest, ShardedDB) {
+  const size_t kDevices = 3;
+  std::vector<std::string> devs(kDevices);
+  std::vector<Options> per_device(kDevices, options_);
+  EmulatorOptions emu_options;
+  emu_options.cmd_latency_ns = 0;
+  emu_options.pcie_mbps = 0;
+  std::vector<std::shared_ptr<Emulator>> emus;
+  for (auto& o : per_device) {
+    emus.push_back(std::make_shared<Emulator>(emu_options));
+    o.emulator = emus.back();
+  }
+  ShardedDB db;
+  ASSERT_EQ(-EINVAL, db.Open(",", options_));   // One emulator, two devices
+  ASSERT_EQ(0, db.Open(devs, per_device));
+  for (uint32_t k = 0; k < 300; k++) {
+    ASSERT_EQ(0, db.Put(Key(k), Value(20, static_cast<char>(k))));
+  }
+  for (auto& emu : emus) {
+    ASSERT_GT(emu->NumKeys(), 60u);
+  }
+  std::string got;
+  for (uint32_t k = 0; k < 300; k++) {
+    ASSERT_EQ(20, db.Get(Key(k), got));
+    ASSERT_EQ(Value(20, static_cast<char>(k)), got);
+  }
+
+  // MultiGet splits the keys by device
+  std::vector<std::string> key_data;
+  for (uint32_t k = 250; k < 350; k++) {
+    key_data.push_back(Key(k));
+  }
+  std::vector<Slice> keys(key_data.begin(), key_data.end());
+  std::vector<std::string> values;
+  std::vector<int> statuses;
+  ASSERT_EQ(0, db.MultiGet(keys, &values, &statuses));
+  for (uint32_t i = 0; i < 100; i++) {
+    if (i < 50) {
+      ASSERT_EQ(0, statuses[i]);
+      ASSERT_EQ(Value(20, static_cast<char>(250 + i)), values[i]);
+    } else {
+      ASSERT_EQ(-2, statuses[i]);
+    }
+  }
+  // Fan-outs of several callers at once, each on threads of its own
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < 20; i++) {
+        std::vector<std::string> vals;
+        std::vector<int> sts;
+        ASSERT_EQ(0, db.MultiGet(keys, &vals, &sts));
+        ASSERT_EQ(0, sts[10]);
+        ASSERT_EQ(Value(20, static_cast<char>(260)), vals[10]);
+        ASSERT_EQ(-2, sts[60]);
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+
+  // The iterator merges the devices in key order
+  ASSERT_EQ(0, db.Delete(Key(5)));
+  unsigned int iter_id;
+  ASSERT_EQ(0, db.CreateIter(iter_id));
+  std::string prev, key;
+  int n = 0;
+  for (int ret = db.Seek(iter_id, std::string(1, '\0'), got); ret != -2;
+       ret = db.Next(iter_id, got)) {
+    ASSERT_EQ(20, ret);
+    ASSERT_EQ(4, db.IterKey(iter_id, key));
+    ASSERT_TRUE(n == 0 || prev < key);
+    uint32_t k;
+    memcpy(&k, key.data(), sizeof(k));
+    ASSERT_EQ(Value(20, static_cast<char>(k)), got);
+    prev = key;
+    n++;
+  }
+  ASSERT_EQ(299, n);
+  ASSERT_EQ(0, db.DestroyIter(iter_id));
+
+  // A batch goes as one Write() per device it touches
+  iLSM::WriteBatch batch;
+  std::vector<bool> touched(kDevices);
+  for (uint32_t k = 0; k < 12; k++) {
+    batch.Put(Key(k), Value(30, static_cast<char>(k)));
+    touched[db.ShardOf(Key(k))] = true;
+  }
+  batch.Delete(Key(20));
+  touched[db.ShardOf(Key(20))] = true;
+  ASSERT_EQ(0, db.Write(batch));
+  ASSERT_EQ(30, db.Get(Key(5), got));
+  ASSERT_EQ(Value(30, 5), got);
+  ASSERT_EQ(-2, db.Get(Key(20), got));
+  uint64_t batches = 0;
+  for (auto& emu : emus) {
+    batches += emu->GetStats().batches;
+  }
+  ASSERT_EQ(static_cast<uint64_t>(std::count(touched.begin(), touched.end(), true)), batches);
+
+  ASSERT_EQ(0, db.DeleteRange(Key(0), Key(0xFFFFFFFF)));
+  for (auto& emu : emus) {
+    ASSERT_EQ(0u, emu->NumKeys());
+  }
+  std::string report = db.Report();
+  ASSERT_NE(std::string::npos, report.find("[Devices] 3, Ops per Device"));
+  ASSERT_NE(std::string::npos, report.find("[Put] Elapse Time"));
+  ASSERT_NE(std::string::npos, report.find("/ 300 = Average"));
+
+  // A fourth device takes keys from the others only
+  std::vector<size_t> before;
+  for (uint32_t k = 0; k < 1000; k++) {
+    before.push_back(db.ShardOf(Key(k)));
+  }
+  devs.push_back("");
+  per_device.push_back(options_);
+  per_device.back().emulator = std::make_shared<Emulator>(emu_options);
+  ASSERT_EQ(0, db.Open(devs, per_device));
+  int moved = 0;
+  for (uint32_t k = 0; k < 1000; k++) {
+    size_t shard = db.ShardOf(Key(k));
+    if (shard != before[k]) {
+      ASSERT_EQ(3u, shard);
+      moved++;
+    }
+  }
+  ASSERT_GT(moved, 100);
+  ASSERT_LT(moved, 400);
+}
+
+TEST_F(iLSMTest, WriteCombining) {
+  options_.write_combining = true;
+  options_.combine_deadline_us = 10000000;    // Pages go out when full
+  options_.cache_capacity = 1 << 20;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // 8B header + 4B key + 40B value: 78 records fill a 4KB page
+  std::vector<int> status(100, 1);
+  for (uint32_t k = 0; k < 100; k++) {
+    ASSERT_EQ(0, db.Put(Key(k), Value(40, static_cast<char>(k)),
+                        [&status, k](int s) { status[k] = s; }));
+  }
+  ASSERT_EQ(0, status[77]);
+  ASSERT_EQ(1, status[78]);
+  ASSERT_EQ(78u, emu_->NumKeys());
+
+  // A put that bypasses the page writes a staged one of the same key first
+  ASSERT_EQ(0, db.Put(Key(90), Value(1000, 9)));
+  ASSERT_EQ(0, status[99]);
+  std::string stored;
+  ASSERT_TRUE(emu_->Lookup(Key(90), &stored));
+  ASSERT_EQ(Value(1000, 9), stored);
+
+  ASSERT_EQ(0, db.Put(Key(200), Value(40, 2), [&status](int s) { status[0] = s + 5; }));
+  db.Flush();
+  ASSERT_EQ(5, status[0]);
+  // A Delete lands after the staged put of its key
+  ASSERT_EQ(0, db.Put(Key(300), Value(40, 3), [](int) {}));
+  ASSERT_EQ(0, db.Delete(Key(300)));
+  ASSERT_FALSE(emu_->Lookup(Key(300), &stored));
+  for (uint32_t k = 0; k < 100; k++) {
+    if (k != 90) {
+      ASSERT_TRUE(emu_->Lookup(Key(k), &stored)) << k;
+      ASSERT_EQ(Value(40, static_cast<char>(k)), stored) << k;
+    }
+  }
+
+  TrafficStats t = db.GetTrafficStats();
+  ASSERT_EQ(102u, t[TrafficPath::BATCH].ops);
+  ASSERT_EQ(4u, t[TrafficPath::BATCH].commands);
+  ASSERT_EQ(102u * 44, t[TrafficPath::BATCH].payload_bytes);
+  ASSERT_EQ(4u * 4096, t[TrafficPath::BATCH].dma_bytes);
+  ASSERT_NE(std::string::npos, db.Report().find("[Write Combining] Pages 4, Records 102"));
+}
+
+TEST_F(iLSMTest, GroupCommit) {
+  // Blocking puts of several threads share pages; a lone put goes out on
+  // its deadline
+  options_.write_combining = true;
+  options_.combine_deadline_us = 200;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  const int kThreads = 8;
+  const int kKeysPerThread = 50;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kKeysPerThread; i++) {
+        uint32_t k = t * kKeysPerThread + i;
+        ASSERT_EQ(0, db.Put(Key(k), Value(40, static_cast<char>(k))));
+        std::string stored;
+        ASSERT_TRUE(emu_->Lookup(Key(k), &stored)) << k;
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  ASSERT_EQ(static_cast<size_t>(kThreads * kKeysPerThread), emu_->NumKeys());
+  TrafficStats t = db.GetTrafficStats();
+  ASSERT_EQ(static_cast<uint64_t>(kThreads * kKeysPerThread), t[TrafficPath::BATCH].ops);
+  ASSERT_LT(t[TrafficPath::BATCH].commands, t[TrafficPath::BATCH].ops);
+
+  std::atomic<int> done(1);
+  ASSERT_EQ(0, db.Put(Key(1000), Value(40, 1), [&done](int s) { done = s; }));
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (done != 0 && std::chrono::steady_clock::now() < until) {
+    std::this_thread::yield();
+  }
+  ASSERT_EQ(0, done);
+  ASSERT_NE(std::string::npos, db.Report().find("Deadline Flushes"));
+}
+
+TEST_F(iLSMTest, Compression) {
+  if (!ValueCompressor::Supported(ROCKSDB_NAMESPACE::kZlibCompression)) {
+    fprintf(stderr, "zlib not built in, skipping\n");
+    return;
+  }
+  options_.compression = ROCKSDB_NAMESPACE::kZlibCompression;
+  options_.transfer_mode = TransferMode::PIGGY;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+
+  std::string json;
+  for (int i = 0; json.size() < 1000; i++) {
+    json += "{\"id\":" + std::to_string(i) + ",\"name\":\"user\",\"tags\":[\"a\",\"b\"]},";
+  }
+  // Compressible: fewer Transfers. Incompressible, or small enough for one
+  // WRITE: stored as given
+  ASSERT_EQ(0, db.Put(Key(1), json));
+  std::string noise = Value(200, 3);
+  for (size_t i = 0; i < noise.size(); i++) {
+    noise[i] = static_cast<char>((i * 2654435761u) >> 13);
+  }
+  ASSERT_EQ(0, db.Put(Key(2), noise));
+  ASSERT_EQ(0, db.Put(Key(3), Value(32, 3)));
+
+  std::string stored;
+  bool compressed = false;
+  ASSERT_TRUE(emu_->Lookup(Key(1), &stored, &compressed));
+  ASSERT_TRUE(compressed);
+  ASSERT_LT(stored.size(), json.size());
+  ASSERT_TRUE(emu_->Lookup(Key(2), &stored, &compressed));
+  ASSERT_FALSE(compressed);
+  ASSERT_EQ(noise, stored);
+
+  // Every read path gives back the value as it was put
+  std::string got;
+  ASSERT_EQ(static_cast<int>(json.size()), db.Get(Key(1), got));
+  ASSERT_EQ(json, got);
+  void* buf = nullptr;
+  ASSERT_EQ(0, posix_memalign(&buf, 4096, 4096));
+  ASSERT_EQ(static_cast<int>(json.size()), db.Get(Key(1), buf, 4096));
+  ASSERT_EQ(json, std::string(static_cast<const char*>(buf), json.size()));
+  free(buf);
+  std::vector<std::string> values;
+  std::vector<int> statuses;
+  std::vector<Slice> keys = {Key(1), Key(2), Key(3)};
+  ASSERT_EQ(0, db.MultiGet(keys, &values, &statuses));
+  ASSERT_EQ(std::vector<int>({0, 0, 0}), statuses);
+  ASSERT_EQ(json, values[0]);
+  ASSERT_EQ(noise, values[1]);
+  unsigned int iter_id;
+  ASSERT_EQ(0, db.CreateIter(iter_id));
+  ASSERT_EQ(static_cast<int>(json.size()), db.Seek(iter_id, Key(1), got));
+  ASSERT_EQ(json, got);
+  ASSERT_EQ(0, db.DestroyIter(iter_id));
+
+  std::string report = db.Report();
+  ASSERT_NE(std::string::npos, report.find("[Compression] Zlib, Values Stored Compressed 1 of 2 Tried"));
+  ASSERT_NE(std::string::npos, report.find("Value Bytes " + std::to_string(json.size()) + " -> "));
+}
+
+TEST_F(iLSMTest, QosScheduler) {
+  const unsigned int weights[] = {8, 4, 1, 2};
+  const int64_t rates[] = {0, 0, 0, 0};
+  QosScheduler qos(1, weights, rates);
+  qos.Admit(QosClass::SCAN, 1, 64);
+
+  // A large write queued first still goes after a read queued behind it
+  std::mutex mtx;
+  std::vector<QosClass> order;
+  auto waiter = [&](QosClass c, uint64_t bytes) {
+    return std::thread([&, c, bytes]() {
+      qos.Admit(c, 1, bytes);
+      {
+        std::lock_guard<std::mutex> l(mtx);
+        order.push_back(c);
+      }
+      qos.Release(1);
+    });
+  };
+  std::thread writer = waiter(QosClass::LARGE_WRITE, 524288);
+  while (qos.Waiting() < 1) {
+    std::this_thread::yield();
+  }
+  std::thread reader = waiter(QosClass::READ, 64);
+  while (qos.Waiting() < 2) {
+    std::this_thread::yield();
+  }
+  qos.Release(1);
+  writer.join();
+  reader.join();
+  ASSERT_EQ(std::vector<QosClass>({QosClass::READ, QosClass::LARGE_WRITE}), order);
+
+  // A wider batch than the device queue takes all of it
+  ASSERT_EQ(0u, qos.Waiting());
+  qos.Admit(QosClass::LARGE_WRITE, 8, 8 * 4096);
+  qos.Release(8);
+}
+
+TEST_F(iLSMTest, QosClasses) {
+  options_.qos_depth = 2;
+  options_.transfer_queue_depth = 4;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+
+  // Bulk loaders next to readers: every command still gets through
+  const int kKeys = 64;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; t++) {
+    threads.emplace_back([&, t]() {
+      for (int k = t; k < kKeys; k += 2) {
+        ASSERT_EQ(0, db.Put(Key(k), Value(k % 4 ? 100 : 600000, static_cast<char>(k))));
+      }
+    });
+  }
+  threads.emplace_back([&]() {
+    std::string value;
+    for (int i = 0; i < 4 * kKeys; i++) {
+      int ret = db.Get(Key(i % kKeys), value);
+      ASSERT_TRUE(ret == -2 || ret == (i % 4 ? 100 : 600000));
+    }
+  });
+  for (auto& th : threads) {
+    th.join();
+  }
+  ASSERT_EQ(0, db.Delete(Key(1)));
+  unsigned int iter_id;
+  std::string got;
+  ASSERT_EQ(0, db.CreateIter(iter_id));
+  ASSERT_EQ(100, db.Seek(iter_id, Key(2), got));
+  ASSERT_EQ(0, db.DestroyIter(iter_id));
+
+  ReportData d;
+  db.GetReport(&d);
+  ASSERT_EQ(static_cast<size_t>(QosClass::LAST), d.qos_wait.size());
+  for (const HistogramSnapshot& h : d.qos_wait) {
+    ASSERT_LT(0u, h.Count());
+  }
+  std::string report = DB::FormatReport(d);
+  ASSERT_NE(std::string::npos, report.find("[QoS Read] Depth 2, Weight 8, Rate Unlimited"));
+  ASSERT_NE(std::string::npos, report.find("[QoS Large Write]"));
+  ASSERT_NE(std::string::npos, report.find("[QoS Scan]"));
+}
+
+TEST_F(iLSMTest, QosRateLimit) {
+  options_.qos_depth = 4;
+  options_.transfer_mode = TransferMode::KVSSD;
+  options_.qos_rate_limit[static_cast<int>(QosClass::LARGE_WRITE)] = 4 << 20;
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  // Reads are not held back by the write limit
+  std::string value;
+  ASSERT_EQ(-2, db.Get(Key(0), value));
+
+  auto st = std::chrono::steady_clock::now();
+  for (int k = 0; k < 4; k++) {
+    ASSERT_EQ(0, db.Put(Key(k), Value(262144, static_cast<char>(k))));
+  }
+  // 1MB at 4MB/s: at least a couple of 100ms refills
+  ASSERT_LE(std::chrono::milliseconds(150), std::chrono::steady_clock::now() - st);
+  ASSERT_EQ(262144, db.Get(Key(3), value));
+  ASSERT_NE(std::string::npos, db.Report().find("[QoS Large Write] Depth 4, Weight 1, Rate 4194304 B/s"));
+}
+
+TEST_F(iLSMTest, WriteBatch) {
+  DB db;
+  ASSERT_EQ(0, db.Open("", options_));
+  ASSERT_EQ(0, db.Put(Key(1), Value(100, 1)));
+  std::string long_key = Value(40, 5);
+
+  // Members by every put path and a delete, one header and one trailer more
+  iLSM::WriteBatch batch;
+  batch.Put(Key(0), Value(20, 0));
+  batch.Put(long_key, Value(300, 5));
+  batch.Put(Key(2), Value(10000, 2));
+  batch.Put(Key(3), Value(600000, 3));
+  batch.Delete(Key(1));
+  batch.Put(Key(0), Value(30, 9));   // Last op of a key wins
+  ASSERT_EQ(6u, batch.Count());
+  ASSERT_EQ(0, db.Write(batch));
+  std::string got;
+  ASSERT_EQ(30, db.Get(Key(0), got));
+  ASSERT_EQ(Value(30, 9), got);
+  ASSERT_EQ(300, db.Get(long_key, got));
+  ASSERT_EQ(Value(300, 5), got);
+  ASSERT_TRUE(emu_->Lookup(Key(2), &got));
+  ASSERT_EQ(Value(10000, 2), got);
+  ASSERT_TRUE(emu_->Lookup(Key(3), &got));
+  ASSERT_EQ(Value(600000, 3), got);
+  ASSERT_EQ(-2, db.Get(Key(1), got));
+  ASSERT_EQ(1u, emu_->GetStats().batches);
+
+  // A bad member fails the whole batch before anything is sent
+  uint64_t commands = emu_->GetStats().commands;
+  batch.Clear();
+  batch.Put(Key(4), Value(8, 4));
+  batch.Put(Key(5), std::string());
+  ASSERT_EQ(-EINVAL, db.Write(batch));
+  batch.Clear();
+  for (uint32_t k = 0; k <= MAX_BATCH_MEMBERS; k++) {
+    batch.Put(Key(100 + k), Value(8, 1));
+  }
+  ASSERT_EQ(-EINVAL, db.Write(batch));
+  ASSERT_EQ(0, db.Write(iLSM::WriteBatch()));
+  ASSERT_EQ(commands, emu_->GetStats().commands);
+  ASSERT_EQ(-2, db.Get(Key(4), got));
+
+  // Staged members stay invisible until the trailer; an abort drops them
+  auto delete_member = [](uint32_t k, uint32_t id) {
+    struct nvme_passthru_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = 0xA2;  // DELETE
+    cmd.cdw2 = k;
+    cmd.cdw10 = 4u << 24;  // Key size
+    cmd.cdw13 = 7 | BATCH_MEMBER | (id << BATCH_ID_SHIFT);
+    return cmd;
+  };
+  auto control = [](uint32_t id, uint32_t n, uint32_t cdw11) {
+    struct nvme_passthru_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = 0xAC;  // WRITE_BATCH
+    cmd.cdw10 = n;
+    cmd.cdw11 = cdw11;
+    cmd.cdw13 = id;
+    return cmd;
+  };
+  struct nvme_passthru_cmd cmd = delete_member(2, 3);
+  ASSERT_NE(0, emu_->Execute(cmd));  // Batch 3 is not open
+  for (uint32_t ctl : {BATCH_ABORT, BATCH_COMMIT}) {
+    cmd = control(3, 2, 0);
+    ASSERT_EQ(0, emu_->Execute(cmd));
+    cmd = control(19, 1, 0);
+    ASSERT_NE(0, emu_->Execute(cmd));  // Slot of batch 3 is taken
+    cmd = delete_member(2, 3);
+    ASSERT_EQ(0, emu_->Execute(cmd));
+    cmd = delete_member(3, 3);
+    ASSERT_EQ(0, emu_->Execute(cmd));
+    ASSERT_TRUE(emu_->Lookup(Key(2), &got));
+    cmd = control(3, 2, ctl);
+    ASSERT_EQ(0, emu_->Execute(cmd));
+    ASSERT_EQ(ctl == BATCH_COMMIT ? 2u : 0u, cmd.result);
+    ASSERT_EQ(ctl == BATCH_ABORT, emu_->Lookup(Key(2), &got));
+    ASSERT_EQ(ctl == BATCH_ABORT, emu_->Lookup(Key(3), &got));
+  }
+  // A commit short of a member applies none
+  cmd = control(4, 2, 0);
+  ASSERT_EQ(0, emu_->Execute(cmd));
+  cmd = delete_member(0, 4);
+  ASSERT_EQ(0, emu_->Execute(cmd));
+  cmd = control(4, 2, BATCH_COMMIT);
+  ASSERT_NE(0, emu_->Execute(cmd));
+  ASSERT_TRUE(emu_->Lookup(Key(0), &got));
+
+  // More writers than device batch slots
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      for (uint32_t i = 0; i < 10; i++) {
+        iLSM::WriteBatch b;
+        for (uint32_t k = 0; k < 8; k++) {
+          b.Put(Key(1000 + t * 1000 + i * 8 + k), Value(16 + k * 40, static_cast<char>(k)));
+        }
+        ASSERT_EQ(0, db.Write(b));
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  for (uint32_t t = 0; t < 4; t++) {
+    ASSERT_EQ(16 + 7 * 40, db.Get(Key(1000 + t * 1000 + 9 * 8 + 7), got));
+  }
+  ASSERT_EQ(1u + 1 + 40, emu_->GetStats().batches);
+
+  TrafficStats t = db.GetTrafficStats();
+  ASSERT_EQ(1u + 3 + 40, t[TrafficPath::WRITE_BATCH].ops);   // Calls, incl. the bad and empty ones
+  ASSERT_EQ(2u * 41, t[TrafficPath::WRITE_BATCH].commands);
+  ASSERT_EQ(1u, t[TrafficPath::DELETE].ops);
+  std::string report = db.Report();
+  ASSERT_NE(std::string::npos, report.find("[Write]"));
+  ASSERT_NE(std::string::npos, report.find("Batches Committed 42"));
+}
+
+}  // namespace iLSM
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
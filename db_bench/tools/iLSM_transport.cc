@@ -0,0 +1,45 @@
+#include "iLSM_transport.h"
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+iLSM::IoctlTransport::~IoctlTransport()
+{
+    if (owns_fd_ && fd_ >= 0)
+        close(fd_);
+}
+
+int iLSM::IoctlTransport::Passthru(struct nvme_passthru_cmd &cmd)
+{
+    return ioctl(fd_, NVME_IOCTL_IO_CMD, &cmd);
+}
+
+iLSM::UringTransport::~UringTransport()
+{
+    ring_.Close();
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+// Takes ownership of fd on success
+int iLSM::UringTransport::Init(int fd, unsigned int depth, bool poll)
+{
+    int err = ring_.Init(fd, depth, poll);
+    if (err < 0)
+        return err;
+    fd_ = fd;
+    return 0;
+}
+
+int iLSM::UringTransport::Passthru(struct nvme_passthru_cmd &cmd)
+{
+    if (ring_.Failed())
+        return ioctl(fd_, NVME_IOCTL_IO_CMD, &cmd);
+    return ring_.Passthru(cmd);
+}
+
+int iLSM::UringTransport::PassthruBatch(struct nvme_passthru_cmd *cmds, unsigned int n, unsigned int depth)
+{
+    if (ring_.Failed())
+        return Transport::PassthruBatch(cmds, n, depth);
+    return ring_.PassthruBatch(cmds, n, depth);
+}
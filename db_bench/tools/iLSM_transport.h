@@ -0,0 +1,118 @@
+#pragma once
+
+#include <linux/nvme_ioctl.h>
+#include <cstdint>
+
+#include "iLSM_uring.h"
+
+namespace iLSM {
+    // Set in CDW13 of a PUT/WRITE whose value the host compressed. The device
+    // keeps it with the value and sets it in every value size it reports
+    // (GET completion DW0, MultiGetEntry and IterRecord value_size)
+    const uint32_t VALUE_COMPRESSED = 1u << 31;
+
+    // Atomic write batch, opcode 0xAC. The header (CDW11 = 0) opens batch
+    // CDW13 of CDW10 members, CDW12 key and value bytes in all. Members are
+    // the usual PUT/WRITE/DELETE commands (and their Transfers) with
+    // BATCH_MEMBER and the batch id in CDW13 next to the stream id; the
+    // device places them but no Get sees them until the trailer (CDW11 =
+    // BATCH_COMMIT) applies all of them at once. A commit of a batch whose
+    // members did not all complete applies none and fails; BATCH_ABORT
+    // drops the batch. Completion DW0 of a commit is the # of members
+    // applied. The device keeps MAX_OPEN_BATCHES open, in slot id % that
+    const uint32_t BATCH_MEMBER = 1u << 30;
+    const uint32_t BATCH_ID_SHIFT = 16;
+    const uint32_t BATCH_ID_MASK = 0x3FFF;
+    const uint32_t BATCH_COMMIT = 1u << 31;
+    const uint32_t BATCH_ABORT = 1u << 30;
+    const uint32_t MAX_BATCH_MEMBERS = 64;
+    const uint32_t MAX_OPEN_BATCHES = 16;
+
+    // Stream id (CDW13 15:0) of a PUT/WRITE/DELETE and its Transfers. The
+    // device reassembles MAX_OPEN_STREAMS pairs at once, in slot id % that:
+    // a new stream evicts the one open in its slot
+    const uint32_t MAX_OPEN_STREAMS = 64;
+
+    // One record of the page ITER_SEEK/NEXT fill: this header, the key, the
+    // value, zero-padded to a dword boundary. Completion DW0 is the # of
+    // records; 0 means the next record alone does not fit the buffer and
+    // only its header was written.
+    struct IterRecord {
+        uint16_t key_size;
+        uint16_t rsvd;
+        uint32_t value_size;
+
+        static uint32_t Size(uint32_t key_size, uint32_t value_size) {
+            value_size &= ~VALUE_COMPRESSED;
+            return (sizeof(IterRecord) + key_size + value_size + 3) / 4 * 4;
+        }
+    };
+
+    // BATCH_PUT writes the pairs of a page of such records: CDW10 records
+    // in CDW11 bytes (up to 16KB). Completion DW0 is the # of records stored;
+    // a malformed page stores none.
+
+    // MULTI_GET uses one buffer both ways. On submission it holds the keys
+    // (CDW10 of them, CDW11 bytes), each a u16 key size and the key, padded
+    // to a dword. On completion it holds one MultiGetEntry per key and then
+    // the values, each dword-aligned. Completion DW0 is the response size; if
+    // that exceeds the buffer, nothing is written and the host retries.
+    struct MultiGetEntry {
+        uint32_t offset;        // Of the value in the buffer, or MULTIGET_MISSING
+        uint32_t value_size;
+    };
+    const uint32_t MULTIGET_MISSING = 0xFFFFFFFF;
+
+    // Where iLSM::DB sends its NVMe commands. Every submission context owns
+    // one transport, so implementations need not be thread-safe themselves.
+    class Transport {
+        public:
+            virtual ~Transport() {}
+            // Same contract as ioctl(NVME_IOCTL_IO_CMD): returns <0 on failure,
+            // otherwise the NVMe status (0 = success); cmd.result gets CQE DW0
+            virtual int Passthru(struct nvme_passthru_cmd &cmd) = 0;
+            // Issues n commands with up to depth of them outstanding, and
+            // returns once all completed: 0, or the first failure as above.
+            // By default they go one at a time
+            virtual int PassthruBatch(struct nvme_passthru_cmd *cmds, unsigned int n, unsigned int depth) {
+                (void)depth;
+                for (unsigned int i = 0; i < n; i++) {
+                    int err = Passthru(cmds[i]);
+                    if (err)
+                        return err;
+                }
+                return 0;
+            }
+            // True if CDW4-CDW9 reach the device untouched; the stock kernel
+            // driver reads them as metadata/PRP pointers and lengths instead
+            virtual bool RawDwords() const { return false; }
+            virtual unsigned int PeakInflight() const { return 1; }
+    };
+
+    // Blocking ioctl(NVME_IOCTL_IO_CMD), one command at a time per fd
+    class IoctlTransport : public Transport {
+        public:
+            IoctlTransport(int fd, bool owns_fd) : fd_(fd), owns_fd_(owns_fd) {}
+            ~IoctlTransport();
+            int Passthru(struct nvme_passthru_cmd &cmd) override;
+        private:
+            int fd_;
+            bool owns_fd_;
+    };
+
+    // io_uring IORING_OP_URING_CMD on the NVMe generic char device
+    class UringTransport : public Transport {
+        public:
+            UringTransport() : fd_(-1) {}
+            ~UringTransport();
+            int Init(int fd, unsigned int depth, bool poll);
+            // Once the ring failed, commands go by ioctl on the same fd
+            int Passthru(struct nvme_passthru_cmd &cmd) override;
+            int PassthruBatch(struct nvme_passthru_cmd *cmds, unsigned int n, unsigned int depth) override;
+            unsigned int PeakInflight() const override { return ring_.PeakInflight(); }
+            Uring &ring() { return ring_; }
+        private:
+            int fd_;
+            Uring ring_;
+    };
+}
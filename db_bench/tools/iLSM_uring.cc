@@ -0,0 +1,421 @@
+#include "iLSM_uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+using namespace std;
+
+#ifdef ILSM_HAVE_IO_URING
+
+const unsigned int SQE_SIZE = 128;  // IORING_SETUP_SQE128 (80B command area)
+const unsigned int CQE_SIZE = 32;   // IORING_SETUP_CQE32 (big CQE carries DW0)
+
+int iLSM::Uring::Init(int fd, unsigned int depth, bool poll)
+{
+    if (IsOpen())
+        return -EBUSY;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+    if (poll)
+        p.flags |= IORING_SETUP_IOPOLL;
+
+    int ret = syscall(__NR_io_uring_setup, depth, &p);
+    if (ret < 0)
+        return -errno;
+    ring_fd_ = ret;
+    fd_ = fd;
+    dead_err_ = 0;
+    sq_entries_ = p.sq_entries;
+
+    sq_ring_sz_ = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_ring_sz_ = p.cq_off.cqes + p.cq_entries * CQE_SIZE;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_sz_ > sq_ring_sz_)
+            sq_ring_sz_ = cq_ring_sz_;
+        cq_ring_sz_ = sq_ring_sz_;
+    }
+
+    sq_ring_ = mmap(0, sq_ring_sz_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        Close();
+        return -ENOMEM;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = mmap(0, cq_ring_sz_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            cq_ring_ = nullptr;
+            Close();
+            return -ENOMEM;
+        }
+    }
+    sqes_sz_ = p.sq_entries * SQE_SIZE;
+    sqes_ = mmap(0, sqes_sz_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        sqes_ = nullptr;
+        Close();
+        return -ENOMEM;
+    }
+
+    uint8_t *sq = (uint8_t*)sq_ring_, *cq = (uint8_t*)cq_ring_;
+    sq_head_  = (unsigned int*)(sq + p.sq_off.head);
+    sq_tail_  = (unsigned int*)(sq + p.sq_off.tail);
+    sq_mask_  = (unsigned int*)(sq + p.sq_off.ring_mask);
+    sq_array_ = (unsigned int*)(sq + p.sq_off.array);
+    cq_head_  = (unsigned int*)(cq + p.cq_off.head);
+    cq_tail_  = (unsigned int*)(cq + p.cq_off.tail);
+    cq_mask_  = (unsigned int*)(cq + p.cq_off.ring_mask);
+    cqes_     = cq + p.cq_off.cqes;
+
+    reqs_.reset(new std::atomic<UringRequest*>[sq_entries_]);
+    free_reqs_.clear();
+    for (unsigned int i = sq_entries_; i > 0; i--) {
+        reqs_[i - 1].store(nullptr);
+        free_reqs_.push_back(i - 1);
+    }
+    reaped_.clear();
+    reaped_.reserve(sq_entries_);
+
+    poll_ = poll;
+    stop_ = false;
+    if (!poll_)
+        reaper_ = thread(&iLSM::Uring::reap, this);
+    return 0;
+}
+
+void iLSM::Uring::Close()
+{
+    if (reaper_.joinable()) {
+        // Wake the reaper up with a NOP that carries no request
+        {
+            unique_lock<mutex> l(sq_mtx_);
+            sq_cv_.wait(l, [&]{ return inflight_ < sq_entries_ || dead_err_; });
+            stop_ = true;
+            if (!dead_err_) {   // Else the reaper is gone already
+                push(IORING_OP_NOP, nullptr, 0);
+                inflight_++;
+                enter(1, 0, 0);
+            }
+        }
+        reaper_.join();
+    }
+    while (poll_ && inflight_ && this->poll() == 0)
+        ;
+    release_ring();
+    fd_ = -1;
+    poll_ = false;
+}
+
+// Unmap and close the ring; the kernel waits out whatever is still in flight
+// on it before it frees the ring
+void iLSM::Uring::release_ring()
+{
+    if (sqes_)
+        munmap(sqes_, sqes_sz_);
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+        munmap(cq_ring_, cq_ring_sz_);
+    if (sq_ring_)
+        munmap(sq_ring_, sq_ring_sz_);
+    sqes_ = cq_ring_ = sq_ring_ = nullptr;
+    if (ring_fd_ >= 0)
+        close(ring_fd_);
+    ring_fd_ = -1;
+    inflight_ = 0;
+}
+
+// The ring broke down (sq_mtx_ held): every request in flight completes with
+// err, and so does any later Submit()
+void iLSM::Uring::fail_all(int err)
+{
+    dead_err_ = err;
+    free_reqs_.clear();
+    for (unsigned int i = 0; i < sq_entries_; i++) {
+        UringRequest *req = reqs_[i].exchange(nullptr);
+        if (req) {
+            lock_guard<mutex> l(req->mtx);
+            req->err = err;
+            req->result = 0;
+            req->done = true;
+            req->cv.notify_one();
+        }
+        free_reqs_.push_back(i);
+    }
+    reaped_.clear();
+    inflight_ = 0;
+    sq_cv_.notify_all();
+}
+
+// Return the request slots the harvesting thread freed (sq_mtx_ held)
+void iLSM::Uring::recycle()
+{
+    free_reqs_.insert(free_reqs_.end(), reaped_.begin(), reaped_.end());
+    reaped_.clear();
+}
+
+int iLSM::Uring::enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+// Fill the next SQE (sq_mtx_ held, a free slot guaranteed by the caller)
+void iLSM::Uring::push(uint8_t opcode, const struct nvme_uring_cmd *cmd, uint64_t user_data)
+{
+    unsigned int tail = *sq_tail_;
+    unsigned int idx = tail & *sq_mask_;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*)((uint8_t*)sqes_ + idx * SQE_SIZE);
+
+    memset(sqe, 0, SQE_SIZE);
+    sqe->opcode = opcode;
+    sqe->fd = fd_;
+    sqe->user_data = user_data;
+    if (cmd) {
+        sqe->cmd_op = NVME_URING_CMD_IO;
+        memcpy(sqe->cmd, cmd, sizeof(*cmd));
+    }
+    sq_array_[idx] = idx;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+int iLSM::Uring::Submit(const struct nvme_passthru_cmd &cmd, UringRequest *req)
+{
+    struct nvme_uring_cmd ucmd;
+    memset(&ucmd, 0, sizeof(ucmd));
+    ucmd.opcode         = cmd.opcode;
+    ucmd.flags          = cmd.flags;
+    ucmd.rsvd1          = cmd.rsvd1;
+    ucmd.nsid           = cmd.nsid;
+    ucmd.cdw2           = cmd.cdw2;
+    ucmd.cdw3           = cmd.cdw3;
+    ucmd.metadata       = cmd.metadata;
+    ucmd.addr           = cmd.addr;
+    ucmd.metadata_len   = cmd.metadata_len;
+    ucmd.data_len       = cmd.data_len;
+    ucmd.cdw10          = cmd.cdw10;
+    ucmd.cdw11          = cmd.cdw11;
+    ucmd.cdw12          = cmd.cdw12;
+    ucmd.cdw13          = cmd.cdw13;
+    ucmd.cdw14          = cmd.cdw14;
+    ucmd.cdw15          = cmd.cdw15;
+    ucmd.timeout_ms     = cmd.timeout_ms;
+
+    req->done = false;
+
+    unique_lock<mutex> l(sq_mtx_);
+    if (dead_err_)
+        return dead_err_;
+    if (!IsOpen())
+        return -EBADF;
+    // Back-pressure: never overrun the CQ, wait for the reaper to free a slot
+    while (poll_ && inflight_ >= sq_entries_) {
+        l.unlock();
+        int err = poll();
+        l.lock();
+        if (err < 0) {
+            fail_all(err);
+            release_ring();
+            return err;
+        }
+    }
+    sq_cv_.wait(l, [&]{ return inflight_ < sq_entries_ || dead_err_; });
+    if (dead_err_)
+        return dead_err_;
+    unsigned int slot = free_reqs_.back();
+    free_reqs_.pop_back();
+    reqs_[slot].store(req);
+    push(IORING_OP_URING_CMD, &ucmd, slot + 1);
+    inflight_++;
+    if (inflight_ > peak_inflight_.load(memory_order_relaxed))
+        peak_inflight_.store(inflight_, memory_order_relaxed);
+
+    // Until the kernel consumed the SQE it can still reach the device, so
+    // keep entering; only an SQE it never took may be taken back
+    unsigned int tail = *sq_tail_;
+    while (__atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) != tail) {
+        int ret = enter(1, 0, 0);
+        if (ret >= 0 || ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) {
+            if (ret < 0 && poll_) {
+                // Out of CQ room: nobody else reaps a polled ring
+                bool stopping = false;
+                enter(0, 0, IORING_ENTER_GETEVENTS);
+                inflight_ -= harvest(stopping);
+                recycle();
+            } else if (ret < 0) {
+                this_thread::yield();
+            }
+            continue;
+        }
+        if (__atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == tail)
+            break;
+        // Nobody else submits under sq_mtx_, so the SQE is still the last one
+        __atomic_store_n(sq_tail_, tail - 1, __ATOMIC_RELEASE);
+        reqs_[slot].store(nullptr);
+        free_reqs_.push_back(slot);
+        inflight_--;
+        return ret;
+    }
+    return 0;
+}
+
+void iLSM::Uring::Wait(UringRequest *req)
+{
+    if (poll_) {
+        // The command stays the device's until its CQE shows up; only once
+        // the ring is gone can no CQE arrive and the request be failed
+        while (!req->done) {
+            if (!IsOpen()) {
+                req->err = dead_err_;
+                req->done = true;
+                break;
+            }
+            int err = poll();
+            if (err < 0) {
+                lock_guard<mutex> l(sq_mtx_);
+                fail_all(err);
+                release_ring();
+            }
+        }
+        return;
+    }
+    unique_lock<mutex> l(req->mtx);
+    req->cv.wait(l, [&]{ return req->done; });
+}
+
+int iLSM::Uring::Passthru(struct nvme_passthru_cmd &cmd)
+{
+    UringRequest req;
+    int err = Submit(cmd, &req);
+    if (err < 0)
+        return err;
+    Wait(&req);
+    cmd.result = req.result;
+    return req.err;
+}
+
+int iLSM::Uring::PassthruBatch(struct nvme_passthru_cmd *cmds, unsigned int n, unsigned int depth)
+{
+    if (!depth)
+        depth = 1;
+    std::unique_ptr<UringRequest[]> reqs(new UringRequest[n]);
+    unsigned int submitted = 0, reaped = 0;
+    int ret = 0;
+    while (reaped < n) {
+        if (!ret && submitted < n && submitted - reaped < depth) {
+            int err = Submit(cmds[submitted], &reqs[submitted]);
+            if (err < 0)
+                ret = err;      // Nothing more goes out, drain the rest
+            else
+                submitted++;
+            continue;
+        }
+        if (reaped == submitted)
+            break;
+        Wait(&reqs[reaped]);
+        cmds[reaped].result = reqs[reaped].result;
+        if (reqs[reaped].err && !ret)
+            ret = reqs[reaped].err;
+        reaped++;
+    }
+    return ret;
+}
+
+// Hand the status/DW0 of every posted CQE back to its submitter; returns
+// the # of CQEs consumed. The slots of the requests go to reaped_ until the
+// caller holds sq_mtx_ (recycle())
+unsigned int iLSM::Uring::harvest(bool &stopping)
+{
+    unsigned int head = *cq_head_;
+    unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned int reaped = 0;
+    for (; head != tail; head++, reaped++) {
+        struct io_uring_cqe *cqe = (struct io_uring_cqe*)(cqes_ + (head & *cq_mask_) * CQE_SIZE);
+        if (!cqe->user_data) {
+            stopping = true;
+            continue;
+        }
+        unsigned int slot = (unsigned int)cqe->user_data - 1;
+        UringRequest *req = reqs_[slot].exchange(nullptr);
+        if (!req)
+            continue;
+        reaped_.push_back(slot);
+        lock_guard<mutex> l(req->mtx);
+        req->err = cqe->res;
+        req->result = (uint32_t)cqe->big_cqe[0];
+        req->done = true;
+        req->cv.notify_one();
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Completion reaper: block for CQEs, hand status/DW0 back to the submitters
+void iLSM::Uring::reap()
+{
+    bool stopping = false;
+    while (1) {
+        int ret = enter(0, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN) {
+            // No completion will be reaped any more: fail what is in flight
+            // rather than leave its waiters (and later submitters) hanging
+            unsigned int reaped = harvest(stopping);
+            lock_guard<mutex> l(sq_mtx_);
+            inflight_ -= reaped;
+            recycle();
+            fail_all(ret);
+            break;
+        }
+
+        unsigned int reaped = harvest(stopping);
+        if (reaped) {
+            lock_guard<mutex> l(sq_mtx_);
+            inflight_ -= reaped;
+            recycle();
+            sq_cv_.notify_all();
+            if (stopping && inflight_ == 0)
+                break;
+        }
+    }
+}
+
+// Polled ring: spin on the poll queue until something completed; <0 only
+// if the ring is unusable
+int iLSM::Uring::poll()
+{
+    bool stopping = false;
+    int ret = enter(0, 1, IORING_ENTER_GETEVENTS);
+    unsigned int reaped = harvest(stopping);
+    {
+        lock_guard<mutex> l(sq_mtx_);
+        inflight_ -= reaped;
+        recycle();
+    }
+    if (reaped || ret >= 0)
+        return 0;
+    if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) {
+        // Transient: back off a little instead of hammering the ring
+        this_thread::yield();
+        return 0;
+    }
+    return ret;
+}
+
+#else
+
+int iLSM::Uring::Init(int, unsigned int, bool) { return -ENOSYS; }
+void iLSM::Uring::Close() {}
+int iLSM::Uring::Submit(const struct nvme_passthru_cmd &, UringRequest *) { return -ENOSYS; }
+void iLSM::Uring::Wait(UringRequest *) {}
+int iLSM::Uring::Passthru(struct nvme_passthru_cmd &) { return -ENOSYS; }
+int iLSM::Uring::PassthruBatch(struct nvme_passthru_cmd *, unsigned int, unsigned int) { return -ENOSYS; }
+
+#endif
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <linux/nvme_ioctl.h>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <vector>
+
+// io_uring NVMe passthrough (IORING_OP_URING_CMD) needs Linux 5.19+ headers
+#if defined(NVME_URING_CMD_IO)
+#include <linux/io_uring.h>
+#if defined(IORING_SETUP_SQE128) && defined(IORING_SETUP_CQE32)
+#define ILSM_HAVE_IO_URING
+#endif
+#endif
+
+namespace iLSM {
+    // One NVMe command in flight on the ring
+    struct UringRequest {
+        int err = 0;            // Same as ioctl(): NVMe status (>0), 0, or -errno
+        uint32_t result = 0;    // Completion DW0
+        bool done = false;
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+
+    // Asynchronous NVMe passthrough over io_uring on the NVMe generic char
+    // device (/dev/ngXnY). Any number of threads may submit; a reaper thread
+    // harvests completions and wakes the submitters, so up to 'depth'
+    // commands can be outstanding at the device at once.
+    //
+    // A polled ring (IORING_SETUP_IOPOLL) has no reaper and no interrupt:
+    // the commands go to an NVMe poll queue and the waiting thread spins in
+    // io_uring_enter() until they complete. One thread at a time only.
+    class Uring {
+        public:
+            Uring() {}
+            ~Uring() { Close(); }
+            Uring(const Uring &) = delete;
+            Uring &operator=(const Uring &) = delete;
+
+            int Init(int fd, unsigned int depth, bool poll = false);
+            void Close();
+            bool IsOpen() const { return ring_fd_ >= 0; }
+
+            int Submit(const struct nvme_passthru_cmd &cmd, UringRequest *req);
+            void Wait(UringRequest *req);
+            // Submit and wait; cmd.result is filled like the ioctl path
+            int Passthru(struct nvme_passthru_cmd &cmd);
+            // Keeps up to depth of cmds in flight, waits for all of them
+            int PassthruBatch(struct nvme_passthru_cmd *cmds, unsigned int n, unsigned int depth);
+
+            unsigned int Depth() const { return sq_entries_; }
+            unsigned int PeakInflight() const { return peak_inflight_.load(); }
+            bool Polled() const { return poll_; }
+            // The ring broke down (its requests were failed): Submit() fails
+            bool Failed() const { return dead_err_.load(std::memory_order_relaxed) != 0; }
+
+        private:
+            void reap();
+            int poll();
+            void release_ring();
+            void fail_all(int err);
+            void recycle();
+            unsigned int harvest(bool &stopping);
+#ifdef ILSM_HAVE_IO_URING
+            void push(uint8_t opcode, const struct nvme_uring_cmd *cmd, uint64_t user_data);
+#endif
+            int enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags);
+
+            int fd_ = -1;
+            int ring_fd_ = -1;
+            unsigned int sq_entries_ = 0;
+            bool poll_ = false;
+            std::atomic<int> dead_err_{0};  // Why the ring failed under its users (set under sq_mtx_)
+
+            void *sq_ring_ = nullptr;
+            void *cq_ring_ = nullptr;
+            void *sqes_ = nullptr;
+            size_t sq_ring_sz_ = 0;
+            size_t cq_ring_sz_ = 0;
+            size_t sqes_sz_ = 0;
+
+            unsigned int *sq_head_ = nullptr;
+            unsigned int *sq_tail_ = nullptr;
+            unsigned int *sq_mask_ = nullptr;
+            unsigned int *sq_array_ = nullptr;
+            unsigned int *cq_head_ = nullptr;
+            unsigned int *cq_tail_ = nullptr;
+            unsigned int *cq_mask_ = nullptr;
+            uint8_t *cqes_ = nullptr;
+
+            std::mutex sq_mtx_;
+            std::condition_variable sq_cv_;
+            unsigned int inflight_ = 0;
+            // Requests in flight by SQE user_data - 1, so a failing ring can
+            // complete all of them; free indices (sq_mtx_), and the ones the
+            // harvesting thread freed since it last held sq_mtx_
+            std::unique_ptr<std::atomic<UringRequest*>[]> reqs_;
+            std::vector<unsigned int> free_reqs_;
+            std::vector<unsigned int> reaped_;
+            std::atomic<unsigned int> peak_inflight_{0};
+
+            std::thread reaper_;
+            std::atomic<bool> stop_{false};
+    };
+}
@@ -57,6 +57,7 @@
 #include "nvme.h"
 #include "host_lld.h"
 #include "nvme_io_cmd.h"
+#include "nvme_kv_payload.h"
 #include "../memory_map.h"
 
 #include "../ftl_config.h"
@@ -85,6 +86,84 @@
     #define ADAPT_COMBI
 #endif
 
+// * CDW11 flag of PUT set by the host when it sends the sub-page tail of the
+//   value by BandSlim Transfer commands (combination transfer); the transfer
+//   mode is picked per value at runtime, so PUTs without it are whole-page DMA
+#define KV_PUT_COMBI (1u << 31)
+
+// * CDW11 of PUT: segment n (15:0) of a value past MDTS (streaming put), which
+//   carries bytes [n x KV_SEGMENT_BYTES, n x KV_SEGMENT_BYTES + KV_SEGMENT_BYTES)
+//   of the PRP part. CDW10 has the whole value size; the last segment ends in
+//   the sub-page tail with KV_PUT_COMBI and opens the Transfer stream. The
+//   segments come in order on the queue, so they land back to back in the
+//   Value Log. GET reads from the value offset in CDW11 (chunked get)
+#define KV_PUT_SEGMENT          (1u << 30)
+#define KV_SEGMENT_INDEX(cdw11) ((cdw11) & 0xFFFF)
+#define KV_SEGMENT_BYTES        524288      // MDTS
+
+// * CDW13 flag of PUT/WRITE set by the host when it compressed the value (the
+//   stream id is CDW13 15:0). The value is kept with it, and it is set in the
+//   value size reported for the value (GET completion DW0, MULTI_GET entries,
+//   iterator records)
+#define KV_VALUE_COMPRESSED (1u << 31)
+
+// * Keys: the first KV_KEY_INLINE bytes ride in CDW2 CDW3 CDW14 CDW15, the key
+//   size in CDW10 (31:24) next to the value size (23:0). The rest of a longer
+//   key, zero-padded to whole dwords, leads the first Transfer command
+#define KV_KEY_INLINE       16
+#define KV_MAX_KEY_SIZE     255
+#define KV_KEY_SIZE(cdw10)  ((cdw10) >> 24)
+#define KV_VALUE_SIZE(cdw10) ((cdw10) & 0xFFFFFF)
+
+// * Piggybacked payload: a Write carries KV_WRITE_PAYLOAD value bytes, a
+//   Transfer KV_TRANSFER_PAYLOAD stream bytes, in the dwords nvme_kv_payload.h
+//   lists. CDW13 of a PUT/WRITE opens the stream of Transfers that may follow
+//   (the host's stream id); every Transfer carries its tag in CDW2, stream id
+//   (31:16) | sequence # (15:0). Fragment n is byte n x 52 of the stream (the
+//   padded rest of a long key, then the value bytes the PUT/WRITE did not
+//   carry), so the host may queue all of them at once and they may arrive in
+//   any order.
+#define KV_STREAM_ID(tag)       ((tag) >> 16)
+#define KV_STREAM_SEQ(tag)      ((tag) & 0xFFFF)
+#define KV_MAX_STREAMS          64      // Puts with Transfers in flight at once
+
+// * Batched put (host write combining): CDW10 records in CDW11 bytes of PRP
+//   pages (NLB in CDW12, up to one slice), each a KV_BATCH_RECORD header, the
+//   key and the value, zero-padded to a dword
+// * CDW11 flag of DELETE: a tombstone of [key, end key). The end key size is in
+//   CDW10 (23:16), the end key follows the rest of the key in the Transfer
+//   stream, zero-padded to whole dwords; deletes move no data
+#define KV_DELETE_RANGE         (1u << 31)
+#define KV_END_KEY_SIZE(cdw10)  (((cdw10) >> 16) & 0xFF)
+
+#ifndef IO_NVM_KV_BATCH_PUT
+#define IO_NVM_KV_BATCH_PUT     0xAB
+#endif
+typedef struct {
+    unsigned short key_size;
+    unsigned short rsvd;
+    unsigned int value_size;
+} KV_BATCH_RECORD;
+#define KV_BATCH_RECORD_SIZE(rec) ((sizeof(KV_BATCH_RECORD) + (rec)->key_size + (rec)->value_size + 3) / 4 * 4)
+
+// * Atomic write batch: the header (CDW11 = 0) opens batch CDW13 of CDW10
+//   members (CDW12 key and value bytes in all). Members are the usual
+//   PUT/WRITE/DELETE commands with KV_BATCH_MEMBER and the batch id in CDW13
+//   (29:16) next to the stream id; their values are placed as usual, but the
+//   pairs are only staged. The trailer (CDW11 = KV_BATCH_COMMIT) inserts all
+//   of them in one go if every member completed, else none; KV_BATCH_ABORT
+//   drops the batch. Staged values left behind are garbage for GC
+#ifndef IO_NVM_KV_WRITE_BATCH
+#define IO_NVM_KV_WRITE_BATCH   0xAC
+#endif
+#define KV_BATCH_MEMBER         (1u << 30)
+#define KV_BATCH_ID_MASK        0x3FFF
+#define KV_BATCH_ID(cdw13)      (((cdw13) >> 16) & KV_BATCH_ID_MASK)
+#define KV_BATCH_COMMIT         (1u << 31)
+#define KV_BATCH_ABORT          (1u << 30)
+#define KV_MAX_BATCHES          16      // Open at once, in slot id % KV_MAX_BATCHES
+#define KV_BATCH_MAX_MEMBERS    64
+
 // Allocate NAND page buffer entry and evict (NAND write) if the buffer is full
 unsigned int get_nand_page_buffer_entry(const unsigned int logicalSliceAddr) {
     unsigned int dataBufEntry, dataBufAddr; int i;
@@ -123,6 +202,119 @@ unsigned int vlogblock_turn;                    // Currently turned-on block
 unsigned int vlog_offset;                       // Current offset of current value_log_lba
 unsigned int vlog_value_length;                 // Value size of current time (single threaded)
 
+/* Pair (or tombstone) whose Transfer stream is still arriving */
+typedef struct {
+    unsigned int id;                            // Host stream id, 0 = free slot
+    unsigned int key[(KV_MAX_KEY_SIZE + 3) / 4];
+    unsigned int spill;                         // Padded key bytes leading the stream
+    uint8_t *vlog;                              // Reserved vLog bytes of the streamed value part
+    unsigned int range;                         // DeleteRange: end key follows the key
+    unsigned int end_key[(KV_MAX_KEY_SIZE + 3) / 4];
+    unsigned int length;                        // Stream bytes
+    unsigned int fragments;                     // # of Transfers expected
+    unsigned int received;                      // # of Transfers received so far
+    unsigned int key_size;
+    unsigned int value_size;
+    unsigned int tombstone;
+    unsigned int batch;                         // CDW13 batch bits of a write batch member
+} KV_STREAM;
+KV_STREAM kv_streams[KV_MAX_STREAMS];
+KV_STREAM kv_inline;                            // Command with nothing to follow
+
+/* Write batch between its header and trailer */
+typedef struct {
+    unsigned int key[(KV_MAX_KEY_SIZE + 3) / 4];
+    unsigned int key_size;
+    unsigned int value_size;
+    unsigned int tombstone;
+} KV_BATCH_PAIR;
+typedef struct {
+    unsigned int open;
+    unsigned int id;
+    unsigned int members;                       // Announced by the header
+    unsigned int staged;                        // Completed so far
+    KV_BATCH_PAIR pair[KV_BATCH_MAX_MEMBERS];
+} KV_BATCH;
+KV_BATCH kv_batches[KV_MAX_BATCHES];
+
+/* Whether the command is a member of a batch that is not open */
+int kv_batch_refuses(NVME_IO_COMMAND *nvmeIOCmd) {
+    unsigned int cdw13 = nvmeIOCmd->dword[13];
+    KV_BATCH *b = &kv_batches[KV_BATCH_ID(cdw13) % KV_MAX_BATCHES];
+
+    return (cdw13 & KV_BATCH_MEMBER) && (!b->open || b->id != KV_BATCH_ID(cdw13));
+}
+
+/* The pair (or tombstone) of st is complete: inserted now, or staged in its
+   write batch until the trailer (dropped if the batch is gone meanwhile) */
+void kv_pair_complete(KV_STREAM *st) {
+    KV_BATCH *b;
+    KV_BATCH_PAIR *m;
+
+    if (!(st->batch & KV_BATCH_MEMBER)) {
+#ifndef NAND_IO_DISABLE
+        /*** Implement the LSM-tree insertion routine here (pair or tombstone) ***/
+#endif
+        return;
+    }
+    b = &kv_batches[KV_BATCH_ID(st->batch) % KV_MAX_BATCHES];
+    if (!b->open || b->id != KV_BATCH_ID(st->batch) || b->staged >= b->members)
+        return;
+    m = &b->pair[b->staged++];
+    memcpy(m->key, st->key, sizeof(m->key));
+    m->key_size = st->key_size;
+    m->value_size = st->value_size;
+    m->tombstone = st->tombstone;
+}
+
+/* Stream (slot) of a Put/Write/Delete command: its own one if the rest of the
+   key or value_left more bytes follow by Transfers */
+KV_STREAM *kv_stream_slot(NVME_IO_COMMAND *nvmeIOCmd, unsigned int value_left) {
+    unsigned int key_size = KV_KEY_SIZE(nvmeIOCmd->dword[10]);
+    unsigned int id = nvmeIOCmd->dword[13] & 0xFFFF;
+    // Leave the slot of an open stream alone if this command completes by itself
+    return key_size > KV_KEY_INLINE || value_left ? &kv_streams[id % KV_MAX_STREAMS] : &kv_inline;
+}
+
+/* Take the key of a Put/Write/Delete command and open its stream if the rest
+   of the key or value_left more bytes follow by Transfers (at vlog) */
+KV_STREAM *kv_stream_open(NVME_IO_COMMAND *nvmeIOCmd, uint8_t *vlog, unsigned int value_left) {
+    unsigned int key_size = KV_KEY_SIZE(nvmeIOCmd->dword[10]);
+    unsigned int id = nvmeIOCmd->dword[13] & 0xFFFF;
+    KV_STREAM *st = kv_stream_slot(nvmeIOCmd, value_left);
+
+    st->key[0] = nvmeIOCmd->dword[2];  st->key[1] = nvmeIOCmd->dword[3];
+    st->key[2] = nvmeIOCmd->dword[14]; st->key[3] = nvmeIOCmd->dword[15];
+    st->spill = key_size > KV_KEY_INLINE ? (key_size - KV_KEY_INLINE + 3) / 4 * 4 : 0;
+    st->vlog = vlog;
+    st->length = st->spill + value_left;
+    st->fragments = (st->length + KV_TRANSFER_PAYLOAD - 1) / KV_TRANSFER_PAYLOAD;
+    st->received = 0;
+    st->range = 0;
+    st->key_size = key_size;
+    st->value_size = KV_VALUE_SIZE(nvmeIOCmd->dword[10]);
+    st->tombstone = 0;
+    st->batch = nvmeIOCmd->dword[13] & (KV_BATCH_MEMBER | (KV_BATCH_ID_MASK << 16));
+    // A stream left open by a failed put is replaced (the slots are
+    // device-wide: the host keeps to one opener per device)
+    st->id = st->length ? id : 0;
+    return st;
+}
+
+/* Reserve len bytes at the current Value Log offset for a streamed tail */
+uint8_t *vlogblock_reserve(unsigned int len) {
+    uint8_t *addr;
+
+    if (!len)
+        return NULL;
+    if (vlogblock_left[vlogblock_turn] < len)
+        vlogblock_flush();
+    addr = vlogblock[vlogblock_turn] + vlog_offset;
+    vlog_offset += len;
+    vlogblock_left[vlogblock_turn] -= len;
+    return addr;
+}
+
 /* Initialize the custom NAND page buffer for BandSlim */
 void vlogblock_init(void) {
     vlogblock_turn = 0;
@@ -133,20 +325,35 @@ void vlogblock_init(void) {
     vlog_offset = 0;
 }
 
+/* Whether a PUT carries the end of its value: all but the leading segments
+   of a streaming put */
+int kv_put_ends_value(NVME_IO_COMMAND *nvmeIOCmd) {
+    unsigned int ofs;
+
+    if (!(nvmeIOCmd->dword[11] & KV_PUT_SEGMENT))
+        return 1;
+    ofs = KV_SEGMENT_INDEX(nvmeIOCmd->dword[11]) * KV_SEGMENT_BYTES;
+    return KV_VALUE_SIZE(nvmeIOCmd->dword[10]) - ofs <= KV_SEGMENT_BYTES;
+}
+
 /* Issue PRP-based DMA transactions to current NAND page buffer entry */
 int vlogblock_issue_rx_dma(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd, unsigned int *kv_lba, unsigned int *kv_index) {
-    int ret = 1, no_combi_flag = 0; unsigned int start_offset, end_offset;
+    int ret = 1, no_combi_flag = 0, combi = 0; unsigned int start_offset, end_offset;
     unsigned int buf_addr, dma_offset, total_dma_size, total_nvme_block, num_nvme_block = 0;
 
-#ifndef ADAPT_COMBI
-    total_dma_size = (((vlog_value_length - 1) / BYTES_PER_NVME_BLOCK) + 1) * BYTES_PER_NVME_BLOCK;
-#else
-    total_dma_size = ((vlog_value_length - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
-    if (total_dma_size < BYTES_PER_NVME_BLOCK) {
-        total_dma_size = BYTES_PER_NVME_BLOCK;
-        no_combi_flag = 1;
-    }
+#ifdef ADAPT_COMBI
+    combi = (nvmeIOCmd->dword[11] & KV_PUT_COMBI) != 0 && kv_put_ends_value(nvmeIOCmd);
 #endif
+    if (!combi) {
+        total_dma_size = (((vlog_value_length - 1) / BYTES_PER_NVME_BLOCK) + 1) * BYTES_PER_NVME_BLOCK;
+    }
+    else {
+        total_dma_size = ((vlog_value_length - 1) / BYTES_PER_NVME_BLOCK) * BYTES_PER_NVME_BLOCK;
+        if (total_dma_size < BYTES_PER_NVME_BLOCK) {
+            total_dma_size = BYTES_PER_NVME_BLOCK;
+            no_combi_flag = 1;
+        }
+    }
     total_nvme_block = total_dma_size / BYTES_PER_NVME_BLOCK; 
     start_offset = vlog_offset; 
     dma_offset = get_mem_page_boundary(vlog_offset);
@@ -178,11 +385,7 @@ int vlogblock_issue_rx_dma(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd,
     // Issue RxDMA transactions
     check_auto_rx_dma_done();
 
-#ifndef ADAPT_COMBI
-    vlog_offset = dma_offset + vlog_value_length;
-    vlog_value_length = 0;
-#else
-    if ((total_dma_size == BYTES_PER_NVME_BLOCK) && no_combi_flag) {
+    if (!combi || ((total_dma_size == BYTES_PER_NVME_BLOCK) && no_combi_flag)) {
         vlog_offset = dma_offset + vlog_value_length;
         vlog_value_length = 0;
     }
@@ -190,44 +393,41 @@ int vlogblock_issue_rx_dma(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd,
         vlog_offset = dma_offset + total_dma_size;
         vlog_value_length -= total_dma_size;
     }
-#endif
     end_offset = vlog_offset;
     vlogblock_left[vlogblock_turn] -= (end_offset - start_offset);
 
     return ret;
 }
 
-// * Macro function for checking value size
-#define IS_LEFT(left) left > 0 && left <= BYTES_PER_DATA_REGION_OF_SLICE
-// * Macro function for inserting piggybacked value (be sure to wrap up this macro with {,})
-#define PIGGYBACK_VALUE(vlog, cdw, left, step, ofs) \
-        memcpy((uint8_t*)(vlog + ofs), &(cdw), (left < step ? left : step)); \
-        ofs += (left < step ? left : step); \
-        left -= step; 
-
-/* Copy piggybacked values to the current Value Log offset (write command) */
-// Known limitation of Cosmos+ OpenSSD during fine-grained value packing
-//  - the platform cannot process memcpy operation on non-word-aligned target addrs
-//  - thus the user always has to put word-aligned-sized values to the device
+/* Pack a piggybacked value as a vLog record at the current Value Log offset
+   (write command) */
+//  - Cosmos+ OpenSSD cannot memcpy to non-word-aligned target addrs, so the
+//    record goes through a KV_VLOG_CURSOR: any value size packs densely and
+//    vlog_offset may end up at any byte, while only aligned words are stored
 int vlogblock_insert(NVME_IO_COMMAND *nvmeIOCmd, unsigned int *kv_lba, unsigned int *kv_index) {
-    int ret = 1; unsigned int start_offset, end_offset;
+    int ret = 1; unsigned int start_offset, end_offset, rest, piggyback;
+    KV_VLOG_CURSOR c;
 
-    if (vlogblock_left[vlogblock_turn] >= vlog_value_length && 
+    if (vlogblock_left[vlogblock_turn] >= KV_VLOG_HEADER_BYTES + vlog_value_length && 
         vlogblock_left[vlogblock_turn] <= BYTES_PER_DATA_REGION_OF_SLICE) {
         start_offset = vlog_offset;
+        rest = vlog_value_length > KV_WRITE_PAYLOAD ? vlog_value_length - KV_WRITE_PAYLOAD : 0;
         
         *kv_lba = value_log_lba;
-        *kv_index = start_offset;
+        *kv_index = start_offset;       // Of the record header
         
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[4], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[5], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[6], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[7], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[8], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[9], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[11], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[12], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[13], vlog_value_length, 4, vlog_offset) }
+        // Header, then one gather over the Write payload dwords
+        piggyback = vlog_value_length < KV_WRITE_PAYLOAD ? vlog_value_length : KV_WRITE_PAYLOAD;
+        kv_vlog_open(&c, vlogblock[vlogblock_turn] + vlog_offset);
+        kv_vlog_put(&c, KV_VLOG_HEADER(nvmeIOCmd->dword[10], nvmeIOCmd->dword[13]), KV_VLOG_HEADER_BYTES);
+        kv_payload_append(&c, nvmeIOCmd->dword, kv_write_dwords, 0, piggyback);
+        kv_vlog_close(&c);
+        vlog_offset += KV_VLOG_HEADER_BYTES + piggyback;
+
+        // The rest of the value comes by Transfers, in whatever order
+        kv_stream_open(nvmeIOCmd, vlogblock[vlogblock_turn] + vlog_offset, rest);
+        vlog_offset += rest;
+        vlog_value_length = 0;
 
         end_offset = vlog_offset;
         vlogblock_left[vlogblock_turn] -= (end_offset - start_offset);
@@ -242,40 +442,42 @@ int vlogblock_insert(NVME_IO_COMMAND *nvmeIOCmd, unsigned int *kv_lba, unsigned
     return ret;
 }
 
-/* Copy piggybacked values to the current Value Log offset (transfer command) */
-int vlogblock_append(NVME_IO_COMMAND *nvmeIOCmd) {
-    int ret = 1; unsigned int start_offset, end_offset;
-
-    if (vlogblock_left[vlogblock_turn] >= vlog_value_length &&
-        vlogblock_left[vlogblock_turn] <= BYTES_PER_DATA_REGION_OF_SLICE) {
-        start_offset = vlog_offset;
-
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[2], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[3], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[4], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[5], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[6], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[7], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[8], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[9], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[10], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[11], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[12], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[13], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[14], vlog_value_length, 4, vlog_offset) }
-        if (IS_LEFT(vlog_value_length)) { PIGGYBACK_VALUE(vlogblock[vlogblock_turn], nvmeIOCmd->dword[15], vlog_value_length, 4, vlog_offset) }
-    
-        end_offset = vlog_offset;
-        vlogblock_left[vlogblock_turn] -= (end_offset - start_offset);
+/* Place one Transfer fragment at its sequence # in its stream (transfer command) */
+//  - returns 1 once the pair is complete, 0 if more fragments are due, -1 if
+//    no such stream is open
+int kv_stream_place(NVME_IO_COMMAND *nvmeIOCmd) {
+    unsigned int tag = nvmeIOCmd->dword[2], pos, end, key_end, first;
+    KV_STREAM *st = &kv_streams[KV_STREAM_ID(tag) % KV_MAX_STREAMS];
+
+    if (!st->id || st->id != KV_STREAM_ID(tag))
+        return -1;
+    // Stream bytes [pos, end) ride in this fragment: the part before
+    // st->spill is the rest of the key, the part after it the end key of a
+    // DeleteRange or value bytes; each part is one gather
+    pos = KV_STREAM_SEQ(tag) * KV_TRANSFER_PAYLOAD;
+    end = pos + KV_TRANSFER_PAYLOAD < st->length ? pos + KV_TRANSFER_PAYLOAD : st->length;
+    key_end = end < st->spill ? end : st->spill;
+    first = 0;
+    if (pos < key_end) {
+        kv_payload_gather(&st->key[KV_KEY_INLINE / 4 + pos / 4], nvmeIOCmd->dword, kv_transfer_dwords, 0, key_end - pos);
+        first = (key_end - pos) / 4;
+        pos = key_end;
     }
-    else {
-        vlogblock_flush();
-        ret = 0;      // Insert again!
+    if (pos < end) {
+        if (st->range)
+            kv_payload_gather(&st->end_key[(pos - st->spill) / 4], nvmeIOCmd->dword, kv_transfer_dwords, first, end - pos);
+#ifndef NAND_IO_DISABLE
+        else    // Merged with the fragments (or record) around it
+            kv_payload_gather_packed(st->vlog + (pos - st->spill), nvmeIOCmd->dword, kv_transfer_dwords, first, end - pos);
+#endif
     }
 #ifdef BANDSLIM_DEBUG
-    xil_printf("turn: %u, buf_addr: %u, ofs: %u, left: %u\r\n", vlogblock_turn, (unsigned int)vlogblock[vlogblock_turn], vlog_offset, vlogblock_left[vlogblock_turn]);
+    xil_printf("stream: %u, seq: %u, received: %u/%u\r\n", st->id, KV_STREAM_SEQ(tag), st->received + 1, st->fragments);
 #endif
-    return ret;
+    if (++st->received < st->fragments)
+        return 0;
+    st->id = 0;
+    return 1;
 }
 
 /* Allocate new NAND page buffer entry and evict the oldest allocated one (if buffer is full) */
@@ -294,28 +496,49 @@ void vlogblock_flush(void) {
 void handle_nvme_io_kv_put(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd)
 {
     IO_READ_COMMAND_DW12 writeInfo12;
-    unsigned int startLba[2], nlb, kv_key, kv_length, kv_nlb, kv_lba, kv_index;
+    unsigned int startLba[2], nlb, kv_key, kv_length, kv_nlb, kv_lba, kv_index, seg_ofs;
+    KV_STREAM *st;
+    NVME_COMPLETION nvmeCPL;
+
+    nvmeCPL.dword[0] = 0;
+    nvmeCPL.specific = 0;
+    if (kv_batch_refuses(nvmeIOCmd)) {
+        nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+        set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
+        return;
+    }
      
     writeInfo12.dword = nvmeIOCmd->dword[12];
     if(writeInfo12.FUA == 1) xil_printf("write FUA\r\n");
     nlb = writeInfo12.NLB;
 
-    kv_key = nvmeIOCmd->dword[2];       // CDW2 -> Key
-    kv_length = nvmeIOCmd->dword[10];   // CDW10 -> Value Size
+    kv_key = nvmeIOCmd->dword[2];       // CDW2 -> Key (first 4B)
+    kv_length = KV_VALUE_SIZE(nvmeIOCmd->dword[10]);   // CDW10 -> Value Size
     vlog_value_length = kv_length;      // Global value size (single threaded machine)
 
     kv_nlb = nlb + 1;                   // # of pages needed
-    ASSERT(kv_nlb == (kv_length / BYTES_PER_SECTOR) + ((kv_length % BYTES_PER_SECTOR) > 0 ? 1 : 0));
+    if (nvmeIOCmd->dword[11] & KV_PUT_SEGMENT) {
+        // Streaming put: this segment's share of the value
+        seg_ofs = KV_SEGMENT_INDEX(nvmeIOCmd->dword[11]) * KV_SEGMENT_BYTES;
+        ASSERT(seg_ofs < kv_length);
+        vlog_value_length = kv_put_ends_value(nvmeIOCmd) ? kv_length - seg_ofs : KV_SEGMENT_BYTES;
+    }
+    else
+        ASSERT(kv_nlb == (kv_length / BYTES_PER_SECTOR) + ((kv_length % BYTES_PER_SECTOR) > 0 ? 1 : 0));
 #ifdef BANDSLIM_DEBUG
     xil_printf("BandSlim PRP Write Command\r\n");
 #endif
-    // Insert (issue page-unit DMA) to the Value Log
+    // Insert (issue page-unit DMA) to the Value Log. The slices a segment
+    // fills are flushed as it goes, so their NAND programs overlap with the
+    // DMA of the segment queued behind it
     while (vlogblock_issue_rx_dma(cmdSlotTag, nvmeIOCmd, kv_lba, kv_index) == 0);
-#ifndef NAND_IO_DISABLE       	
-    /*** Implement the LSM-tree insertion routine here ***/
-#endif
-    NVME_COMPLETION nvmeCPL;
-    nvmeCPL.dword[0] = 0;
+    // A combination transfer leaves the sub-page tail to the Transfer stream
+    if (kv_put_ends_value(nvmeIOCmd)) {
+        st = kv_stream_open(nvmeIOCmd, vlogblock_reserve(vlog_value_length), vlog_value_length);
+        if (!st->id)
+            kv_pair_complete(st);
+    }
+    vlog_value_length = 0;
     nvmeCPL.specific = kv_length;
     set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
 }
@@ -323,28 +546,40 @@ void handle_nvme_io_kv_put(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd)
 // Write Command
 void handle_nvme_io_bandslim_write(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd)
 {
-    unsigned int kv_key, kv_length, kv_lba, kv_index;
+    unsigned int kv_key, kv_length, kv_lba, kv_index, value_left;
+    KV_STREAM *st;
+    NVME_COMPLETION nvmeCPL;
 
-    kv_key = nvmeIOCmd->dword[2];       // CDW2 -> Key
-    kv_length = nvmeIOCmd->dword[10];   // CDW10 -> Value Size
+    nvmeCPL.dword[0] = 0;
+    nvmeCPL.specific = 0;
+    kv_length = KV_VALUE_SIZE(nvmeIOCmd->dword[10]);   // CDW10 -> Value Size
+    // The record (header and value) has to fit one slice, or no flush makes room
+    if (kv_batch_refuses(nvmeIOCmd) || KV_VLOG_HEADER_BYTES + kv_length > BYTES_PER_DATA_REGION_OF_SLICE) {
+        nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+        set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
+        return;
+    }
+
+    kv_key = nvmeIOCmd->dword[2];       // CDW2 -> Key (first 4B)
     vlog_value_length = kv_length;      // Global value size (single threaded machine)
+    value_left = kv_length > KV_WRITE_PAYLOAD ? kv_length - KV_WRITE_PAYLOAD : 0;
 
 #ifdef BANDSLIM_DEBUG
     xil_printf("BandSlim Write Command\r\n");
     xil_printf("%x%x ", nvmeIOCmd->dword[4], nvmeIOCmd->dword[5]);
     xil_printf("%x%x ", nvmeIOCmd->dword[6], nvmeIOCmd->dword[7]);
     xil_printf("%x ", nvmeIOCmd->dword[8]); xil_printf("%x ", nvmeIOCmd->dword[9]);
-    xil_printf("%x ", nvmeIOCmd->dword[11]); xil_printf("%x ", nvmeIOCmd->dword[12]);
-    xil_printf("%x\r\n", nvmeIOCmd->dword[13]); 
+    xil_printf("%x ", nvmeIOCmd->dword[11]); xil_printf("%x\r\n", nvmeIOCmd->dword[12]);
 #endif
 #ifndef NAND_IO_DISABLE       	
     // Insert to the Value Log
     while (vlogblock_insert(nvmeIOCmd, &kv_lba, &kv_index) == 0);
-
-    /*** Implement the LSM-tree insertion routine here ***/
+    st = kv_stream_slot(nvmeIOCmd, value_left);
+#else
+    st = kv_stream_open(nvmeIOCmd, NULL, value_left);
 #endif
-    NVME_COMPLETION nvmeCPL;
-    nvmeCPL.dword[0] = 0;
+    if (!st->id)
+        kv_pair_complete(st);
     nvmeCPL.specific = kv_length;
     set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
 }
@@ -363,12 +598,145 @@ void handle_nvme_io_bandslim_transfer(unsigned int cmdSlotTag, NVME_IO_COMMAND *
     xil_printf("%x ", nvmeIOCmd->dword[13]); xil_printf("%x ", nvmeIOCmd->dword[14]);
     xil_printf("%x\r\n", nvmeIOCmd->dword[15]); 
 #endif    
-#ifndef NAND_IO_DISABLE       	
-    while (vlogblock_append(nvmeIOCmd) == 0);
+    int done = kv_stream_place(nvmeIOCmd);
+    if (done == 1)
+        kv_pair_complete(&kv_streams[KV_STREAM_ID(nvmeIOCmd->dword[2]) % KV_MAX_STREAMS]);
+    NVME_COMPLETION nvmeCPL;
+    nvmeCPL.dword[0] = 0;
+    nvmeCPL.specific = 0;
+    if (done < 0)   // Tag of no open stream
+        nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+    set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
+}
+
+// Delete Command
+//  - records a tombstone of the key (or of [key, end key) with KV_DELETE_RANGE)
+//    for GC/compaction to drop the dead vLog bytes; long keys and the end key
+//    arrive by Transfers, and a missing key is not an error
+void handle_nvme_io_kv_delete(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd)
+{
+    unsigned int range = (nvmeIOCmd->dword[11] & KV_DELETE_RANGE) != 0;
+    unsigned int end_size = range ? KV_END_KEY_SIZE(nvmeIOCmd->dword[10]) : 0;
+    KV_STREAM *st;
+    NVME_COMPLETION nvmeCPL;
+
+    nvmeCPL.dword[0] = 0;
+    nvmeCPL.specific = 0;
+    if (!KV_KEY_SIZE(nvmeIOCmd->dword[10]) || (range && !end_size) || kv_batch_refuses(nvmeIOCmd)) {
+        nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+        set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
+        return;
+    }
+#ifdef BANDSLIM_DEBUG
+    xil_printf("Delete Command%s: key size %u\r\n", range ? " (range)" : "", KV_KEY_SIZE(nvmeIOCmd->dword[10]));
 #endif
+    st = kv_stream_open(nvmeIOCmd, NULL, (end_size + 3) / 4 * 4);
+    st->range = range;
+    st->tombstone = 1;
+    st->value_size = 0;
+    if (!st->id)
+        kv_pair_complete(st);
+    set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
+}
+
+// Batched Put Command
+//  - the pages land on a 4KB boundary of the Value Log, then every value slides
+//    down to the packing offset as a vLog record (never past its own page
+//    record, which is longer, so in place)
+void handle_nvme_io_kv_batch_put(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd)
+{
+    unsigned int n = nvmeIOCmd->dword[10], len = nvmeIOCmd->dword[11];
+    unsigned int total_dma_size, dma_offset, pos, i, stored = 0;
+    uint8_t *page;
+    KV_BATCH_RECORD rec;
+    KV_VLOG_CURSOR c;
     NVME_COMPLETION nvmeCPL;
+
+    nvmeCPL.dword[0] = 0;
+    total_dma_size = len ? ((len - 1) / BYTES_PER_NVME_BLOCK + 1) * BYTES_PER_NVME_BLOCK : 0;
+    if (!n || !len || total_dma_size > BYTES_PER_DATA_REGION_OF_SLICE) {
+        nvmeCPL.specific = 0;
+        nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+        set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
+        return;
+    }
+#ifdef BANDSLIM_DEBUG
+    xil_printf("Batched Put Command: %u records, %u bytes\r\n", n, len);
+#endif
+    dma_offset = get_mem_page_boundary(vlog_offset);
+    if (dma_offset + total_dma_size > BYTES_PER_DATA_REGION_OF_SLICE) {
+        vlogblock_flush();
+        dma_offset = 0;
+    }
+    page = vlogblock[vlogblock_turn] + dma_offset;
+    for (i = 0; i < total_dma_size / BYTES_PER_NVME_BLOCK; i++)
+        set_auto_rx_dma(cmdSlotTag, i, (unsigned int)page + i * BYTES_PER_NVME_BLOCK, NVME_COMMAND_AUTO_COMPLETION_OFF);
+    check_auto_rx_dma_done();
+
+    kv_vlog_open(&c, vlogblock[vlogblock_turn] + vlog_offset);
+    for (i = 0, pos = 0; i < n && pos + sizeof(rec) <= len; i++) {
+        memcpy(&rec, page + pos, sizeof(rec));
+        if (!rec.key_size || rec.key_size > KV_MAX_KEY_SIZE || pos + KV_BATCH_RECORD_SIZE(&rec) > len)
+            break;
+#ifndef NAND_IO_DISABLE
+        /*** Implement the LSM-tree insertion routine here (key at page + pos +
+             sizeof(rec), before the value move below may overwrite it) ***/
+        kv_vlog_put(&c, rec.value_size, KV_VLOG_HEADER_BYTES);
+        kv_vlog_append(&c, page + pos + sizeof(rec) + rec.key_size, rec.value_size);
+        vlog_offset += KV_VLOG_HEADER_BYTES + rec.value_size;
+#endif
+        pos += KV_BATCH_RECORD_SIZE(&rec);
+        stored++;
+    }
+    kv_vlog_close(&c);
+    vlogblock_left[vlogblock_turn] = BYTES_PER_DATA_REGION_OF_SLICE - vlog_offset;
+
+    nvmeCPL.specific = stored;
+    if (stored != n)    // Malformed page
+        nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+    set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
+}
+
+// Write Batch Command
+//  - the header opens the batch in its slot; the trailer inserts the staged
+//    members all at once (the firmware runs one command at a time, so no GET
+//    sees part of them) or drops them. DW0 of a commit is the # inserted
+void handle_nvme_io_kv_write_batch(unsigned int cmdSlotTag, NVME_IO_COMMAND *nvmeIOCmd)
+{
+    unsigned int n = nvmeIOCmd->dword[10], ctl = nvmeIOCmd->dword[11];
+    unsigned int id = nvmeIOCmd->dword[13] & KV_BATCH_ID_MASK, i;
+    KV_BATCH *b = &kv_batches[id % KV_MAX_BATCHES];
+    NVME_COMPLETION nvmeCPL;
+
     nvmeCPL.dword[0] = 0;
     nvmeCPL.specific = 0;
+#ifdef BANDSLIM_DEBUG
+    xil_printf("Write Batch Command: id %u, %u members, ctl %x\r\n", id, n, ctl);
+#endif
+    if (!(ctl & (KV_BATCH_COMMIT | KV_BATCH_ABORT))) {
+        if (!n || n > KV_BATCH_MAX_MEMBERS || b->open) {
+            nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+        } else {
+            b->open = 1;
+            b->id = id;
+            b->members = n;
+            b->staged = 0;
+        }
+    } else if (!b->open || b->id != id) {
+        nvmeCPL.statusField.SC = SC_INVALID_FIELD;
+    } else {
+        b->open = 0;
+        if ((ctl & KV_BATCH_COMMIT) && n == b->members && b->staged == b->members) {
+            for (i = 0; i < b->staged; i++) {
+#ifndef NAND_IO_DISABLE
+                /*** Implement the LSM-tree insertion routine here (b->pair[i]: pair or tombstone) ***/
+#endif
+            }
+            nvmeCPL.specific = b->staged;
+        } else if (ctl & KV_BATCH_COMMIT) {
+            nvmeCPL.statusField.SC = SC_INVALID_FIELD;     // A member is missing
+        }
+    }
     set_auto_nvme_cpl(cmdSlotTag, nvmeCPL.specific, nvmeCPL.statusFieldWord);
 }
 
@@ -397,6 +765,21 @@ void handle_nvme_io_cmd(NVME_COMMAND *nvmeCmd)
             handle_nvme_io_bandslim_transfer(nvmeCmd->cmdSlotTag, nvmeIOCmd);
             break;
         }
+        case IO_NVM_KV_DELETE:
+        {
+            handle_nvme_io_kv_delete(nvmeCmd->cmdSlotTag, nvmeIOCmd);
+            break;
+        }
+        case IO_NVM_KV_BATCH_PUT:
+        {
+            handle_nvme_io_kv_batch_put(nvmeCmd->cmdSlotTag, nvmeIOCmd);
+            break;
+        }
+        case IO_NVM_KV_WRITE_BATCH:
+        {
+            handle_nvme_io_kv_write_batch(nvmeCmd->cmdSlotTag, nvmeIOCmd);
+            break;
+        }
         default:
         {
             xil_printf("Not Support IO Command OPC: %X\r\n", opc);
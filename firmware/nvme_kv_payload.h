@@ -0,0 +1,157 @@
+#ifndef __NVME_KV_PAYLOAD_H_
+#define __NVME_KV_PAYLOAD_H_
+
+#include <string.h>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// BandSlim Payload Layout /////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+// Which dwords of a BandSlim command carry payload, and in what order. The
+// host (db_bench/tools/iLSM.cc and its emulator) packs by these lists and
+// the firmware gathers by them, so a layout change is made here only
+// * Write: value bytes in CDW4-CDW9, CDW11, CDW12 (CDW2/3/14/15 are the key,
+//   CDW10 the sizes, CDW13 the stream id)
+// * Transfer: stream bytes in CDW3-CDW15 (CDW2 is the tag)
+#define KV_WRITE_DWORDS(X)      X(4) X(5) X(6) X(7) X(8) X(9) X(11) X(12)
+#define KV_TRANSFER_DWORDS(X)   X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+
+#define KV_PAYLOAD_SLOT(dw)     dw,
+#define KV_PAYLOAD_COUNT(dw)    + 1
+
+// * # of payload dwords and bytes per command
+#define KV_WRITE_SLOTS          (0 KV_WRITE_DWORDS(KV_PAYLOAD_COUNT))
+#define KV_TRANSFER_SLOTS       (0 KV_TRANSFER_DWORDS(KV_PAYLOAD_COUNT))
+#define KV_WRITE_PAYLOAD        (KV_WRITE_SLOTS * 4)
+#define KV_TRANSFER_PAYLOAD     (KV_TRANSFER_SLOTS * 4)
+#define KV_MAX_SLOTS            KV_TRANSFER_SLOTS
+
+static const unsigned char kv_write_dwords[KV_WRITE_SLOTS] = { KV_WRITE_DWORDS(KV_PAYLOAD_SLOT) };
+static const unsigned char kv_transfer_dwords[KV_TRANSFER_SLOTS] = { KV_TRANSFER_DWORDS(KV_PAYLOAD_SLOT) };
+
+/* Host: lay len (<= slots x 4) bytes of src out in the payload dwords of a
+   16-dword command. The bytes are staged in zeroed dwords (the tail mask),
+   then every slot is stored, so the cost does not depend on len */
+static inline void kv_payload_pack(unsigned int *cmd, const unsigned char *dwords, unsigned int slots,
+        const void *src, unsigned int len)
+{
+    unsigned int stage[KV_MAX_SLOTS] = {0}, i;
+    memcpy(stage, src, len);
+    for (i = 0; i < slots; i++)
+        cmd[dwords[i]] = stage[i];
+}
+
+/* Device: copy len bytes of payload, from payload dword first on, to dst at
+   a fixed stride of one dword (dst word-aligned; kv_payload_gather_packed()
+   places at any byte) */
+static inline void kv_payload_gather(void *dst, const unsigned int *cmd, const unsigned char *dwords,
+        unsigned int first, unsigned int len)
+{
+    unsigned char *d = (unsigned char*)dst;
+    unsigned int n = len / 4, i;
+    for (i = 0; i < n; i++)
+        memcpy(d + i * 4, &cmd[dwords[first + i]], 4);
+    if (len % 4)
+        memcpy(d + n * 4, &cmd[dwords[first + n]], len % 4);
+}
+
+// * vLog record of a packed value (piggybacked, or put by BATCH_PUT): a
+//   KV_VLOG_HEADER_BYTES header with the exact value size (23:0) and the
+//   compressed flag of CDW13 (31), then the value bytes. Records follow each
+//   other with no padding, so one may start at any byte; the device still
+//   stores aligned words only (KV_VLOG_CURSOR). A value put by PRP starts on
+//   a 4KB boundary and has no header, its sub-page tail follows its pages
+#define KV_VLOG_HEADER_BYTES    4
+#define KV_VLOG_HEADER(cdw10, cdw13) (((cdw10) & 0xFFFFFF) | ((cdw13) & 0x80000000u))
+
+/* Device: appends bytes at any byte address of word-aligned memory with
+   aligned word loads and stores only (Cosmos+ cannot store to unaligned
+   addresses). The incoming bytes are shifted into place a word at a time;
+   the partial words at both ends are merged with the bytes already there,
+   so records (and Transfer fragments) may be placed in any order.
+   Little-endian: the first bytes of a word are its low-order ones */
+typedef struct {
+    unsigned char *word;        // Next word to store (aligned)
+    unsigned int carry;         // Bytes not stored yet, low-order first
+    unsigned int filled;        // # of them (0-3)
+} KV_VLOG_CURSOR;
+
+static inline unsigned int kv_low_bytes(unsigned int n)
+{
+    return n >= 4 ? 0xFFFFFFFFu : (1u << (n * 8)) - 1;
+}
+
+static inline void kv_vlog_open(KV_VLOG_CURSOR *c, void *dst)
+{
+    unsigned long a = (unsigned long)dst;
+    c->word = (unsigned char*)(a & ~3ul);
+    c->filled = a & 3;
+    c->carry = 0;
+    if (c->filled) {
+        memcpy(&c->carry, c->word, 4);
+        c->carry &= kv_low_bytes(c->filled);
+    }
+}
+
+/* Append the n (1-4) low-order bytes of w */
+static inline void kv_vlog_put(KV_VLOG_CURSOR *c, unsigned int w, unsigned int n)
+{
+    unsigned long long acc = c->carry | ((unsigned long long)(w & kv_low_bytes(n)) << (c->filled * 8));
+    unsigned int word;
+    c->filled += n;
+    if (c->filled >= 4) {
+        word = (unsigned int)acc;
+        memcpy(c->word, &word, 4);
+        c->word += 4;
+        c->filled -= 4;
+        acc >>= 32;
+    }
+    c->carry = (unsigned int)acc;
+}
+
+/* Merge the partial trailing word */
+static inline void kv_vlog_close(KV_VLOG_CURSOR *c)
+{
+    unsigned int word;
+    if (!c->filled)
+        return;
+    memcpy(&word, c->word, 4);
+    word = (word & ~kv_low_bytes(c->filled)) | c->carry;
+    memcpy(c->word, &word, 4);
+}
+
+/* Append len bytes of payload, from payload dword first on */
+static inline void kv_payload_append(KV_VLOG_CURSOR *c, const unsigned int *cmd, const unsigned char *dwords,
+        unsigned int first, unsigned int len)
+{
+    unsigned int i;
+    for (i = 0; i < len; i += 4)
+        kv_vlog_put(c, cmd[dwords[first + i / 4]], len - i < 4 ? len - i : 4);
+}
+
+/* Append len bytes of src (a byte address at or after the cursor, e.g. the
+   values of a BATCH_PUT page sliding down) */
+static inline void kv_vlog_append(KV_VLOG_CURSOR *c, const void *src, unsigned int len)
+{
+    const unsigned char *s = (const unsigned char*)src;
+    unsigned int i, n, w;
+    for (i = 0; i < len; i += 4) {
+        n = len - i < 4 ? len - i : 4;
+        w = 0;
+        memcpy(&w, s + i, n);
+        kv_vlog_put(c, w, n);
+    }
+}
+
+/* Device: kv_payload_gather() to any byte address */
+static inline void kv_payload_gather_packed(void *dst, const unsigned int *cmd, const unsigned char *dwords,
+        unsigned int first, unsigned int len)
+{
+    KV_VLOG_CURSOR c;
+    if (!len)
+        return;
+    kv_vlog_open(&c, dst);
+    kv_payload_append(&c, cmd, dwords, first, len);
+    kv_vlog_close(&c);
+}
+
+#endif	//__NVME_KV_PAYLOAD_H_